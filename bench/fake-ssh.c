@@ -0,0 +1,176 @@
+/***************************************************************************\
+ * fake-ssh.c - local stand-in for ssh for the x11 plugin benchmarks
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * run the remote command given by the helper (the last argument, the
+ * host being the one before) locally through /bin/sh, after a simulated
+ * session setup delay, like ssh does on the target node. With -Y the
+ * command gets a forwarded DISPLAY, with -x none. The process stays the
+ * parent of the command until it exits, like ssh, and exits with its
+ * status. Each session gets a private /tmp, like a distinct node, using
+ * an unprivileged user and mount namespace when the kernel allows it,
+ * so that the helpers of the simulated nodes do not share their DISPLAY
+ * references. The helper must thus not be installed under /tmp.
+ *
+ * The session is tuned through the environment :
+ *
+ *   FAKE_SSH_LATENCY  setup delay in milliseconds (default 0)
+ *   FAKE_SSH_JITTER   random delay added to the setup, in milliseconds,
+ *                     uniformly distributed (default 0)
+ *   FAKE_SSH_FAILURE  percentage of sessions failing with the 255 exit
+ *                     code of ssh after the setup delay (default 0)
+ *   FAKE_SSH_DISPLAY  DISPLAY of the forwarded sessions (default
+ *                     localhost:10.0)
+ *
+ * build : gcc -O2 -o fake-ssh bench/fake-ssh.c
+ *
+ * use it with ssh_cmd=/path/to/fake-ssh in plugstack.conf or -s with the
+ * helper.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sched.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+
+static long fake_env(const char* var)
+{
+	char* value = getenv(var);
+
+	return ( value != NULL ) ? atol(value) : 0 ;
+}
+
+static int fake_write(const char* file,const char* value)
+{
+	int fd;
+	int rc;
+
+	fd = open(file,O_WRONLY);
+	if ( fd == -1 )
+		return -1;
+	rc = ( write(fd,value,strlen(value)) == (ssize_t) strlen(value) );
+	close(fd);
+
+	return rc ? 0 : -1 ;
+}
+
+/*
+ * give the session a private /tmp, the user keeping its identity
+ */
+static int fake_node_tmp(void)
+{
+	char map[64];
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+
+	if ( unshare(CLONE_NEWUSER|CLONE_NEWNS) )
+		return -1;
+	snprintf(map,sizeof(map),"%u %u 1",(unsigned) uid,(unsigned) uid);
+	if ( fake_write("/proc/self/uid_map",map) )
+		return -1;
+	if ( fake_write("/proc/self/setgroups","deny") && errno != ENOENT )
+		return -1;
+	snprintf(map,sizeof(map),"%u %u 1",(unsigned) gid,(unsigned) gid);
+	if ( fake_write("/proc/self/gid_map",map) )
+		return -1;
+	if ( mount(NULL,"/",NULL,MS_REC|MS_PRIVATE,NULL) ||
+	     mount("tmpfs","/tmp","tmpfs",0,"mode=1777") )
+		return -1;
+
+	return 0;
+}
+
+int main(int argc,char** argv)
+{
+	struct timespec ts;
+	long delay;
+	long jitter;
+	long failure;
+	char* display;
+	int status;
+	pid_t pid;
+	int i;
+
+	if ( argc < 3 ) {
+		fprintf(stderr,"usage: %s [options] host command\n",argv[0]);
+		return 255;
+	}
+
+	/* the helper always gives the remote command as a single string */
+	for ( i = 1 ; i < argc - 2 ; i++ ) {
+		if ( strcmp(argv[i],"-Y") == 0 || strcmp(argv[i],"-X") == 0 ) {
+			display = getenv("FAKE_SSH_DISPLAY");
+			setenv("DISPLAY",( display != NULL ) ? display :
+			       "localhost:10.0",1);
+		}
+		else if ( strcmp(argv[i],"-x") == 0 )
+			unsetenv("DISPLAY");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	srandom(getpid() ^ ts.tv_nsec);
+
+	delay = fake_env("FAKE_SSH_LATENCY");
+	jitter = fake_env("FAKE_SSH_JITTER");
+	failure = fake_env("FAKE_SSH_FAILURE");
+	if ( jitter > 0 )
+		delay += random() % ( jitter + 1 );
+	if ( delay > 0 ) {
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = ( delay % 1000 ) * 1000000;
+		while ( nanosleep(&ts,&ts) == -1 && errno == EINTR ) ;
+	}
+
+	if ( failure > 0 && random() % 100 < failure ) {
+		fprintf(stderr,"ssh: connect to host %s port 22: Connection "
+			"timed out\n",argv[argc-2]);
+		return 255;
+	}
+
+	pid = fork();
+	if ( pid == -1 ) {
+		fprintf(stderr,"ssh: fork failed : %s\n",strerror(errno));
+		return 255;
+	}
+	if ( pid == 0 ) {
+		if ( fake_node_tmp() )
+			fprintf(stderr,"warning: unable to give %s a private "
+				"/tmp : %s\n",argv[argc-2],strerror(errno));
+		execl("/bin/sh","sh","-c",argv[argc-1],(char*) NULL);
+		_exit(127);
+	}
+	while ( waitpid(pid,&status,0) == -1 && errno == EINTR ) ;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 255 ;
+}
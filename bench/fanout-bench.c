@@ -0,0 +1,392 @@
+/***************************************************************************\
+ * fanout-bench.c - scaling of the tunnels setup with the number of nodes
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * time the setup of the tunnels of an interactive step by srun on a
+ * simulated hostlist (node[1-n]), the real helper being run on every
+ * node through fake-ssh on the local host. Each run is done by a child
+ * process playing srun, that calls _x11_connect_nodes like
+ * slurm_spank_local_user_init does, the tunnels being established
+ * before the step is launched (setup_timeout=0). The plugin source is
+ * included so that the measured code is the one of the plugin, its
+ * setup failures counter being diverted to count the nodes that did not
+ * get a tunnel.
+ *
+ * The processes and file descriptors of srun and of the helper tasks
+ * (all in the process group of srun) are sampled in /proc every 10 ms
+ * during the run. Every tunnel keeps two processes (fake-ssh and the remote helper)
+ * until the end of the run, so 10000 nodes require a process limit
+ * (ulimit -u) above 20000. All the "nodes" sharing /tmp,
+ * they share the DISPLAY reference of the step, which is removed at the
+ * end of each run.
+ *
+ * build from the top directory (Slurm development headers required),
+ * the helper being built with the same X11_LIBEXEC_PROG :
+ *
+ *   gcc -O2 -DX11_LIBEXEC_PROG=\"$PWD/slurm-spank-x11\" \
+ *       -o slurm-spank-x11 slurm-spank-x11.c slurm-spank-x11-relay.c \
+ *       slurm-spank-x11-proto.c slurm-spank-x11-image.c \
+ *       slurm-spank-x11-broker.c slurm-spank-x11-ref.c \
+ *       slurm-spank-x11-trace.c slurm-spank-x11-stats.c -lz
+ *   gcc -O2 -o fake-ssh bench/fake-ssh.c
+ *   gcc -O2 -I. -Ibench -DX11_LIBEXEC_PROG=\"$PWD/slurm-spank-x11\" \
+ *       -o fanout-bench bench/fanout-bench.c bench/slurm-stub.c \
+ *       slurm-spank-x11-ref.c slurm-spank-x11-trace.c \
+ *       slurm-spank-x11-stats.c -pthread
+ *
+ * usage : fanout-bench [-m modes] [-F fanout_max] [-T fanout_tree]
+ *                      [-l latency_ms] [-j jitter_ms] [-e failure_pct]
+ *                      [-s fake_ssh] [nodes ...]
+ *
+ * modes is a comma separated list of first, last and all (default all
+ * of them), the default node counts being 1 10 100 1000. -l, -j and -e
+ * set the FAKE_SSH_LATENCY, FAKE_SSH_JITTER and FAKE_SSH_FAILURE knobs
+ * of fake-ssh. One line is printed per mode and node count, with the
+ * wall-clock setup time, the number of nodes that did not get a tunnel,
+ * the peak number of processes and of file descriptors of srun and the
+ * helper tasks, and the peak number of file descriptors of srun alone.
+ */
+#define x11_stats_count bench_stats_count
+#include "slurm-spank-x11-plug.c"
+
+#include <dirent.h>
+
+#include "slurm-stub.h"
+
+#define BENCH_SAMPLE_PERIOD 10000
+
+static struct {
+	pthread_t thread;
+	volatile int stop;
+	pid_t pgid;
+	pid_t srun;
+	int procs;
+	int fds;
+	int srun_fds;
+} bench_sample;
+
+static uint64_t bench_failures;
+
+void bench_stats_count(enum x11_stats_counter counter,uint64_t n)
+{
+	if ( counter == X11_STATS_SETUP_FAILURES )
+		bench_failures += n;
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_count_fds(pid_t pid)
+{
+	char path[64];
+	struct dirent* d;
+	DIR* dir;
+	int n = 0;
+
+	snprintf(path,sizeof(path),"/proc/%d/fd",(int) pid);
+	dir = opendir(path);
+	if ( dir == NULL )
+		return 0;
+	while ( ( d = readdir(dir) ) != NULL ) {
+		if ( d->d_name[0] != '.' )
+			n++;
+	}
+	closedir(dir);
+
+	return n;
+}
+
+/*
+ * walk the live processes of a process group, calling fn on each one,
+ * and return their number
+ */
+static int bench_walk(pid_t pgid,void (*fn)(pid_t,void*),void* arg)
+{
+	char path[64];
+	char buf[512];
+	struct dirent* d;
+	DIR* dir;
+	FILE* f;
+	char* p;
+	char state;
+	int ppid, group;
+	pid_t pid;
+	int n = 0;
+
+	dir = opendir("/proc");
+	if ( dir == NULL )
+		return 0;
+	while ( ( d = readdir(dir) ) != NULL ) {
+		pid = (pid_t) atoi(d->d_name);
+		if ( pid <= 0 )
+			continue;
+		snprintf(path,sizeof(path),"/proc/%d/stat",(int) pid);
+		f = fopen(path,"r");
+		if ( f == NULL )
+			continue;
+		p = fgets(buf,sizeof(buf),f);
+		fclose(f);
+		/* the command name may contain blanks and parentheses */
+		if ( p == NULL || ( p = strrchr(buf,')') ) == NULL ||
+		     sscanf(p + 1," %c %d %d",&state,&ppid,&group) != 3 )
+			continue;
+		if ( group != pgid || state == 'Z' )
+			continue;
+		n++;
+		if ( fn != NULL )
+			fn(pid,arg);
+	}
+	closedir(dir);
+
+	return n;
+}
+
+static void bench_add_fds(pid_t pid,void* arg)
+{
+	*(int*) arg += bench_count_fds(pid);
+}
+
+static void* bench_sampler(void* arg)
+{
+	int procs, fds, n;
+
+	while ( ! bench_sample.stop ) {
+		fds = 0;
+		procs = bench_walk(bench_sample.pgid,bench_add_fds,&fds);
+		if ( procs > bench_sample.procs )
+			bench_sample.procs = procs;
+		if ( fds > bench_sample.fds )
+			bench_sample.fds = fds;
+		n = bench_count_fds(bench_sample.srun);
+		if ( n > bench_sample.srun_fds )
+			bench_sample.srun_fds = n;
+		usleep(BENCH_SAMPLE_PERIOD);
+	}
+
+	return NULL;
+}
+
+static void bench_signal(pid_t pid,void* arg)
+{
+	kill(pid,*(int*) arg);
+}
+
+/*
+ * release the tunnels left by a run, like srun does when it exits
+ */
+static void bench_cleanup(pid_t pgid)
+{
+	int sig = SIGTERM;
+	int i;
+
+	for ( i = 0 ; bench_walk(pgid,NULL,NULL) > 0 ; i++ ) {
+		if ( i == 50 )
+			sig = SIGKILL;
+		bench_walk(pgid,bench_signal,&sig);
+		usleep(100000);
+	}
+}
+
+/*
+ * play srun, writing the setup time and the number of failed nodes
+ */
+static void bench_srun(int mode,int nnodes,uint32_t jobid,uint32_t stepid,
+		       int go,int out)
+{
+	char nodes[64];
+	char result[64];
+	uint64_t start, elapsed;
+	int i;
+
+	x11_mode = mode;
+	setup_timeout = 0;
+	snprintf(nodes,sizeof(nodes),"node[1-%d]",nnodes);
+
+	/* wait for the sampler */
+	if ( read(go,result,1) != 1 )
+		_exit(1);
+
+	start = bench_now();
+	_x11_connect_nodes(nodes,jobid,stepid);
+	elapsed = bench_now() - start;
+
+	i = snprintf(result,sizeof(result),"%llu %d\n",
+		     (unsigned long long) elapsed,(int) bench_failures);
+	if ( write(out,result,i) != i )
+		_exit(1);
+	_exit(0);
+}
+
+static int bench_run(const char* name,int mode,int nnodes,uint32_t jobid,
+		     uint32_t stepid)
+{
+	unsigned long long elapsed;
+	char result[64];
+	char refid[64];
+	int go[2], out[2];
+	int failed;
+	ssize_t n;
+	pid_t pid;
+
+	if ( pipe(go) || pipe(out) ) {
+		fprintf(stderr,"error: unable to create pipes\n");
+		return -1;
+	}
+	pid = fork();
+	if ( pid == -1 ) {
+		fprintf(stderr,"error: unable to fork\n");
+		return -1;
+	}
+	/* srun and its helper tasks are sampled and released as a
+	 * process group */
+	setpgid(pid,pid);
+	if ( pid == 0 ) {
+		close(go[1]);
+		close(out[0]);
+		bench_srun(mode,nnodes,jobid,stepid,go[0],out[1]);
+	}
+	close(go[0]);
+	close(out[1]);
+
+	memset(&bench_sample,0,sizeof(bench_sample));
+	bench_sample.pgid = pid;
+	bench_sample.srun = pid;
+	if ( pthread_create(&bench_sample.thread,NULL,bench_sampler,NULL) ) {
+		fprintf(stderr,"error: unable to start sampler\n");
+		kill(pid,SIGKILL);
+	}
+	else if ( write(go[1],"",1) != 1 )
+		kill(pid,SIGKILL);
+
+	n = read(out[0],result,sizeof(result) - 1);
+	result[( n > 0 ) ? n : 0] = '\0';
+	bench_sample.stop = 1;
+	pthread_join(bench_sample.thread,NULL);
+	close(go[1]);
+	close(out[0]);
+	waitpid(pid,NULL,0);
+
+	bench_cleanup(bench_sample.pgid);
+	_x11_refid(refid,64,jobid,stepid);
+	remove_display_ref(refid);
+
+	if ( sscanf(result,"%llu %d",&elapsed,&failed) != 2 ) {
+		fprintf(stderr,"error: %s run on %d node(s) failed\n",name,
+			nnodes);
+		return -1;
+	}
+	printf("%-6s %6d %10.1f %7d %10d %9d %9d\n",name,nnodes,
+	       (double) elapsed / 1000,failed,bench_sample.procs,
+	       bench_sample.fds,bench_sample.srun_fds);
+	fflush(stdout);
+
+	return 0;
+}
+
+int main(int argc,char** argv)
+{
+	char* names[] = { "first", "last", "all" };
+	int modes[] = { X11_MODE_FIRST, X11_MODE_LAST, X11_MODE_ALL };
+	int selected[3] = { 1, 1, 1 };
+	int counts[] = { 1, 10, 100, 1000 };
+	int* nodes = counts;
+	int nnodes = sizeof(counts) / sizeof(int);
+	char* fake = "fake-ssh";
+	char* list;
+	char* p;
+	uint32_t stepid = 0;
+	int rc = 0;
+	int opt;
+	int i, j;
+
+	while ( ( opt = getopt(argc,argv,"m:F:T:l:j:e:s:") ) != -1 ) {
+		switch ( opt ) {
+		case 'm' :
+			memset(selected,0,sizeof(selected));
+			list = strdup(optarg);
+			for ( p = strtok(list,",") ; p != NULL ;
+			      p = strtok(NULL,",") ) {
+				for ( i = 0 ; i < 3 ; i++ )
+					selected[i] |= !strcmp(p,names[i]);
+			}
+			free(list);
+			break;
+		case 'F' :
+			fanout_max = atoi(optarg);
+			break;
+		case 'T' :
+			fanout_tree = atoi(optarg);
+			break;
+		case 'l' :
+			setenv("FAKE_SSH_LATENCY",optarg,1);
+			break;
+		case 'j' :
+			setenv("FAKE_SSH_JITTER",optarg,1);
+			break;
+		case 'e' :
+			setenv("FAKE_SSH_FAILURE",optarg,1);
+			break;
+		case 's' :
+			fake = optarg;
+			break;
+		default :
+			fprintf(stderr,"usage: %s [-m modes] [-F fanout_max] "
+				"[-T fanout_tree] [-l latency_ms] "
+				"[-j jitter_ms] [-e failure_pct] "
+				"[-s fake_ssh] [nodes ...]\n",argv[0]);
+			return 1;
+		}
+	}
+	if ( optind < argc ) {
+		nnodes = argc - optind;
+		nodes = (int*) calloc(nnodes,sizeof(int));
+		for ( i = 0 ; nodes != NULL && i < nnodes ; i++ )
+			nodes[i] = atoi(argv[optind+i]);
+	}
+
+	/* the helper tasks look for fake-ssh from their own directory */
+	ssh_cmd = realpath(fake,NULL);
+	if ( nodes == NULL || ssh_cmd == NULL ) {
+		fprintf(stderr,"error: invalid parameters\n");
+		return 1;
+	}
+
+	printf("%-6s %6s %10s %7s %10s %9s %9s\n","mode","nodes","wall_ms",
+	       "failed","peak_procs","peak_fds","srun_fds");
+	for ( i = 0 ; i < 3 ; i++ ) {
+		if ( ! selected[i] )
+			continue;
+		for ( j = 0 ; j < nnodes ; j++ )
+			rc |= bench_run(names[i],modes[i],nodes[j],getpid(),
+					stepid++);
+	}
+
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,1186 @@
+/***************************************************************************\
+ * relay-bench.c - latency and throughput of the x11 relay forwarding modes
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * measure the X11 data path of the helper over loopback, a synthetic X
+ * server and a load client being connected through the relays of each
+ * forwarding mode :
+ *
+ *   direct    the client talks to the X server
+ *   relay     through a relay, like -l and -R
+ *   cache     through a relay answering from its cache, like -C
+ *   chain     through two relays, like the batch two-hop chain
+ *   compress  through two relays, the first one compressing the
+ *             traffic sent to the second one, like -z
+ *   images    like compress, the images being sent as deltas, like -z -I
+ *
+ * The X server answers the connection setup, InternAtom, GetInputFocus,
+ * QueryExtension and GetImage requests and discards PutImage requests,
+ * each connection being served by a child process. The client measures
+ * the connection setup time, the round trips of GetInputFocus requests
+ * (never cached) and of InternAtom requests on a small set of names
+ * (cached with -C), then the throughput of PutImage uploads of a 
+ * synthetic frame sequence and of GetImage downloads. The sequences 
+ * are :
+ *
+ *   band      a band of changed_pct of the rows changes on each frame,
+ *             like an updated window
+ *   plot      a curve scrolls on a still background, like a live plot
+ *   noise     every pixel changes on each frame, like a video
+ *
+ * With -L, the link between the X server and the relays next to the
+ * client (between the two relays in the chain modes) is emulated at 
+ * link_mbit Mbit/s in each direction, the bytes sent on it toward the X
+ * server while the frames are uploaded being reported per frame.
+ *
+ * build from the top directory :
+ *
+ *   gcc -O2 -I. -o relay-bench bench/relay-bench.c \
+ *       slurm-spank-x11-relay.c slurm-spank-x11-proto.c \
+ *       slurm-spank-x11-image.c -lz
+ *
+ * usage : relay-bench [-m modes] [-n round_trips] [-k atoms]
+ *                     [-i images] [-g width x height] [-c changed_pct]
+ *                     [-f sequence] [-L link_mbit] [-v]
+ *                     [-S | -d display [-a cookie]]
+ *
+ * modes is a comma separated list of the modes above (default all of
+ * them) and sequence one of the frame sequences (default band). One 
+ * JSON object is printed per mode on a line, with the p50 and p99 
+ * latencies in microseconds, the throughputs in MB/s, the uploaded 
+ * frames per second and, with -L, the kilobytes per frame sent on the
+ * link. With -v, the relays report the traffic of each connection on
+ * stderr.
+ *
+ * The X server and the client can also be run apart, to measure another
+ * forwarding path like an ssh tunnel (see wan-bench.sh). With -S, the
+ * X server is started, its DISPLAY printed, and it runs until the bench
+ * is terminated. With -d, the client is run against the given DISPLAY
+ * (the display mode), presenting the MIT-MAGIC-COOKIE-1 given in hex by
+ * -a if any.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "slurm-spank-x11-relay.h"
+
+/* the synthetic X server uses a display below the relay ones */
+#define BENCH_DISPLAY_FIRST    60
+#define BENCH_DISPLAY_LAST     99
+
+#define BENCH_ROUND_TRIPS      10000
+#define BENCH_ATOMS            64
+#define BENCH_IMAGES           200
+#define BENCH_WIDTH            256
+#define BENCH_HEIGHT           240
+#define BENCH_CHANGED          10
+#define BENCH_CONNECTIONS      50
+#define BENCH_LINK_CHUNK       16384
+
+/* requests are limited to the maximum length without BIG-REQUESTS */
+#define BENCH_REQUEST_MAX      ( 65535 * 4 )
+
+#define X11_INTERN_ATOM        16
+#define X11_GET_INPUT_FOCUS    43
+#define X11_PUT_IMAGE          72
+#define X11_GET_IMAGE          73
+#define X11_QUERY_EXTENSION    98
+
+#define PAD4(n)                ( ( (n) + 3 ) & ~3 )
+
+enum {
+	MODE_DIRECT = 0,
+	MODE_RELAY,
+	MODE_CACHE,
+	MODE_CHAIN,
+	MODE_COMPRESS,
+	MODE_IMAGES,
+	MODE_COUNT
+};
+
+static const char* mode_names[MODE_COUNT] = {
+	"direct", "relay", "cache", "chain", "compress", "images"
+};
+
+enum {
+	SEQ_BAND = 0,
+	SEQ_PLOT,
+	SEQ_NOISE,
+	SEQ_COUNT
+};
+
+static const char* seq_names[SEQ_COUNT] = {
+	"band", "plot", "noise"
+};
+
+static int verbose = 0;
+
+static unsigned char client_auth[16];
+static int client_auth_len = 0;
+
+static volatile sig_atomic_t server_stop = 0;
+
+/* bytes sent toward the X server on the emulated link, shared with the
+ * processes of the link */
+static uint64_t* link_bytes = NULL;
+
+/*
+ * buffered reader of a connection
+ */
+struct bench_conn {
+	int    fd;
+	int    msb;
+	char*  buf;
+	size_t pos;
+	size_t len;
+	size_t size;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_cmp(const void* a,const void* b)
+{
+	uint64_t ua = *(const uint64_t*) a;
+	uint64_t ub = *(const uint64_t*) b;
+
+	return ( ua > ub ) - ( ua < ub );
+}
+
+static uint32_t bench_get16(struct bench_conn* c,const char* p)
+{
+	const unsigned char* u = (const unsigned char*) p;
+
+	return c->msb ? ( u[0] << 8 ) | u[1] : ( u[1] << 8 ) | u[0] ;
+}
+
+static uint32_t bench_get32(struct bench_conn* c,const char* p)
+{
+	const unsigned char* u = (const unsigned char*) p;
+
+	if ( c->msb )
+		return ( (uint32_t) u[0] << 24 ) | ( u[1] << 16 ) |
+			( u[2] << 8 ) | u[3];
+	else
+		return ( (uint32_t) u[3] << 24 ) | ( u[2] << 16 ) |
+			( u[1] << 8 ) | u[0];
+}
+
+static void bench_put16(struct bench_conn* c,char* p,uint32_t v)
+{
+	unsigned char* u = (unsigned char*) p;
+
+	u[c->msb ? 0 : 1] = ( v >> 8 ) & 0xff;
+	u[c->msb ? 1 : 0] = v & 0xff;
+}
+
+static void bench_put32(struct bench_conn* c,char* p,uint32_t v)
+{
+	bench_put16(c,p + ( c->msb ? 0 : 2 ),v >> 16);
+	bench_put16(c,p + ( c->msb ? 2 : 0 ),v & 0xffff);
+}
+
+static int bench_conn_init(struct bench_conn* c,int fd)
+{
+	c->fd = fd;
+	c->msb = 0;
+	c->pos = c->len = 0;
+	c->size = BENCH_REQUEST_MAX + 4096;
+	c->buf = (char*) malloc(c->size);
+
+	return ( c->buf == NULL ) ? -1 : 0 ;
+}
+
+static void bench_conn_free(struct bench_conn* c)
+{
+	close(c->fd);
+	free(c->buf);
+	c->buf = NULL;
+}
+
+/*
+ * get the next len bytes of the connection, return NULL at the end of
+ * the stream or on error
+ */
+static char* bench_read(struct bench_conn* c,size_t len)
+{
+	ssize_t n;
+	char* p;
+
+	if ( len > c->size )
+		return NULL;
+	if ( c->len - c->pos < len && c->pos + len > c->size ) {
+		memmove(c->buf,c->buf + c->pos,c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+	while ( c->len - c->pos < len ) {
+		n = read(c->fd,c->buf + c->len,c->size - c->len);
+		if ( n == -1 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return NULL;
+		c->len += n;
+	}
+	p = c->buf + c->pos;
+	c->pos += len;
+
+	return p;
+}
+
+static int bench_write(int fd,const char* buf,size_t len)
+{
+	ssize_t n;
+
+	while ( len > 0 ) {
+		n = write(fd,buf,len);
+		if ( n == -1 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return -1;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * pixels of the images, a gradient shifted by the frame number on the
+ * changed rows
+ */
+static void bench_pixels(char* data,int width,int rows,int first,int frame)
+{
+	uint32_t* p = (uint32_t*) data;
+	int x, y;
+
+	for ( y = 0 ; y < rows ; y++ ) {
+		for ( x = 0 ; x < width ; x++ )
+			p[y*width+x] = 0xff000000 |
+				( ( ( x + frame ) & 0xff ) << 16 ) |
+				( ( ( first + y ) & 0xff ) << 8 ) |
+				( ( ( x ^ ( first + y ) ) + frame ) & 0xff );
+	}
+}
+
+struct bench_params {
+	int n;
+	int atoms;
+	int images;
+	int width;
+	int height;
+	int changed;
+	int seq;
+	int link_mbit;
+};
+
+/*
+ * row of the curve of the plot sequence at column x of a frame, a 
+ * triangle wave moving by 4 columns per frame
+ */
+static int bench_plot_row(struct bench_params* bp,int x,int frame)
+{
+	int period = 2 * ( bp->height / 2 );
+	int t;
+
+	if ( period < 2 )
+		return 0;
+	t = ( 3 * x + 4 * frame ) % period;
+	return ( t < period / 2 ) ? t + bp->height / 4 :
+		period - t + bp->height / 4 - 1 ;
+}
+
+static void bench_plot_curve(struct bench_params* bp,uint32_t* p,
+			     int frame,uint32_t color)
+{
+	int x, y;
+
+	for ( x = 0 ; x < bp->width ; x++ ) {
+		y = bench_plot_row(bp,x,frame);
+		if ( y >= 0 && y + 1 < bp->height ) {
+			p[y*bp->width+x] = color;
+			p[(y+1)*bp->width+x] = color;
+		}
+	}
+}
+
+/*
+ * pixels of frame of a sequence, data holding the previous frame
+ */
+static void bench_frame(char* data,struct bench_params* bp,int frame)
+{
+	uint32_t* p = (uint32_t*) data;
+	uint32_t r;
+	size_t i;
+	int band, first;
+
+	switch ( bp->seq ) {
+	case SEQ_BAND :
+		if ( frame == 0 ) {
+			bench_pixels(data,bp->width,bp->height,0,0);
+			break;
+		}
+		band = ( bp->height * bp->changed ) / 100;
+		first = ( band > 0 ) ? ( ( frame - 1 ) * band ) % bp->height :
+			0 ;
+		if ( first + band > bp->height )
+			first = bp->height - band;
+		bench_pixels(data + (size_t) first * bp->width * 4,bp->width,
+			     band,first,frame);
+		break;
+	case SEQ_PLOT :
+		if ( frame == 0 ) {
+			for ( i = 0 ; i < (size_t) bp->width * bp->height ; 
+			      i++ )
+				p[i] = 0xffffffff;
+		}
+		else
+			bench_plot_curve(bp,p,frame - 1,0xffffffff);
+		bench_plot_curve(bp,p,frame,0xff2060c0);
+		break;
+	default :
+		/* xorshift, a new stream per frame */
+		r = 2654435761u * ( frame + 1 );
+		for ( i = 0 ; i < (size_t) bp->width * bp->height ; i++ ) {
+			r ^= r << 13;
+			r ^= r >> 17;
+			r ^= r << 5;
+			p[i] = 0xff000000 | ( r & 0xffffff );
+		}
+	}
+}
+
+/*
+ * synthetic X server
+ */
+static int server_setup(struct bench_conn* c)
+{
+	static const char vendor[8] = "bench";
+	char reply[8 + 32 + 8 + 8 + 40 + 8 + 24];
+	char* p;
+	char* r;
+	size_t len;
+
+	p = bench_read(c,12);
+	if ( p == NULL || ( p[0] != 'B' && p[0] != 'l' ) )
+		return -1;
+	c->msb = ( p[0] == 'B' );
+	len = PAD4(bench_get16(c,p + 6)) + PAD4(bench_get16(c,p + 8));
+	if ( len > 0 && bench_read(c,len) == NULL )
+		return -1;
+
+	/* one screen of depth 24 with one TrueColor visual */
+	memset(reply,0,sizeof(reply));
+	r = reply;
+	r[0] = 1;
+	bench_put16(c,r + 2,11);
+	bench_put16(c,r + 6,( sizeof(reply) - 8 ) / 4);
+	r += 8;
+	bench_put32(c,r + 4,0x00200000);
+	bench_put32(c,r + 8,0x001fffff);
+	bench_put16(c,r + 16,sizeof(vendor));
+	bench_put16(c,r + 18,65535);
+	r[20] = 1;
+	r[21] = 1;
+	r[24] = r[25] = 32;
+	r[26] = 8;
+	r[27] = (char) 255;
+	r += 32;
+	memcpy(r,vendor,sizeof(vendor));
+	r += 8;
+	r[0] = 24;
+	r[1] = r[2] = 32;
+	r += 8;
+	bench_put32(c,r,0x100);
+	bench_put32(c,r + 8,0xffffff);
+	bench_put16(c,r + 20,BENCH_WIDTH * 4);
+	bench_put16(c,r + 22,BENCH_HEIGHT * 4);
+	bench_put16(c,r + 28,1);
+	bench_put16(c,r + 30,1);
+	bench_put32(c,r + 32,0x21);
+	r[38] = 24;
+	r[39] = 1;
+	r += 40;
+	r[0] = 24;
+	bench_put16(c,r + 2,1);
+	r += 8;
+	bench_put32(c,r,0x21);
+	r[4] = 4;
+	r[5] = 8;
+	bench_put16(c,r + 6,256);
+	bench_put32(c,r + 8,0xff0000);
+	bench_put32(c,r + 12,0xff00);
+	bench_put32(c,r + 16,0xff);
+
+	return bench_write(c->fd,reply,sizeof(reply));
+}
+
+static int server_serve(int fd)
+{
+	struct bench_conn c;
+	char reply[32];
+	char* image = NULL;
+	char* p;
+	int opcode;
+	uint32_t hash;
+	uint16_t seq = 0;
+	size_t len;
+	size_t size;
+	int width, rows;
+	int i;
+
+	if ( bench_conn_init(&c,fd) || server_setup(&c) )
+		return 1;
+
+	while ( ( p = bench_read(&c,4) ) != NULL ) {
+		/* p is set to the request data after its header */
+		opcode = (unsigned char) p[0];
+		len = bench_get16(&c,p + 2) * 4;
+		if ( len < 4 )
+			return 1;
+		p = bench_read(&c,len - 4);
+		if ( p == NULL )
+			return 1;
+		seq++;
+
+		memset(reply,0,sizeof(reply));
+		reply[0] = 1;
+		bench_put16(&c,reply + 2,seq);
+		switch ( opcode ) {
+		case X11_INTERN_ATOM :
+			/* the same name always gets the same atom */
+			if ( len < 8 || len < 8 + bench_get16(&c,p) )
+				return 1;
+			hash = 2166136261u;
+			for ( i = 0 ; i < (int) bench_get16(&c,p) ; i++ )
+				hash = ( hash ^ (unsigned char) p[4+i] ) *
+					16777619u;
+			bench_put32(&c,reply + 8,( hash & 0x1fffffff ) | 0x100);
+			break;
+		case X11_GET_INPUT_FOCUS :
+			reply[1] = 1;
+			bench_put32(&c,reply + 8,0x00200001);
+			break;
+		case X11_QUERY_EXTENSION :
+			break;
+		case X11_GET_IMAGE :
+			if ( len < 20 )
+				return 1;
+			width = bench_get16(&c,p + 8);
+			rows = bench_get16(&c,p + 10);
+			size = (size_t) width * rows * 4;
+			if ( size > BENCH_REQUEST_MAX )
+				return 1;
+			if ( image == NULL )
+				image = (char*) malloc(BENCH_REQUEST_MAX);
+			if ( image == NULL )
+				return 1;
+			bench_pixels(image,width,rows,0,seq);
+			reply[1] = 24;
+			bench_put32(&c,reply + 4,size / 4);
+			bench_put32(&c,reply + 8,0x21);
+			if ( bench_write(fd,reply,sizeof(reply)) ||
+			     bench_write(fd,image,size) )
+				return 1;
+			continue;
+		default :
+			/* PutImage and the other requests without reply */
+			continue;
+		}
+		if ( bench_write(fd,reply,sizeof(reply)) )
+			return 1;
+	}
+
+	bench_conn_free(&c);
+	free(image);
+	return 0;
+}
+
+/*
+ * listen on the TCP port of a free display and serve its connections in
+ * child processes, return the display number and set the server pid
+ */
+static int server_start(pid_t* pid)
+{
+	struct sockaddr_in sin;
+	int one = 1;
+	int num;
+	int fd;
+	int cfd;
+
+	for ( num = BENCH_DISPLAY_FIRST ; num <= BENCH_DISPLAY_LAST ; num++ ) {
+		fd = socket(AF_INET,SOCK_STREAM,0);
+		if ( fd == -1 )
+			return -1;
+		setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+		memset(&sin,0,sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(X11_TCP_PORT_BASE + num);
+		if ( bind(fd,(struct sockaddr*) &sin,sizeof(sin)) == 0 &&
+		     listen(fd,128) == 0 )
+			break;
+		close(fd);
+	}
+	if ( num > BENCH_DISPLAY_LAST )
+		return -1;
+
+	*pid = fork();
+	if ( *pid == -1 ) {
+		close(fd);
+		return -1;
+	}
+	if ( *pid > 0 ) {
+		close(fd);
+		return num;
+	}
+
+	signal(SIGCHLD,SIG_IGN);
+	while ( 1 ) {
+		cfd = accept(fd,NULL,NULL);
+		if ( cfd == -1 ) {
+			if ( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			_exit(1);
+		}
+		setsockopt(cfd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+		switch ( fork() ) {
+		case 0 :
+			close(fd);
+			_exit(server_serve(cfd));
+		default :
+			close(cfd);
+		}
+	}
+}
+
+/*
+ * start a relay of the helper toward a target display, return its
+ * display number
+ */
+static int relay_start(const char* target,int compress,int images,
+		       int cache,pid_t* pid,struct x11_relay* relay)
+{
+	if ( x11_relay_listen(relay,NULL) )
+		return -1;
+	relay->compress = compress;
+	relay->images = images;
+	relay->cache = cache;
+
+	*pid = fork();
+	if ( *pid == -1 ) {
+		x11_relay_close(relay,1);
+		return -1;
+	}
+	if ( *pid == 0 ) {
+		if ( ! verbose && freopen("/dev/null","w",stderr) == NULL )
+			_exit(1);
+		x11_relay_run(relay,target);
+		_exit(1);
+	}
+	/* the X11 socket of the relay is removed by bench_stop */
+	x11_relay_close(relay,0);
+
+	return relay->num;
+}
+
+/*
+ * forward a direction of a connection of the emulated link, each chunk
+ * leaving the link once the previous ones were sent at its rate
+ */
+static void link_pump(int from,int to,int mbit,int count)
+{
+	char buf[BENCH_LINK_CHUNK];
+	struct timespec ts;
+	uint64_t next = 0;
+	uint64_t now;
+	ssize_t n;
+
+	while ( ( n = read(from,buf,sizeof(buf)) ) != 0 ) {
+		if ( n == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+		now = bench_now();
+		if ( next < now )
+			next = now;
+		next += (uint64_t) n * 8000 / mbit;
+		if ( next > now ) {
+			ts.tv_sec = ( next - now ) / 1000000000;
+			ts.tv_nsec = ( next - now ) % 1000000000;
+			while ( nanosleep(&ts,&ts) == -1 && errno == EINTR ) ;
+		}
+		if ( bench_write(to,buf,n) )
+			break;
+		if ( count )
+			__atomic_add_fetch(link_bytes,n,__ATOMIC_RELAXED);
+	}
+	shutdown(to,SHUT_WR);
+}
+
+/*
+ * start the emulated link toward a target display, each connection 
+ * being forwarded by two child processes, return its display number
+ */
+static int link_start(const char* target,int mbit,pid_t* pid)
+{
+	struct sockaddr_in sin;
+	int one = 1;
+	int num;
+	int fd, cfd, sfd;
+
+	for ( num = BENCH_DISPLAY_FIRST ; num <= BENCH_DISPLAY_LAST ; num++ ) {
+		fd = socket(AF_INET,SOCK_STREAM,0);
+		if ( fd == -1 )
+			return -1;
+		setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+		memset(&sin,0,sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(X11_TCP_PORT_BASE + num);
+		if ( bind(fd,(struct sockaddr*) &sin,sizeof(sin)) == 0 &&
+		     listen(fd,128) == 0 )
+			break;
+		close(fd);
+	}
+	if ( num > BENCH_DISPLAY_LAST )
+		return -1;
+
+	*pid = fork();
+	if ( *pid != 0 ) {
+		close(fd);
+		return ( *pid == -1 ) ? -1 : num ;
+	}
+
+	signal(SIGCHLD,SIG_IGN);
+	while ( 1 ) {
+		cfd = accept(fd,NULL,NULL);
+		if ( cfd == -1 ) {
+			if ( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			_exit(1);
+		}
+		if ( fork() == 0 ) {
+			close(fd);
+			sfd = x11_display_connect(target);
+			if ( sfd == -1 )
+				_exit(1);
+			setsockopt(cfd,IPPROTO_TCP,TCP_NODELAY,&one,
+				   sizeof(one));
+			if ( fork() == 0 ) {
+				link_pump(sfd,cfd,mbit,0);
+				_exit(0);
+			}
+			link_pump(cfd,sfd,mbit,1);
+			_exit(0);
+		}
+		close(cfd);
+	}
+}
+
+/*
+ * load client
+ */
+static int client_connect(struct bench_conn* c,const char* display)
+{
+	char setup[12 + 20 + 16];
+	size_t len = 12;
+	char* p;
+	int fd;
+
+	fd = x11_display_connect(display);
+	if ( fd == -1 || bench_conn_init(c,fd) ) {
+		if ( fd != -1 )
+			close(fd);
+		return -1;
+	}
+
+	memset(setup,0,sizeof(setup));
+	setup[0] = 'l';
+	bench_put16(c,setup + 2,11);
+	if ( client_auth_len > 0 ) {
+		bench_put16(c,setup + 6,18);
+		bench_put16(c,setup + 8,client_auth_len);
+		memcpy(setup + 12,"MIT-MAGIC-COOKIE-1",18);
+		memcpy(setup + 32,client_auth,client_auth_len);
+		len = sizeof(setup);
+	}
+	if ( bench_write(fd,setup,len) ||
+	     ( p = bench_read(c,8) ) == NULL || p[0] != 1 ||
+	     bench_read(c,bench_get16(c,p + 6) * 4) == NULL ) {
+		bench_conn_free(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * wait for the reply of a request, return its data or NULL on error
+ */
+static char* client_reply(struct bench_conn* c,size_t* len)
+{
+	char* p;
+
+	p = bench_read(c,32);
+	if ( p == NULL || p[0] != 1 )
+		return NULL;
+	*len = (size_t) bench_get32(c,p + 4) * 4;
+
+	return ( *len > 0 ) ? bench_read(c,*len) : p ;
+}
+
+static int client_round_trip(struct bench_conn* c,const char* req,
+			     size_t len)
+{
+	size_t rlen;
+
+	if ( bench_write(c->fd,req,len) || client_reply(c,&rlen) == NULL )
+		return -1;
+
+	return 0;
+}
+
+static void client_latency(uint64_t* lat,int n,double* p50,double* p99)
+{
+	qsort(lat,n,sizeof(uint64_t),bench_cmp);
+	*p50 = lat[n/2] / 1000.0;
+	*p99 = lat[(n*99)/100] / 1000.0;
+}
+
+struct bench_result {
+	double setup_p50;
+	double setup_p99;
+	double sync_p50;
+	double sync_p99;
+	double atom_p50;
+	double atom_p99;
+	double put_mbs;
+	double put_fps;
+	double link_kb;
+	double get_mbs;
+};
+
+static int client_run(const char* display,struct bench_params* bp,
+		      struct bench_result* res)
+{
+	struct bench_conn c;
+	char* req;
+	char name[32];
+	uint64_t* lat;
+	uint64_t start;
+	uint64_t bytes = 0;
+	size_t len;
+	int i;
+	int n;
+
+	/* slow paths make fewer connections */
+	n = ( bp->n < BENCH_CONNECTIONS ) ? bp->n : BENCH_CONNECTIONS ;
+	lat = (uint64_t*) calloc(bp->n,sizeof(uint64_t));
+	req = (char*) malloc(BENCH_REQUEST_MAX);
+	if ( lat == NULL || req == NULL )
+		return -1;
+
+	/* connection setup */
+	for ( i = 0 ; i < n ; i++ ) {
+		start = bench_now();
+		if ( client_connect(&c,display) )
+			return -1;
+		lat[i] = bench_now() - start;
+		bench_conn_free(&c);
+	}
+	client_latency(lat,n,&res->setup_p50,&res->setup_p99);
+
+	if ( client_connect(&c,display) )
+		return -1;
+
+	/* GetInputFocus round trips */
+	memset(req,0,4);
+	req[0] = X11_GET_INPUT_FOCUS;
+	bench_put16(&c,req + 2,1);
+	for ( i = 0 ; i < bp->n ; i++ ) {
+		start = bench_now();
+		if ( client_round_trip(&c,req,4) )
+			return -1;
+		lat[i] = bench_now() - start;
+	}
+	client_latency(lat,bp->n,&res->sync_p50,&res->sync_p99);
+
+	/* InternAtom round trips */
+	for ( i = 0 ; i < bp->n ; i++ ) {
+		len = snprintf(name,sizeof(name),"_BENCH_ATOM_%d",
+			       i % bp->atoms);
+		memset(req,0,8 + PAD4(len));
+		req[0] = X11_INTERN_ATOM;
+		bench_put16(&c,req + 2,2 + PAD4(len) / 4);
+		bench_put16(&c,req + 4,len);
+		memcpy(req + 8,name,len);
+		start = bench_now();
+		if ( client_round_trip(&c,req,8 + PAD4(len)) )
+			return -1;
+		lat[i] = bench_now() - start;
+	}
+	client_latency(lat,bp->n,&res->atom_p50,&res->atom_p99);
+
+	/* PutImage uploads, ZPixmap of depth 24, followed by a round
+	 * trip so that the X server got all of them */
+	len = 24 + (size_t) bp->width * 4 * bp->height;
+	memset(req,0,24);
+	req[0] = X11_PUT_IMAGE;
+	req[1] = 2;
+	bench_put16(&c,req + 2,len / 4);
+	bench_put32(&c,req + 4,0x00200001);
+	bench_put32(&c,req + 8,0x00200002);
+	bench_put16(&c,req + 12,bp->width);
+	bench_put16(&c,req + 14,bp->height);
+	req[21] = 24;
+	bench_frame(req + 24,bp,0);
+	if ( link_bytes != NULL )
+		bytes = __atomic_load_n(link_bytes,__ATOMIC_RELAXED);
+	start = bench_now();
+	for ( i = 0 ; i < bp->images ; i++ ) {
+		bench_frame(req + 24,bp,i + 1);
+		if ( bench_write(c.fd,req,len) )
+			return -1;
+	}
+	memset(req,0,4);
+	req[0] = X11_GET_INPUT_FOCUS;
+	bench_put16(&c,req + 2,1);
+	if ( client_round_trip(&c,req,4) )
+		return -1;
+	start = bench_now() - start;
+	res->put_mbs = (double) ( len - 24 ) * bp->images / ( start / 1000.0 );
+	res->put_fps = bp->images / ( start / 1e9 );
+	res->link_kb = -1;
+	if ( link_bytes != NULL )
+		res->link_kb = ( __atomic_load_n(link_bytes,__ATOMIC_RELAXED) -
+				 bytes ) / 1024.0 / bp->images;
+
+	/* GetImage downloads */
+	memset(req,0,20);
+	req[0] = X11_GET_IMAGE;
+	req[1] = 2;
+	bench_put16(&c,req + 2,5);
+	bench_put32(&c,req + 4,0x00200001);
+	bench_put16(&c,req + 12,bp->width);
+	bench_put16(&c,req + 14,bp->height);
+	bench_put32(&c,req + 16,0xffffffff);
+	start = bench_now();
+	for ( i = 0 ; i < bp->images ; i++ ) {
+		if ( client_round_trip(&c,req,20) )
+			return -1;
+	}
+	res->get_mbs = (double) ( len - 24 ) * bp->images /
+		( ( bench_now() - start ) / 1000.0 );
+
+	bench_conn_free(&c);
+	free(req);
+	free(lat);
+	return 0;
+}
+
+static void bench_stop(pid_t* pids,struct x11_relay* relays,int n,
+		       pid_t link)
+{
+	int i;
+
+	if ( link > 0 ) {
+		kill(link,SIGTERM);
+		while ( waitpid(link,NULL,0) == -1 && errno == EINTR ) ;
+	}
+	for ( i = 0 ; i < n ; i++ ) {
+		kill(pids[i],SIGTERM);
+		while ( waitpid(pids[i],NULL,0) == -1 && errno == EINTR ) ;
+		x11_relay_close(&relays[i],1);
+	}
+}
+
+/*
+ * run the client through the relays of a mode, the first relay started
+ * being the one next to the X server, the emulated link being inserted
+ * before the relay next to the client
+ */
+static int bench_mode(int mode,int server,struct bench_params* bp,
+		      struct bench_result* res)
+{
+	struct x11_relay relays[2];
+	pid_t pids[2];
+	pid_t link = 0;
+	char target[32];
+	int nrelays = 0;
+	int num = server;
+	int rc;
+
+	snprintf(target,sizeof(target),"127.0.0.1:%d",num);
+	if ( mode == MODE_CHAIN || mode == MODE_COMPRESS ||
+	     mode == MODE_IMAGES ) {
+		num = relay_start(target,0,0,0,&pids[0],&relays[0]);
+		if ( num == -1 )
+			return -1;
+		nrelays++;
+		snprintf(target,sizeof(target),"127.0.0.1:%d",num);
+	}
+	if ( bp->link_mbit > 0 ) {
+		num = link_start(target,bp->link_mbit,&link);
+		if ( num == -1 ) {
+			bench_stop(pids,relays,nrelays,0);
+			return -1;
+		}
+		snprintf(target,sizeof(target),"127.0.0.1:%d",num);
+	}
+	if ( mode != MODE_DIRECT ) {
+		num = relay_start(target,( mode == MODE_COMPRESS ||
+					   mode == MODE_IMAGES ),
+				  ( mode == MODE_IMAGES ),
+				  ( mode == MODE_CACHE ),&pids[nrelays],
+				  &relays[nrelays]);
+		if ( num == -1 ) {
+			bench_stop(pids,relays,nrelays,link);
+			return -1;
+		}
+		nrelays++;
+		snprintf(target,sizeof(target),"127.0.0.1:%d",num);
+	}
+
+	rc = client_run(target,bp,res);
+	bench_stop(pids,relays,nrelays,link);
+
+	return rc;
+}
+
+static void bench_print(const char* mode,struct bench_params* bp,
+			struct bench_result* res)
+{
+	printf("{\"mode\":\"%s\",\"round_trips\":%d,\"images\":%d,"
+	       "\"width\":%d,\"height\":%d,\"changed_pct\":%d,"
+	       "\"sequence\":\"%s\",\"link_mbit\":%d,"
+	       "\"setup_p50_us\":%.1f,\"setup_p99_us\":%.1f,"
+	       "\"sync_p50_us\":%.1f,\"sync_p99_us\":%.1f,"
+	       "\"atom_p50_us\":%.1f,\"atom_p99_us\":%.1f,"
+	       "\"put_mbs\":%.1f,\"put_fps\":%.1f,",mode,bp->n,bp->images,
+	       bp->width,bp->height,bp->changed,seq_names[bp->seq],
+	       bp->link_mbit,res->setup_p50,res->setup_p99,res->sync_p50,
+	       res->sync_p99,res->atom_p50,res->atom_p99,res->put_mbs,
+	       res->put_fps);
+	if ( res->link_kb >= 0 )
+		printf("\"link_kb_per_frame\":%.1f,",res->link_kb);
+	else
+		printf("\"link_kb_per_frame\":null,");
+	printf("\"get_mbs\":%.1f}\n",res->get_mbs);
+	fflush(stdout);
+}
+
+static void bench_terminate(int sig)
+{
+	server_stop = 1;
+}
+
+/*
+ * parse a cookie given as an hexadecimal string
+ */
+static int bench_cookie(const char* hex)
+{
+	unsigned int byte;
+
+	if ( strlen(hex) != 2 * sizeof(client_auth) )
+		return -1;
+	for ( client_auth_len = 0 ; 
+	      client_auth_len < (int) sizeof(client_auth) ; 
+	      client_auth_len++ ) {
+		if ( sscanf(hex + 2 * client_auth_len,"%2x",&byte) != 1 )
+			return -1;
+		client_auth[client_auth_len] = byte;
+	}
+
+	return 0;
+}
+
+int main(int argc,char** argv)
+{
+	struct bench_params bp = {
+		BENCH_ROUND_TRIPS, BENCH_ATOMS, BENCH_IMAGES, BENCH_WIDTH,
+		BENCH_HEIGHT, BENCH_CHANGED, SEQ_BAND, 0
+	};
+	struct bench_result res;
+	int selected[MODE_COUNT] = { 1, 1, 1, 1, 1, 1 };
+	pid_t server;
+	char* display = NULL;
+	char* list;
+	char* p;
+	int serve = 0;
+	int num;
+	int opt;
+	int rc = 0;
+	int i;
+
+	while ( ( opt = getopt(argc,argv,"m:n:k:i:g:c:f:L:vSd:a:") ) != -1 ) {
+		switch ( opt ) {
+		case 'm' :
+			memset(selected,0,sizeof(selected));
+			list = strdup(optarg);
+			for ( p = strtok(list,",") ; p != NULL ;
+			      p = strtok(NULL,",") ) {
+				for ( i = 0 ; i < MODE_COUNT ; i++ )
+					selected[i] |= !strcmp(p,mode_names[i]);
+			}
+			free(list);
+			break;
+		case 'n' :
+			bp.n = atoi(optarg);
+			break;
+		case 'k' :
+			bp.atoms = atoi(optarg);
+			break;
+		case 'i' :
+			bp.images = atoi(optarg);
+			break;
+		case 'g' :
+			if ( sscanf(optarg,"%dx%d",&bp.width,&bp.height) != 2 )
+				bp.width = 0;
+			break;
+		case 'c' :
+			bp.changed = atoi(optarg);
+			break;
+		case 'f' :
+			for ( bp.seq = 0 ; bp.seq < SEQ_COUNT ; bp.seq++ ) {
+				if ( strcmp(optarg,seq_names[bp.seq]) == 0 )
+					break;
+			}
+			break;
+		case 'L' :
+			bp.link_mbit = atoi(optarg);
+			break;
+		case 'v' :
+			verbose = 1;
+			break;
+		case 'S' :
+			serve = 1;
+			break;
+		case 'd' :
+			display = optarg;
+			break;
+		case 'a' :
+			if ( bench_cookie(optarg) ) {
+				fprintf(stderr,"error: invalid cookie\n");
+				return 1;
+			}
+			break;
+		default :
+			fprintf(stderr,"usage: %s [-m modes] [-n round_trips] "
+				"[-k atoms] [-i images] [-g width x height] "
+				"[-c changed_pct] [-f sequence] "
+				"[-L link_mbit] [-v] [-S | -d display "
+				"[-a cookie]]\n",argv[0]);
+			return 1;
+		}
+	}
+	if ( bp.n <= 0 || bp.atoms <= 0 || bp.images <= 0 ||
+	     bp.width <= 0 || bp.height <= 0 || bp.changed < 0 ||
+	     bp.changed > 100 || bp.seq == SEQ_COUNT || bp.link_mbit < 0 ||
+	     ( display != NULL && bp.link_mbit > 0 ) ||
+	     24 + (size_t) bp.width * bp.height * 4 > BENCH_REQUEST_MAX ) {
+		fprintf(stderr,"error: invalid parameters\n");
+		return 1;
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+
+	/* the bytes of the link are counted by its processes */
+	if ( bp.link_mbit > 0 ) {
+		link_bytes = (uint64_t*) mmap(NULL,sizeof(uint64_t),
+					      PROT_READ|PROT_WRITE,
+					      MAP_SHARED|MAP_ANONYMOUS,-1,0);
+		if ( link_bytes == MAP_FAILED ) {
+			fprintf(stderr,"error: unable to map the link "
+				"counter\n");
+			return 1;
+		}
+	}
+
+	/* client of another forwarding path */
+	if ( display != NULL ) {
+		if ( client_run(display,&bp,&res) ) {
+			fprintf(stderr,"error: display mode failed on %s\n",
+				display);
+			return 1;
+		}
+		bench_print("display",&bp,&res);
+		return 0;
+	}
+
+	num = server_start(&server);
+	if ( num == -1 ) {
+		fprintf(stderr,"error: unable to start the X server : %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	/* X server of another forwarding path */
+	if ( serve ) {
+		signal(SIGTERM,bench_terminate);
+		signal(SIGINT,bench_terminate);
+		printf("127.0.0.1:%d\n",num);
+		fflush(stdout);
+		while ( ! server_stop )
+			pause();
+		memset(selected,0,sizeof(selected));
+	}
+
+	for ( i = 0 ; i < MODE_COUNT ; i++ ) {
+		if ( ! selected[i] )
+			continue;
+		if ( bench_mode(i,num,&bp,&res) ) {
+			fprintf(stderr,"error: %s mode failed\n",mode_names[i]);
+			rc = 1;
+			continue;
+		}
+		bench_print(mode_names[i],&bp,&res);
+	}
+
+	kill(server,SIGTERM);
+	while ( waitpid(server,NULL,0) == -1 && errno == EINTR ) ;
+
+	return rc;
+}
@@ -0,0 +1,382 @@
+/***************************************************************************\
+ * slurm-stub.c - stub of the Slurm library for the x11 plugin benchmarks
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <slurm/slurm.h>
+#include <slurm/spank.h>
+
+#include "slurm-stub.h"
+
+char* slurm_stub_nodes = NULL;
+unsigned long slurm_stub_rpcs = 0;
+unsigned long slurm_stub_hostlist_calls = 0;
+
+/*
+ * hostlists are expanded arrays, only the prefix[a-b,c] syntax being
+ * supported, which is all the benchmarks need
+ */
+struct hostlist {
+	char** hosts;
+	int    count;
+	int    first;
+};
+
+static int stub_add(struct hostlist* hl,const char* host)
+{
+	char** hosts;
+
+	if ( ( hl->count & ( hl->count - 1 ) ) == 0 ) {
+		hosts = realloc(hl->hosts,
+				( hl->count ? 2 * hl->count : 1 ) *
+				sizeof(char*));
+		if ( hosts == NULL )
+			return -1;
+		hl->hosts = hosts;
+	}
+	hl->hosts[hl->count] = strdup(host);
+	if ( hl->hosts[hl->count] == NULL )
+		return -1;
+	hl->count++;
+	return 0;
+}
+
+hostlist_t slurm_hostlist_create(const char* list)
+{
+	struct hostlist* hl;
+	char host[256];
+	const char* p = list;
+	const char* q;
+	const char* r;
+	char* end;
+	unsigned long lo, hi, i;
+	int width;
+
+	slurm_stub_hostlist_calls++;
+	hl = calloc(1,sizeof(*hl));
+	if ( hl == NULL )
+		return NULL;
+	while ( p != NULL && *p != '\0' ) {
+		q = p + strcspn(p,",[");
+		if ( *q != '[' ) {
+			snprintf(host,sizeof(host),"%.*s",(int) (q - p),p);
+			if ( q > p && stub_add(hl,host) )
+				goto error;
+			p = ( *q == ',' ) ? q + 1 : q;
+			continue;
+		}
+		r = q + 1;
+		while ( *r != ']' ) {
+			lo = hi = strtoul(r,&end,10);
+			width = end - r;
+			if ( end == r )
+				goto error;
+			if ( *end == '-' ) {
+				r = end + 1;
+				hi = strtoul(r,&end,10);
+				if ( end == r )
+					goto error;
+			}
+			for ( i = lo ; i <= hi ; i++ ) {
+				snprintf(host,sizeof(host),"%.*s%0*lu",
+					 (int) (q - p),p,width,i);
+				if ( stub_add(hl,host) )
+					goto error;
+			}
+			r = ( *end == ',' ) ? end + 1 : end;
+			if ( *r == '\0' )
+				goto error;
+		}
+		p = ( r[1] == ',' ) ? r + 2 : r + 1;
+	}
+	return hl;
+
+error:
+	slurm_hostlist_destroy(hl);
+	return NULL;
+}
+
+int slurm_hostlist_count(hostlist_t hl)
+{
+	slurm_stub_hostlist_calls++;
+	return hl->count - hl->first;
+}
+
+void slurm_hostlist_destroy(hostlist_t hl)
+{
+	int i;
+
+	if ( hl == NULL )
+		return;
+	for ( i = hl->first ; i < hl->count ; i++ )
+		free(hl->hosts[i]);
+	free(hl->hosts);
+	free(hl);
+}
+
+int slurm_hostlist_find(hostlist_t hl,const char* hostname)
+{
+	int i;
+
+	slurm_stub_hostlist_calls++;
+	for ( i = hl->first ; i < hl->count ; i++ ) {
+		if ( strcmp(hl->hosts[i],hostname) == 0 )
+			return i - hl->first;
+	}
+	return -1;
+}
+
+char* slurm_hostlist_shift(hostlist_t hl)
+{
+	slurm_stub_hostlist_calls++;
+	if ( hl->first == hl->count )
+		return NULL;
+	return hl->hosts[hl->first++];
+}
+
+int slurm_load_job(job_info_msg_t** resp,uint32_t job_id,
+		   uint16_t show_flags)
+{
+	static char alloc_node[256];
+	job_info_msg_t* msg;
+
+	slurm_stub_rpcs++;
+	msg = calloc(1,sizeof(*msg));
+	if ( msg == NULL )
+		return -1;
+	msg->job_array = calloc(1,sizeof(*msg->job_array));
+	if ( msg->job_array == NULL ) {
+		free(msg);
+		return -1;
+	}
+	gethostname(alloc_node,sizeof(alloc_node));
+	msg->record_count = 1;
+	msg->job_array->job_id = job_id;
+	msg->job_array->user_id = getuid();
+	msg->job_array->nodes = slurm_stub_nodes;
+	msg->job_array->alloc_node = alloc_node;
+	*resp = msg;
+	return 0;
+}
+
+void slurm_free_job_info_msg(job_info_msg_t* msg)
+{
+	if ( msg == NULL )
+		return;
+	free(msg->job_array);
+	free(msg);
+}
+
+int slurm_get_job_steps(time_t update_time,uint32_t job_id,
+			uint32_t step_id,job_step_info_response_msg_t** resp,
+			uint16_t show_flags)
+{
+	job_step_info_response_msg_t* msg;
+
+	slurm_stub_rpcs++;
+	msg = calloc(1,sizeof(*msg));
+	if ( msg == NULL )
+		return -1;
+	msg->job_steps = calloc(1,sizeof(*msg->job_steps));
+	if ( msg->job_steps == NULL ) {
+		free(msg);
+		return -1;
+	}
+	msg->job_step_count = 1;
+	msg->job_steps->nodes = slurm_stub_nodes;
+	*resp = msg;
+	return 0;
+}
+
+void slurm_free_job_step_info_response_msg(job_step_info_response_msg_t* msg)
+{
+	if ( msg == NULL )
+		return;
+	free(msg->job_steps);
+	free(msg);
+}
+
+int spank_remote(spank_t sp)
+{
+	return sp->remote;
+}
+
+spank_err_t spank_get_item(spank_t sp,spank_item_t item,...)
+{
+	va_list ap;
+	uint32_t* p;
+
+	va_start(ap,item);
+	p = va_arg(ap,uint32_t*);
+	va_end(ap);
+	switch ( item ) {
+	case S_JOB_UID :
+		*p = sp->uid;
+		break;
+	case S_JOB_GID :
+		*p = sp->gid;
+		break;
+	case S_JOB_ID :
+		*p = sp->jobid;
+		break;
+	case S_JOB_STEPID :
+		*p = sp->stepid;
+		break;
+	case S_JOB_NNODES :
+		*p = sp->nnodes;
+		break;
+	case S_JOB_NODEID :
+		*p = sp->nodeid;
+		break;
+	default :
+		return ESPANK_ERROR;
+	}
+	return ESPANK_SUCCESS;
+}
+
+static char** stub_env_find(spank_t sp,const char* var)
+{
+	size_t len = strlen(var);
+	int i;
+
+	for ( i = 0 ; i < STUB_ENV_MAX ; i++ ) {
+		if ( sp->env[i] != NULL && strncmp(sp->env[i],var,len) == 0 &&
+		     sp->env[i][len] == '=' )
+			return &sp->env[i];
+	}
+	return NULL;
+}
+
+spank_err_t spank_getenv(spank_t sp,const char* var,char* buf,int len)
+{
+	char** e = stub_env_find(sp,var);
+
+	if ( e == NULL || 
+	     snprintf(buf,len,"%s",*e + strlen(var) + 1) >= len )
+		return ESPANK_ERROR;
+	return ESPANK_SUCCESS;
+}
+
+spank_err_t spank_setenv(spank_t sp,const char* var,const char* val,
+			 int overwrite)
+{
+	char** e = stub_env_find(sp,var);
+	int i;
+
+	/* srun propagates its own environment to the tasks */
+	if ( ! sp->remote )
+		setenv(var,val,overwrite);
+	if ( e != NULL && ! overwrite )
+		return ESPANK_SUCCESS;
+	if ( e == NULL ) {
+		for ( i = 0 ; i < STUB_ENV_MAX && sp->env[i] != NULL ; i++ ) ;
+		if ( i == STUB_ENV_MAX )
+			return ESPANK_ERROR;
+		e = &sp->env[i];
+	}
+	free(*e);
+	if ( asprintf(e,"%s=%s",var,val) == -1 ) {
+		*e = NULL;
+		return ESPANK_ERROR;
+	}
+	return ESPANK_SUCCESS;
+}
+
+spank_err_t spank_unsetenv(spank_t sp,const char* var)
+{
+	char** e = stub_env_find(sp,var);
+
+	if ( ! sp->remote )
+		unsetenv(var);
+	if ( e != NULL ) {
+		free(*e);
+		*e = NULL;
+	}
+	return ESPANK_SUCCESS;
+}
+
+void slurm_stub_env_clear(struct spank_handle* h)
+{
+	int i;
+
+	for ( i = 0 ; i < STUB_ENV_MAX ; i++ ) {
+		free(h->env[i]);
+		h->env[i] = NULL;
+	}
+}
+
+spank_err_t spank_option_register(spank_t sp,struct spank_option* opt)
+{
+	return ESPANK_SUCCESS;
+}
+
+static void stub_log(const char* level,const char* fmt,va_list ap)
+{
+	if ( getenv("SLURM_STUB_VERBOSE") == NULL )
+		return;
+	fprintf(stderr,"%s: ",level);
+	vfprintf(stderr,fmt,ap);
+	fputc('\n',stderr);
+}
+
+void slurm_error(const char* fmt,...)
+{
+	va_list ap;
+
+	va_start(ap,fmt);
+	stub_log("error",fmt,ap);
+	va_end(ap);
+}
+
+void error(const char* fmt,...)
+{
+	va_list ap;
+
+	va_start(ap,fmt);
+	stub_log("error",fmt,ap);
+	va_end(ap);
+}
+
+void slurm_debug(const char* fmt,...)
+{
+	va_list ap;
+
+	va_start(ap,fmt);
+	stub_log("debug",fmt,ap);
+	va_end(ap);
+}
+
+void slurm_info(const char* fmt,...)
+{
+	va_list ap;
+
+	va_start(ap,fmt);
+	stub_log("info",fmt,ap);
+	va_end(ap);
+}
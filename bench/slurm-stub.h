@@ -0,0 +1,61 @@
+/***************************************************************************\
+ * slurm-stub.h - stub of the Slurm library for the x11 plugin benchmarks
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_STUB_H
+#define _SLURM_STUB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * the stub implements the Slurm and SPANK functions used by x11.so with 
+ * local data so that the plugin hooks can be driven without Slurm. The
+ * handle given to the hooks describes the step as seen by the simulated
+ * context (srun or slurmstepd), its job environment being separate from
+ * the environment of the process.
+ */
+#define STUB_ENV_MAX 64
+
+struct spank_handle {
+	int      remote;
+	uint32_t jobid;
+	uint32_t stepid;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nnodes;
+	uint32_t nodeid;
+	char*    env[STUB_ENV_MAX];
+};
+
+/*
+ * nodelist returned by slurm_load_job and slurm_get_job_steps, and
+ * number of calls of these RPCs and of the hostlist functions
+ */
+extern char* slurm_stub_nodes;
+extern unsigned long slurm_stub_rpcs;
+extern unsigned long slurm_stub_hostlist_calls;
+
+void slurm_stub_env_clear(struct spank_handle* h);
+
+#endif
@@ -0,0 +1,501 @@
+/***************************************************************************\
+ * spank-host.c - cost of the x11 plugin hooks in slurmstepd
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * play slurmstepd on one node of a step, loading x11.so with dlopen and
+ * calling its hooks like slurmstepd and slurmd do : slurm_spank_init and
+ * slurm_spank_user_init once, slurm_spank_task_init in each forked task,
+ * slurm_spank_exit and at last slurm_spank_job_epilog. The Slurm and
+ * SPANK functions the plugin uses are the ones of the stub linked in the
+ * host (bench/slurm-stub.c), the job environment being the one srun
+ * exports (SLURM_SPANK_X11, SLURM_SUBMIT_HOST, DISPLAY in batch mode).
+ *
+ * In interactive modes the DISPLAY reference of the step is created as
+ * the tunnel helper would before user_init, or after it with -l, in
+ * which case user_init waits for it up to setup_timeout and each task
+ * resolves the DISPLAY on its own. In batch mode the real helper is run
+ * by user_init, ssh_cmd=fake-ssh (bench/fake-ssh.c) being given among
+ * the plugin arguments for it to work on a single host.
+ *
+ * Each step is run twice in a child process : once to time the hooks,
+ * once under ptrace to count the system calls and the processes
+ * (fork, vfork or clone without CLONE_THREAD) of the hooks, their
+ * helper tasks included. The tasks are run one after the other so that
+ * their counts do not overlap.
+ *
+ * build from the top directory (Slurm development headers required),
+ * the plugin and the helper being built with the same X11_LIBEXEC_PROG :
+ *
+ *   gcc -O2 -fPIC -shared -DX11_LIBEXEC_PROG=\"$PWD/slurm-spank-x11\" \
+ *       -o x11.so slurm-spank-x11-plug.c slurm-spank-x11-ref.c \
+ *       slurm-spank-x11-trace.c slurm-spank-x11-stats.c -pthread
+ *   gcc -O2 -I. -Ibench -rdynamic -o spank-host bench/spank-host.c \
+ *       bench/slurm-stub.c -ldl
+ *
+ * usage : spank-host [-p plugin] [-m mode] [-N nnodes] [-n nodeid] [-l]
+ *                    [tasks ...] [-- plugin_args ...]
+ *
+ * mode is the --x11 value of the step (default all), the default task
+ * counts being 1 4 16 64 256 and the plugin x11.so in the current
+ * directory. One line is printed per task count and hook, with the
+ * number of calls, the total and per call times in microseconds and
+ * the total numbers of system calls and spawned processes.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+
+#include <slurm/slurm.h>
+#include <slurm/spank.h>
+
+#include "slurm-spank-x11-ref.h"
+
+#include "slurm-stub.h"
+
+#define HOST_NODE_DISPLAY "localhost:10.0"
+
+typedef int (*spank_hook_f)(spank_t sp,int ac,char** av);
+
+enum host_hook {
+	HOST_LOAD = 0,
+	HOST_INIT,
+	HOST_USER_INIT,
+	HOST_TASK_INIT,
+	HOST_EXIT,
+	HOST_JOB_EPILOG,
+	HOST_NHOOKS
+};
+
+static const char* host_hook_names[HOST_NHOOKS] = {
+	"dlopen", "init", "user_init", "task_init", "exit", "job_epilog"
+};
+
+static const char* host_hook_symbols[HOST_NHOOKS] = {
+	NULL, "slurm_spank_init", "slurm_spank_user_init",
+	"slurm_spank_task_init", "slurm_spank_exit", "slurm_spank_job_epilog"
+};
+
+/*
+ * results shared between the host, the simulated slurmstepd and its
+ * tasks, the counters being only updated by the tracer while the traced
+ * processes are stopped
+ */
+struct host_shared {
+	uint64_t syscalls;
+	uint64_t procs;
+	struct {
+		uint64_t calls;
+		uint64_t usecs;
+		uint64_t syscalls;
+		uint64_t procs;
+	} hooks[HOST_NHOOKS];
+};
+
+static struct host_shared* host_shared;
+
+static struct {
+	char*    plugin;
+	char*    mode;
+	uint32_t nnodes;
+	uint32_t nodeid;
+	int      late;
+	int      ac;
+	char**   av;
+} host = { "./x11.so", "all", 1, 0, 0, 0, NULL };
+
+static uint64_t host_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct host_mark {
+	uint64_t usecs;
+	uint64_t syscalls;
+	uint64_t procs;
+};
+
+static void host_start(struct host_mark* m)
+{
+	m->syscalls = host_shared->syscalls;
+	m->procs = host_shared->procs;
+	m->usecs = host_now();
+}
+
+static void host_stop(struct host_mark* m,enum host_hook hook)
+{
+	uint64_t now = host_now();
+
+	host_shared->hooks[hook].calls++;
+	host_shared->hooks[hook].usecs += now - m->usecs;
+	host_shared->hooks[hook].syscalls += host_shared->syscalls -
+		m->syscalls;
+	host_shared->hooks[hook].procs += host_shared->procs - m->procs;
+}
+
+/*
+ * run a hook of the plugin, a missing hook being skipped like slurmstepd
+ * does
+ */
+static int host_call(void* dl,enum host_hook hook,spank_t sp)
+{
+	struct host_mark m;
+	spank_hook_f fn;
+	int rc;
+
+	fn = (spank_hook_f) dlsym(dl,host_hook_symbols[hook]);
+	if ( fn == NULL )
+		return 0;
+	host_start(&m);
+	rc = fn(sp,host.ac,host.av);
+	host_stop(&m,hook);
+
+	return rc;
+}
+
+static int host_display_ref(void* dl,char* refid)
+{
+	int (*write_ref)(char*,char*);
+
+	write_ref = (int (*)(char*,char*)) dlsym(dl,"write_display_ref");
+	if ( write_ref == NULL )
+		return -1;
+
+	return write_ref(refid,HOST_NODE_DISPLAY);
+}
+
+/*
+ * simulated slurmstepd of a step of ntasks tasks
+ */
+static void host_stepd(int ntasks,uint32_t jobid,int traced)
+{
+	struct spank_handle h;
+	struct host_mark m;
+	char hostname[256];
+	char refid[64];
+	int batch;
+	void* dl;
+	pid_t pid;
+	int i;
+
+	if ( traced && ( ptrace(PTRACE_TRACEME,0,NULL,NULL) ||
+			 raise(SIGSTOP) ) )
+		_exit(1);
+
+	batch = ( strcmp(host.mode,"batch") == 0 );
+	memset(&h,0,sizeof(h));
+	h.remote = 1;
+	h.jobid = jobid;
+	h.stepid = batch ? SLURM_BATCH_SCRIPT : 0;
+	h.uid = getuid();
+	h.gid = getgid();
+	h.nnodes = host.nnodes;
+	h.nodeid = host.nodeid;
+	gethostname(hostname,sizeof(hostname));
+	hostname[sizeof(hostname)-1] = '\0';
+	spank_setenv(&h,"SLURM_SPANK_X11",host.mode,1);
+	spank_setenv(&h,"SLURM_SUBMIT_HOST",hostname,1);
+	if ( batch )
+		spank_setenv(&h,"DISPLAY",HOST_NODE_DISPLAY,1);
+	snprintf(refid,sizeof(refid),"%u.%u",h.jobid,h.stepid);
+
+	host_start(&m);
+	dl = dlopen(host.plugin,RTLD_NOW|RTLD_LOCAL);
+	host_stop(&m,HOST_LOAD);
+	if ( dl == NULL ) {
+		fprintf(stderr,"error: unable to load %s : %s\n",host.plugin,
+			dlerror());
+		_exit(1);
+	}
+
+	host_call(dl,HOST_INIT,&h);
+
+	/* the tunnel of the node is established by srun */
+	if ( ! batch && ! host.late && host_display_ref(dl,refid) )
+		fprintf(stderr,"warning: unable to create ref %s\n",refid);
+	host_call(dl,HOST_USER_INIT,&h);
+	if ( ! batch && host.late && host_display_ref(dl,refid) )
+		fprintf(stderr,"warning: unable to create ref %s\n",refid);
+
+	for ( i = 0 ; i < ntasks ; i++ ) {
+		pid = fork();
+		if ( pid == 0 ) {
+			h.nodeid = host.nodeid;
+			host_call(dl,HOST_TASK_INIT,&h);
+			_exit(0);
+		}
+		while ( pid > 0 && waitpid(pid,NULL,0) == -1 &&
+			errno == EINTR ) ;
+	}
+
+	host_call(dl,HOST_EXIT,&h);
+	host_call(dl,HOST_JOB_EPILOG,&h);
+	slurm_stub_env_clear(&h);
+
+	_exit(0);
+}
+
+/*
+ * count the system calls and the processes of the traced processes
+ * until the simulated slurmstepd exits, the processes left being killed
+ */
+static int host_trace(pid_t stepd)
+{
+	char* entered;
+	long max = 1 << 22;
+	unsigned long msg;
+	char path[64];
+	char line[128];
+	FILE* f;
+	int status;
+	int sig;
+	int event;
+	int tgid;
+	pid_t pid;
+
+	f = fopen("/proc/sys/kernel/pid_max","r");
+	if ( f != NULL ) {
+		if ( fscanf(f,"%ld",&max) != 1 )
+			max = 1 << 22;
+		fclose(f);
+	}
+	entered = (char*) calloc(max + 1,1);
+	if ( entered == NULL )
+		return -1;
+
+	while ( ( pid = waitpid(-1,&status,__WALL) ) != -1 || errno == EINTR ) {
+		if ( pid == -1 )
+			continue;
+		if ( WIFEXITED(status) || WIFSIGNALED(status) ) {
+			if ( pid <= max )
+				entered[pid] = 0;
+			if ( pid == stepd )
+				kill(-stepd,SIGKILL);
+			continue;
+		}
+		if ( ! WIFSTOPPED(status) )
+			continue;
+
+		sig = WSTOPSIG(status);
+		event = status >> 16;
+		if ( sig == ( SIGTRAP | 0x80 ) ) {
+			/* syscall entry and exit stops alternate */
+			if ( pid <= max ) {
+				entered[pid] = ! entered[pid];
+				if ( entered[pid] )
+					host_shared->syscalls++;
+			}
+			sig = 0;
+		}
+		else if ( event != 0 ) {
+			if ( event == PTRACE_EVENT_FORK ||
+			     event == PTRACE_EVENT_VFORK )
+				host_shared->procs++;
+			else if ( event == PTRACE_EVENT_CLONE &&
+				  ptrace(PTRACE_GETEVENTMSG,pid,NULL,&msg)
+				  == 0 ) {
+				/* threads are not processes */
+				snprintf(path,sizeof(path),"/proc/%lu/status",
+					 msg);
+				tgid = 0;
+				f = fopen(path,"r");
+				while ( f != NULL &&
+					fgets(line,sizeof(line),f) != NULL ) {
+					if ( sscanf(line,"Tgid: %d",&tgid)
+					     == 1 )
+						break;
+				}
+				if ( f != NULL )
+					fclose(f);
+				if ( tgid == (int) msg )
+					host_shared->procs++;
+			}
+			sig = 0;
+		}
+		else if ( sig == SIGSTOP || sig == SIGTRAP ) {
+			/* initial stops of the traced processes */
+			if ( pid == stepd && sig == SIGSTOP )
+				ptrace(PTRACE_SETOPTIONS,pid,NULL,
+				       PTRACE_O_TRACESYSGOOD|
+				       PTRACE_O_TRACEFORK|
+				       PTRACE_O_TRACEVFORK|
+				       PTRACE_O_TRACECLONE|
+				       PTRACE_O_TRACEEXEC|
+				       PTRACE_O_EXITKILL);
+			sig = 0;
+		}
+		ptrace(PTRACE_SYSCALL,pid,NULL,(void*)(long) sig);
+	}
+	free(entered);
+
+	return 0;
+}
+
+/*
+ * run a step in a job of its own, the end marker left by the job epilog
+ * being removed afterwards
+ */
+static int host_step(int ntasks,int traced)
+{
+	static uint32_t jobs = 0;
+	uint32_t jobid = ( (uint32_t) getpid() << 8 ) + jobs++;
+	char marker[256];
+	char refid[64];
+	int status;
+	int rc;
+	pid_t pid;
+
+	snprintf(refid,sizeof(refid),"%u",jobid);
+	snprintf(marker,sizeof(marker),END_FILE_PATTERN,refid);
+
+	pid = fork();
+	if ( pid == -1 )
+		return -1;
+
+	/* the step and its helper tasks are released as a process group */
+	setpgid(pid,pid);
+	if ( pid == 0 )
+		host_stepd(ntasks,jobid,traced);
+
+	if ( traced )
+		rc = host_trace(pid);
+	else {
+		while ( waitpid(pid,&status,0) == -1 && errno == EINTR ) ;
+		kill(-pid,SIGKILL);
+		rc = ( WIFEXITED(status) && WEXITSTATUS(status) == 0 ) ?
+			0 : -1 ;
+	}
+	unlink(marker);
+
+	return rc;
+}
+
+int main(int argc,char** argv)
+{
+	int counts[] = { 1, 4, 16, 64, 256 };
+	int* tasks = counts;
+	int ntasks = sizeof(counts) / sizeof(int);
+	uint64_t usecs[HOST_NHOOKS];
+	uint64_t calls[HOST_NHOOKS];
+	int opt;
+	int i, j;
+
+	while ( ( opt = getopt(argc,argv,"+p:m:N:n:l") ) != -1 ) {
+		switch ( opt ) {
+		case 'p' :
+			host.plugin = optarg;
+			break;
+		case 'm' :
+			host.mode = optarg;
+			break;
+		case 'N' :
+			host.nnodes = atoi(optarg);
+			break;
+		case 'n' :
+			host.nodeid = atoi(optarg);
+			break;
+		case 'l' :
+			host.late = 1;
+			break;
+		default :
+			fprintf(stderr,"usage: %s [-p plugin] [-m mode] "
+				"[-N nnodes] [-n nodeid] [-l] [tasks ...] "
+				"[-- plugin_args ...]\n",argv[0]);
+			return 1;
+		}
+	}
+	/* the task counts are followed by the plugin arguments */
+	i = optind;
+	if ( optind == 1 || strcmp(argv[optind-1],"--") != 0 ) {
+		while ( i < argc && strcmp(argv[i],"--") != 0 )
+			i++;
+		if ( i > optind ) {
+			ntasks = i - optind;
+			tasks = (int*) calloc(ntasks,sizeof(int));
+			for ( j = 0 ; tasks != NULL && j < ntasks ; j++ )
+				tasks[j] = atoi(argv[optind+j]);
+		}
+		if ( i < argc )
+			i++;
+	}
+	host.ac = argc - i;
+	host.av = argv + i;
+
+	host_shared = mmap(NULL,sizeof(*host_shared),PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if ( tasks == NULL || host_shared == MAP_FAILED ) {
+		fprintf(stderr,"error: invalid parameters\n");
+		return 1;
+	}
+
+	printf("%5s %-10s %5s %10s %10s %9s %6s\n","tasks","hook","calls",
+	       "total_us","call_us","syscalls","procs");
+	for ( i = 0 ; i < ntasks ; i++ ) {
+		/* time the hooks */
+		memset(host_shared,0,sizeof(*host_shared));
+		if ( host_step(tasks[i],0) )
+			fprintf(stderr,"warning: step of %d task(s) failed\n",
+				tasks[i]);
+		for ( j = 0 ; j < HOST_NHOOKS ; j++ ) {
+			usecs[j] = host_shared->hooks[j].usecs;
+			calls[j] = host_shared->hooks[j].calls;
+		}
+
+		/* count their system calls and processes */
+		memset(host_shared,0,sizeof(*host_shared));
+		if ( host_step(tasks[i],1) )
+			fprintf(stderr,"warning: unable to trace step of %d "
+				"task(s)\n",tasks[i]);
+
+		for ( j = 0 ; j < HOST_NHOOKS ; j++ ) {
+			printf("%5d %-10s %5llu %10llu %10.1f %9llu %6llu\n",
+			       tasks[i],host_hook_names[j],
+			       (unsigned long long) calls[j],
+			       (unsigned long long) usecs[j],
+			       calls[j] ? (double) usecs[j] / calls[j] : 0.0,
+			       (unsigned long long)
+			       host_shared->hooks[j].syscalls,
+			       (unsigned long long)
+			       host_shared->hooks[j].procs);
+		}
+		fflush(stdout);
+	}
+
+	return 0;
+}
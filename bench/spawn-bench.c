@@ -0,0 +1,216 @@
+/***************************************************************************\
+ * spawn-bench.c - spawn latency of the x11 plugin helper tasks
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * compare the latency of the fork based xpopen the plugin used to spawn
+ * its helper tasks from slurmstepd with the one of xspawn, as the
+ * resident memory of the parent grows like the one of slurmstepd for
+ * large memory jobs. The plugin source is included so that the measured
+ * xspawn is the one of the plugin.
+ *
+ * build from the top directory (Slurm development headers required) :
+ *
+ *   gcc -O2 -I. -Ibench -o spawn-bench bench/spawn-bench.c \
+ *       bench/slurm-stub.c slurm-spank-x11-ref.c slurm-spank-x11-trace.c \
+ *       slurm-spank-x11-stats.c -pthread
+ *
+ * usage : spawn-bench [-n iterations] [-c command] [rss_mb ...]
+ *
+ * one line per parent size and path is printed, with the mean, median
+ * and 99th percentile spawn-to-exit latencies in microseconds, the
+ * default sizes being 0 64 256 1024 4096.
+ */
+#include "slurm-spank-x11-plug.c"
+
+#include "slurm-stub.h"
+
+#define BENCH_ITERATIONS 200
+
+/*
+ * previous implementation, forking slurmstepd and running the command
+ * through /bin/sh
+ */
+static FILE *fork_xpopen(const char *command)
+{
+	int pid;
+	int pep[2];
+	uid_t euid;
+	gid_t egid;
+
+	if ( pipe(pep) < 0 )
+		return NULL;
+
+	switch( pid = fork() )
+	{
+	case -1:
+		close(pep[0]);
+		close(pep[1]);
+		return NULL;
+	case 0:
+		if (close(pep[0]) == -1)
+			exit(1);
+		if (dup2(pep[1],1) == -1)
+			exit(1);
+		if (close(pep[1]) == -1)
+			exit(1);
+		euid = geteuid();
+		egid = getegid();
+		if (setresgid(egid,-1,egid) || setresuid(euid,-1,euid))
+			exit(2);
+		execl( "/bin/sh", "sh", "-c", command, NULL );
+		exit(1);
+	default:
+		if ( close(pep[1]) == -1 )
+			return NULL;
+		return fdopen(pep[0],"r");
+	}
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_cmp(const void* a,const void* b)
+{
+	uint64_t ua = *(const uint64_t*) a;
+	uint64_t ub = *(const uint64_t*) b;
+
+	return ( ua > ub ) - ( ua < ub );
+}
+
+/*
+ * spawn the command and wait for its end of file and exit
+ */
+static uint64_t bench_spawn(int forked,char* command)
+{
+	char* argv[2] = { command, NULL };
+	char buf[256];
+	uint64_t start = bench_now();
+	pid_t pid = 0;
+	FILE* f;
+
+	f = forked ? fork_xpopen(command) : xspawn(argv,0,&pid);
+	if ( f == NULL ) {
+		fprintf(stderr,"error: unable to spawn %s\n",command);
+		exit(1);
+	}
+	while ( fread(buf,1,sizeof(buf),f) > 0 ) ;
+	if ( forked ) {
+		fclose(f);
+		while ( wait(NULL) == -1 && errno == EINTR ) ;
+	}
+	else
+		xpclose(f,pid);
+
+	return bench_now() - start;
+}
+
+static void bench_report(const char* path,long rss,uint64_t* lat,int n)
+{
+	uint64_t sum = 0;
+	int i;
+
+	qsort(lat,n,sizeof(uint64_t),bench_cmp);
+	for ( i = 0 ; i < n ; i++ )
+		sum += lat[i];
+	printf("%-6s %8ld %10.1f %10llu %10llu\n",path,rss,(double) sum / n,
+	       (unsigned long long) lat[n/2],
+	       (unsigned long long) lat[(n*99)/100]);
+	fflush(stdout);
+}
+
+int main(int argc,char** argv)
+{
+	long sizes[] = { 0, 64, 256, 1024, 4096 };
+	long* rss = sizes;
+	int nrss = sizeof(sizes) / sizeof(long);
+	int n = BENCH_ITERATIONS;
+	char* command = "/bin/true";
+	uint64_t* lat;
+	char* mem = NULL;
+	size_t len = 0;
+	size_t size;
+	int opt;
+	int i, j;
+
+	while ( ( opt = getopt(argc,argv,"n:c:") ) != -1 ) {
+		switch ( opt ) {
+		case 'n' :
+			n = atoi(optarg);
+			break;
+		case 'c' :
+			command = optarg;
+			break;
+		default :
+			fprintf(stderr,"usage: %s [-n iterations] [-c command]"
+				" [rss_mb ...]\n",argv[0]);
+			return 1;
+		}
+	}
+	if ( optind < argc ) {
+		nrss = argc - optind;
+		rss = (long*) calloc(nrss,sizeof(long));
+		for ( i = 0 ; rss != NULL && i < nrss ; i++ )
+			rss[i] = atol(argv[optind+i]);
+	}
+	lat = (uint64_t*) calloc(n > 0 ? n : 1,sizeof(uint64_t));
+	if ( n <= 0 || rss == NULL || lat == NULL ) {
+		fprintf(stderr,"error: invalid parameters\n");
+		return 1;
+	}
+
+	printf("%-6s %8s %10s %10s %10s\n","path","rss_mb","mean_us",
+	       "p50_us","p99_us");
+	for ( i = 0 ; i < nrss ; i++ ) {
+		/* grow the touched memory of the parent */
+		size = (size_t) rss[i] << 20;
+		if ( size > len ) {
+			if ( mem != NULL )
+				munmap(mem,len);
+			mem = mmap(NULL,size,PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+			if ( mem == MAP_FAILED ) {
+				fprintf(stderr,"error: unable to map %ld MB\n",
+					rss[i]);
+				return 1;
+			}
+			memset(mem,1,size);
+			len = size;
+		}
+
+		for ( j = 0 ; j < n ; j++ )
+			lat[j] = bench_spawn(1,command);
+		bench_report("fork",rss[i],lat,n);
+		for ( j = 0 ; j < n ; j++ )
+			lat[j] = bench_spawn(0,command);
+		bench_report("xspawn",rss[i],lat,n);
+	}
+
+	return 0;
+}
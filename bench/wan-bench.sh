@@ -0,0 +1,313 @@
+#!/bin/bash
+#############################################################################
+# wan-bench.sh - X11 tunnel setup and latency over an emulated WAN
+#############################################################################
+# Copyright (2026) the slurm-spank-x11 contributors
+#
+# This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+# providing access to X11 display through tunneling on SLURM execution
+# nodes using OpenSSH.
+#
+# slurm-spank-x11 is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by the
+# Free Software Foundation; either version 2 of the License, or (at your
+# option) any later version.
+#
+# slurm-spank-x11 is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+# or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+# for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+#############################################################################
+#
+# time the tunnels of the helper through a private sshd, the loopback
+# interface of a private network namespace being given the delay and
+# loss of a WAN with tc netem (half of the RTT being added to each
+# packet). The namespace is created with an unprivileged user namespace
+# when not run as root. Every node name reaches the private sshd, which
+# keeps the X11 authorizations of its sessions in its work directory.
+#
+# For each RTT and tunnel mode, the helper is run like the plugin does :
+#
+#   tunnel  -t nodeB, from the node of the X display (srun)
+#   proxy   -p -d display -t nodeB, the node of the display being told
+#           which DISPLAY to forward
+#   batch   -f nodeA -d display -t nodeB, the batch two-hop chain, nodeB
+#           asking nodeA to open the tunnel
+#
+# The setup time is the time until the helper reports the DISPLAY of the
+# tunnel. On the last run, relay-bench is run through the tunnel against
+# its synthetic X server (relay-bench -S) to measure the X round trips
+# and throughputs.
+#
+# build the helper, with X11_LIBEXEC_PROG set to its path, and relay-bench
+# in the same directory (see relay-bench.c), then run as any user :
+#
+#   bench/wan-bench.sh -b /path/to/bindir
+#
+# usage : wan-bench.sh [-b bindir] [-r rtts_ms] [-l loss_pct] [-n runs]
+#                      [-m modes] [-x round_trips] [-i images]
+#                      [-k persist]
+#
+# rtts_ms is a comma separated list of RTTs in milliseconds (default
+# 0.1,1,10,40,80) and modes a comma separated list of the modes above
+# (default all of them). -k shares the ssh connections of the helper
+# (its -m option). One JSON object is printed per RTT and mode on a
+# line, with the p50 and maximum tunnel setup times of the runs in
+# milliseconds (tunnel_*_ms) followed by the fields of relay-bench. sshd
+# is searched in the PATH and in /usr/sbin, SSHD overriding it.
+#
+
+BINDIR=$(dirname "$0")
+RTTS="0.1,1,10,40,80"
+LOSS=0
+RUNS=5
+MODES="tunnel,proxy,batch"
+ROUND_TRIPS=50
+IMAGES=10
+PERSIST=0
+PORT=2222
+TIMEOUT=60
+
+usage() {
+	echo "usage: $0 [-b bindir] [-r rtts_ms] [-l loss_pct] [-n runs]" \
+	     "[-m modes] [-x round_trips] [-i images] [-k persist]" >&2
+	exit 1
+}
+
+# shape the loopback interface of a private network namespace
+if [ -z "$WAN_BENCH_NETNS" ] ; then
+	export WAN_BENCH_NETNS=1
+	if [ "$(id -u)" -eq 0 ] ; then
+		exec unshare -n "$0" "$@"
+	else
+		exec unshare -c -n --keep-caps "$0" "$@"
+	fi
+	echo "error: unable to create a network namespace" >&2
+	exit 1
+fi
+
+while getopts "b:r:l:n:m:x:i:k:h" opt ; do
+	case $opt in
+	b) BINDIR=$OPTARG ;;
+	r) RTTS=$OPTARG ;;
+	l) LOSS=$OPTARG ;;
+	n) RUNS=$OPTARG ;;
+	m) MODES=$OPTARG ;;
+	x) ROUND_TRIPS=$OPTARG ;;
+	i) IMAGES=$OPTARG ;;
+	k) PERSIST=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+HELPER=$(cd "$BINDIR" && pwd)/slurm-spank-x11
+RELAY_BENCH=$(cd "$BINDIR" && pwd)/relay-bench
+SSHD=${SSHD:-$(PATH=$PATH:/usr/sbin command -v sshd)}
+XAUTH=$(command -v xauth)
+
+for prog in "$HELPER" "$RELAY_BENCH" "$SSHD" "$XAUTH" ; do
+	if [ ! -x "$prog" ] ; then
+		echo "error: ${prog:-sshd or xauth} not found" >&2
+		exit 1
+	fi
+done
+if [ "$RUNS" -le 0 ] ; then
+	usage
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/var/tmp}/wan-bench.XXXXXX") || exit 1
+SSHD_PID=
+XSERVER_PID=
+HELPER_PID=
+
+cleanup() {
+	[ -n "$HELPER_PID" ] && kill "$HELPER_PID" 2>/dev/null
+	[ -n "$SSHD_PID" ] && kill "$SSHD_PID" 2>/dev/null
+	[ -n "$XSERVER_PID" ] && kill "$XSERVER_PID" 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ip link set lo up || exit 1
+
+# keys of the private sshd and of its only user
+ssh-keygen -q -t ed25519 -N '' -f "$WORK/host_key" || exit 1
+ssh-keygen -q -t ed25519 -N '' -f "$WORK/user_key" || exit 1
+cp "$WORK/user_key.pub" "$WORK/authorized_keys"
+
+# the X11 authorizations of the sessions are kept in the work directory
+cat > "$WORK/xauth" <<EOF
+#!/bin/sh
+exec "$XAUTH" -f "$WORK/Xauthority" "\$@"
+EOF
+chmod 755 "$WORK/xauth"
+
+cat > "$WORK/sshd_config" <<EOF
+ListenAddress 127.0.0.1:$PORT
+HostKey $WORK/host_key
+AuthorizedKeysFile $WORK/authorized_keys
+PidFile $WORK/sshd.pid
+StrictModes no
+UsePAM no
+PermitRootLogin yes
+PasswordAuthentication no
+KbdInteractiveAuthentication no
+X11Forwarding yes
+X11UseLocalhost yes
+X11DisplayOffset 10
+XAuthLocation $WORK/xauth
+EOF
+
+cat > "$WORK/ssh_config" <<EOF
+Host *
+	HostName 127.0.0.1
+	Port $PORT
+	IdentityFile $WORK/user_key
+	IdentitiesOnly yes
+	StrictHostKeyChecking no
+	UserKnownHostsFile /dev/null
+	BatchMode yes
+	LogLevel ERROR
+	ForwardX11Trusted yes
+	XAuthLocation $WORK/xauth
+EOF
+SSH="ssh -F $WORK/ssh_config"
+
+"$SSHD" -D -e -f "$WORK/sshd_config" 2> "$WORK/sshd.log" &
+SSHD_PID=$!
+"$RELAY_BENCH" -S > "$WORK/xserver" &
+XSERVER_PID=$!
+
+# wait for the X server and sshd
+for i in $(seq 100) ; do
+	XDISPLAY=$(head -n 1 "$WORK/xserver" 2>/dev/null)
+	if [ -n "$XDISPLAY" ] && $SSH wan-node true 2>/dev/null ; then
+		break
+	fi
+	XDISPLAY=
+	sleep 0.1
+done
+if [ -z "$XDISPLAY" ] ; then
+	echo "error: unable to start sshd or the X server" >&2
+	cat "$WORK/sshd.log" >&2
+	exit 1
+fi
+
+now_ns() {
+	date +%s%N
+}
+
+# set the RTT and loss of the loopback interface
+shape() {
+	local delay
+
+	delay=$(awk -v r="$1" 'BEGIN { printf "%gms", r / 2 }')
+	tc qdisc del dev lo root 2>/dev/null
+	if [ "$1" != 0 ] || [ "$LOSS" != 0 ] ; then
+		tc qdisc add dev lo root netem limit 100000 delay "$delay" \
+		   loss "$LOSS%"
+	fi
+}
+
+# run the helper of a mode in the background, on the fifo
+start_helper() {
+	local mode=$1
+	local refid=$2
+	local args=(-s "$SSH" -m "$PERSIST" -i "$refid")
+
+	case $mode in
+	tunnel)
+		exec env DISPLAY="$XDISPLAY" "$HELPER" "${args[@]}" -t wan-b \
+		    -cwg ;;
+	proxy)
+		exec env -u DISPLAY "$HELPER" "${args[@]}" -p -d "$XDISPLAY" \
+		    -t wan-b -cwg ;;
+	batch)
+		exec env -u DISPLAY "$HELPER" "${args[@]}" -f wan-a \
+		    -d "$XDISPLAY" -t wan-b -cwg ;;
+	esac > "$WORK/fifo" 2>> "$WORK/helper.log" &
+	HELPER_PID=$!
+}
+
+# end the tunnel, the waiting helpers exiting with the reference
+stop_helper() {
+	"$HELPER" -i "$1" -r 2>/dev/null
+	exec 3<&-
+	wait "$HELPER_PID" 2>/dev/null
+	HELPER_PID=
+}
+
+mkfifo "$WORK/fifo" || exit 1
+
+for rtt in ${RTTS//,/ } ; do
+	if ! shape "$rtt" ; then
+		echo "error: unable to emulate a RTT of $rtt ms with netem" >&2
+		exit 1
+	fi
+	for mode in ${MODES//,/ } ; do
+		case $mode in
+		tunnel|proxy|batch) ;;
+		*) echo "error: unknown mode $mode" >&2 ; exit 1 ;;
+		esac
+
+		setups=()
+		failed=0
+		xresult=
+		for run in $(seq "$RUNS") ; do
+			refid="wan$$.$mode.$run"
+			start=$(now_ns)
+			start_helper "$mode" "$refid"
+			exec 3< "$WORK/fifo"
+			display=
+			read -r -t "$TIMEOUT" display rest <&3
+			end=$(now_ns)
+			if [ -z "$display" ] ; then
+				failed=$(( failed + 1 ))
+				kill "$HELPER_PID" 2>/dev/null
+				stop_helper "$refid"
+				continue
+			fi
+			setups+=( $(( ( end - start ) / 1000 )) )
+
+			# X round trips through the tunnel of the last run
+			if [ "$run" -eq "$RUNS" ] ; then
+				num=${display##*:}
+				num=${num%%.*}
+				cookie=$("$WORK/xauth" list 2>/dev/null | \
+					awk -v d=":$num" \
+					'$1 ~ d "$" { c = $3 } END { print c }')
+				xresult=$("$RELAY_BENCH" -d "$display" \
+					${cookie:+-a "$cookie"} \
+					-n "$ROUND_TRIPS" -i "$IMAGES")
+			fi
+			stop_helper "$refid"
+		done
+
+		stats=$(printf "%s\n" "${setups[@]}" | sort -n | awk '
+			NF { v[n++] = $1 }
+			END {
+				if ( n == 0 ) {
+					printf "\"tunnel_p50_ms\":null," \
+					       "\"tunnel_max_ms\":null"
+					exit
+				}
+				printf "\"tunnel_p50_ms\":%.1f," \
+				       "\"tunnel_max_ms\":%.1f",
+				       v[int(n/2)] / 1000, v[n-1] / 1000
+			}')
+		head="{\"rtt_ms\":$rtt,\"loss_pct\":$LOSS,\"mode\":\"$mode\","
+		head="$head\"runs\":$RUNS,\"failed\":$failed,$stats"
+		if [ -n "$xresult" ] ; then
+			echo "$xresult" | sed "s/^{\"mode\":\"display\",/$head,/"
+		else
+			echo "$head}"
+		fi
+	done
+done
@@ -0,0 +1,486 @@
+/***************************************************************************\
+ * slurm-spank-x11-broker.c - SLURM SPANK X11 node references broker
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "slurm-spank-x11-ref.h"
+#include "slurm-spank-x11-broker.h"
+
+#define BROKER_BUCKETS              1024
+#define BROKER_LINE_MAX             512
+#define BROKER_MAX_EVENTS           64
+#define BROKER_UID_MAX              256  /* references per uid */
+
+/* what a client waits for once its request is answered with 1 */
+#define BROKER_WAIT                 1  /* removal of the reference */
+#define BROKER_READY                2  /* creation of the reference */
+
+struct broker_ref {
+	char refid[64];
+	char display[256];
+	uid_t uid;
+	pid_t pid;
+	struct broker_ref* next;
+};
+
+struct broker_owner {
+	uid_t uid;
+	int count;
+	struct broker_owner* next;
+};
+
+struct broker_client {
+	int fd;
+	uid_t uid;
+	pid_t pid;
+	uid_t target;
+	int waiting;
+	char refid[64];
+	char line[BROKER_LINE_MAX];
+	size_t len;
+	struct broker_client* prev;
+	struct broker_client* next;
+};
+
+static struct broker_ref* broker_refs[BROKER_BUCKETS];
+static struct broker_owner* broker_owners = NULL;
+static struct broker_client* broker_waiters = NULL;
+static int broker_efd = -1;
+
+/*
+ * return the link to the first reference of the bucket of refid in the
+ * hash table, the references of every uid being in the same bucket
+ */
+static struct broker_ref** broker_bucket(const char* refid)
+{
+	unsigned int h = 2166136261u;
+	const char* p;
+
+	for ( p = refid ; *p != '\0' ; p++ )
+		h = ( h ^ (unsigned char) *p ) * 16777619u;
+
+	return &broker_refs[h % BROKER_BUCKETS];
+}
+
+/*
+ * return the link to the reference refid of uid in the hash table, or
+ * the link where to add it
+ */
+static struct broker_ref** broker_find(const char* refid,uid_t uid)
+{
+	struct broker_ref** link;
+
+	link = broker_bucket(refid);
+	while ( *link != NULL && ( (*link)->uid != uid ||
+				   strcmp((*link)->refid,refid) != 0 ) )
+		link = &(*link)->next;
+
+	return link;
+}
+
+/*
+ * return the number of references of uid, adding delta to it
+ */
+static int broker_count(uid_t uid,int delta)
+{
+	struct broker_owner** link;
+	struct broker_owner* owner;
+
+	link = &broker_owners;
+	while ( *link != NULL && (*link)->uid != uid )
+		link = &(*link)->next;
+	owner = *link;
+	if ( owner == NULL ) {
+		if ( delta <= 0 )
+			return 0;
+		owner = (struct broker_owner*) calloc(1,sizeof(*owner));
+		if ( owner == NULL )
+			return BROKER_UID_MAX;
+		owner->uid = uid;
+		*link = owner;
+	}
+	owner->count += delta;
+	if ( owner->count > 0 )
+		return owner->count;
+
+	*link = owner->next;
+	free(owner);
+	return 0;
+}
+
+static void broker_reply(struct broker_client* c,int code,
+			 struct broker_ref* ref)
+{
+	char line[BROKER_LINE_MAX];
+	int n;
+
+	/* the owner lets root check who created the reference */
+	if ( ref != NULL )
+		n = snprintf(line,sizeof(line),"%d %s %u\n",code,ref->display,
+			     (unsigned int) ref->uid);
+	else
+		n = snprintf(line,sizeof(line),"%d\n",code);
+
+	/* the answer fits in the empty buffer of the socket */
+	if ( write(c->fd,line,n) != n )
+		shutdown(c->fd,SHUT_RDWR);
+}
+
+static void broker_unwait(struct broker_client* c)
+{
+	if ( ! c->waiting )
+		return;
+	if ( c->prev != NULL )
+		c->prev->next = c->next;
+	else
+		broker_waiters = c->next;
+	if ( c->next != NULL )
+		c->next->prev = c->prev;
+	c->waiting = 0;
+}
+
+static void broker_close(struct broker_client* c)
+{
+	broker_unwait(c);
+	epoll_ctl(broker_efd,EPOLL_CTL_DEL,c->fd,NULL);
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * answer the clients waiting for the creation or the removal of refid
+ * of uid, their connections being closed once they read the answer so
+ * that the events already collected for them remain valid
+ */
+static void broker_notify(const char* refid,uid_t uid,int waiting,
+			  struct broker_ref* ref)
+{
+	struct broker_client* c;
+	struct broker_client* next;
+
+	for ( c = broker_waiters ; c != NULL ; c = next ) {
+		next = c->next;
+		if ( c->waiting != waiting || c->target != uid ||
+		     strcmp(c->refid,refid) != 0 )
+			continue;
+		broker_reply(c,0,ref);
+		broker_unwait(c);
+		shutdown(c->fd,SHUT_WR);
+	}
+}
+
+static void broker_remove(struct broker_ref** link)
+{
+	struct broker_ref* ref = *link;
+
+	*link = ref->next;
+	broker_count(ref->uid,-1);
+	broker_notify(ref->refid,ref->uid,BROKER_WAIT,NULL);
+	free(ref);
+}
+
+/*
+ * remove the references refid of every uid, return their number
+ */
+static int broker_remove_all(const char* refid)
+{
+	struct broker_ref** link;
+	int n = 0;
+
+	link = broker_bucket(refid);
+	while ( *link != NULL ) {
+		if ( strcmp((*link)->refid,refid) == 0 ) {
+			broker_remove(link);
+			n++;
+		}
+		else
+			link = &(*link)->next;
+	}
+
+	return n;
+}
+
+static void broker_request(struct broker_client* c)
+{
+	char op[16];
+	char refid[64];
+	char display[256];
+	struct broker_ref** link;
+	struct broker_ref* ref;
+	int n;
+
+	n = sscanf(c->line,"%15s %63s %255s",op,refid,display);
+	if ( n < 2 ) {
+		broker_reply(c,20,NULL);
+		return;
+	}
+
+	/* every uid only sees and creates references of its own, so that
+	 * no user can take the refid of the job of another one first.
+	 * root accesses the references of the uid given after the refid,
+	 * its own ones otherwise, and removes the ones of every uid */
+	c->target = c->uid;
+	if ( c->uid == 0 && n == 3 && strcmp(op,"create") != 0 &&
+	     strcmp(op,"drop") != 0 )
+		c->target = (uid_t) strtoul(display,NULL,10);
+	link = broker_find(refid,c->target);
+	ref = *link;
+
+	if ( strcmp(op,"create") == 0 && n == 3 ) {
+		if ( ref == NULL ) {
+			if ( broker_count(c->uid,0) >= BROKER_UID_MAX ) {
+				broker_reply(c,30,NULL);
+				return;
+			}
+			ref = (struct broker_ref*) calloc(1,sizeof(*ref));
+			if ( ref == NULL ) {
+				broker_reply(c,30,NULL);
+				return;
+			}
+			strcpy(ref->refid,refid);
+			ref->uid = c->uid;
+			broker_count(c->uid,1);
+			*link = ref;
+		}
+		strcpy(ref->display,display);
+		ref->pid = c->pid;
+		broker_reply(c,0,NULL);
+		broker_notify(refid,ref->uid,BROKER_READY,ref);
+	}
+	else if ( strcmp(op,"get") == 0 ) {
+		if ( ref != NULL )
+			broker_reply(c,0,ref);
+		else
+			broker_reply(c,30,NULL);
+	}
+	else if ( strcmp(op,"remove") == 0 && c->uid == 0 && n == 2 ) {
+		if ( broker_remove_all(refid) > 0 )
+			broker_reply(c,0,NULL);
+		else
+			broker_reply(c,31,NULL);
+	}
+	else if ( strcmp(op,"remove") == 0 ) {
+		if ( ref != NULL ) {
+			broker_remove(link);
+			broker_reply(c,0,NULL);
+		}
+		else
+			broker_reply(c,31,NULL);
+	}
+	else if ( strcmp(op,"drop") == 0 && n == 3 ) {
+		/* a newer creator may have replaced the reference */
+		if ( ref == NULL )
+			broker_reply(c,30,NULL);
+		else if ( ref->pid != c->pid || strcmp(ref->display,display) )
+			broker_reply(c,36,NULL);
+		else {
+			broker_remove(link);
+			broker_reply(c,0,NULL);
+		}
+	}
+	else if ( ( strcmp(op,"wait") == 0 && ref != NULL ) ||
+		  ( strcmp(op,"ready") == 0 && ref == NULL ) ) {
+		c->waiting = ( op[0] == 'w' ) ? BROKER_WAIT : BROKER_READY ;
+		strcpy(c->refid,refid);
+		c->prev = NULL;
+		c->next = broker_waiters;
+		if ( broker_waiters != NULL )
+			broker_waiters->prev = c;
+		broker_waiters = c;
+		broker_reply(c,1,NULL);
+	}
+	else if ( strcmp(op,"wait") == 0 )
+		broker_reply(c,30,NULL);
+	else if ( strcmp(op,"ready") == 0 )
+		broker_reply(c,0,ref);
+	else
+		broker_reply(c,20,NULL);
+}
+
+/*
+ * a creator that stops waiting for its reference without removing it is
+ * gone, like the tunnel the reference leads to
+ */
+static void broker_hangup(struct broker_client* c)
+{
+	struct broker_ref** link;
+
+	if ( c->waiting == BROKER_WAIT ) {
+		broker_unwait(c);
+		link = broker_find(c->refid,c->uid);
+		if ( *link != NULL && (*link)->pid == c->pid )
+			broker_remove(link);
+	}
+	broker_close(c);
+}
+
+static void broker_read(struct broker_client* c)
+{
+	ssize_t n;
+	char* eol;
+
+	n = read(c->fd,c->line+c->len,sizeof(c->line)-1-c->len);
+	if ( n == -1 && ( errno == EAGAIN || errno == EINTR ) )
+		return;
+	if ( n <= 0 ) {
+		broker_hangup(c);
+		return;
+	}
+
+	/* one request per connection, only waiting ones being kept */
+	if ( c->waiting ) {
+		c->len = 0;
+		return;
+	}
+	c->len += n;
+	c->line[c->len] = '\0';
+	eol = strchr(c->line,'\n');
+	if ( eol == NULL ) {
+		if ( c->len == sizeof(c->line) - 1 )
+			broker_close(c);
+		return;
+	}
+	*eol = '\0';
+	broker_request(c);
+	c->len = 0;
+	if ( ! c->waiting )
+		broker_close(c);
+}
+
+static void broker_accept(int lfd)
+{
+	struct broker_client* c;
+	struct epoll_event ev;
+	struct ucred cred;
+	socklen_t len;
+	int fd;
+
+	while ( ( fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC|SOCK_NONBLOCK) )
+		!= -1 ) {
+		len = sizeof(cred);
+		c = (struct broker_client*) calloc(1,sizeof(*c));
+		if ( c == NULL ||
+		     getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&len) ) {
+			free(c);
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->uid = cred.uid;
+		c->pid = cred.pid;
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if ( epoll_ctl(broker_efd,EPOLL_CTL_ADD,fd,&ev) ) {
+			free(c);
+			close(fd);
+		}
+	}
+}
+
+int x11_broker_serve(const char* path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct epoll_event events[BROKER_MAX_EVENTS];
+	mode_t mask;
+	int lfd;
+	int rc;
+	int n, i;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if ( strlen(path) >= sizeof(addr.sun_path) )
+		return 10;
+	strcpy(addr.sun_path,path);
+
+	lfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK,0);
+	if ( lfd == -1 )
+		return 20;
+
+	/* do not steal the socket of a running broker */
+	if ( connect(lfd,(struct sockaddr*) &addr,sizeof(addr)) == 0 ) {
+		fprintf(stderr,"error: a broker already listens on %s\n",path);
+		close(lfd);
+		return 30;
+	}
+	close(lfd);
+	lfd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK,0);
+	if ( lfd == -1 )
+		return 20;
+
+	/* every user of the node can connect, the requests being 
+	 * authorized with the credentials of the peers and only reaching
+	 * the references of their uid */
+	unlink(path);
+	mask = umask(0);
+	rc = bind(lfd,(struct sockaddr*) &addr,sizeof(addr));
+	umask(mask);
+	if ( rc || listen(lfd,SOMAXCONN) ) {
+		fprintf(stderr,"error: unable to listen on %s : %s\n",path,
+			strerror(errno));
+		close(lfd);
+		return 30;
+	}
+
+	signal(SIGPIPE,SIG_IGN);
+	broker_efd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if ( broker_efd == -1 || epoll_ctl(broker_efd,EPOLL_CTL_ADD,lfd,&ev) ) {
+		close(lfd);
+		return 40;
+	}
+
+	while ( 1 ) {
+		n = epoll_wait(broker_efd,events,BROKER_MAX_EVENTS,-1);
+		if ( n == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+		for ( i = 0 ; i < n ; i++ ) {
+			if ( events[i].data.ptr == NULL )
+				broker_accept(lfd);
+			else
+				broker_read(events[i].data.ptr);
+		}
+	}
+
+	close(broker_efd);
+	close(lfd);
+	return 40;
+}
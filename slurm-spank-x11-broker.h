@@ -0,0 +1,37 @@
+/***************************************************************************\
+ * slurm-spank-x11-broker.h - SLURM SPANK X11 node references broker
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_BROKER_H
+#define _SLURM_SPANK_X11_BROKER_H
+
+/*
+ * serve the DISPLAY references of the node from memory on the unix 
+ * socket path (see slurm-spank-x11-ref.h for the protocol), the peers 
+ * being authorized using their SO_PEERCRED credentials.
+ *
+ * Only returns on error, with a positive error code.
+ */
+int x11_broker_serve(const char* path);
+
+#endif
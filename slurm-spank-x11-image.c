@@ -0,0 +1,505 @@
+/***************************************************************************\
+ * slurm-spank-x11-image.c - SLURM SPANK X11 relay image deltas
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "slurm-spank-x11-image.h"
+
+#define X11_IMAGE_MIN           4096       /* smaller images sent as is */
+#define X11_IMAGE_CACHE_MAX     ( 32 << 20 ) /* per connection */
+#define X11_IMAGE_SLOTS         16
+
+/* tiles are made of 16 rows of 256 bytes of the image data */
+#define X11_TILE_WIDTH          256
+#define X11_TILE_HEIGHT         16
+
+#define X11_IMAGE_STORE         0  /* full image stored in a slot */
+#define X11_IMAGE_DELTA         1  /* changed tiles of a slot image */
+#define X11_IMAGE_RAW           2  /* client request of the same opcode */
+
+/*
+ * delta requests start with an 8 bytes header (opcode, kind, 0 and the
+ * 32 bits length in 4 bytes units), followed by the slot number and the
+ * length of the image data, then the header of the PutImage request 
+ * (24 bytes, 28 for a big request). Come next the data of the image for
+ * a store or the bitmap of the changed tiles and their data for a delta
+ */
+#define X11_IMAGE_HDR           16
+
+#define PAD4(n)                 ( ( (n) + 3 ) & ~3 )
+
+/*
+ * last image put in a drawable at a position, the key being only used
+ * by the sending relay
+ */
+struct x11_slot {
+	char*         data;
+	size_t        len;
+	unsigned long tick;
+	uint32_t      drawable;
+	unsigned char key[12];
+};
+
+struct x11_image {
+	struct x11_slot slots[X11_IMAGE_SLOTS];
+	size_t          total;
+	unsigned long   tick;
+	char*           buf;
+	size_t          size;
+
+	unsigned long      images;
+	unsigned long long raw;
+	unsigned long long wire;
+};
+
+/*
+ * geometry of the tiles of an image
+ */
+struct x11_tiles {
+	size_t rows;
+	size_t stride;
+	size_t nx;
+	size_t ny;
+};
+
+typedef int (*x11_tile_cmp_f)(const char* a,const char* b,size_t stride,
+			      size_t width,size_t rows);
+
+/*
+ * tell if a tile is the same in two images, a vector version being used
+ * when the CPU supports it
+ */
+static int x11_tile_equal_c(const char* a,const char* b,size_t stride,
+			    size_t width,size_t rows)
+{
+	uint64_t x, y;
+	size_t r, i;
+	uint64_t d;
+
+	for ( r = 0 ; r < rows ; r++, a += stride, b += stride ) {
+		d = 0;
+		for ( i = 0 ; i + 8 <= width ; i += 8 ) {
+			memcpy(&x,a + i,8);
+			memcpy(&y,b + i,8);
+			d |= x ^ y;
+		}
+		if ( d != 0 || memcmp(a + i,b + i,width - i) )
+			return 0;
+	}
+
+	return 1;
+}
+
+#if defined(__x86_64__)
+static int x11_tile_equal_sse2(const char* a,const char* b,size_t stride,
+			       size_t width,size_t rows)
+{
+	__m128i d;
+	size_t r, i;
+
+	for ( r = 0 ; r < rows ; r++, a += stride, b += stride ) {
+		d = _mm_setzero_si128();
+		for ( i = 0 ; i + 16 <= width ; i += 16 )
+			d = _mm_or_si128(d,_mm_xor_si128(
+				 _mm_loadu_si128((const __m128i*) (a + i)),
+				 _mm_loadu_si128((const __m128i*) (b + i))));
+		if ( _mm_movemask_epi8(_mm_cmpeq_epi8(d,_mm_setzero_si128()))
+		     != 0xffff || memcmp(a + i,b + i,width - i) )
+			return 0;
+	}
+
+	return 1;
+}
+
+__attribute__((target("avx2")))
+static int x11_tile_equal_avx2(const char* a,const char* b,size_t stride,
+			       size_t width,size_t rows)
+{
+	__m256i d;
+	size_t r, i;
+
+	for ( r = 0 ; r < rows ; r++, a += stride, b += stride ) {
+		d = _mm256_setzero_si256();
+		for ( i = 0 ; i + 32 <= width ; i += 32 )
+			d = _mm256_or_si256(d,_mm256_xor_si256(
+				 _mm256_loadu_si256((const __m256i*) (a + i)),
+				 _mm256_loadu_si256((const __m256i*) (b + i))));
+		if ( ! _mm256_testz_si256(d,d) || 
+		     memcmp(a + i,b + i,width - i) )
+			return 0;
+	}
+
+	return 1;
+}
+#endif
+
+static x11_tile_cmp_f x11_tile_equal = NULL;
+
+static uint32_t x11_get16(int msb,const char* p)
+{
+	const unsigned char* u = (const unsigned char*) p;
+
+	return msb ? ( u[0] << 8 ) | u[1] : ( u[1] << 8 ) | u[0] ;
+}
+
+static uint32_t x11_get32(int msb,const char* p)
+{
+	return msb ? ( x11_get16(msb,p) << 16 ) | x11_get16(msb,p + 2) :
+		( x11_get16(msb,p + 2) << 16 ) | x11_get16(msb,p) ;
+}
+
+static void x11_put32(int msb,char* p,uint32_t v)
+{
+	int i;
+
+	for ( i = 0 ; i < 4 ; i++ )
+		p[msb ? i : 3 - i] = ( v >> ( 24 - 8 * i ) ) & 0xff;
+}
+
+/*
+ * get the length of the header of a PutImage request and the geometry
+ * of its tiles, return -1 if the image can not be split in tiles
+ */
+static int x11_image_tiles(int msb,const char* req,size_t len,
+			   size_t* hlen,struct x11_tiles* t)
+{
+	size_t h;
+
+	h = ( x11_get16(msb,req + 2) == 0 ) ? 4 : 0 ;
+	*hlen = 24 + h;
+	if ( len < *hlen )
+		return -1;
+
+	/* XYPixmap images are made of one bitmap per plane */
+	t->rows = x11_get16(msb,req + 14 + h);
+	if ( req[1] == 1 )
+		t->rows *= (unsigned char) req[21 + h];
+	if ( t->rows == 0 || ( len - *hlen ) % t->rows )
+		return -1;
+	t->stride = ( len - *hlen ) / t->rows;
+	t->nx = ( t->stride + X11_TILE_WIDTH - 1 ) / X11_TILE_WIDTH;
+	t->ny = ( t->rows + X11_TILE_HEIGHT - 1 ) / X11_TILE_HEIGHT;
+
+	return 0;
+}
+
+/*
+ * get the offset, width and number of rows of a tile
+ */
+static size_t x11_tile(struct x11_tiles* t,size_t i,size_t* width,
+		       size_t* rows)
+{
+	size_t x = ( i % t->nx ) * X11_TILE_WIDTH;
+	size_t y = ( i / t->nx ) * X11_TILE_HEIGHT;
+
+	*width = ( t->stride - x < X11_TILE_WIDTH ) ? 
+		t->stride - x : X11_TILE_WIDTH ;
+	*rows = ( t->rows - y < X11_TILE_HEIGHT ) ? 
+		t->rows - y : X11_TILE_HEIGHT ;
+
+	return y * t->stride + x;
+}
+
+/*
+ * allocate len bytes to a slot, evicting the least recently used ones 
+ * to stay in the cache limit. Both relays do the same evictions as they
+ * process the same images.
+ */
+static int x11_image_slot(struct x11_image* xi,int id,size_t len)
+{
+	struct x11_slot* s = &xi->slots[id];
+	int lru;
+	int i;
+
+	if ( len > X11_IMAGE_CACHE_MAX )
+		return -1;
+
+	xi->total -= s->len;
+	free(s->data);
+	s->data = NULL;
+	s->len = 0;
+	while ( xi->total + len > X11_IMAGE_CACHE_MAX ) {
+		lru = -1;
+		for ( i = 0 ; i < X11_IMAGE_SLOTS ; i++ ) {
+			if ( xi->slots[i].data != NULL && 
+			     ( lru == -1 || 
+			       xi->slots[i].tick < xi->slots[lru].tick ) )
+				lru = i;
+		}
+		xi->total -= xi->slots[lru].len;
+		free(xi->slots[lru].data);
+		xi->slots[lru].data = NULL;
+		xi->slots[lru].len = 0;
+	}
+
+	s->data = (char*) malloc(len);
+	if ( s->data == NULL )
+		return -1;
+	s->len = len;
+	s->tick = ++xi->tick;
+	xi->total += len;
+
+	return 0;
+}
+
+/*
+ * get room for an output request
+ */
+static char* x11_image_buf(struct x11_image* xi,size_t len)
+{
+	char* p;
+
+	if ( len > xi->size ) {
+		p = (char*) realloc(xi->buf,len);
+		if ( p == NULL )
+			return NULL;
+		xi->buf = p;
+		xi->size = len;
+	}
+
+	return xi->buf;
+}
+
+struct x11_image* x11_image_new(void)
+{
+	if ( x11_tile_equal == NULL ) {
+		x11_tile_equal = x11_tile_equal_c;
+#if defined(__x86_64__)
+		x11_tile_equal = x11_tile_equal_sse2;
+		if ( __builtin_cpu_supports("avx2") )
+			x11_tile_equal = x11_tile_equal_avx2;
+#endif
+	}
+
+	return (struct x11_image*) calloc(1,sizeof(struct x11_image));
+}
+
+void x11_image_free(struct x11_image* xi)
+{
+	int i;
+
+	if ( xi->images > 0 )
+		fprintf(stderr,"x11 relay: sent %lu image(s) of %llu bytes "
+			"as %llu bytes\n",xi->images,xi->raw,xi->wire);
+	for ( i = 0 ; i < X11_IMAGE_SLOTS ; i++ )
+		free(xi->slots[i].data);
+	free(xi->buf);
+	free(xi);
+}
+
+int x11_image_encode(struct x11_image* xi,int msb,const char* req,
+		     size_t len,const char** out,size_t* outlen)
+{
+	struct x11_tiles t;
+	struct x11_slot* s;
+	const char* data;
+	unsigned char key[12];
+	unsigned char* bitmap;
+	uint32_t drawable;
+	size_t hlen, dlen;
+	size_t off, w, rows, r;
+	size_t i;
+	char* p;
+	int id = -1;
+	int kind = X11_IMAGE_DELTA;
+
+	/* the requests of the client using the opcode of the deltas are
+	 * wrapped so that the other relay does not mistake them */
+	if ( req[0] == X11_IMAGE_OPCODE ) {
+		p = x11_image_buf(xi,X11_IMAGE_HDR + len);
+		if ( p == NULL )
+			return -1;
+		memset(p,0,X11_IMAGE_HDR);
+		p[1] = X11_IMAGE_RAW;
+		x11_put32(msb,p + 4,( X11_IMAGE_HDR + len ) / 4);
+		memcpy(p + X11_IMAGE_HDR,req,len);
+		*out = p;
+		*outlen = X11_IMAGE_HDR + len;
+		return 0;
+	}
+
+	if ( len < X11_IMAGE_MIN || x11_image_tiles(msb,req,len,&hlen,&t) ||
+	     len - hlen > X11_IMAGE_CACHE_MAX )
+		return 1;
+	data = req + hlen;
+	dlen = len - hlen;
+
+	/* the image replaces the previous one put at the same place with 
+	 * the same geometry, the gc not being part of the key */
+	drawable = x11_get32(msb,req + hlen - 20);
+	memcpy(key,req + hlen - 12,8);
+	key[8] = req[1];
+	memcpy(key + 9,req + hlen - 4,2);
+	key[11] = 0;
+	for ( i = 0 ; i < X11_IMAGE_SLOTS ; i++ ) {
+		s = &xi->slots[i];
+		if ( s->data != NULL && s->drawable == drawable &&
+		     s->len == dlen && memcmp(s->key,key,12) == 0 )
+			break;
+	}
+	if ( i == X11_IMAGE_SLOTS ) {
+		kind = X11_IMAGE_STORE;
+		for ( i = 0 ; i < X11_IMAGE_SLOTS ; i++ ) {
+			if ( xi->slots[i].data == NULL ) {
+				id = i;
+				break;
+			}
+			if ( id == -1 || xi->slots[i].tick < xi->slots[id].tick )
+				id = i;
+		}
+		i = id;
+	}
+	s = &xi->slots[i];
+
+	/* worst case being every tile changed */
+	p = x11_image_buf(xi,PAD4(X11_IMAGE_HDR + hlen + 
+				  ( t.nx * t.ny + 7 ) / 8 + dlen));
+	if ( p == NULL || ( kind == X11_IMAGE_STORE && 
+			    x11_image_slot(xi,i,dlen) ) )
+		return 1;
+	s->drawable = drawable;
+	memcpy(s->key,key,12);
+	if ( kind == X11_IMAGE_DELTA )
+		s->tick = ++xi->tick;
+
+	memcpy(p + X11_IMAGE_HDR,req,hlen);
+	off = X11_IMAGE_HDR + hlen;
+	if ( kind == X11_IMAGE_STORE ) {
+		memcpy(s->data,data,dlen);
+		memcpy(p + off,data,dlen);
+		off += dlen;
+	}
+	else {
+		bitmap = (unsigned char*) p + off;
+		memset(bitmap,0,( t.nx * t.ny + 7 ) / 8);
+		off += ( t.nx * t.ny + 7 ) / 8;
+		for ( i = 0 ; i < t.nx * t.ny ; i++ ) {
+			r = x11_tile(&t,i,&w,&rows);
+			if ( x11_tile_equal(data + r,s->data + r,t.stride,
+					    w,rows) )
+				continue;
+			bitmap[i / 8] |= 1 << ( i % 8 );
+			for ( ; rows > 0 ; rows--, r += t.stride ) {
+				memcpy(p + off,data + r,w);
+				memcpy(s->data + r,data + r,w);
+				off += w;
+			}
+		}
+	}
+
+	memset(p + off,0,PAD4(off) - off);
+	off = PAD4(off);
+	p[0] = X11_IMAGE_OPCODE;
+	p[1] = kind;
+	p[2] = p[3] = 0;
+	x11_put32(msb,p + 4,off / 4);
+	x11_put32(msb,p + 8,s - xi->slots);
+	x11_put32(msb,p + 12,dlen);
+
+	xi->images++;
+	xi->raw += len;
+	xi->wire += off;
+	*out = p;
+	*outlen = off;
+
+	return 0;
+}
+
+int x11_image_decode(struct x11_image* xi,int msb,const char* req,
+		     size_t len,const char** out,size_t* outlen)
+{
+	struct x11_tiles t;
+	struct x11_slot* s;
+	const char* bitmap;
+	size_t hlen, dlen;
+	size_t off, w, rows, r;
+	size_t i;
+	uint32_t id;
+	char* p;
+
+	if ( len < X11_IMAGE_HDR )
+		return -1;
+	if ( req[1] == X11_IMAGE_RAW ) {
+		*out = req + X11_IMAGE_HDR;
+		*outlen = len - X11_IMAGE_HDR;
+		return 0;
+	}
+	id = x11_get32(msb,req + 8);
+	dlen = x11_get32(msb,req + 12);
+	hlen = ( x11_get16(msb,req + X11_IMAGE_HDR + 2) == 0 ) ? 28 : 24 ;
+	if ( id >= X11_IMAGE_SLOTS || X11_IMAGE_HDR + hlen > len ||
+	     ( req[1] == X11_IMAGE_STORE && 
+	       X11_IMAGE_HDR + hlen + dlen > len ) ||
+	     x11_image_tiles(msb,req + X11_IMAGE_HDR,hlen + dlen,&hlen,&t) )
+		return -1;
+	s = &xi->slots[id];
+
+	/* the stored image is sent as is */
+	if ( req[1] == X11_IMAGE_STORE ) {
+		if ( x11_image_slot(xi,id,dlen) )
+			return -1;
+		memcpy(s->data,req + X11_IMAGE_HDR + hlen,dlen);
+		*out = req + X11_IMAGE_HDR;
+		*outlen = hlen + dlen;
+		return 0;
+	}
+
+	if ( req[1] != X11_IMAGE_DELTA || s->data == NULL || s->len != dlen )
+		return -1;
+	s->tick = ++xi->tick;
+
+	bitmap = req + X11_IMAGE_HDR + hlen;
+	off = X11_IMAGE_HDR + hlen + ( t.nx * t.ny + 7 ) / 8;
+	if ( off > len )
+		return -1;
+	for ( i = 0 ; i < t.nx * t.ny ; i++ ) {
+		if ( ! ( bitmap[i / 8] & ( 1 << ( i % 8 ) ) ) )
+			continue;
+		r = x11_tile(&t,i,&w,&rows);
+		if ( off + w * rows > len )
+			return -1;
+		for ( ; rows > 0 ; rows--, r += t.stride ) {
+			memcpy(s->data + r,req + off,w);
+			off += w;
+		}
+	}
+
+	p = x11_image_buf(xi,hlen + dlen);
+	if ( p == NULL )
+		return -1;
+	memcpy(p,req + X11_IMAGE_HDR,hlen);
+	memcpy(p + hlen,s->data,dlen);
+	*out = p;
+	*outlen = hlen + dlen;
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/***************************************************************************\
+ * slurm-spank-x11-image.h - SLURM SPANK X11 relay image deltas
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_IMAGE_H
+#define _SLURM_SPANK_X11_IMAGE_H
+
+#include <sys/types.h>
+
+/*
+ * PutImage requests sent between relays as deltas of the previous image
+ * put at the same place of the same drawable. Both relays keep the last
+ * images of a connection, the sending one replacing the PutImage 
+ * requests by requests of an opcode unused by the core protocol (0) 
+ * carrying the tiles of the image that changed, the receiving one
+ * rebuilding the original requests from them.
+ */
+#define X11_IMAGE_OPCODE        0
+#define X11_PUT_IMAGE           72
+
+/* larger requests are sent as is */
+#define X11_IMAGE_REQUEST_MAX   ( ( 32 << 20 ) + 65536 )
+
+struct x11_image;
+
+struct x11_image* x11_image_new(void);
+
+/*
+ * release the images of a connection, reporting the traffic saved on
+ * stderr
+ */
+void x11_image_free(struct x11_image* xi);
+
+/*
+ * encode a complete PutImage request (or a request of the opcode of the
+ * deltas) in the byte order given by msb, *out being set to the delta
+ * request to send instead. Return 0 on success, 1 if the request has to
+ * be sent as is or -1 on error
+ */
+int x11_image_encode(struct x11_image* xi,int msb,const char* req,
+		     size_t len,const char** out,size_t* outlen);
+
+/*
+ * rebuild the PutImage request of a complete delta request, *out being
+ * set to the request to send. Return 0 on success or -1 if the request
+ * is invalid
+ */
+int x11_image_decode(struct x11_image* xi,int msb,const char* req,
+		     size_t len,const char** out,size_t* outlen);
+
+#endif
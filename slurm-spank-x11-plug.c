@@ -24,42 +24,103 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  *
 \***************************************************************************/
-/* Note: To compile: gcc -fPIC -shared -o x11 slurm-spank-x11-plug.c */
+/* Note: To compile: gcc -fPIC -shared -o x11 slurm-spank-x11-plug.c \
+ *       libslurm-spank-x11-ref.a */
+#define _GNU_SOURCE
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <pwd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
 #include <stdint.h>
 
+extern char **environ;
+
 #include <slurm/slurm.h>
 #include <slurm/spank.h>
 
+#include "slurm-spank-x11-ref.h"
+#include "slurm-spank-x11-trace.h"
+#include "slurm-spank-x11-stats.h"
+
 #ifndef X11_LIBEXEC_PROG
 #define X11_LIBEXEC_PROG         "/usr/libexec/slurm-spank-x11"
 #endif
 
 #define SPANK_X11_ENVVAR         "SLURM_SPANK_X11" 
+#define SPANK_X11_HOST_ENVVAR    "SLURM_SPANK_X11_HOST"
+#define SPANK_X11_STATUS_ENVVAR  "SLURM_SPANK_X11_STATUS"
 
 #define X11_MODE_NONE    0
 #define X11_MODE_FIRST   1
 #define X11_MODE_LAST    2
 #define X11_MODE_ALL     3
 #define X11_MODE_BATCH   4
+#define X11_MODE_RANKS   5
+#define X11_MODE_EVERY   6
+#define X11_MODE_HOSTS   7
+
+#define X11_TARGET_MAXLEN 1024
+
+#define X11_SCOPE_STEP   0
+#define X11_SCOPE_JOB    1
+
+/* seconds after which the end markers of the jobs are removed */
+#define X11_END_MARKER_AGE 3600
 
 #define INFO  slurm_debug
 #define DEBUG slurm_debug
+#define WARN  slurm_info
 #define ERROR slurm_error
 
 static int x11_mode = X11_MODE_NONE ;
 
+/*
+ * nodes targeted by the ranks:|every:|hosts: modes
+ */
+struct x11_range {
+	uint32_t lo;
+	uint32_t hi;
+};
+static struct x11_range* x11_ranges = NULL ;
+static int x11_nranges = 0 ;
+static uint32_t x11_stride = 0 ;
+static char* x11_hosts = NULL ;
+
 static char* ssh_cmd = NULL;
 static char* ssh_args = NULL;
 static char* helpertask_args = NULL ;
+static int fanout_max = -1 ;
+static int ssh_mux_persist = -1 ;
+static int tunnel_scope = X11_SCOPE_STEP ;
+static int fanout_tree = -1 ;
+static int x11_relay = -1 ;
+static int relay_compress = -1 ;
+static int relay_cache = -1 ;
+static int relay_images = -1 ;
+static char* trace_dir = NULL ;
+static char* metrics_file = NULL ;
+static int setup_timeout = -1 ;
+static int x11_lazy = -1 ;
 
 /* 
  * can be used to adapt the ssh parameters to use to 
@@ -79,90 +140,319 @@ static char* helpertask_args = NULL ;
  */
 #define DEFAULT_HELPERTASK_ARGS ""
 
+/*
+ * maximum number of helper tasks launched concurrently by srun to
+ * set up the ssh tunnels (0 means no limit)
+ *
+ * this can be overriden by fanout_max= spank plugin conf arg
+ */
+#define DEFAULT_FANOUT_MAX 64
+
+/*
+ * number of seconds idle ssh ControlMaster connections are kept to
+ * share them among the tunnels of a user (0 disables the sharing)
+ *
+ * this can be overriden by ssh_mux_persist= spank plugin conf arg
+ */
+#define DEFAULT_SSH_MUX_PERSIST 0
+#define MUX_PERSIST ( (ssh_mux_persist < 0) ? \
+		      DEFAULT_SSH_MUX_PERSIST : ssh_mux_persist )
+
+/*
+ * number of nodes srun directly connects when more nodes are targeted,
+ * each one relaying the tunnels to its share of the remaining nodes
+ * (0 means that srun directly connects all the nodes)
+ *
+ * this can be overriden by fanout_tree= spank plugin conf arg
+ */
+#define DEFAULT_FANOUT_TREE 0
+#define FANOUT_TREE ( (fanout_tree < 0) ? DEFAULT_FANOUT_TREE : fanout_tree )
+
+/*
+ * only tunnel the first selected node, the other ones using a relay
+ * running on it to access its tunnel through the cluster network
+ *
+ * this can be overriden by relay= spank plugin conf arg
+ */
+#define DEFAULT_X11_RELAY 0
+#define X11_RELAY ( (x11_relay < 0) ? DEFAULT_X11_RELAY : x11_relay )
+
+/*
+ * compress the traffic between the relayed nodes and the first node in
+ * relay mode, the compression level adapting to the link throughput
+ *
+ * this can be overriden by relay_compress= spank plugin conf arg
+ */
+#define DEFAULT_RELAY_COMPRESS 1
+#define RELAY_COMPRESS ( (relay_compress < 0) ? \
+			 DEFAULT_RELAY_COMPRESS : relay_compress )
+
+/*
+ * send the images between the relayed nodes and the first node in relay
+ * mode as deltas of the previous ones, with relay_compress only
+ *
+ * this can be overriden by relay_images= spank plugin conf arg
+ */
+#define DEFAULT_RELAY_IMAGES 1
+#define RELAY_IMAGES ( (relay_images < 0) ? \
+		       DEFAULT_RELAY_IMAGES : relay_images )
+
+/*
+ * give access to the tunnels of interactive steps through a local relay
+ * answering the idempotent X11 requests (atoms, extensions) from a cache
+ *
+ * this can be overriden by relay_cache= spank plugin conf arg
+ */
+#define DEFAULT_RELAY_CACHE 0
+#define RELAY_CACHE ( (relay_cache < 0) ? DEFAULT_RELAY_CACHE : relay_cache )
+
+/*
+ * directory where the phases of the X11 setup are traced (Chrome trace
+ * format), the SLURM_SPANK_X11_TRACE environment variable of the user
+ * taking precedence. No trace is written when not set.
+ *
+ * this can be overriden by trace= spank plugin conf arg
+ */
+#define DEFAULT_TRACE_DIR ""
+#define TRACE_DIR ( (trace_dir == NULL) ? DEFAULT_TRACE_DIR : trace_dir )
+
+/*
+ * file where the metrics of the node (active tunnels, setup latencies,
+ * failures) are exported in the Prometheus text format. The metrics are
+ * not recorded when not set.
+ *
+ * this can be overriden by metrics= spank plugin conf arg
+ */
+#define DEFAULT_METRICS_FILE ""
+#define METRICS_FILE ( (metrics_file == NULL) ? \
+		       DEFAULT_METRICS_FILE : metrics_file )
+
+/*
+ * number of seconds the tasks wait for the tunnels that srun establishes
+ * in the background while the step is launched, the tasks of a node 
+ * running without DISPLAY if its tunnel is not ready in time. 0 means
+ * that srun establishes the tunnels before the step is launched.
+ *
+ * this can be overriden by setup_timeout= spank plugin conf arg
+ */
+#define DEFAULT_SETUP_TIMEOUT 30
+#define SETUP_TIMEOUT ( (setup_timeout < 0) ? \
+			DEFAULT_SETUP_TIMEOUT : setup_timeout )
+
+/*
+ * number of seconds srun waits for the helper task of a node to report
+ * its DISPLAY, whatever the setup timeout, before abandoning the node
+ */
+#define X11_CONNECT_TIMEOUT 300
+
+/*
+ * publish on the nodes the DISPLAY of a local relay instead of connecting
+ * them from srun, each node only establishing its tunnel from the srun 
+ * host when the first X11 client of the step connects, as in batch mode.
+ *
+ * this can be overriden by lazy= spank plugin conf arg
+ */
+#define DEFAULT_LAZY 0
+#define LAZY ( (x11_lazy < 0) ? DEFAULT_LAZY : x11_lazy )
+
 /*
  * All spank plugins must define this macro for the SLURM plugin loader.
  */
 SPANK_PLUGIN(x11, 1);
 
 /*
- * Implement a local version of popen that ensure that the command is 
- * ran with real and saved set-user-id uid/git set to effective uid/gid
+ * xspawn flags
  */
-static FILE *xpopen(const char *command, const char *mode)
+#define XSPAWN_QUIET   0x1   /* redirect child stderr to /dev/null */
+#define XSPAWN_DETACH  0x2   /* detach the child like "&" would do */
+
+#define XSPAWN_STACK_SIZE (64*1024)
+
+struct xspawn_args {
+	char* const* argv;
+	int          pep[2];
+	int          flags;
+	sigset_t     oldmask;
+	char*        stack;
+};
+
+static int _xspawn_exec(void* arg);
+
+/*
+ * intermediate child used in detached mode, it spawns the command 
+ * and exits so that the command gets reattached to init 
+ */
+static int _xspawn_detach(void* arg)
 {
-	int pid;
-	int pep[2];          /* pipe endpoints */
-	int p_end, c_end;    /* identify parent and child endpoints */
+	struct xspawn_args* args = (struct xspawn_args*) arg;
+
+	if ( clone(_xspawn_exec,args->stack + XSPAWN_STACK_SIZE/2,
+		   CLONE_VM|CLONE_VFORK|SIGCHLD,arg) == -1 )
+		_exit(1);
+	_exit(0);
+}
 
+/*
+ * child side of xspawn, runs on its own stack in the address space
+ * of the parent which is suspended until the exec
+ */
+static int _xspawn_exec(void* arg)
+{
+	struct xspawn_args* args = (struct xspawn_args*) arg;
+	struct sigaction sa;
 	uid_t euid;
 	gid_t egid;
+	int fd;
+	int sig;
+
+	/* do not run the parent signal handlers in the shared address 
+	 * space, restore default dispositions before unblocking signals */
+	memset(&sa,0,sizeof(sa));
+	for ( sig = 1 ; sig < _NSIG ; sig++ ) {
+		if ( sigaction(sig,NULL,&sa) == 0 && 
+		     sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL ) {
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			sigaction(sig,&sa,NULL);
+		}
+	}
+	sigprocmask(SIG_SETMASK,&args->oldmask,NULL);
+
+	/* redirect the pipe to the stdout fd */
+	if ( dup2(args->pep[1],1) == -1 )
+		_exit(1);
+	if ( args->flags & XSPAWN_QUIET ) {
+		fd = open("/dev/null",O_WRONLY|O_CLOEXEC);
+		if ( fd == -1 || dup2(fd,2) == -1 )
+			_exit(1);
+	}
+
+	/* change real/saved_set-user-id uid and gid to match the effective 
+	 * one without that the exec would automatically revert to an
+	 * execution using the real uid/gid. That is a security issue that 
+	 * we have to avoid. The raw syscalls are used as the libc wrappers
+	 * would try to apply the change to all the threads of the parent.
+	 */
+	euid = geteuid();
+	egid = getegid();
+	if ( syscall(SYS_setresgid,egid,-1,egid) || 
+	     syscall(SYS_setresuid,euid,-1,euid) )
+		_exit(2);
+	      
+	/* execute the provided command */
+	execve(args->argv[0],args->argv,environ);
+	_exit(1);
+}
+
+/*
+ * Implement a local version of popen(...,"r") that ensures that the 
+ * command is ran with real and saved set-user-id uid/gid set to the 
+ * effective uid/gid. 
+ *
+ * The command is directly executed using the provided argv, without
+ * any intermediate shell. The child is created using vfork semantics
+ * (clone with CLONE_VM|CLONE_VFORK) so that the page tables of a large
+ * slurmstepd do not have to be copied as with fork.
+ *
+ * If pid is not NULL, it is set to the pid of the child to reap using 
+ * xpclose, or 0 when XSPAWN_DETACH is used.
+ */
+static FILE *xspawn(char* const argv[], int flags, pid_t* pid)
+{
+	struct xspawn_args args;
+	sigset_t allmask;
+	int cpid;
+	int status;
+	FILE* f;
 
-	/* identify process to pipe endpoints based on requested mode (r|w) */
-	if ( *mode == 'r' ) {
-		p_end = 0;
-		c_end = 1 ;
-	} else if ( *mode == 'w' ) {
-		p_end = 1;
-		c_end = 0 ;
-	} else
-		return NULL ;
+	args.argv = argv;
+	args.flags = flags;
 	
 	/* create the pipe */
-	if ( pipe(pep) < 0 )
+	if ( pipe2(args.pep,O_CLOEXEC) < 0 )
+		return NULL;
+
+	args.stack = mmap(NULL,XSPAWN_STACK_SIZE,PROT_READ|PROT_WRITE,
+			  MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK,-1,0);
+	if ( args.stack == MAP_FAILED ) {
+		close(args.pep[0]);
+		close(args.pep[1]);
 		return NULL;
+	}
+
+	/* no signal handler must run in the child before it resets them */
+	sigfillset(&allmask);
+	pthread_sigmask(SIG_BLOCK,&allmask,&args.oldmask);
+
+	cpid = clone(( flags & XSPAWN_DETACH ) ? 
+		     _xspawn_detach : _xspawn_exec,
+		     args.stack + XSPAWN_STACK_SIZE,
+		     CLONE_VM|CLONE_VFORK|SIGCHLD,&args);
 
-	/* create a child task to run the command and get the 
-	 * associated FILE* in the parent process */
-	switch( pid = fork() )
-	{
+	pthread_sigmask(SIG_SETMASK,&args.oldmask,NULL);
+	munmap(args.stack,XSPAWN_STACK_SIZE);
+	close(args.pep[1]);
 
-	case -1: 
-		ERROR("xopen: unable to fork child task");
+	if ( cpid == -1 ) {
+		ERROR("x11: unable to spawn child task");
+		close(args.pep[0]);
 		return NULL;
-	case 0:
-		/* child process closes the parent endpoint 
-		 * and redirect the pipe to either the stdin or 
-		 * stdout fd (0|1) */
-		if (close(pep[p_end]) == -1)
-			exit(1);
-		if (dup2(pep[c_end],c_end) == -1)
-			exit(1);
-		if (close(pep[c_end]) == -1)
-			exit(1);
-		
-		/* change real/saved_set-user-id uid and gid to match the effective one
-		 * without that the execl of /bin/sh would automatically revert to
-		 * an execution using the real uid/gid. That is a security issue that we
-		 * have to avoid.
-		 */
-		euid = geteuid();
-		egid = getegid();
-		if (setresgid(egid,-1,egid) || setresuid(euid,-1,euid))
-			exit(2);
-	      
-		/* execute the  provided command */
-		execl( "/bin/sh", "sh", "-c", command, NULL );
-		exit(1);
+	}
+
+	/* the intermediate child is already gone */
+	if ( flags & XSPAWN_DETACH ) {
+		while ( waitpid(cpid,&status,0) == -1 && errno == EINTR ) ;
+		cpid = 0;
+	}
 
-	default:
-		/* parent process closes the child endpoint and return 
-		 * the file descriptor to use in either r or w mode */
-		if ( close(pep[c_end]) == -1 )
-			return NULL;
-		return fdopen(pep[p_end], mode);
+	f = fdopen(args.pep[0],"r");
+	if ( f == NULL ) {
+		close(args.pep[0]);
+		if ( cpid > 0 )
+			while ( waitpid(cpid,&status,0) == -1 && 
+				errno == EINTR ) ;
+		return NULL;
 	}
+	if ( pid != NULL )
+		*pid = cpid;
+
+	return f;
 } 
 
+/*
+ * close a stream returned by xspawn and reap the associated child
+ */
+static int xpclose(FILE* f, pid_t pid)
+{
+	int status = 0;
+
+	fclose(f);
+	if ( pid > 0 ) {
+		while ( waitpid(pid,&status,0) == -1 ) {
+			if ( errno != EINTR )
+				return -1;
+		}
+	}
+
+	return status;
+}
+
 /*
  *  Provide a --x11=first|last|all option to srun:
  */
 static int _x11_opt_process (int val, const char *optarg, int remote);
+static int _x11_parse_target (const char* value);
+static int _x11_node_selected (spank_t sp,uint32_t nodeid,uint32_t nnodes);
+static int _x11_select_hosts (char* nodes,char*** hosts);
+static int _x11_status_listen (spank_t sp);
+static int _x11_status_connect (spank_t sp);
 
 
 struct spank_option spank_opts[] =
 {
-	{ "x11", "[batch|first|last|all]", 
-	  "Export x11 display on first|last|all allocated node(s)", 2, 0,
+	{ "x11", "[batch|first|last|all|ranks:<list>|every:<n>|hosts:<hostlist>]", 
+	  "Export x11 display on first|last|all|selected allocated node(s)",
+	  2, 0,
 	  (spank_opt_cb_f) _x11_opt_process
 	},
 	SPANK_OPTIONS_TABLE_END
@@ -185,6 +475,100 @@ slurm_spank_init (spank_t sp, int ac, char *av[])
 	return 0;
 }
 
+/*
+ * account the job infos requests served from the local data and from
+ * slurmctld in the node metrics
+ */
+static void _x11_job_infos_path(uint32_t jobid,int rpc)
+{
+	x11_stats_count(rpc ? X11_STATS_JOB_INFOS_RPC :
+			X11_STATS_JOB_INFOS_LOCAL,1);
+	DEBUG("x11: job %u infos taken from %s",jobid,
+	      rpc ? "slurmctld" : "local data");
+}
+
+/*
+ * get the nodelist of the step from the environment of srun, the job 
+ * nodelist is used when the step one is not available and the step
+ * spans all the nodes of the job, the ranks of the targeted nodes being
+ * relative to the step. The variables are only trusted if they refer to
+ * the current job/step.
+ */
+static char* _x11_local_nodelist(uint32_t jobid,uint32_t stepid,
+				 uint32_t nnodes)
+{
+	char* val;
+	char* nodes;
+
+	val = getenv("SLURM_STEP_ID");
+	nodes = getenv("SLURM_STEP_NODELIST");
+	if ( val != NULL && nodes != NULL && 
+	     strtoul(val,NULL,10) == stepid ) {
+		val = getenv("SLURM_JOB_ID");
+		if ( val != NULL && strtoul(val,NULL,10) == jobid )
+			return nodes;
+	}
+
+	val = getenv("SLURM_JOB_NUM_NODES");
+	if ( nnodes == 0 || val == NULL || strtoul(val,NULL,10) != nnodes )
+		return NULL;
+	val = getenv("SLURM_JOB_ID");
+	nodes = getenv("SLURM_JOB_NODELIST");
+	if ( val != NULL && nodes != NULL &&
+	     strtoul(val,NULL,10) == jobid )
+		return nodes;
+
+	return NULL;
+}
+
+/*
+ * open the trace of the X11 setup of the step if requested, the role
+ * naming the track of the calling process
+ */
+static void _x11_trace_open(spank_t sp,uint32_t jobid,uint32_t stepid,
+			    const char* role)
+{
+	char* dir = TRACE_DIR;
+	char envdir[1024];
+	char refid[64];
+
+	if ( spank_remote(sp) ) {
+		if ( spank_getenv(sp,TRACE_ENVVAR,envdir,1024)
+		     == ESPANK_SUCCESS ) {
+			envdir[1023] = '\0';
+			dir = envdir;
+		}
+	}
+	else if ( getenv(TRACE_ENVVAR) != NULL )
+		dir = getenv(TRACE_ENVVAR);
+
+	if ( *dir == '\0' )
+		return;
+
+	snprintf(refid,64,"%u.%u",jobid,stepid);
+	if ( x11_trace_open(dir,refid,role) )
+		ERROR("x11: unable to open trace of %s in %s",refid,dir);
+}
+
+/*
+ * set when the tunnels of the step are established in the background,
+ * the setup of the step starting at x11_setup_start
+ */
+static int x11_async = 0;
+static uint64_t x11_setup_start = 0;
+
+/*
+ * record the metrics of the node if requested
+ */
+static void _x11_stats_open(void)
+{
+	if ( *METRICS_FILE == '\0' )
+		return;
+
+	if ( x11_stats_open(METRICS_FILE) )
+		ERROR("x11: unable to open node metrics %s",STATS_SHM_GLOB);
+}
+
 /*
  * srun call, the client node connects the allocated node(s)
  */
@@ -194,8 +578,13 @@ int slurm_spank_local_user_init (spank_t sp, int ac, char **av)
 
 	uint32_t jobid;
 	uint32_t stepid;
-	job_info_msg_t * job_buffer_ptr;
-	job_info_t* job_ptr;
+	uint32_t nnodes;
+	char* nodes;
+	job_step_info_response_msg_t * step_buffer_ptr;
+	job_step_info_t* step_ptr;
+	uint64_t start;
+	uint64_t rpc_start;
+	char localhost[256];
 
 	/* only handle interactive usage */
 	if ( x11_mode == X11_MODE_NONE || 
@@ -221,88 +610,358 @@ int slurm_spank_local_user_init (spank_t sp, int ac, char **av)
 		status = -1;
 		goto exit;
 	}
-	
-	/* get job infos */
-	status = slurm_load_job(&job_buffer_ptr,jobid,SHOW_ALL);
+
+	/* in lazy mode, the nodes establish their tunnel from this host on
+	 * demand */
+	if ( LAZY ) {
+		if ( gethostname(localhost,256) != 0 ||
+		     spank_setenv(sp,SPANK_X11_HOST_ENVVAR,localhost,1)
+		     != ESPANK_SUCCESS ) {
+			ERROR("x11: unable to export the lazy mode host");
+			status = -2;
+		}
+		else {
+			INFO("x11: lazy mode, tunnels from %s established on "
+			     "demand",localhost);
+			status = 0;
+		}
+		goto exit;
+	}
+
+	_x11_trace_open(sp,jobid,stepid,"srun");
+	_x11_stats_open();
+	start = x11_trace_now();
+	x11_setup_start = x11_stats_now();
+
+	/* tell the nodes waiting for their tunnel when it failed */
+	if ( SETUP_TIMEOUT > 0 && _x11_status_listen(sp) )
+		ERROR("x11: unable to report tunnels to the nodes");
+
+	/* use the nodelist of the local environment if available */
+	if ( spank_get_item (sp, S_JOB_NNODES, &nnodes) != ESPANK_SUCCESS )
+		nnodes = 0;
+	nodes = _x11_local_nodelist(jobid,stepid,nnodes);
+	if ( nodes != NULL ) {
+		_x11_job_infos_path(jobid,0);
+		status = _x11_connect_nodes(nodes,jobid,stepid);
+		goto trace_exit;
+	}
+
+	/* get step infos */
+	_x11_job_infos_path(jobid,1);
+	rpc_start = x11_trace_now();
+	status = slurm_get_job_steps((time_t) 0,jobid,stepid,
+				     &step_buffer_ptr,SHOW_ALL);
+	x11_trace_span("slurm_get_job_steps",rpc_start,NULL,NULL);
 	if ( status != 0 ) {
-		ERROR("x11: unable to get job infos");
+		ERROR("x11: unable to get step infos");
 		status = -3;
-		goto exit;
+		goto trace_exit;
 	}
 
 	/* check infos validity  */
-	if ( job_buffer_ptr->record_count != 1 ) {
-		ERROR("x11: job infos are invalid");
+	if ( step_buffer_ptr->job_step_count != 1 ) {
+		ERROR("x11: step infos are invalid");
 		status = -4;
 		goto clean_exit;
 	}
-	job_ptr = job_buffer_ptr->job_array;
+	step_ptr = step_buffer_ptr->job_steps;
 
-	/* check allocated nodes var */
-	if ( job_ptr->nodes == NULL ) {
-		ERROR("x11: job has no allocated nodes defined");
+	/* check step nodes var */
+	if ( step_ptr->nodes == NULL ) {
+		ERROR("x11: step has no nodes defined");
 		status = -5;
 		goto clean_exit;
 	}
 
 	/* connect required nodes */
-	status = _x11_connect_nodes(job_ptr->nodes,jobid,stepid);
+	status = _x11_connect_nodes(step_ptr->nodes,jobid,stepid);
 
 clean_exit:
-	slurm_free_job_info_msg(job_buffer_ptr);
+	slurm_free_job_step_info_response_msg(step_buffer_ptr);
+
+trace_exit:
+	x11_trace_span("local_user_init",start,NULL,NULL);
+
+	/* the background fan-out ends the trace and the metrics */
+	if ( ! x11_async ) {
+		x11_trace_close();
+		x11_stats_observe(X11_STATS_STEP_SETUP,x11_setup_start);
+		x11_stats_close();
+	}
 
 exit:
 	return status;
 }
 
 
-int _x11_init_remote_inter(spank_t sp,uint32_t jobid,uint32_t stepid)
+/*
+ * build the reference of the tunnels of an interactive step, shared by
+ * all the steps of the job when tunnels are job scoped
+ */
+static void _x11_refid(char* refid,size_t size,uint32_t jobid,
+		       uint32_t stepid)
+{
+	if ( tunnel_scope == X11_SCOPE_JOB )
+		snprintf(refid,size,"%u",jobid);
+	else
+		snprintf(refid,size,"%u.%u",jobid,stepid);
+}
+
+/*
+ * the DISPLAY of the step is resolved once on each node by slurmstepd in
+ * user_init, before the tasks are forked, so that they inherit it. When
+ * the tunnel is not ready yet, slurmstepd maps a cache shared with the
+ * tasks it forks afterwards: the first task that resolves the DISPLAY 
+ * stores it there and the following ones take it from the cache instead
+ * of reading the reference again. Failed lookups are not cached.
+ */
+#define X11_CACHE_EMPTY   0
+#define X11_CACHE_FILLING 1
+#define X11_CACHE_READY   2
+
+struct x11_display_cache {
+	uint32_t state;
+	uint32_t lookups;
+	uint32_t hits;
+	char     display[256];
+};
+static struct x11_display_cache* x11_display_cache = NULL;
+static int x11_pending = 0;
+
+static void _x11_display_cache_open(void)
+{
+	void* p;
+
+	if ( x11_display_cache != NULL )
+		return;
+	p = mmap(NULL,sizeof(struct x11_display_cache),PROT_READ|PROT_WRITE,
+		 MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if ( p == MAP_FAILED ) {
+		ERROR("x11: unable to map the DISPLAY cache of the tasks");
+		return;
+	}
+	x11_display_cache = (struct x11_display_cache*) p;
+}
+
+static void _x11_display_cache_close(void)
+{
+	if ( x11_display_cache == NULL )
+		return;
+	munmap(x11_display_cache,sizeof(struct x11_display_cache));
+	x11_display_cache = NULL;
+}
+
+int _x11_resolve_display(uint32_t jobid,uint32_t stepid,uid_t uid,
+			 char** display)
+{
+	int rc;
+	char refid[64];
+	uint64_t start;
+	uint64_t stats_start = x11_stats_now();
+	struct x11_display_cache* c = x11_display_cache;
+	uint32_t state = X11_CACHE_EMPTY;
+
+	if ( c != NULL &&
+	     __atomic_load_n(&c->state,__ATOMIC_ACQUIRE) == X11_CACHE_READY ) {
+		*display = strdup(c->display);
+		if ( *display != NULL ) {
+			__atomic_fetch_add(&c->hits,1,__ATOMIC_RELAXED);
+			rc = 0;
+			goto exit;
+		}
+	}
+
+	/* read the connected DISPLAY to use from the local reference, 
+	 * only trusting the references created by the user of the job */
+	_x11_refid(refid,64,jobid,stepid);
+	start = x11_trace_now();
+	rc = read_display_ref_uid(refid,display,uid);
+	x11_trace_span("read_display_ref",start,"refid",refid);
+	if ( c != NULL )
+		__atomic_fetch_add(&c->lookups,1,__ATOMIC_RELAXED);
+	if ( rc != 0 ) {
+		ERROR("x11: unable to read DISPLAY value of ref %s (%d)",
+		      refid,rc);
+		x11_stats_count(X11_STATS_DISPLAY_FAILURES,1);
+	}
+	else if ( c != NULL &&
+		  strlen(*display) < sizeof(c->display) &&
+		  __atomic_compare_exchange_n(&c->state,&state,
+					      X11_CACHE_FILLING,0,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED) ) {
+		strcpy(c->display,*display);
+		__atomic_store_n(&c->state,X11_CACHE_READY,__ATOMIC_RELEASE);
+	}
+
+exit:
+	x11_stats_observe(X11_STATS_DISPLAY_RESOLVE,stats_start);
+	if ( c != NULL )
+		DEBUG("x11: DISPLAY of %u.%u : %u lookup(s), %u served from "
+		      "cache",jobid,stepid,
+		      __atomic_load_n(&c->lookups,__ATOMIC_RELAXED),
+		      __atomic_load_n(&c->hits,__ATOMIC_RELAXED));
+	return rc;
+}
+
+/*
+ * set the DISPLAY of the step, waiting at most timeout seconds for the
+ * tunnel that srun establishes in the background. Return 1 if it is not
+ * ready in time, the DISPLAY being unset so that the tasks run without
+ * it unless they find it later.
+ */
+int _x11_init_remote_inter(spank_t sp,uint32_t jobid,uint32_t stepid,
+			   int timeout)
 {
-	FILE* f;
 	int status = -1;
-	char* cmd_pattern= X11_LIBEXEC_PROG " -i %u.%u -g";
-	char* cmd;
-	size_t cmd_length;
-	char display[256];
-        
-	/* build slum-spank-x11 command to retrieve connected DISPLAY to use */
-	cmd_length = strlen(cmd_pattern) + 128 ;
-	cmd = (char*) malloc(cmd_length*sizeof(char));
-	if ( cmd == NULL || 
-	     snprintf(cmd,cmd_length,cmd_pattern,jobid,stepid) >= cmd_length ) {
-		ERROR("x11: error while building cmd");
-		status = -2;
+	char* display;
+	char refid[64];
+	char answer = '\0';
+	uint64_t start;
+	struct timespec now, deadline;
+	int fd;
+	int rc;
+	uid_t uid;
+
+	if ( spank_get_item(sp,S_JOB_UID,&uid) != ESPANK_SUCCESS ) {
+		ERROR("x11: unable to get job uid");
+		return -4;
 	}
-	else {
-	        /* execute the command to retrieve the DISPLAY value to use */
-		f = popen(cmd,"r");
-		if ( f != NULL ) {
-			if ( fscanf(f,"%255s\n",display) == 1 ) {
-				if ( spank_setenv(sp,"DISPLAY",display,1) 
-				     != ESPANK_SUCCESS ) {
-					ERROR("x11: unable "
-						    "to set DISPLAY in env");
-					status = -5;
-				}
-				else {
-					INFO("x11: now using DISPLAY=%s",
-						   display);
-					status = 0;
-				}
-			}
-			else {
-				ERROR("x11: unable to read DISPLAY value");
-				status = -4;
+
+	if ( timeout > 0 ) {
+		_x11_refid(refid,64,jobid,stepid);
+		start = x11_trace_now();
+		clock_gettime(CLOCK_MONOTONIC,&deadline);
+		deadline.tv_sec += timeout;
+
+		/* stop waiting as soon as srun is done with the tunnel */
+		rc = wait_display_ref_ready_fd(refid,0,-1,uid);
+		if ( rc != 0 ) {
+			fd = _x11_status_connect(sp);
+			rc = wait_display_ref_ready_fd(refid,timeout,fd,uid);
+			if ( rc == 50 && read(fd,&answer,1) == 1 )
+				rc = wait_display_ref_ready_fd(refid,0,-1,uid);
+			else if ( rc == 50 ) {
+				clock_gettime(CLOCK_MONOTONIC,&now);
+				rc = wait_display_ref_ready_fd(refid,
+					deadline.tv_sec - now.tv_sec,-1,uid);
 			}
-			pclose(f);
+			if ( fd != -1 )
+				close(fd);
+		}
+		if ( rc ) {
+			if ( answer != '\0' )
+				WARN("x11: warning: tunnel of ref %s to this "
+				     "node failed, running without DISPLAY",
+				     refid);
+			else
+				WARN("x11: warning: DISPLAY of ref %s not "
+				     "ready after %d s, running without "
+				     "DISPLAY",refid,timeout);
+			spank_unsetenv(sp,"DISPLAY");
+			x11_stats_count(X11_STATS_DISPLAY_FAILURES,1);
+			x11_trace_span("wait_display_ref",start,"refid",refid);
+			return 1;
+		}
+		x11_trace_span("wait_display_ref",start,"refid",refid);
+	}
+        
+	if ( _x11_resolve_display(jobid,stepid,uid,&display) == 0 ) {
+		if ( spank_setenv(sp,"DISPLAY",display,1) 
+		     != ESPANK_SUCCESS ) {
+			ERROR("x11: unable to set DISPLAY in env");
+			status = -5;
 		}
 		else {
-		        ERROR("x11: unable to exec get cmd '%s'",cmd);
+			INFO("x11: now using DISPLAY=%s",display);
+			status = 0;
+		}
+		free(display);
+	}
+	else
+		status = -4;
+	
+	return status;
+}
+
+/*
+ * get the submission host and the user name of the job from the job env
+ * if available, from the job infos of the controller otherwise
+ */
+static int _x11_job_submitter(spank_t sp,uint32_t jobid,char* host,
+			      size_t hsize,char* user,size_t usize)
+{
+	int status;
+
+        struct passwd user_pwent;
+        struct passwd *p_pwent;
+        size_t pwent_buffer_length = sysconf(_SC_GETPW_R_SIZE_MAX);
+        char pwent_buffer[pwent_buffer_length];
+        
+	job_info_msg_t * job_buffer_ptr = NULL;
+	job_info_t* job_ptr;
+	uint32_t uid;
+	uint64_t start;
+	int len;
+
+	/* get submission host and user from the job env if available */
+	if ( spank_getenv(sp,"SLURM_SUBMIT_HOST",host,hsize) 
+	     == ESPANK_SUCCESS &&
+	     spank_get_item(sp,S_JOB_UID,&uid) == ESPANK_SUCCESS ) {
+		_x11_job_infos_path(jobid,0);
+		host[hsize-1] = '\0';
+	}
+	else {
+		/* get job infos */
+		_x11_job_infos_path(jobid,1);
+		start = x11_trace_now();
+		status = slurm_load_job(&job_buffer_ptr,jobid,SHOW_ALL);
+		x11_trace_span("slurm_load_job",start,NULL,NULL);
+		if ( status != 0 ) {
+			ERROR("x11: unable to get job infos");
+			job_buffer_ptr = NULL;
 			status = -3;
+			goto exit;
+		}
+	
+		/* check infos validity  */
+		if ( job_buffer_ptr->record_count != 1 ) {
+			ERROR("x11: job infos are invalid");
+			status = -4;
+			goto clean_exit;
+		}
+		job_ptr = job_buffer_ptr->job_array;
+		uid = job_ptr->user_id;
+		if ( job_ptr->alloc_node == NULL ||
+		     ( len = snprintf(host,hsize,"%s",job_ptr->alloc_node) )
+		     < 0 || (size_t) len >= hsize ) {
+			ERROR("x11: job has no valid submission host");
+			status = -4;
+			goto clean_exit;
 		}
-		free(cmd);
 	}
 	
+	/* get user name */
+	status = getpwuid_r(uid,&user_pwent,pwent_buffer,
+			    pwent_buffer_length,&p_pwent) ;
+        if (status) {
+                error("x11: unable to get username for uid=%u : %s",uid,
+		      strerror(status)) ;
+		status = -10;
+		goto clean_exit;
+        }
+	len = snprintf(user,usize,"%s",user_pwent.pw_name);
+	if ( len < 0 || (size_t) len >= usize ) {
+		status = -10;
+		goto clean_exit;
+	}
+
+clean_exit:
+	if ( job_buffer_ptr != NULL )
+		slurm_free_job_info_msg(job_buffer_ptr);
+
+exit:
 	return status;
 }
 
@@ -311,19 +970,24 @@ int _x11_init_remote_batch(spank_t sp,uint32_t jobid,uint32_t stepid)
 	int status;
 
 	FILE* f;
+	pid_t pid;
 	char localhost[256];
-	char* cmd_pattern= X11_LIBEXEC_PROG " -u %s -s \"%s\" -o \"%s\" -f %s -d %s -t %s -i %u.%u -cwg %s &";
-	char* cmd;
+	char* cmd_pattern= X11_LIBEXEC_PROG " -u %s -s \"%s\" -o \"%s\" -m %d -f %s -d %s -t %s -i %u.%u%s%s%s%s%s%s -cwg %s &";
+	char* cmd = NULL;
 	size_t cmd_length;
 	char display[256];
+	char refid[64];
+	char mux_persist[16];
+	int rc;
+	char* argv[32];
+	int argc = 0;
+	int flags = XSPAWN_DETACH;
 	
-        struct passwd user_pwent;
-        struct passwd *p_pwent;
-        size_t pwent_buffer_length = sysconf(_SC_GETPW_R_SIZE_MAX);
-        char pwent_buffer[pwent_buffer_length];
-        
-	job_info_msg_t * job_buffer_ptr;
-	job_info_t* job_ptr;
+	char user[256];
+	char alloc_node[256];
+	const char* tdir = x11_trace_dir();
+	const char* mfile = x11_stats_file();
+	uint64_t start;
 	
 	/*
 	 * get current hostname 
@@ -345,87 +1009,255 @@ int _x11_init_remote_batch(spank_t sp,uint32_t jobid,uint32_t stepid)
 		goto exit;
 	}
 	
-	/* get job infos */
-	status = slurm_load_job(&job_buffer_ptr,jobid,SHOW_ALL);
-	if ( status != 0 ) {
-		ERROR("x11: unable to get job infos");
-		status = -3;
+	/* get submission host and user */
+	status = _x11_job_submitter(sp,jobid,alloc_node,256,user,256);
+	if ( status )
 		goto exit;
-	}
 	
-	/* check infos validity  */
-	if ( job_buffer_ptr->record_count != 1 ) {
-		ERROR("x11: job infos are invalid");
-		status = -4;
-		goto clean_exit;
-	}
-	job_ptr = job_buffer_ptr->job_array;
-	
-	/* get user name */
-	status = getpwuid_r(job_ptr->user_id,&user_pwent,pwent_buffer,
-			    pwent_buffer_length,&p_pwent) ;
-        if (status) {
-                error("x11: unable to get username for uid=%u : %s",job_ptr->user_id,
-		      strerror(status)) ;
-		status = -10;
-		goto clean_exit;
-        }
-	
-	/* 
-	 * build the command line that will be used to forward the 
-	 * alloc node X11 tunnel
-	 */
-	cmd_length = strlen(cmd_pattern) + 128 ;
-	cmd = (char*) malloc(cmd_length*sizeof(char));
-	if ( cmd == NULL ||
-	     snprintf(cmd,cmd_length,cmd_pattern,user_pwent.pw_name,
-		      (ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd,
-		      (ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args,
-		      job_ptr->alloc_node,display,localhost,jobid,stepid,
-		      (helpertask_args == NULL) ? DEFAULT_HELPERTASK_ARGS : helpertask_args) >= cmd_length ) {
-		ERROR("x11: error while building cmd");
-		status = -2;
+	/* 
+	 * build the command line that will be used to forward the 
+	 * alloc node X11 tunnel, a shell is only required to honor
+	 * helper task trailing args
+	 */
+	snprintf(refid,64,"%u.%u",jobid,stepid);
+	if ( helpertask_args != NULL && *helpertask_args != '\0' ) {
+		cmd_length = strlen(cmd_pattern) + strlen(display) +
+			strlen(localhost) + strlen(user) +
+			strlen(alloc_node) + 128 +
+			( ( tdir == NULL ) ? 0 : strlen(tdir) ) +
+			( ( mfile == NULL ) ? 0 : strlen(mfile) ) +
+			strlen((ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd) +
+			strlen((ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args)+
+			strlen(helpertask_args);
+		cmd = (char*) malloc(cmd_length*sizeof(char));
+		if ( cmd == NULL ||
+		     (size_t) snprintf(cmd,cmd_length,cmd_pattern,user,
+			      (ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd,
+			      (ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args,
+			      MUX_PERSIST,alloc_node,display,localhost,jobid,
+			      stepid,( tdir == NULL ) ? "" : " -P \"",
+			      ( tdir == NULL ) ? "" : tdir,
+			      ( tdir == NULL ) ? "" : "\"",
+			      ( mfile == NULL ) ? "" : " -M \"",
+			      ( mfile == NULL ) ? "" : mfile,
+			      ( mfile == NULL ) ? "" : "\"",
+			      helpertask_args) >= cmd_length ) {
+			ERROR("x11: error while building cmd");
+			status = -2;
+			goto free_exit;
+		}
+		INFO("x11: batch mode : executing %s",cmd);
+		argv[argc++] = "/bin/sh";
+		argv[argc++] = "-c";
+		argv[argc++] = cmd;
+		argv[argc++] = NULL;
+		flags = 0;
 	}
 	else {
-		INFO("x11: batch mode : executing %s",cmd);
-	        /* execute the command to retrieve the DISPLAY value to use */
-		f = xpopen(cmd,"r");
-		if ( f != NULL ) {
-			if ( fscanf(f,"%255s",display) == 1 ) {
-				if ( spank_setenv(sp,"DISPLAY",display,1)
-				     != ESPANK_SUCCESS ) {
-					ERROR("x11: unable to set DISPLAY"
-						    " in job env");
-					status = -5;
-				}
-				else {
-					INFO("x11: now using DISPLAY=%s",
-						   display);
-					status=0;
-				}
+		snprintf(mux_persist,16,"%d",MUX_PERSIST);
+		argv[argc++] = X11_LIBEXEC_PROG;
+		argv[argc++] = "-u";
+		argv[argc++] = user;
+		argv[argc++] = "-s";
+		argv[argc++] = (ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd;
+		argv[argc++] = "-o";
+		argv[argc++] = (ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args;
+		argv[argc++] = "-m";
+		argv[argc++] = mux_persist;
+		argv[argc++] = "-f";
+		argv[argc++] = alloc_node;
+		argv[argc++] = "-d";
+		argv[argc++] = display;
+		argv[argc++] = "-t";
+		argv[argc++] = localhost;
+		argv[argc++] = "-i";
+		argv[argc++] = refid;
+		if ( tdir != NULL ) {
+			argv[argc++] = "-P";
+			argv[argc++] = (char*) tdir;
+		}
+		if ( mfile != NULL ) {
+			argv[argc++] = "-M";
+			argv[argc++] = (char*) mfile;
+		}
+		argv[argc++] = "-cwg";
+		argv[argc++] = NULL;
+		INFO("x11: batch mode : executing %s -u %s -s \"%s\" -o \"%s\" "
+		     "-m %s -f %s -d %s -t %s -i %s%s%s%s%s -cwg",
+		     X11_LIBEXEC_PROG,user,argv[4],argv[6],
+		     mux_persist,alloc_node,display,localhost,refid,
+		     ( tdir == NULL ) ? "" : " -P ",( tdir == NULL ) ? "" : tdir,
+		     ( mfile == NULL ) ? "" : " -M ",
+		     ( mfile == NULL ) ? "" : mfile);
+	}
+
+	/* execute the command to retrieve the DISPLAY value to use */
+	start = x11_trace_now();
+	f = xspawn(argv,flags,&pid);
+	x11_trace_span("helper_spawn",start,"node",alloc_node);
+	if ( f != NULL ) {
+		start = x11_trace_now();
+		rc = fscanf(f,"%255s",display);
+		x11_trace_span("helper_read",start,"node",alloc_node);
+		if ( rc == 1 ) {
+			if ( spank_setenv(sp,"DISPLAY",display,1)
+			     != ESPANK_SUCCESS ) {
+				ERROR("x11: unable to set DISPLAY"
+				      " in job env");
+				status = -5;
 			}
 			else {
-				ERROR("x11: unable to get a DISPLAY value");
-				status = -6;
+				INFO("x11: now using DISPLAY=%s",
+				     display);
+				status=0;
 			}
-			pclose(f);
 		}
 		else {
-		        ERROR("x11: unable to exec get cmd '%s'",cmd);
-			status = -3;
+			ERROR("x11: unable to get a DISPLAY value");
+			status = -6;
 		}
+		xpclose(f,pid);
+	}
+	else {
+		ERROR("x11: unable to exec get cmd '%s'",argv[0]);
+		status = -3;
 	}
 
+free_exit:
 	if ( cmd != NULL )
 		free(cmd);
 
-clean_exit:
-	slurm_free_job_info_msg(job_buffer_ptr);
-	
 exit:
 	return status;
 }
 
+/*
+ * in lazy mode, publish the DISPLAY of a local relay that establishes the
+ * tunnel from the srun host when the first X11 client of the step 
+ * connects, and that ends with the step, or with the job when tunnels are
+ * job scoped
+ */
+int _x11_init_remote_lazy(spank_t sp,uint32_t jobid,uint32_t stepid)
+{
+	int status;
+
+	FILE* f;
+	pid_t pid;
+	char display[256];
+	char host[256];
+	char user[256];
+	char refid[64];
+	char mux_persist[16];
+	char end_pid[16];
+	int rc;
+	char* argv[32];
+	int argc = 0;
+	const char* tdir = x11_trace_dir();
+	const char* mfile = x11_stats_file();
+	uint64_t start;
+	uid_t uid;
+
+	/* a job scoped DISPLAY is published once for all the steps */
+	_x11_refid(refid,64,jobid,stepid);
+	if ( tunnel_scope == X11_SCOPE_JOB && 
+	     spank_get_item(sp,S_JOB_UID,&uid) == ESPANK_SUCCESS &&
+	     wait_display_ref_ready_fd(refid,0,-1,uid) == 0 )
+		return _x11_init_remote_inter(sp,jobid,stepid,0);
+
+	if ( spank_getenv(sp,"DISPLAY",display,256) != ESPANK_SUCCESS ) {
+		ERROR("x11: unable to read step inherited DISPLAY value");
+		return -1;
+	}
+
+	/* get the srun host, the submission host otherwise */
+	status = _x11_job_submitter(sp,jobid,host,256,user,256);
+	if ( status )
+		return status;
+	if ( spank_getenv(sp,SPANK_X11_HOST_ENVVAR,host,256) 
+	     == ESPANK_SUCCESS )
+		host[255] = '\0';
+
+	snprintf(mux_persist,16,"%d",MUX_PERSIST);
+	snprintf(end_pid,16,"%d",( tunnel_scope == X11_SCOPE_JOB ) ? 
+		 0 : (int) getpid());
+	argv[argc++] = X11_LIBEXEC_PROG;
+	argv[argc++] = "-L";
+	argv[argc++] = "-e";
+	argv[argc++] = end_pid;
+	argv[argc++] = "-u";
+	argv[argc++] = user;
+	argv[argc++] = "-s";
+	argv[argc++] = (ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd;
+	argv[argc++] = "-o";
+	argv[argc++] = (ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args;
+	argv[argc++] = "-m";
+	argv[argc++] = mux_persist;
+	argv[argc++] = "-f";
+	argv[argc++] = host;
+	argv[argc++] = "-d";
+	argv[argc++] = display;
+	argv[argc++] = "-i";
+	argv[argc++] = refid;
+	if ( tdir != NULL ) {
+		argv[argc++] = "-P";
+		argv[argc++] = (char*) tdir;
+	}
+	if ( mfile != NULL ) {
+		argv[argc++] = "-M";
+		argv[argc++] = (char*) mfile;
+	}
+	argv[argc++] = "-cwg";
+	argv[argc++] = NULL;
+	INFO("x11: lazy mode : executing %s -L -e %s -u %s -s \"%s\" "
+	     "-o \"%s\" -m %s -f %s -d %s -i %s%s%s%s%s -cwg",
+	     X11_LIBEXEC_PROG,end_pid,user,argv[8],argv[10],mux_persist,host,
+	     display,refid,( tdir == NULL ) ? "" : " -P ",
+	     ( tdir == NULL ) ? "" : tdir,( mfile == NULL ) ? "" : " -M ",
+	     ( mfile == NULL ) ? "" : mfile);
+
+	/* execute the command to retrieve the DISPLAY value to use */
+	start = x11_trace_now();
+	f = xspawn(argv,XSPAWN_DETACH,&pid);
+	x11_trace_span("helper_spawn",start,"node",host);
+	if ( f == NULL ) {
+		ERROR("x11: unable to exec get cmd '%s'",argv[0]);
+		return -3;
+	}
+	start = x11_trace_now();
+	rc = fscanf(f,"%255s",display);
+	x11_trace_span("helper_read",start,"node",host);
+	xpclose(f,pid);
+	if ( rc != 1 ) {
+		ERROR("x11: unable to get a DISPLAY value");
+		x11_stats_count(X11_STATS_DISPLAY_FAILURES,1);
+		return -6;
+	}
+
+	if ( spank_setenv(sp,"DISPLAY",display,1) != ESPANK_SUCCESS ) {
+		ERROR("x11: unable to set DISPLAY in job env");
+		return -5;
+	}
+	INFO("x11: now using lazy DISPLAY=%s",display);
+
+	return 0;
+}
+
+/*
+ * report a lazy DISPLAY that no X11 client ever connected to
+ */
+static void _x11_lazy_report(spank_t sp,char* refid)
+{
+	char lazy_refid[128];
+	uid_t uid;
+
+	if ( ! LAZY || spank_get_item(sp,S_JOB_UID,&uid) != ESPANK_SUCCESS ||
+	     wait_display_ref_ready_fd(refid,0,-1,uid) != 0 )
+		return;
+	snprintf(lazy_refid,128,"%s.lazy",refid);
+	if ( wait_display_ref_ready_fd(lazy_refid,0,-1,uid) != 0 )
+		INFO("x11: lazy DISPLAY of ref %s was never used",refid);
+}
+
 /*
  * in remote mode, read DISPLAY file content and set its value in job's DISPLAY
  * environment variable 
@@ -438,6 +1270,9 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
 	uint32_t stepid;
 	uint32_t nnodes;
 	uint32_t nodeid; 
+	uint64_t start;
+	char refid[64];
+	char holder[16];
 
 	if ( x11_mode == X11_MODE_NONE )
 		return 0;
@@ -451,7 +1286,12 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
 	        return status;
 
 	if ( stepid == SLURM_BATCH_SCRIPT && x11_mode == X11_MODE_BATCH ) {
-		return _x11_init_remote_batch(sp,jobid,stepid);
+		_x11_trace_open(sp,jobid,stepid,"slurmstepd");
+		_x11_stats_open();
+		start = x11_trace_now();
+		status = _x11_init_remote_batch(sp,jobid,stepid);
+		x11_trace_span("user_init",start,NULL,NULL);
+		return status;
 	}
 	else if ( x11_mode != X11_MODE_BATCH ) {
 
@@ -464,33 +1304,67 @@ int slurm_spank_user_init (spank_t sp, int ac, char **av)
 			return status;
 
 		/* test if the local node has to go further */
-		switch ( x11_mode ) {
-		case X11_MODE_FIRST :
-			if ( nodeid == 0 ) {
-				do_init = 1;
-			}
-			break;
-		case X11_MODE_LAST :
-			if ( nodeid == (nnodes - 1) ) {
-				do_init = 1;
+		do_init = _x11_node_selected(sp,nodeid,nnodes);
+		
+		/* do the initialization of the X11 export if requested, 
+		 * once for all the local tasks of the step. If the tunnel
+		 * is not ready yet, the tasks will retry on their own, the
+		 * step being launched anyway */
+		if ( do_init == 1 ) {
+			_x11_trace_open(sp,jobid,stepid,"slurmstepd");
+			_x11_stats_open();
+			start = x11_trace_now();
+
+			/* the job scoped DISPLAY is used by this step until
+			 * its end */
+			if ( tunnel_scope == X11_SCOPE_JOB ) {
+				_x11_refid(refid,64,jobid,stepid);
+				snprintf(holder,16,"%u",stepid);
+				hold_display_ref(refid,holder);
 			}
-			break;
-		case X11_MODE_ALL :
-			do_init = 1;
-			break;
-		default :
-			break;
+			if ( LAZY )
+				status = _x11_init_remote_lazy(sp,jobid,stepid);
+			else
+				status = _x11_init_remote_inter(sp,jobid,stepid,
+								SETUP_TIMEOUT);
+			x11_trace_span("user_init",start,NULL,NULL);
+			x11_pending = ( status != 0 );
+			if ( x11_pending )
+				_x11_display_cache_open();
+			return ( status == 1 ) ? 0 : status ;
 		}
-		
-		/* do the initialization of the X11 export if requested */
-		if ( do_init == 1 )
-			return _x11_init_remote_inter(sp,jobid,stepid);
 		else
 			return 0;
 	}
 
 }
 
+/*
+ * in remote mode, retry the DISPLAY resolution for the tasks launched 
+ * before the tunnel was ready
+ */
+int slurm_spank_task_init (spank_t sp, int ac, char **av)
+{
+	uint32_t jobid;
+	uint32_t stepid;
+	uint64_t start;
+
+	if ( ! x11_pending )
+		return 0;
+
+	if ( spank_get_item (sp, S_JOB_ID, &jobid) != ESPANK_SUCCESS )
+		return -1;
+
+	if ( spank_get_item (sp, S_JOB_STEPID, &stepid) != ESPANK_SUCCESS )
+	        return -1;
+
+	start = x11_trace_now();
+	_x11_init_remote_inter(sp,jobid,stepid,0);
+	x11_trace_span("task_init",start,NULL,NULL);
+
+	return 0;
+}
+
 /*
  * in remote mode, remove DISPLAY file in order to stop
  * ssh -X process initialized by the client
@@ -499,16 +1373,19 @@ int slurm_spank_exit (spank_t sp, int ac, char **av)
 {
 	uint32_t jobid;
 	uint32_t stepid;
+	uid_t uid;
 
-	FILE* f;
-	char* expc_pattern= X11_LIBEXEC_PROG " -i %u.%u -r 2>/dev/null";
-	char* expc_cmd;
-	size_t expc_length;
+	char refid[64];
+	char holder[16];
 	
 	/* noting to do in local mode */
 	if (!spank_remote (sp))
 		return 0;
 
+	x11_trace_close();
+	x11_stats_close();
+	_x11_display_cache_close();
+
 	/* get job id */
 	if ( spank_get_item (sp, S_JOB_ID, &jobid) != ESPANK_SUCCESS )
 		return -1;
@@ -517,29 +1394,341 @@ int slurm_spank_exit (spank_t sp, int ac, char **av)
 	if ( spank_get_item (sp, S_JOB_STEPID, &stepid) != ESPANK_SUCCESS )
 		return -1;
 	
-	/* remove DISPLAY reference */
-	expc_length = strlen(expc_pattern) + 128 ;
-	expc_cmd = (char*) malloc(expc_length*sizeof(char));
-	if ( expc_cmd != NULL && 
-	     ( snprintf(expc_cmd,expc_length,expc_pattern,jobid,stepid)
-	       >= expc_length )	) {
-		ERROR("x11: error while creating remove reference cmd");
+	/* remove DISPLAY reference, if any, to stop the tunnel helper, 
+	 * job scoped references being only removed with their last holder.
+	 * The step is marked as ended for the tunnels still in progress */
+	snprintf(refid,64,"%u.%u",jobid,stepid);
+	_x11_lazy_report(sp,refid);
+	if ( x11_mode != X11_MODE_NONE )
+		end_display_ref(refid);
+	else
+		remove_display_ref(refid);
+
+	/* the last step using a job scoped DISPLAY releases it */
+	if ( x11_mode != X11_MODE_NONE && tunnel_scope == X11_SCOPE_JOB ) {
+		snprintf(refid,64,"%u",jobid);
+		snprintf(holder,16,"%u",stepid);
+		if ( spank_get_item (sp, S_JOB_UID, &uid) != ESPANK_SUCCESS )
+			uid = 0;
+		if ( release_display_ref(refid,holder,uid) == 0 )
+			INFO("x11: job DISPLAY of ref %s released",refid);
 	}
-	else {
-		f = xpopen(expc_cmd,"r");
-		if ( f == NULL ) {
-			ERROR("x11: unable to exec remove"
-				    " cmd '%s'",expc_cmd);
-		}
-		else
-			pclose(f);		
-	}
-	if ( expc_cmd != NULL )
-		free(expc_cmd);
 	
 	return 0;
 }
 
+/*
+ * at the end of the job, remove the job scoped DISPLAY reference, if 
+ * any, in order to stop the tunnel shared by the steps of the job
+ */
+int slurm_spank_job_epilog (spank_t sp, int ac, char **av)
+{
+	uint32_t jobid;
+	char refid[64];
+
+	if ( spank_get_item (sp, S_JOB_ID, &jobid) != ESPANK_SUCCESS )
+		return -1;
+
+	/* the job marker also covers its steps ones, the markers left by 
+	 * the jobs ended for a while being removed meanwhile */
+	snprintf(refid,64,"%u",jobid);
+	_x11_lazy_report(sp,refid);
+	end_display_ref(refid);
+	purge_display_refs(refid,X11_END_MARKER_AGE);
+
+	return 0;
+}
+
+/*
+ * parse a ranks:<list>|every:<n>|hosts:<hostlist> target and return the 
+ * associated mode, X11_MODE_NONE if the value is not valid
+ *
+ * ranks are relative node indexes in the step, for example ranks:0,8-15
+ */
+static int _x11_range_cmp (const void* a,const void* b)
+{
+	const struct x11_range* ra = (const struct x11_range*) a;
+	const struct x11_range* rb = (const struct x11_range*) b;
+
+	return ( ra->lo > rb->lo ) - ( ra->lo < rb->lo );
+}
+
+static int _x11_parse_target (const char* value)
+{
+	const char* p;
+	char* end;
+	unsigned long lo, hi;
+	struct x11_range* ranges;
+	int i, j;
+
+	if ( strncmp(value,"ranks:",6) == 0 ) {
+		free(x11_ranges);
+		x11_ranges = NULL;
+		x11_nranges = 0;
+		p = value + 6;
+		while ( *p != '\0' ) {
+			errno = 0;
+			lo = strtoul(p,&end,10);
+			if ( end == p || errno != 0 || lo > UINT32_MAX )
+				return X11_MODE_NONE;
+			hi = lo;
+			if ( *end == '-' ) {
+				p = end + 1;
+				hi = strtoul(p,&end,10);
+				if ( end == p || errno != 0 || hi > UINT32_MAX ||
+				     hi < lo )
+					return X11_MODE_NONE;
+			}
+			if ( *end == ',' )
+				end++;
+			else if ( *end != '\0' )
+				return X11_MODE_NONE;
+			p = end;
+
+			ranges = (struct x11_range*) realloc(x11_ranges,
+			   (x11_nranges+1)*sizeof(struct x11_range));
+			if ( ranges == NULL )
+				return X11_MODE_NONE;
+			x11_ranges = ranges;
+			x11_ranges[x11_nranges].lo = lo;
+			x11_ranges[x11_nranges].hi = hi;
+			x11_nranges++;
+		}
+		if ( x11_nranges == 0 )
+			return X11_MODE_NONE;
+
+		/* sort and merge overlapping or adjacent ranges so that 
+		 * every node is selected once */
+		qsort(x11_ranges,x11_nranges,sizeof(struct x11_range),
+		      _x11_range_cmp);
+		for ( i = 1, j = 0 ; i < x11_nranges ; i++ ) {
+			if ( (uint64_t) x11_ranges[i].lo <= 
+			     (uint64_t) x11_ranges[j].hi + 1 ) {
+				if ( x11_ranges[i].hi > x11_ranges[j].hi )
+					x11_ranges[j].hi = x11_ranges[i].hi;
+			}
+			else
+				x11_ranges[++j] = x11_ranges[i];
+		}
+		x11_nranges = j + 1;
+		return X11_MODE_RANKS;
+	}
+	else if ( strncmp(value,"every:",6) == 0 ) {
+		errno = 0;
+		lo = strtoul(value+6,&end,10);
+		if ( end == value+6 || *end != '\0' || errno != 0 || 
+		     lo == 0 || lo > UINT32_MAX )
+			return X11_MODE_NONE;
+		x11_stride = lo;
+		return X11_MODE_EVERY;
+	}
+	else if ( strncmp(value,"hosts:",6) == 0 && value[6] != '\0' ) {
+		free(x11_hosts);
+		x11_hosts = strdup(value+6);
+		if ( x11_hosts == NULL )
+			return X11_MODE_NONE;
+		return X11_MODE_HOSTS;
+	}
+
+	return X11_MODE_NONE;
+}
+
+/*
+ * test if the local node is one of the nodes the display is exported to
+ */
+static int _x11_node_selected (spank_t sp,uint32_t nodeid,uint32_t nnodes)
+{
+	int i;
+	int found = 0;
+	char nodename[256];
+	hostlist_t hlist;
+
+	switch ( x11_mode ) {
+	case X11_MODE_FIRST :
+		return ( nodeid == 0 );
+	case X11_MODE_LAST :
+		return ( nodeid == (nnodes - 1) );
+	case X11_MODE_ALL :
+		return 1;
+	case X11_MODE_RANKS :
+		for ( i = 0 ; i < x11_nranges ; i++ ) {
+			if ( nodeid >= x11_ranges[i].lo &&
+			     nodeid <= x11_ranges[i].hi )
+				return 1;
+		}
+		return 0;
+	case X11_MODE_EVERY :
+		return ( nodeid % x11_stride == 0 );
+	case X11_MODE_HOSTS :
+		if ( spank_getenv(sp,"SLURMD_NODENAME",nodename,256)
+		     != ESPANK_SUCCESS && 
+		     gethostname(nodename,256) != 0 )
+			return 0;
+		nodename[255] = '\0';
+		hlist = slurm_hostlist_create(x11_hosts);
+		if ( hlist == NULL )
+			return 0;
+		found = ( slurm_hostlist_find(hlist,nodename) >= 0 );
+		slurm_hostlist_destroy(hlist);
+		return found;
+	default :
+		return 0;
+	}
+}
+
+static int _x11_host_cmp(const void* a,const void* b)
+{
+	return strcmp(*(char* const*) a,*(char* const*) b);
+}
+
+/*
+ * resolve the nodes of a nodelist the display must be exported to, 
+ * walking the list once and stopping after its last selected entry
+ *
+ * return the number of hosts stored in the allocated *hosts array 
+ * or -1 on error
+ */
+static int _x11_select_hosts (char* nodes,char*** hosts)
+{
+	hostlist_t hlist;
+	hostlist_t tlist = NULL;
+	char* host;
+	char** sel = NULL;
+	char** targets = NULL;
+	int n, nsel = 0, maxsel = 0, ntargets = 0;
+	int i, j;
+	uint32_t idx, hi;
+
+	hlist = slurm_hostlist_create(nodes);
+	if ( hlist == NULL ) {
+		ERROR("x11: unable to parse nodelist %s",nodes);
+		return -1;
+	}
+	n = slurm_hostlist_count(hlist);
+
+	/* compute an upper bound of the selected hosts count */
+	switch ( x11_mode ) {
+	case X11_MODE_FIRST :
+	case X11_MODE_LAST :
+		maxsel = 1;
+		break;
+	case X11_MODE_ALL :
+		maxsel = n;
+		break;
+	case X11_MODE_RANKS :
+		for ( i = 0 ; i < x11_nranges && maxsel < n ; i++ ) {
+			if ( x11_ranges[i].lo < (uint32_t) n ) {
+				hi = ( x11_ranges[i].hi < (uint32_t) n ) ?
+					x11_ranges[i].hi : (uint32_t) n - 1 ;
+				maxsel += hi - x11_ranges[i].lo + 1;
+			}
+		}
+		break;
+	case X11_MODE_EVERY :
+		maxsel = ( n + x11_stride - 1 ) / x11_stride;
+		break;
+	case X11_MODE_HOSTS :
+		tlist = slurm_hostlist_create(x11_hosts);
+		if ( tlist == NULL ) {
+			ERROR("x11: unable to parse hostlist %s",x11_hosts);
+			slurm_hostlist_destroy(hlist);
+			return -1;
+		}
+		maxsel = slurm_hostlist_count(tlist);
+		break;
+	default :
+		break;
+	}
+
+	if ( n > 0 && maxsel > 0 ) {
+		sel = (char**) malloc(maxsel*sizeof(char*));
+		if ( x11_mode == X11_MODE_HOSTS )
+			targets = (char**) malloc(maxsel*sizeof(char*));
+		if ( sel == NULL || 
+		     ( x11_mode == X11_MODE_HOSTS && targets == NULL ) ) {
+			ERROR("x11: unable to allocate hosts list");
+			free(sel);
+			free(targets);
+			if ( x11_mode == X11_MODE_HOSTS )
+				slurm_hostlist_destroy(tlist);
+			slurm_hostlist_destroy(hlist);
+			return -1;
+		}
+	}
+	else
+		maxsel = 0;
+
+	/* walk the list once, only keeping the selected entries, the 
+	 * ranges being sorted and merged by _x11_parse_target */
+	switch ( maxsel > 0 ? x11_mode : X11_MODE_NONE ) {
+	case X11_MODE_FIRST :
+	case X11_MODE_LAST :
+	case X11_MODE_ALL :
+	case X11_MODE_RANKS :
+	case X11_MODE_EVERY :
+		i = 0;
+		idx = 0;
+		while ( nsel < maxsel &&
+			( host = slurm_hostlist_shift(hlist) ) != NULL ) {
+			if ( x11_mode == X11_MODE_RANKS ) {
+				while ( i < x11_nranges && 
+					x11_ranges[i].hi < idx )
+					i++;
+				if ( i == x11_nranges )
+					maxsel = nsel;
+			}
+			if ( ( x11_mode == X11_MODE_FIRST && idx == 0 ) ||
+			     ( x11_mode == X11_MODE_LAST && 
+			       idx == (uint32_t) n - 1 ) ||
+			     x11_mode == X11_MODE_ALL ||
+			     ( x11_mode == X11_MODE_RANKS && i < x11_nranges &&
+			       idx >= x11_ranges[i].lo ) ||
+			     ( x11_mode == X11_MODE_EVERY && 
+			       idx % x11_stride == 0 ) )
+				sel[nsel++] = host;
+			else
+				free(host);
+			idx++;
+		}
+		break;
+	case X11_MODE_HOSTS :
+		/* sort the targeted hosts, dropping the duplicates, and
+		 * keep the entries of the list found among them */
+		while ( ntargets < maxsel && 
+			( host = slurm_hostlist_shift(tlist) ) != NULL )
+			targets[ntargets++] = host;
+		qsort(targets,ntargets,sizeof(char*),_x11_host_cmp);
+		for ( i = 1, j = 0 ; i < ntargets ; i++ ) {
+			if ( strcmp(targets[i],targets[j]) == 0 )
+				free(targets[i]);
+			else
+				targets[++j] = targets[i];
+		}
+		if ( ntargets > 0 )
+			ntargets = j + 1;
+		while ( nsel < ntargets &&
+			( host = slurm_hostlist_shift(hlist) ) != NULL ) {
+			if ( bsearch(&host,targets,ntargets,sizeof(char*),
+				     _x11_host_cmp) != NULL )
+				sel[nsel++] = host;
+			else
+				free(host);
+		}
+		for ( i = 0 ; i < ntargets ; i++ )
+			free(targets[i]);
+		free(targets);
+		break;
+	default :
+		break;
+	}
+	if ( x11_mode == X11_MODE_HOSTS )
+		slurm_hostlist_destroy(tlist);
+	slurm_hostlist_destroy(hlist);
+
+	*hosts = sel;
+	return nsel;
+}
+
 static int _x11_opt_process (int val, const char *optarg, int remote)
 {
 	if (optarg == NULL) {
@@ -559,6 +1748,9 @@ static int _x11_opt_process (int val, const char *optarg, int remote)
 	else if ( strncmp(optarg,"batch",5)==0 ) {
 		x11_mode = X11_MODE_BATCH;
 	}
+	else {
+		x11_mode = _x11_parse_target(optarg);
+	}
 
 	if ( x11_mode == X11_MODE_NONE ) {
 		ERROR ("Bad value for --x11: %s", optarg);
@@ -568,87 +1760,973 @@ static int _x11_opt_process (int val, const char *optarg, int remote)
 	return (0);
 }
 
-int _connect_node (char* node,uint32_t jobid,uint32_t stepid)
+/*
+ * report of the tunnels established in the background: srun listens on
+ * an ephemeral TCP port exported with a random token in the environment
+ * of the step, each node waiting for its tunnel sending "token node" and
+ * getting "0" once srun is done with its tunnel or "1" if it failed, so
+ * that the tasks of a failed node stop waiting at once. The port is only
+ * bound to the address nodes reach srun on for the I/O of the step,
+ * SLURM_SRUN_COMM_HOST if srun runs in a step of the same host, the
+ * address of its hostname otherwise, which is exported with the port.
+ */
+#define X11_STATUS_PENDING 0
+#define X11_STATUS_OK      1
+#define X11_STATUS_FAILED  2
+
+#define X11_STATUS_CONNECT_TIMEOUT 2000
+
+struct x11_status_client {
+	int    fd;
+	int    host;
+	size_t len;
+	char   line[320];
+};
+
+struct x11_status_state {
+	pthread_mutex_t lock;
+	int    fd;
+	int    wake[2];
+	char   token[33];
+	char** hosts;
+	char*  states;
+	int    nhosts;
+};
+
+static struct x11_status_state x11_status = {
+	PTHREAD_MUTEX_INITIALIZER, -1, { -1, -1 }, "", NULL, NULL, 0
+};
+
+/*
+ * bind a listening socket to the first address of host that is not a
+ * loopback one on an ephemeral port, setting the numeric address and
+ * the port. Return the socket or -1.
+ */
+static int _x11_status_bind(const char* host,char* addr,size_t size,
+			    int* port)
 {
-	int status = -1;
-	
-	FILE* f;
-	char display[256];
-	char* expc_pattern= X11_LIBEXEC_PROG " -t %s -i %u.%u -cgw -s \"%s\" -o \"%s\" 2>/dev/null %s &";
+	struct addrinfo hints;
+	struct addrinfo* res;
+	struct addrinfo* ai;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	char serv[16];
+	int fd = -1;
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( host == NULL || getaddrinfo(host,NULL,&hints,&res) != 0 )
+		return -1;
+	for ( ai = res ; ai != NULL ; ai = ai->ai_next ) {
+		if ( ( ai->ai_family == AF_INET &&
+		       ( ntohl(((struct sockaddr_in*) ai->ai_addr)->
+			       sin_addr.s_addr) >> 24 ) == IN_LOOPBACKNET ) ||
+		     ( ai->ai_family == AF_INET6 &&
+		       IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*)
+					      ai->ai_addr)->sin6_addr) ) )
+			continue;
+		fd = socket(ai->ai_family,SOCK_STREAM|SOCK_NONBLOCK|
+			    SOCK_CLOEXEC,0);
+		if ( fd == -1 )
+			continue;
+		len = sizeof(ss);
+		if ( bind(fd,ai->ai_addr,ai->ai_addrlen) == 0 &&
+		     getsockname(fd,(struct sockaddr*) &ss,&len) == 0 &&
+		     getnameinfo((struct sockaddr*) &ss,len,addr,size,serv,
+				 sizeof(serv),NI_NUMERICHOST|
+				 NI_NUMERICSERV) == 0 ) {
+			*port = atoi(serv);
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/*
+ * open the listening socket of the reports and export its port
+ */
+static int _x11_status_listen(spank_t sp)
+{
+	unsigned char rnd[16];
+	char value[128];
+	char host[256];
+	char addr[64];
+	int fd;
+	int port;
+	int i;
+
+	fd = open("/dev/urandom",O_RDONLY|O_CLOEXEC);
+	if ( fd == -1 )
+		return -1;
+	i = read(fd,rnd,sizeof(rnd));
+	close(fd);
+	if ( i != (int) sizeof(rnd) )
+		return -1;
+	for ( i = 0 ; i < (int) sizeof(rnd) ; i++ )
+		snprintf(x11_status.token + 2 * i,3,"%02x",rnd[i]);
+
+	/* the comm host of an outer step only applies on its own host */
+	fd = _x11_status_bind(getenv("SLURM_SRUN_COMM_HOST"),addr,
+			      sizeof(addr),&port);
+	if ( fd == -1 && gethostname(host,sizeof(host)) == 0 ) {
+		host[sizeof(host)-1] = '\0';
+		fd = _x11_status_bind(host,addr,sizeof(addr),&port);
+	}
+	if ( fd == -1 )
+		return -1;
+
+	/* the progress of the tunnels wakes the reporting thread up */
+	snprintf(value,sizeof(value),"%d %s %s",port,x11_status.token,addr);
+	if ( listen(fd,SOMAXCONN) ||
+	     pipe2(x11_status.wake,O_CLOEXEC|O_NONBLOCK) ||
+	     spank_setenv(sp,SPANK_X11_STATUS_ENVVAR,value,1) 
+	     != ESPANK_SUCCESS ) {
+		if ( x11_status.wake[0] != -1 ) {
+			close(x11_status.wake[0]);
+			close(x11_status.wake[1]);
+			x11_status.wake[0] = x11_status.wake[1] = -1;
+		}
+		close(fd);
+		return -1;
+	}
+	x11_status.fd = fd;
+
+	return 0;
+}
+
+static int _x11_status_find(const char* host)
+{
+	char** p;
+
+	p = (char**) bsearch(&host,x11_status.hosts,x11_status.nhosts,
+			     sizeof(char*),_x11_host_cmp);
+
+	return ( p == NULL ) ? -1 : p - x11_status.hosts ;
+}
+
+/*
+ * record the copy of the selected hosts, before they are split in trees
+ */
+static void _x11_status_init(char** hosts,int nhosts)
+{
+	int i;
+
+	if ( x11_status.fd == -1 )
+		return;
+
+	x11_status.hosts = (char**) calloc(nhosts,sizeof(char*));
+	x11_status.states = (char*) calloc(nhosts,sizeof(char));
+	if ( x11_status.hosts == NULL || x11_status.states == NULL ) {
+		free(x11_status.hosts);
+		free(x11_status.states);
+		x11_status.hosts = NULL;
+		x11_status.states = NULL;
+		return;
+	}
+	for ( i = 0 ; i < nhosts ; i++ ) {
+		x11_status.hosts[i] = strdup(hosts[i]);
+		if ( x11_status.hosts[i] == NULL )
+			break;
+	}
+	x11_status.nhosts = i;
+	qsort(x11_status.hosts,x11_status.nhosts,sizeof(char*),
+	      _x11_host_cmp);
+}
+
+/*
+ * record the state of the tunnel of a node and of the nodes it relays
+ */
+static void _x11_status_set(char* host,char* tree,int state)
+{
+	char* p;
+	char* q;
+	int i;
+
+	if ( x11_status.nhosts == 0 )
+		return;
+
+	pthread_mutex_lock(&x11_status.lock);
+	i = _x11_status_find(host);
+	if ( i >= 0 )
+		x11_status.states[i] = state;
+	for ( p = tree ; p != NULL && *p != '\0' ; p = q ) {
+		q = strchr(p,',');
+		if ( q != NULL )
+			*q = '\0';
+		i = _x11_status_find(p);
+		if ( i >= 0 )
+			x11_status.states[i] = state;
+		if ( q != NULL )
+			*q++ = ',';
+	}
+	pthread_mutex_unlock(&x11_status.lock);
+
+	/* a full pipe already wakes the thread up */
+	if ( write(x11_status.wake[1],"",1) == -1 && errno != EAGAIN )
+		ERROR("x11: unable to wake tunnels report up : %s",
+		      strerror(errno));
+}
+
+/*
+ * answer the nodes waiting for their tunnel, holding the ones whose
+ * tunnel is still in progress, the thread sleeping until a node connects
+ * or sends its request or until the state of a tunnel changes
+ */
+static void* _x11_status_run(void* arg)
+{
+	struct x11_status_state* st = (struct x11_status_state*) arg;
+	struct x11_status_client* clients = NULL;
+	struct x11_status_client* c;
+	struct pollfd* pfds = NULL;
+	void* p;
+	char* token;
+	char* host;
+	char* save;
+	char line[64];
+	int nclients = 0;
+	int state;
+	int fd;
+	int i, n;
+	ssize_t rc;
+
+	while ( 1 ) {
+		p = realloc(pfds,(nclients + 2) * sizeof(struct pollfd));
+		if ( p == NULL )
+			break;
+		pfds = (struct pollfd*) p;
+		pfds[0].fd = st->fd;
+		pfds[1].fd = st->wake[0];
+		for ( i = 0 ; i < nclients ; i++ )
+			pfds[i+2].fd = clients[i].fd;
+		for ( i = 0 ; i < nclients + 2 ; i++ ) {
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+		}
+		if ( poll(pfds,nclients + 2,-1) == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+
+		/* the states are read below, whatever the number of changes */
+		if ( pfds[1].revents & POLLIN )
+			while ( read(st->wake[0],line,sizeof(line)) > 0 )
+				;
+
+		/* read the requests, answering the resolved nodes */
+		for ( i = 0, n = 0 ; i < nclients ; i++ ) {
+			c = &clients[i];
+			if ( c->host == -1 && pfds[i+2].revents != 0 ) {
+				rc = read(c->fd,c->line + c->len,
+					  sizeof(c->line) - 1 - c->len);
+				if ( rc <= 0 ) {
+					close(c->fd);
+					continue;
+				}
+				c->len += rc;
+				c->line[c->len] = '\0';
+				if ( strchr(c->line,'\n') == NULL &&
+				     c->len < sizeof(c->line) - 1 ) {
+					clients[n++] = *c;
+					continue;
+				}
+				token = strtok_r(c->line," \n",&save);
+				host = strtok_r(NULL," \n",&save);
+				if ( token == NULL || host == NULL ||
+				     strcmp(token,st->token) != 0 ) {
+					close(c->fd);
+					continue;
+				}
+				c->host = _x11_status_find(host);
+				if ( c->host == -1 ) {
+					rc = send(c->fd,"1\n",2,
+						  MSG_NOSIGNAL);
+					close(c->fd);
+					continue;
+				}
+			}
+			else if ( c->host >= 0 && pfds[i+2].revents != 0 ) {
+				/* the node stopped waiting */
+				close(c->fd);
+				continue;
+			}
+			if ( c->host >= 0 ) {
+				pthread_mutex_lock(&st->lock);
+				state = st->states[c->host];
+				pthread_mutex_unlock(&st->lock);
+				if ( state != X11_STATUS_PENDING ) {
+					rc = send(c->fd,( state == 
+							  X11_STATUS_OK ) ?
+						  "0\n" : "1\n",2,
+						  MSG_NOSIGNAL);
+					close(c->fd);
+					continue;
+				}
+			}
+			clients[n++] = *c;
+		}
+		nclients = n;
+
+		/* accept the new nodes */
+		if ( ! ( pfds[0].revents & POLLIN ) )
+			continue;
+		while ( ( fd = accept4(st->fd,NULL,NULL,
+				       SOCK_NONBLOCK|SOCK_CLOEXEC) ) != -1 ) {
+			p = realloc(clients,(nclients + 1) *
+				    sizeof(struct x11_status_client));
+			if ( p == NULL ) {
+				close(fd);
+				break;
+			}
+			clients = (struct x11_status_client*) p;
+			clients[nclients].fd = fd;
+			clients[nclients].host = -1;
+			clients[nclients].len = 0;
+			nclients++;
+		}
+	}
+
+	ERROR("x11: tunnels report failed : %s",strerror(errno));
+	for ( i = 0 ; i < nclients ; i++ )
+		close(clients[i].fd);
+	free(clients);
+	free(pfds);
+
+	return NULL;
+}
+
+/*
+ * answer the nodes in the background for the lifetime of srun
+ */
+static void _x11_status_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if ( x11_status.nhosts == 0 || pthread_attr_init(&attr) )
+		return;
+	pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+	if ( pthread_create(&thread,&attr,_x11_status_run,
+			   &x11_status) )
+		ERROR("x11: unable to report tunnels to the nodes");
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * ask srun for the state of the tunnel of the local node, return the 
+ * connected socket that becomes readable when the answer is available,
+ * -1 if tunnels are not reported
+ */
+static int _x11_status_connect(spank_t sp)
+{
+	struct addrinfo hints;
+	struct addrinfo* res;
+	struct addrinfo* ai;
+	struct pollfd pfd;
+	socklen_t len;
+	char value[128];
+	char host[256];
+	char nodename[256];
+	char port[16];
+	char token[64];
+	char line[320];
+	int fd = -1;
+	int err;
+	int n;
+
+	/* srun only listens on the address it exports, if any */
+	if ( spank_getenv(sp,SPANK_X11_STATUS_ENVVAR,value,128) 
+	     != ESPANK_SUCCESS )
+		return -1;
+	n = sscanf(value,"%15s %63s %255s",port,token,host);
+	if ( n < 2 || ( n == 2 &&
+			spank_getenv(sp,"SLURM_SRUN_COMM_HOST",host,256)
+			!= ESPANK_SUCCESS ) )
+		return -1;
+	if ( spank_getenv(sp,"SLURMD_NODENAME",nodename,256) 
+	     != ESPANK_SUCCESS && gethostname(nodename,256) != 0 )
+		return -1;
+	nodename[255] = '\0';
+	n = snprintf(line,sizeof(line),"%s %s\n",token,nodename);
+	if ( n < 0 || (size_t) n >= sizeof(line) )
+		return -1;
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo(host,port,&hints,&res) != 0 )
+		return -1;
+	for ( ai = res ; ai != NULL ; ai = ai->ai_next ) {
+		fd = socket(ai->ai_family,ai->ai_socktype|SOCK_NONBLOCK|
+			    SOCK_CLOEXEC,ai->ai_protocol);
+		if ( fd == -1 )
+			continue;
+		if ( connect(fd,ai->ai_addr,ai->ai_addrlen) == 0 )
+			break;
+		if ( errno == EINPROGRESS ) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			len = sizeof(err);
+			if ( poll(&pfd,1,X11_STATUS_CONNECT_TIMEOUT) == 1 &&
+			     getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len) == 0 &&
+			     err == 0 )
+				break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if ( fd != -1 && send(fd,line,n,MSG_NOSIGNAL) != n ) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+/*
+ * state of a tunnel helper launched by the fan-out engine
+ */
+struct x11_conn {
+	char*  host;
+	char*  tree;
+	FILE*  f;
+	size_t len;
+	char   display[256];
+	int    relayed;
+	time_t expire;
+	uint64_t start;
+	uint64_t stats_start;
+};
+
+/*
+ * launch the helper task responsible for the tunnel to a node without
+ * waiting for it to report the associated DISPLAY
+ */
+FILE* _connect_node_start (char* node,char* tree,
+			   uint32_t jobid,uint32_t stepid)
+{
+	FILE* f = NULL;
+	char* expc_pattern= X11_LIBEXEC_PROG " -t %s -i %s -cgw%s -s \"%s\" -o \"%s\" -m %d%s%s%s%s%s%s%s%s%s%s -W %d 2>/dev/null %s &";
 	char* expc_cmd;
 	size_t expc_length;
+	char refid[64];
+	const char* tdir = x11_trace_dir();
+	const char* mfile = x11_stats_file();
+	uint64_t start = x11_trace_now();
 	
+	_x11_refid(refid,64,jobid,stepid);
 	expc_length = strlen(expc_pattern) + strlen(node) + 128 +
+		( ( tree == NULL ) ? 0 : strlen(tree) ) +
+		( ( tdir == NULL ) ? 0 : strlen(tdir) ) +
+		( ( mfile == NULL ) ? 0 : strlen(mfile) ) +
 		strlen((ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd)  +
 		strlen((ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args) +
 		strlen((helpertask_args == NULL) ?
 		       DEFAULT_HELPERTASK_ARGS : helpertask_args) ;
 	expc_cmd = (char*) malloc(expc_length*sizeof(char));
 	if ( expc_cmd != NULL ) {
-		snprintf(expc_cmd,expc_length,expc_pattern,node,jobid,stepid,
+		snprintf(expc_cmd,expc_length,expc_pattern,node,refid,
+			 (tunnel_scope == X11_SCOPE_JOB) ? " -k" : "",
 			 (ssh_cmd == NULL) ? DEFAULT_SSH_CMD : ssh_cmd,
 			 (ssh_args == NULL) ? DEFAULT_SSH_ARGS : ssh_args,
+			 MUX_PERSIST,
+			 ( tree == NULL ) ? "" : ( X11_RELAY ? " -R " : " -T " ),
+			 ( tree == NULL ) ? "" : tree,
+			 ( tree == NULL || ! X11_RELAY || ! RELAY_COMPRESS ) ?
+			 "" : ( RELAY_IMAGES ? " -z -I" : " -z" ),
+			 RELAY_CACHE ? " -C" : "",
+			 ( tdir == NULL ) ? "" : " -P \"",
+			 ( tdir == NULL ) ? "" : tdir,
+			 ( tdir == NULL ) ? "" : "\"",
+			 ( mfile == NULL ) ? "" : " -M \"",
+			 ( mfile == NULL ) ? "" : mfile,
+			 ( mfile == NULL ) ? "" : "\"",
+			 FANOUT_TREE,
 			 (helpertask_args == NULL) ? 
 			 DEFAULT_HELPERTASK_ARGS : helpertask_args );
 		INFO("x11: interactive mode : executing %s",expc_cmd);		
 		f = popen(expc_cmd,"r");
-		if ( fscanf(f,"%255s",display) != 1 )
-			ERROR("x11: unable to connect node %s",node);
-		else {
-			INFO("x11: DISPLAY=%s on node %s",display,node);
-			status = 0;
-		}
-		pclose(f);
+		if ( f == NULL )
+			ERROR("x11: unable to exec connect cmd '%s'",expc_cmd);
 		free(expc_cmd);
 	}
+	x11_trace_span("connect_node_start",start,"node",node);
 	
-	return status;
+	return f;
 }
 
-int _x11_connect_nodes (char* nodes,uint32_t jobid,uint32_t stepid)
+/*
+ * read what the helper task has written so far, return 1 when the
+ * DISPLAY value is complete (or will never be), 0 otherwise
+ */
+int _connect_node_read (struct x11_conn* conn)
 {
-	char* host;
-	hostlist_t hlist;
-	int n=0;
-	int i;
-	
-	/* count allocated nodes... */
-	hlist = slurm_hostlist_create(nodes);
-	n=-1;
+	ssize_t rc;
+	size_t  left = sizeof(conn->display) - 1 - conn->len;
+
 	do {
-		n++;
-		host = slurm_hostlist_shift(hlist);
+		rc = read(fileno(conn->f),conn->display + conn->len,left);
 	}
-	while ( host != NULL ) ;
-	slurm_hostlist_destroy(hlist);
-	
-	/* do the export stuff */
-	hlist = slurm_hostlist_create(nodes);
-	for (i=0; i < n; i++ ) {
-		host = slurm_hostlist_shift(hlist);
-		switch ( x11_mode ) {
-			
-		case X11_MODE_FIRST :
-			if ( i == 0 ) {
-				_connect_node(host,jobid,stepid);
+	while ( rc == -1 && errno == EINTR );
+
+	if ( rc > 0 ) {
+		conn->len += rc;
+		conn->display[conn->len] = '\0';
+		if ( strchr(conn->display,'\n') == NULL && 
+		     conn->len < sizeof(conn->display) - 1 )
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * collect the DISPLAY value reported by the helper task and release it
+ */
+int _connect_node_end (struct x11_conn* conn)
+{
+	int status = -1;
+	int failed = 1;
+	char display[256];
+
+	/* relaying nodes also tell if all the relayed nodes are connected */
+	conn->display[conn->len] = '\0';
+	if ( sscanf(conn->display,"%255s %d",display,&failed) < 1 )
+		ERROR("x11: unable to connect node %s",conn->host);
+	else {
+		conn->relayed = ( conn->tree != NULL && failed == 0 );
+		INFO("x11: DISPLAY=%s on node %s",display,conn->host);
+		x11_stats_observe(X11_STATS_NODE_SETUP,conn->stats_start);
+		status = 0;
+	}
+	x11_trace_span("connect_node",conn->start,"node",conn->host);
+	pclose(conn->f);
+	conn->f = NULL;
+	conn->len = 0;
+
+	return status;
+}
+
+/*
+ * milliseconds left until a monotonic deadline, 0 if it passed
+ */
+static int _x11_ms_left(struct timespec* deadline)
+{
+	struct timespec now;
+	long long ms;
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	ms = ( deadline->tv_sec - now.tv_sec ) * 1000LL +
+		( deadline->tv_nsec - now.tv_nsec ) / 1000000;
+
+	return ( ms < 0 ) ? 0 : ( ms > INT_MAX ) ? INT_MAX : (int) ms ;
+}
+
+/*
+ * register the nodes relayed by a node as reachable through its job 
+ * scoped tunnel, for the following steps of the job
+ */
+static void _x11_link_tree(char* host,char* tree,uint32_t jobid,
+			   uint32_t stepid)
+{
+	char refid[64];
+	char* p;
+	char* q;
+
+	_x11_refid(refid,64,jobid,stepid);
+	for ( p = tree ; p != NULL && *p != '\0' ; p = q ) {
+		q = strchr(p,',');
+		if ( q != NULL )
+			*q = '\0';
+		if ( link_tunnel_ref(refid,p,host) )
+			ERROR("x11: unable to register job tunnel to node %s "
+			      "through %s",p,host);
+		if ( q != NULL )
+			*q++ = ',';
+	}
+}
+
+/*
+ * connect a set of nodes, keeping at most fanout_max helper tasks in 
+ * flight and collecting their DISPLAY values as soon as they are
+ * available. If trees is not NULL, each node relays the tunnels to the
+ * associated nodes. The nodes that do not report their DISPLAY within
+ * X11_CONNECT_TIMEOUT seconds are abandoned. Return the number of nodes
+ * that could not be connected.
+ */
+int _x11_fanout (char** hosts,char** trees,int nhosts,
+		 uint32_t jobid,uint32_t stepid)
+{
+	struct x11_conn* conns;
+	struct pollfd* pfds;
+	int width;
+	int max;
+	int next = 0;
+	int inflight = 0;
+	int failed = 0;
+	int reported = 1;
+	int i, rc;
+	int timeout;
+	struct timespec now, deadline, expire;
+
+	if ( nhosts <= 0 )
+		return 0;
+
+	/* report the nodes whose tasks stopped waiting for their tunnel */
+	if ( x11_async && SETUP_TIMEOUT > 0 ) {
+		clock_gettime(CLOCK_MONOTONIC,&deadline);
+		deadline.tv_sec += SETUP_TIMEOUT;
+		reported = 0;
+	}
+
+	width = nhosts;
+	max = (fanout_max < 0) ? DEFAULT_FANOUT_MAX : fanout_max ;
+	if ( max > 0 && max < nhosts )
+		width = max;
+
+	conns = (struct x11_conn*) calloc(width,sizeof(struct x11_conn));
+	pfds = (struct pollfd*) calloc(width,sizeof(struct pollfd));
+	if ( conns == NULL || pfds == NULL ) {
+		ERROR("x11: unable to allocate fan-out structures");
+		free(conns);
+		free(pfds);
+		return nhosts;
+	}
+
+	do {
+		/* fill the free slots with pending nodes */
+		for ( i = 0 ; i < width && next < nhosts ; i++ ) {
+			if ( conns[i].f != NULL )
+				continue;
+			conns[i].host = hosts[next];
+			conns[i].tree = ( trees != NULL ) ? trees[next] : NULL ;
+			next++;
+			conns[i].len = 0;
+			conns[i].relayed = 0;
+			clock_gettime(CLOCK_MONOTONIC,&now);
+			conns[i].expire = now.tv_sec + X11_CONNECT_TIMEOUT;
+			conns[i].start = x11_trace_now();
+			conns[i].stats_start = x11_stats_now();
+			x11_stats_count(X11_STATS_SETUPS,1);
+			conns[i].f = _connect_node_start(conns[i].host,
+							 conns[i].tree,
+							 jobid,stepid);
+			if ( conns[i].f == NULL ) {
+				_x11_status_set(conns[i].host,conns[i].tree,
+						X11_STATUS_FAILED);
+				failed++;
 			}
-			break;
+			else
+				inflight++;
+		}
 
-		case X11_MODE_LAST :
-			if ( i == (n - 1) ) {
-				_connect_node(host,jobid,stepid);
+		if ( inflight == 0 )
+			continue;
+
+		/* wait for helper tasks output, until the setup deadline or
+		 * the first node to abandon */
+		timeout = INT_MAX;
+		for ( i = 0 ; i < width ; i++ ) {
+			pfds[i].fd = ( conns[i].f != NULL ) ?
+				fileno(conns[i].f) : -1 ;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+			if ( conns[i].f == NULL )
+				continue;
+			expire.tv_sec = conns[i].expire;
+			expire.tv_nsec = 0;
+			rc = _x11_ms_left(&expire);
+			if ( rc < timeout )
+				timeout = rc;
+		}
+		if ( ! reported ) {
+			rc = _x11_ms_left(&deadline);
+			if ( rc == 0 ) {
+				ERROR("x11: %d node(s) not connected "
+				      "after %d s, their tasks run without "
+				      "DISPLAY",inflight + nhosts - next,
+				      SETUP_TIMEOUT);
+				reported = 1;
 			}
-			break;
-			
-		case X11_MODE_ALL :
-			_connect_node(host,jobid,stepid);
-			break;
-			
-		default :
+			else if ( rc < timeout )
+				timeout = rc;
+		}
+		rc = poll(pfds,width,timeout);
+		if ( rc == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			ERROR("x11: fan-out poll failed : %s",strerror(errno));
 			break;
 		}
+
+		/* collect completed DISPLAY values */
+		for ( i = 0 ; i < width ; i++ ) {
+			if ( conns[i].f == NULL || pfds[i].revents == 0 )
+				continue;
+			if ( _connect_node_read(&conns[i]) == 0 )
+				continue;
+			rc = _connect_node_end(&conns[i]);
+			_x11_status_set(conns[i].host,conns[i].tree,
+					( rc == 0 ) ? X11_STATUS_OK :
+					X11_STATUS_FAILED);
+			if ( rc == 0 && conns[i].relayed &&
+			     tunnel_scope == X11_SCOPE_JOB )
+				_x11_link_tree(conns[i].host,conns[i].tree,
+					       jobid,stepid);
+			if ( rc != 0 )
+				failed++;
+			inflight--;
+		}
+
+		/* abandon the nodes whose helper task is stuck, the helper
+		 * getting SIGPIPE if it ever reports */
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		for ( i = 0 ; i < width ; i++ ) {
+			if ( conns[i].f == NULL || now.tv_sec < conns[i].expire )
+				continue;
+			ERROR("x11: node %s not connected after %d s, "
+			      "abandoned",conns[i].host,X11_CONNECT_TIMEOUT);
+			x11_trace_span("connect_node",conns[i].start,"node",
+				       conns[i].host);
+			pclose(conns[i].f);
+			conns[i].f = NULL;
+			_x11_status_set(conns[i].host,conns[i].tree,
+					X11_STATUS_FAILED);
+			failed++;
+			inflight--;
+		}
+	}
+	while ( inflight > 0 || next < nhosts ) ;
+
+	/* only reached on poll failure */
+	for ( i = 0 ; i < width ; i++ ) {
+		if ( conns[i].f != NULL ) {
+			pclose(conns[i].f);
+			_x11_status_set(conns[i].host,conns[i].tree,
+					X11_STATUS_FAILED);
+			failed++;
+		}
+	}
+
+	free(pfds);
+	free(conns);
+
+	return failed;
+}
+
+/*
+ * split the selected hosts in up to width subtrees, keeping the head of
+ * each subtree in hosts and building the comma separated list of the
+ * rest of the subtree in trees. Return the number of subtrees.
+ */
+int _x11_split_tree (char** hosts,int nhosts,int width,char*** trees)
+{
+	char** t;
+	int chunk;
+	int n = 0;
+	int i, j, k;
+	size_t len, off;
+
+	t = (char**) calloc(width,sizeof(char*));
+	if ( t == NULL )
+		return -1;
+
+	chunk = ( nhosts + width - 1 ) / width;
+
+	/* build the lists of the subtrees */
+	for ( i = 0 ; i < nhosts ; i += chunk, n++ ) {
+		k = ( i + chunk < nhosts ) ? chunk : nhosts - i ;
+		if ( k == 1 )
+			continue;
+		/* one separator or terminating byte per host */
+		for ( len = 0, j = i + 1 ; j < i + k ; j++ )
+			len += strlen(hosts[j]) + 1;
+		t[n] = (char*) malloc(len + 1);
+		if ( t[n] == NULL ) {
+			for ( j = 0 ; j < n ; j++ )
+				free(t[j]);
+			free(t);
+			return -1;
+		}
+		for ( off = 0, j = i + 1 ; j < i + k ; j++ ) {
+			len = strlen(hosts[j]);
+			memcpy(t[n] + off,hosts[j],len);
+			off += len;
+			t[n][off++] = ',';
+		}
+		t[n][off - 1] = '\0';
 	}
-	slurm_hostlist_destroy(hlist);
+
+	/* only keep the heads in the hosts array */
+	for ( n = 0, i = 0 ; i < nhosts ; i += chunk ) {
+		k = ( i + chunk < nhosts ) ? chunk : nhosts - i ;
+		for ( j = i + 1 ; j < i + k ; j++ )
+			free(hosts[j]);
+		hosts[n++] = hosts[i];
+	}
+
+	*trees = t;
+	return n;
+}
+
+/*
+ * nodes to connect by the fan-out, run in the background when the 
+ * tasks wait for the tunnels
+ */
+struct x11_fanout_args {
+	char**   hosts;
+	char**   trees;
+	int      nhosts;
+	int      ntotal;
+	uint32_t jobid;
+	uint32_t stepid;
+};
+
+static void* _x11_fanout_run (void* arg)
+{
+	struct x11_fanout_args* args = (struct x11_fanout_args*) arg;
+	int failed;
+	int i;
+	uint64_t start;
+
+	/* do the export stuff */
+	start = x11_trace_now();
+	failed = _x11_fanout(args->hosts,args->trees,args->nhosts,
+			     args->jobid,args->stepid);
+	x11_trace_span("fanout",start,NULL,NULL);
+	x11_stats_count(X11_STATS_SETUP_FAILURES,failed);
+	if ( failed > 0 )
+		ERROR("x11: unable to connect %d of %d node(s)%s",failed,
+		      args->nhosts,
+		      ( args->trees != NULL ) ? " relaying tunnels" : "");
+	else if ( args->trees != NULL )
+		INFO("x11: %d node(s) connected through %d %s",args->ntotal,
+		     args->nhosts,X11_RELAY ? "tunnel" : "relay(s)");
+
+	for (i=0; i < args->nhosts; i++ ) {
+		free(args->hosts[i]);
+		if ( args->trees != NULL )
+			free(args->trees[i]);
+	}
+	free(args->hosts);
+	free(args->trees);
+	free(args);
+
+	if ( x11_async ) {
+		x11_trace_close();
+		x11_stats_observe(X11_STATS_STEP_SETUP,x11_setup_start);
+		x11_stats_close();
+	}
+
+	return NULL;
+}
+
+int _x11_connect_nodes (char* nodes,uint32_t jobid,uint32_t stepid)
+{
+	struct x11_fanout_args* args;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char** hosts;
+	char** trees = NULL;
+	int nhosts;
+	int ntotal;
+	int i, j;
+	char refid[64];
+	uint64_t start;
+
+	/* resolve the nodes to export the display to */
+	start = x11_trace_now();
+	nhosts = _x11_select_hosts(nodes,&hosts);
+	x11_trace_span("select_hosts",start,"nodes",nodes);
+	if ( nhosts < 0 )
+		return -1;
+	_x11_status_init(hosts,nhosts);
+
+	/* reuse the tunnels already established by a previous step, each
+	 * node being checked on its own before being excluded, the nodes 
+	 * reached through the tunnel of another one included */
+	if ( tunnel_scope == X11_SCOPE_JOB ) {
+		_x11_refid(refid,64,jobid,stepid);
+		for ( i = 0, j = 0 ; i < nhosts ; i++ ) {
+			if ( check_tunnel_ref(refid,hosts[i]) == 0 ) {
+				INFO("x11: reusing job tunnel to node %s",
+				     hosts[i]);
+				_x11_status_set(hosts[i],NULL,X11_STATUS_OK);
+				free(hosts[i]);
+			}
+			else
+				hosts[j++] = hosts[i];
+		}
+		nhosts = j;
+	}
+	ntotal = nhosts;
+
+	/* only connect the heads of the subtrees in tree mode */
+	if ( ! X11_RELAY && FANOUT_TREE > 0 && nhosts > FANOUT_TREE ) {
+		i = _x11_split_tree(hosts,nhosts,FANOUT_TREE,&trees);
+		if ( i < 0 )
+			ERROR("x11: unable to build the tree of nodes, "
+			      "connecting all of them");
+		else
+			nhosts = i;
+	}
+
+	/* only connect the first node in relay mode, the other ones
+	 * being given access to its tunnel through a relay */
+	if ( X11_RELAY && nhosts > 1 ) {
+		i = _x11_split_tree(hosts,nhosts,1,&trees);
+		if ( i < 0 )
+			ERROR("x11: unable to build the list of relayed nodes, "
+			      "connecting all of them");
+		else {
+			ntotal = nhosts;
+			nhosts = i;
+		}
+	}
+	
+	args = (struct x11_fanout_args*) malloc(sizeof(*args));
+	if ( args == NULL ) {
+		ERROR("x11: unable to allocate fan-out structures");
+		for (i=0; i < nhosts; i++ ) {
+			free(hosts[i]);
+			if ( trees != NULL )
+				free(trees[i]);
+		}
+		free(hosts);
+		free(trees);
+		return -1;
+	}
+	args->hosts = hosts;
+	args->trees = trees;
+	args->nhosts = nhosts;
+	args->ntotal = ntotal;
+	args->jobid = jobid;
+	args->stepid = stepid;
+	_x11_status_start();
+
+	/* let srun launch the step while the tunnels are established, 
+	 * the tasks waiting for them up to the setup timeout */
+	if ( SETUP_TIMEOUT > 0 && pthread_attr_init(&attr) == 0 ) {
+		pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+		x11_async = 1;
+		if ( pthread_create(&thread,&attr,_x11_fanout_run,args) ) {
+			ERROR("x11: unable to establish tunnels in the "
+			      "background, waiting for them");
+			x11_async = 0;
+		}
+		pthread_attr_destroy(&attr);
+		if ( x11_async )
+			return 0;
+	}
+
+	_x11_fanout_run(args);
 
 	return 0;
 }
@@ -661,7 +2739,7 @@ _spank_x11_get_mode(spank_t sp, int ac, char *av[])
 	char* elt;
 	char* p;
         int fstatus;
-	char spank_x11_env[6];
+	char spank_x11_env[X11_TARGET_MAXLEN];
 
 	char* envval=NULL;
 
@@ -686,6 +2764,60 @@ _spank_x11_get_mode(spank_t sp, int ac, char *av[])
 				p++;
 			}
                 }
+                else if ( strncmp(elt,"fanout_max=",11) == 0 ) {
+                        fanout_max=atoi(elt+11);
+                }
+                else if ( strncmp(elt,"ssh_mux_persist=",16) == 0 ) {
+                        ssh_mux_persist=atoi(elt+16);
+                }
+                else if ( strncmp(elt,"fanout_tree=",12) == 0 ) {
+                        fanout_tree=atoi(elt+12);
+                }
+                else if ( strncmp(elt,"relay=",6) == 0 ) {
+			if ( strcmp(elt+6,"yes") == 0 )
+				x11_relay = 1;
+			else
+				x11_relay = 0;
+                }
+                else if ( strncmp(elt,"relay_compress=",15) == 0 ) {
+			if ( strcmp(elt+15,"yes") == 0 )
+				relay_compress = 1;
+			else
+				relay_compress = 0;
+                }
+                else if ( strncmp(elt,"relay_images=",13) == 0 ) {
+			if ( strcmp(elt+13,"yes") == 0 )
+				relay_images = 1;
+			else
+				relay_images = 0;
+                }
+                else if ( strncmp(elt,"relay_cache=",12) == 0 ) {
+			if ( strcmp(elt+12,"yes") == 0 )
+				relay_cache = 1;
+			else
+				relay_cache = 0;
+                }
+                else if ( strncmp(elt,"trace=",6) == 0 ) {
+                        trace_dir=strdup(elt+6);
+                }
+                else if ( strncmp(elt,"metrics=",8) == 0 ) {
+                        metrics_file=strdup(elt+8);
+                }
+                else if ( strncmp(elt,"setup_timeout=",14) == 0 ) {
+                        setup_timeout=atoi(elt+14);
+                }
+                else if ( strncmp(elt,"lazy=",5) == 0 ) {
+			if ( strcmp(elt+5,"yes") == 0 )
+				x11_lazy = 1;
+			else
+				x11_lazy = 0;
+                }
+                else if ( strncmp(elt,"tunnel_scope=",13) == 0 ) {
+			if ( strcmp(elt+13,"job") == 0 )
+				tunnel_scope = X11_SCOPE_JOB;
+			else
+				tunnel_scope = X11_SCOPE_STEP;
+                }
                 else if ( strncmp(elt,"helpertask_args=",16) == 0 ) {
                         helpertask_args=strdup(elt+16);
 			p = helpertask_args;
@@ -700,9 +2832,9 @@ _spank_x11_get_mode(spank_t sp, int ac, char *av[])
 	/* read env configuration variable */
 	if (spank_remote (sp)) {
 		fstatus = spank_getenv(sp,SPANK_X11_ENVVAR,
-				       spank_x11_env,6);
+				       spank_x11_env,X11_TARGET_MAXLEN);
 		if ( fstatus == 0 ) {
-			spank_x11_env[5]='\0';
+			spank_x11_env[X11_TARGET_MAXLEN-1]='\0';
 			envval=spank_x11_env;
 		}
 	}
@@ -725,7 +2857,7 @@ _spank_x11_get_mode(spank_t sp, int ac, char *av[])
 			return X11_MODE_BATCH ;
 		}
 		else
-			return X11_MODE_NONE ;
+			return _x11_parse_target(envval) ;
 	}
 	else {
                 /* no env variable defined, return command line */
@@ -0,0 +1,939 @@
+/***************************************************************************\
+ * slurm-spank-x11-proto.c - SLURM SPANK X11 relay protocol cache
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "slurm-spank-x11-proto.h"
+#include "slurm-spank-x11-image.h"
+
+/* core protocol opcodes handled by the cache */
+#define X11_INTERN_ATOM        16
+#define X11_GET_ATOM_NAME      17
+#define X11_GET_INPUT_FOCUS    43
+#define X11_QUERY_EXTENSION    98
+
+#define X11_ERROR              0
+#define X11_REPLY              1
+#define X11_KEYMAP_NOTIFY      11
+#define X11_GENERIC_EVENT      35
+
+#define X11_UNIT               32
+
+/* larger requests and replies are not cached */
+#define X11_CACHE_NAME_MAX     1024
+#define X11_CACHE_REPLY_MAX    ( X11_UNIT + X11_CACHE_NAME_MAX )
+#define X11_CACHE_ENTRIES_MAX  8192
+#define X11_CACHE_BUCKETS      1024
+
+/* the client is not read while that many cached replies are pending */
+#define X11_PENDING_MAX        256
+
+#define X11_STATE_SETUP        0
+#define X11_STATE_RUNNING      1
+#define X11_STATE_PASS         2
+
+#define PAD4(n)                ( ( (n) + 3 ) & ~3 )
+
+/*
+ * core requests with exactly one reply, the ones of extensions being
+ * unknown and handled like requests without reply
+ */
+static const unsigned char x11_single_reply[128] = {
+	[3] = 1, [14] = 1, [15] = 1, [16] = 1, [17] = 1, [20] = 1, [21] = 1,
+	[23] = 1, [26] = 1, [31] = 1, [38] = 1, [39] = 1, [40] = 1, [43] = 1,
+	[44] = 1, [47] = 1, [48] = 1, [49] = 1, [52] = 1, [73] = 1, [83] = 1,
+	[84] = 1, [85] = 1, [86] = 1, [87] = 1, [91] = 1, [92] = 1, [97] = 1,
+	[98] = 1, [99] = 1, [101] = 1, [103] = 1, [106] = 1, [108] = 1,
+	[110] = 1, [116] = 1, [117] = 1, [118] = 1, [119] = 1
+};
+
+/*
+ * cache of the relay, shared by its connections as they all use the 
+ * same X server
+ */
+struct x11_atom {
+	char*            name;
+	size_t           len;
+	uint32_t         atom;
+	struct x11_atom* next_name;
+	struct x11_atom* next_atom;
+};
+
+struct x11_ext {
+	char*            name;
+	size_t           len;
+	unsigned char    info[4];  /* present, major opcode, first event
+				    * and first error */
+	struct x11_ext*  next;
+};
+
+static struct x11_atom* x11_atoms_by_name[X11_CACHE_BUCKETS];
+static struct x11_atom* x11_atoms_by_id[X11_CACHE_BUCKETS];
+static struct x11_ext* x11_exts = NULL;
+static int x11_cache_entries = 0;
+
+/*
+ * request forwarded to the X server whose reply will fill the cache
+ */
+struct x11_fill {
+	uint32_t sseq;
+	int      opcode;
+	uint32_t atom;
+	char*    name;
+	size_t   len;
+};
+
+/*
+ * cached reply of a request that was not forwarded, only sent once the 
+ * X server answered the requests forwarded before it
+ */
+struct x11_reply {
+	uint32_t cseq;
+	uint32_t after;
+	size_t   len;
+	char     data[X11_CACHE_REPLY_MAX];
+};
+
+/*
+ * client sequence number of the replies, errors and events of the X 
+ * server starting from a server sequence number
+ */
+struct x11_seg {
+	uint32_t sseq;
+	uint32_t delta;
+};
+
+struct x11_proto {
+	int      flags;
+	int      cstate;
+	int      sstate;
+	int      msb;
+	size_t   crem;
+	size_t   srem;
+	int      swallow;
+	uint32_t cseq;
+	uint32_t sseq;
+	uint32_t last_in;
+	uint32_t last_out;
+	uint32_t acked;
+	uint32_t last_reply;
+	uint32_t delta;
+
+	struct x11_seg*   segs;
+	int               nsegs;
+	int               ssegs;
+	struct x11_fill*  fills;
+	int               nfills;
+	int               sfills;
+	struct x11_reply* replies;
+	int               nreplies;
+	int               sreplies;
+
+	/* image request being collected and rewritten request to send */
+	struct x11_image* xi;
+	char*       ibuf;
+	size_t      isize;
+	size_t      ilen;
+	size_t      itotal;
+	const char* obuf;
+	size_t      olen;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long syncs;
+};
+
+static uint32_t x11_hash(const char* data,size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for ( i = 0 ; i < len ; i++ ) {
+		h ^= (unsigned char) data[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct x11_atom* x11_atom_by_name(const char* name,size_t len)
+{
+	struct x11_atom* a;
+
+	a = x11_atoms_by_name[x11_hash(name,len) % X11_CACHE_BUCKETS];
+	for ( ; a != NULL ; a = a->next_name ) {
+		if ( a->len == len && memcmp(a->name,name,len) == 0 )
+			return a;
+	}
+
+	return NULL;
+}
+
+static struct x11_atom* x11_atom_by_id(uint32_t atom)
+{
+	struct x11_atom* a;
+
+	a = x11_atoms_by_id[atom % X11_CACHE_BUCKETS];
+	for ( ; a != NULL ; a = a->next_atom ) {
+		if ( a->atom == atom )
+			return a;
+	}
+
+	return NULL;
+}
+
+static void x11_atom_add(const char* name,size_t len,uint32_t atom)
+{
+	struct x11_atom* a;
+	uint32_t h;
+
+	if ( atom == 0 || x11_cache_entries >= X11_CACHE_ENTRIES_MAX ||
+	     x11_atom_by_name(name,len) != NULL || x11_atom_by_id(atom) )
+		return;
+
+	a = (struct x11_atom*) malloc(sizeof(struct x11_atom));
+	if ( a == NULL )
+		return;
+	a->name = (char*) malloc(len + 1);
+	if ( a->name == NULL ) {
+		free(a);
+		return;
+	}
+	memcpy(a->name,name,len);
+	a->name[len] = '\0';
+	a->len = len;
+	a->atom = atom;
+
+	h = x11_hash(name,len) % X11_CACHE_BUCKETS;
+	a->next_name = x11_atoms_by_name[h];
+	x11_atoms_by_name[h] = a;
+	h = atom % X11_CACHE_BUCKETS;
+	a->next_atom = x11_atoms_by_id[h];
+	x11_atoms_by_id[h] = a;
+	x11_cache_entries++;
+}
+
+static struct x11_ext* x11_ext_get(const char* name,size_t len)
+{
+	struct x11_ext* e;
+
+	for ( e = x11_exts ; e != NULL ; e = e->next ) {
+		if ( e->len == len && memcmp(e->name,name,len) == 0 )
+			return e;
+	}
+
+	return NULL;
+}
+
+static void x11_ext_add(const char* name,size_t len,const char* info)
+{
+	struct x11_ext* e;
+
+	if ( x11_cache_entries >= X11_CACHE_ENTRIES_MAX ||
+	     x11_ext_get(name,len) != NULL )
+		return;
+
+	e = (struct x11_ext*) malloc(sizeof(struct x11_ext));
+	if ( e == NULL )
+		return;
+	e->name = (char*) malloc(len + 1);
+	if ( e->name == NULL ) {
+		free(e);
+		return;
+	}
+	memcpy(e->name,name,len);
+	e->name[len] = '\0';
+	e->len = len;
+	memcpy(e->info,info,4);
+	e->next = x11_exts;
+	x11_exts = e;
+	x11_cache_entries++;
+}
+
+/*
+ * byte order helpers, the byte order of a connection being chosen by 
+ * the client in the connection setup
+ */
+static uint32_t x11_get16(struct x11_proto* xp,const char* p)
+{
+	const unsigned char* u = (const unsigned char*) p;
+
+	if ( xp->msb )
+		return ( u[0] << 8 ) | u[1];
+	else
+		return ( u[1] << 8 ) | u[0];
+}
+
+static uint32_t x11_get32(struct x11_proto* xp,const char* p)
+{
+	const unsigned char* u = (const unsigned char*) p;
+
+	if ( xp->msb )
+		return ( (uint32_t) u[0] << 24 ) | ( u[1] << 16 ) | 
+			( u[2] << 8 ) | u[3];
+	else
+		return ( (uint32_t) u[3] << 24 ) | ( u[2] << 16 ) | 
+			( u[1] << 8 ) | u[0];
+}
+
+static void x11_put16(struct x11_proto* xp,char* p,uint32_t v)
+{
+	unsigned char* u = (unsigned char*) p;
+
+	if ( xp->msb ) {
+		u[0] = ( v >> 8 ) & 0xff;
+		u[1] = v & 0xff;
+	}
+	else {
+		u[1] = ( v >> 8 ) & 0xff;
+		u[0] = v & 0xff;
+	}
+}
+
+static void x11_put32(struct x11_proto* xp,char* p,uint32_t v)
+{
+	x11_put16(xp,p + ( xp->msb ? 0 : 2 ),v >> 16);
+	x11_put16(xp,p + ( xp->msb ? 2 : 0 ),v & 0xffff);
+}
+
+/*
+ * growable arrays used as FIFOs
+ */
+static void* x11_grow(void* array,int n,int* size,size_t elt)
+{
+	void* p;
+
+	if ( n < *size )
+		return array;
+	p = realloc(array,( *size + 16 ) * elt);
+	if ( p != NULL )
+		*size += 16;
+
+	return p;
+}
+
+/*
+ * set the client minus server sequence offset of the server requests
+ * starting from sseq
+ */
+static int x11_seg_push(struct x11_proto* xp,uint32_t sseq,uint32_t delta)
+{
+	struct x11_seg* p;
+
+	xp->delta = delta;
+	if ( xp->nsegs > 0 && xp->segs[xp->nsegs - 1].sseq == sseq ) {
+		xp->segs[xp->nsegs - 1].delta = delta;
+		return 0;
+	}
+	p = (struct x11_seg*) x11_grow(xp->segs,xp->nsegs,&xp->ssegs,
+				       sizeof(struct x11_seg));
+	if ( p == NULL )
+		return -1;
+	xp->segs = p;
+	xp->segs[xp->nsegs].sseq = sseq;
+	xp->segs[xp->nsegs].delta = delta;
+	xp->nsegs++;
+
+	return 0;
+}
+
+static uint32_t x11_seg_map(struct x11_proto* xp,uint32_t sseq)
+{
+	int i;
+
+	/* forget the offsets of the requests the server went past */
+	while ( xp->nsegs > 1 && xp->segs[1].sseq <= sseq ) {
+		memmove(xp->segs,xp->segs + 1,
+			( xp->nsegs - 1 ) * sizeof(struct x11_seg));
+		xp->nsegs--;
+	}
+	for ( i = xp->nsegs - 1 ; i >= 0 ; i-- ) {
+		if ( xp->segs[i].sseq <= sseq )
+			return sseq + xp->segs[i].delta;
+	}
+
+	return sseq;
+}
+
+static int x11_fill_push(struct x11_proto* xp,int opcode,uint32_t atom,
+			 const char* name,size_t len)
+{
+	struct x11_fill* p;
+	struct x11_fill* f;
+
+	p = (struct x11_fill*) x11_grow(xp->fills,xp->nfills,&xp->sfills,
+					sizeof(struct x11_fill));
+	if ( p == NULL )
+		return -1;
+	xp->fills = p;
+	f = &xp->fills[xp->nfills];
+	f->name = NULL;
+	if ( name != NULL ) {
+		f->name = (char*) malloc(len);
+		if ( f->name == NULL )
+			return -1;
+		memcpy(f->name,name,len);
+	}
+	f->sseq = xp->sseq;
+	f->opcode = opcode;
+	f->atom = atom;
+	f->len = len;
+	xp->nfills++;
+
+	return 0;
+}
+
+static void x11_fill_pop(struct x11_proto* xp)
+{
+	free(xp->fills[0].name);
+	memmove(xp->fills,xp->fills + 1,
+		( xp->nfills - 1 ) * sizeof(struct x11_fill));
+	xp->nfills--;
+}
+
+/*
+ * fill the cache with the reply of a forwarded request
+ */
+static void x11_fill_reply(struct x11_proto* xp,struct x11_fill* f,
+			   const char* reply,size_t len)
+{
+	size_t n;
+
+	switch ( f->opcode ) {
+	case X11_INTERN_ATOM :
+		x11_atom_add(f->name,f->len,x11_get32(xp,reply + 8));
+		break;
+	case X11_GET_ATOM_NAME :
+		n = x11_get16(xp,reply + 8);
+		if ( X11_UNIT + n <= len )
+			x11_atom_add(reply + X11_UNIT,n,f->atom);
+		break;
+	case X11_QUERY_EXTENSION :
+		x11_ext_add(f->name,f->len,reply + 8);
+		break;
+	}
+}
+
+/*
+ * build the reply of a request from the cache, return 0 if it is not
+ * cached
+ */
+static int x11_cache_reply(struct x11_proto* xp,const char* req,size_t len,
+			   struct x11_reply* r)
+{
+	struct x11_atom* a = NULL;
+	struct x11_ext* e;
+	size_t n;
+
+	memset(r->data,0,X11_UNIT);
+	r->data[0] = X11_REPLY;
+	r->len = X11_UNIT;
+
+	switch ( (unsigned char) req[0] ) {
+	case X11_INTERN_ATOM :
+		n = x11_get16(xp,req + 4);
+		if ( 8 + n <= len )
+			a = x11_atom_by_name(req + 8,n);
+		if ( a == NULL )
+			return 0;
+		x11_put32(xp,r->data + 8,a->atom);
+		return 1;
+	case X11_GET_ATOM_NAME :
+		a = x11_atom_by_id(x11_get32(xp,req + 4));
+		if ( a == NULL )
+			return 0;
+		x11_put32(xp,r->data + 4,PAD4(a->len) / 4);
+		x11_put16(xp,r->data + 8,a->len);
+		memset(r->data + X11_UNIT,0,PAD4(a->len));
+		memcpy(r->data + X11_UNIT,a->name,a->len);
+		r->len += PAD4(a->len);
+		return 1;
+	case X11_QUERY_EXTENSION :
+		n = x11_get16(xp,req + 4);
+		if ( 8 + n > len || ( e = x11_ext_get(req + 8,n) ) == NULL )
+			return 0;
+		memcpy(r->data + 8,e->info,4);
+		return 1;
+	}
+
+	return 0;
+}
+
+struct x11_proto* x11_proto_new(int flags)
+{
+	struct x11_proto* xp;
+
+	xp = (struct x11_proto*) calloc(1,sizeof(struct x11_proto));
+	if ( xp == NULL )
+		return NULL;
+	xp->flags = flags;
+
+	/* the server messages are only looked at to use the cache */
+	if ( ! ( flags & X11_PROTO_CACHE ) )
+		xp->sstate = X11_STATE_PASS;
+	if ( flags & ( X11_PROTO_IMAGE_ENCODE | X11_PROTO_IMAGE_DECODE ) ) {
+		xp->xi = x11_image_new();
+		if ( xp->xi == NULL ) {
+			free(xp);
+			return NULL;
+		}
+	}
+
+	return xp;
+}
+
+void x11_proto_free(struct x11_proto* xp)
+{
+	if ( xp->hits > 0 )
+		fprintf(stderr,"x11 relay: %lu request(s) answered from cache "
+			"and %lu forwarded, %lu round trip(s) saved\n",
+			xp->hits,xp->misses,
+			( xp->hits > xp->syncs ) ? xp->hits - xp->syncs : 0);
+	while ( xp->nfills > 0 )
+		x11_fill_pop(xp);
+	if ( xp->xi != NULL )
+		x11_image_free(xp->xi);
+	free(xp->ibuf);
+	free(xp->fills);
+	free(xp->segs);
+	free(xp->replies);
+	free(xp);
+}
+
+int x11_proto_pending(struct x11_proto* xp)
+{
+	return ( xp->nreplies > 0 && xp->replies[0].after <= xp->acked );
+}
+
+int x11_proto_client_pending(struct x11_proto* xp)
+{
+	return ( xp->olen > 0 || xp->itotal > 0 );
+}
+
+/*
+ * answer a request from the cache, injecting a GetInputFocus request 
+ * in out when requests without reply were forwarded before it so that
+ * the errors they might generate are received before the cached reply.
+ * Return 1 if the request was answered, 0 if it was not cached or -1 if
+ * there is no room in out to inject the synchronization.
+ */
+static int x11_proto_elide(struct x11_proto* xp,const char* req,size_t len,
+			   char* out,size_t outsize,size_t* outlen)
+{
+	struct x11_reply* p;
+	struct x11_reply* r;
+
+	p = (struct x11_reply*) x11_grow(xp->replies,xp->nreplies,
+					 &xp->sreplies,
+					 sizeof(struct x11_reply));
+	if ( p == NULL )
+		return 0;
+	xp->replies = p;
+	r = &xp->replies[xp->nreplies];
+	if ( x11_cache_reply(xp,req,len,r) == 0 )
+		return 0;
+
+	r->after = xp->sseq;
+	if ( xp->acked < xp->sseq && xp->last_reply != xp->sseq ) {
+		if ( outsize - *outlen < 4 )
+			return -1;
+		xp->sseq++;
+		if ( x11_fill_push(xp,X11_GET_INPUT_FOCUS,0,NULL,0) ) {
+			xp->sseq--;
+			return 0;
+		}
+		out += *outlen;
+		out[0] = X11_GET_INPUT_FOCUS;
+		out[1] = 0;
+		x11_put16(xp,out + 2,1);
+		*outlen += 4;
+		xp->last_reply = xp->sseq;
+		xp->syncs++;
+		x11_seg_push(xp,xp->sseq,xp->delta - 1);
+	}
+
+	xp->cseq++;
+	r->cseq = xp->cseq;
+	xp->nreplies++;
+	xp->hits++;
+	x11_seg_push(xp,xp->sseq + 1,xp->delta + 1);
+
+	return 1;
+}
+
+/*
+ * rewrite a collected image request, the one to send being set in obuf
+ */
+static int x11_proto_image(struct x11_proto* xp)
+{
+	int rc;
+
+	if ( xp->flags & X11_PROTO_IMAGE_DECODE )
+		return x11_image_decode(xp->xi,xp->msb,xp->ibuf,xp->itotal,
+					&xp->obuf,&xp->olen);
+
+	rc = x11_image_encode(xp->xi,xp->msb,xp->ibuf,xp->itotal,
+			      &xp->obuf,&xp->olen);
+	if ( rc == 1 ) {
+		xp->obuf = xp->ibuf;
+		xp->olen = xp->itotal;
+	}
+
+	return ( rc < 0 ) ? -1 : 0 ;
+}
+
+ssize_t x11_proto_client(struct x11_proto* xp,const char* in,size_t inlen,
+			 int eof,char* out,size_t outsize,size_t* outlen)
+{
+	size_t used = 0;
+	size_t avail;
+	size_t len;
+	size_t n;
+	int opcode;
+	int fill;
+	int rc;
+	char* p;
+
+	*outlen = 0;
+	while ( 1 ) {
+		/* send the rewritten image request */
+		if ( xp->olen > 0 ) {
+			n = ( xp->olen < outsize - *outlen ) ?
+				xp->olen : outsize - *outlen ;
+			if ( n == 0 )
+				break;
+			memcpy(out + *outlen,xp->obuf,n);
+			*outlen += n;
+			xp->obuf += n;
+			xp->olen -= n;
+			continue;
+		}
+
+		/* an image truncated by the end of the stream is sent as is */
+		if ( used >= inlen && eof && xp->itotal > 0 ) {
+			xp->obuf = xp->ibuf;
+			xp->olen = xp->ilen;
+			xp->ilen = xp->itotal = 0;
+			xp->cstate = X11_STATE_PASS;
+			continue;
+		}
+		if ( used >= inlen )
+			break;
+		avail = inlen - used;
+
+		/* collect the image request */
+		if ( xp->ilen < xp->itotal ) {
+			n = ( avail < xp->itotal - xp->ilen ) ?
+				avail : xp->itotal - xp->ilen ;
+			memcpy(xp->ibuf + xp->ilen,in + used,n);
+			xp->ilen += n;
+			used += n;
+			if ( xp->ilen == xp->itotal ) {
+				if ( x11_proto_image(xp) )
+					return -1;
+				xp->ilen = xp->itotal = 0;
+			}
+			continue;
+		}
+
+		/* forward the rest of the current request */
+		if ( xp->crem > 0 || xp->cstate == X11_STATE_PASS ) {
+			n = ( xp->cstate == X11_STATE_PASS ) ? avail : xp->crem ;
+			if ( n > avail )
+				n = avail;
+			if ( n > outsize - *outlen )
+				n = outsize - *outlen;
+			if ( n == 0 )
+				break;
+			memcpy(out + *outlen,in + used,n);
+			*outlen += n;
+			used += n;
+			if ( xp->cstate != X11_STATE_PASS )
+				xp->crem -= n;
+			continue;
+		}
+
+		/* a partial request at the end of the stream is forwarded */
+		if ( xp->cstate == X11_STATE_SETUP ) {
+			if ( avail < 12 && ! eof )
+				break;
+			if ( avail < 12 || 
+			     ( in[used] != 'B' && in[used] != 'l' ) ) {
+				xp->cstate = X11_STATE_PASS;
+				xp->sstate = X11_STATE_PASS;
+				continue;
+			}
+			xp->msb = ( in[used] == 'B' );
+			xp->crem = 12 + PAD4(x11_get16(xp,in + used + 6)) +
+				PAD4(x11_get16(xp,in + used + 8));
+			xp->cstate = X11_STATE_RUNNING;
+			continue;
+		}
+
+		if ( avail < 4 && ! eof )
+			break;
+		if ( avail < 4 ) {
+			xp->cstate = X11_STATE_PASS;
+			continue;
+		}
+		opcode = (unsigned char) in[used];
+		len = x11_get16(xp,in + used + 2) * 4;
+		if ( len == 0 ) {
+			/* big request */
+			if ( avail < 8 && ! eof )
+				break;
+			if ( avail < 8 ) {
+				xp->cstate = X11_STATE_PASS;
+				continue;
+			}
+			len = (size_t) x11_get32(xp,in + used + 4) * 4;
+			if ( len < 8 )
+				return -1;
+		}
+
+		/* images are rewritten once complete */
+		if ( ( ( xp->flags & X11_PROTO_IMAGE_ENCODE && 
+			 ( opcode == X11_PUT_IMAGE || 
+			   opcode == X11_IMAGE_OPCODE ) ) ||
+		       ( xp->flags & X11_PROTO_IMAGE_DECODE &&
+			 opcode == X11_IMAGE_OPCODE ) ) &&
+		     len <= X11_IMAGE_REQUEST_MAX ) {
+			if ( len > xp->isize ) {
+				p = (char*) realloc(xp->ibuf,len);
+				if ( p == NULL )
+					return -1;
+				xp->ibuf = p;
+				xp->isize = len;
+			}
+			xp->itotal = len;
+			xp->cseq++;
+			xp->sseq++;
+			continue;
+		}
+
+		/* answer the cacheable requests from the cache */
+		fill = 0;
+		if ( xp->flags & X11_PROTO_CACHE &&
+		     ( opcode == X11_INTERN_ATOM || 
+		       opcode == X11_GET_ATOM_NAME ||
+		       opcode == X11_QUERY_EXTENSION ) &&
+		     len >= 8 && len <= 8 + X11_CACHE_NAME_MAX &&
+		     x11_get16(xp,in + used + 2) != 0 ) {
+			if ( avail < len ) {
+				if ( ! eof )
+					break;
+			}
+			else if ( xp->nreplies >= X11_PENDING_MAX )
+				break;
+			else {
+				rc = x11_proto_elide(xp,in + used,len,
+						     out,outsize,outlen);
+				if ( rc < 0 )
+					break;
+				if ( rc > 0 ) {
+					used += len;
+					continue;
+				}
+				xp->misses++;
+				fill = 1;
+			}
+		}
+
+		xp->cseq++;
+		xp->sseq++;
+		if ( opcode < 128 && x11_single_reply[opcode] )
+			xp->last_reply = xp->sseq;
+		xp->crem = len;
+
+		/* the reply of a missed request will fill the cache */
+		if ( fill && opcode == X11_GET_ATOM_NAME )
+			rc = x11_fill_push(xp,opcode,
+					   x11_get32(xp,in + used + 4),NULL,0);
+		else if ( fill )
+			rc = x11_fill_push(xp,opcode,0,in + used + 8,
+					   x11_get16(xp,in + used + 4));
+		if ( fill && rc )
+			return -1;
+	}
+
+	return used;
+}
+
+/*
+ * widen the 16 bits sequence number of a server message, knowing that 
+ * it does not go backward and does not go past the last request sent
+ */
+static uint32_t x11_widen(struct x11_proto* xp,uint32_t seq16)
+{
+	uint32_t seq;
+
+	seq = ( xp->last_in & ~0xffffu ) | seq16;
+	if ( seq < xp->last_in )
+		seq += 0x10000;
+	if ( seq > xp->sseq && seq >= 0x10000 )
+		seq -= 0x10000;
+
+	return seq;
+}
+
+ssize_t x11_proto_server(struct x11_proto* xp,const char* in,size_t inlen,
+			 char* out,size_t outsize,size_t* outlen)
+{
+	struct x11_reply* r;
+	size_t used = 0;
+	size_t avail;
+	size_t len;
+	size_t n;
+	uint32_t seq;
+	uint32_t cseq;
+	uint32_t pre;
+	uint32_t post;
+	int type;
+	int match;
+
+	*outlen = 0;
+	while ( 1 ) {
+		avail = inlen - used;
+
+		/* forward the rest of the current message */
+		if ( xp->srem > 0 || xp->sstate == X11_STATE_PASS ) {
+			n = ( xp->sstate == X11_STATE_PASS ) ? avail : xp->srem ;
+			if ( n > avail )
+				n = avail;
+			if ( ! xp->swallow && n > outsize - *outlen )
+				n = outsize - *outlen;
+			if ( n == 0 )
+				break;
+			if ( ! xp->swallow ) {
+				memcpy(out + *outlen,in + used,n);
+				*outlen += n;
+			}
+			used += n;
+			if ( xp->sstate != X11_STATE_PASS )
+				xp->srem -= n;
+			if ( xp->srem == 0 )
+				xp->swallow = 0;
+			continue;
+		}
+
+		/* send the cached replies whose preceding requests were 
+		 * answered by the server */
+		if ( x11_proto_pending(xp) ) {
+			r = &xp->replies[0];
+			if ( r->len > outsize - *outlen )
+				break;
+			cseq = ( r->cseq > xp->last_out ) ? 
+				r->cseq : xp->last_out ;
+			xp->last_out = cseq;
+			x11_put16(xp,r->data + 2,cseq & 0xffff);
+			memcpy(out + *outlen,r->data,r->len);
+			*outlen += r->len;
+			memmove(xp->replies,xp->replies + 1,
+				( xp->nreplies - 1 ) * sizeof(struct x11_reply));
+			xp->nreplies--;
+			continue;
+		}
+
+		if ( xp->sstate == X11_STATE_SETUP ) {
+			if ( avail < 8 )
+				break;
+			xp->srem = 8 + x11_get16(xp,in + used + 6) * 4;
+			xp->sstate = ( in[used] == 1 ) ?
+				X11_STATE_RUNNING : X11_STATE_PASS ;
+			continue;
+		}
+
+		if ( avail < X11_UNIT )
+			break;
+		type = (unsigned char) in[used];
+		len = X11_UNIT;
+		if ( type == X11_REPLY || ( type & 0x7f ) == X11_GENERIC_EVENT )
+			len += (size_t) x11_get32(xp,in + used + 4) * 4;
+		if ( ( type & 0x7f ) == X11_KEYMAP_NOTIFY ) {
+			xp->srem = len;
+			continue;
+		}
+
+		seq = x11_widen(xp,x11_get16(xp,in + used + 2));
+		xp->last_in = seq;
+
+		/* drop the fills of the requests that failed */
+		while ( xp->nfills > 0 && ( xp->fills[0].sseq < seq ||
+		       ( xp->fills[0].sseq == seq && type == X11_ERROR ) ) )
+			x11_fill_pop(xp);
+		match = ( type == X11_REPLY && xp->nfills > 0 && 
+			  xp->fills[0].sseq == seq );
+		if ( match && xp->fills[0].opcode != X11_GET_INPUT_FOCUS &&
+		     len <= X11_CACHE_REPLY_MAX && avail < len )
+			break;
+
+		/* the requests before this one are complete, and this one 
+		 * too if it failed or got its single reply */
+		pre = ( seq > 0 ) ? seq - 1 : 0 ;
+		post = pre;
+		if ( type == X11_ERROR || ( type == X11_REPLY &&
+		      ( seq == xp->last_reply || match ) ) )
+			post = seq;
+		if ( pre > xp->acked ) {
+			xp->acked = pre;
+			if ( x11_proto_pending(xp) )
+				continue;
+		}
+		if ( outsize - *outlen < X11_UNIT )
+			break;
+
+		if ( match && xp->fills[0].opcode == X11_GET_INPUT_FOCUS ) {
+			/* injected synchronization */
+			xp->swallow = 1;
+			x11_fill_pop(xp);
+		}
+		else if ( match ) {
+			if ( len <= X11_CACHE_REPLY_MAX )
+				x11_fill_reply(xp,&xp->fills[0],in + used,len);
+			x11_fill_pop(xp);
+		}
+
+		if ( ! xp->swallow ) {
+			cseq = x11_seg_map(xp,seq);
+			if ( cseq < xp->last_out )
+				cseq = xp->last_out;
+			xp->last_out = cseq;
+			memcpy(out + *outlen,in + used,X11_UNIT);
+			x11_put16(xp,out + *outlen + 2,cseq & 0xffff);
+			*outlen += X11_UNIT;
+			used += X11_UNIT;
+			xp->srem = len - X11_UNIT;
+		}
+		else
+			xp->srem = len;
+		if ( post > xp->acked )
+			xp->acked = post;
+	}
+
+	return used;
+}
@@ -0,0 +1,78 @@
+/***************************************************************************\
+ * slurm-spank-x11-proto.h - SLURM SPANK X11 relay protocol cache
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_PROTO_H
+#define _SLURM_SPANK_X11_PROTO_H
+
+#include <sys/types.h>
+
+/*
+ * X11 protocol filter of a relayed connection answering the idempotent
+ * requests (InternAtom, GetAtomName, QueryExtension) from a cache shared
+ * by the connections of the relay, renumbering the following replies, 
+ * errors and events so that the client does not notice it. 
+ * It can also send the PutImage requests to another relay as deltas of
+ * the previous images or rebuild them when received from another relay.
+ */
+#define X11_PROTO_CACHE         0x1
+#define X11_PROTO_IMAGE_ENCODE  0x2
+#define X11_PROTO_IMAGE_DECODE  0x4
+
+struct x11_proto;
+
+struct x11_proto* x11_proto_new(int flags);
+
+/*
+ * release a filter, reporting the round trips it saved on stderr
+ */
+void x11_proto_free(struct x11_proto* xp);
+
+/*
+ * process the data sent by the client, writing what has to be sent to
+ * the X server in out. Return the number of bytes consumed or -1 on
+ * protocol error, *outlen being set to the number of bytes written
+ */
+ssize_t x11_proto_client(struct x11_proto* xp,const char* in,size_t inlen,
+			 int eof,char* out,size_t outsize,size_t* outlen);
+
+/*
+ * process the data sent by the X server, writing what has to be sent to
+ * the client in out, including the cached replies. Return the number of
+ * bytes consumed or -1 on protocol error, *outlen being set to the number
+ * of bytes written
+ */
+ssize_t x11_proto_server(struct x11_proto* xp,const char* in,size_t inlen,
+			 char* out,size_t outsize,size_t* outlen);
+
+/*
+ * tell if cached replies are waiting to be sent to the client
+ */
+int x11_proto_pending(struct x11_proto* xp);
+
+/*
+ * tell if data of the client is waiting to be sent to the X server
+ */
+int x11_proto_client_pending(struct x11_proto* xp);
+
+#endif
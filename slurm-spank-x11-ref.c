@@ -0,0 +1,964 @@
+/***************************************************************************\
+ * slurm-spank-x11-ref.c - SLURM SPANK X11 DISPLAY references library
+ ***************************************************************************
+ * Copyright  CEA/DAM/DIF (2008)
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "slurm-spank-x11-ref.h"
+
+/*
+ * error reporting callback, messages are dropped when not set
+ */
+void (*display_ref_logger)(const char* fmt,va_list ap) = NULL;
+
+static void display_ref_log(const char* fmt,...)
+{
+	va_list ap;
+
+	if ( display_ref_logger == NULL )
+		return;
+	va_start(ap,fmt);
+	display_ref_logger(fmt,ap);
+	va_end(ap);
+}
+
+/*
+ * send a request to the node broker and read the first line of its 
+ * answer, the DISPLAY it holds being copied in answer (256 bytes) and 
+ * its owner in owner if not NULL. Return the answer code or -1 if the
+ * broker is not running, so that the caller falls back to the reference
+ * files. The connection is kept in *sock for the second answer of a 
+ * pending wait or ready request.
+ */
+static int display_ref_broker(char* op,char* refid,char* display,
+			      char* answer,uid_t* owner,int* sock)
+{
+	struct sockaddr_un addr;
+	char line[512];
+	size_t len = 0;
+	ssize_t n;
+	int code;
+	int fd;
+
+	if ( sock != NULL )
+		*sock = -1;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path,BROKER_SOCKET,sizeof(addr.sun_path)-1);
+	fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if ( fd == -1 )
+		return -1;
+	if ( connect(fd,(struct sockaddr*) &addr,sizeof(addr)) ) {
+		close(fd);
+		return -1;
+	}
+
+	n = snprintf(line,sizeof(line),"%s %s %s\n",op,refid,
+		     ( display != NULL ) ? display : "");
+	if ( n < 0 || (size_t) n >= sizeof(line) || write(fd,line,n) != n ) {
+		close(fd);
+		return -1;
+	}
+
+	/* the answer is a single line, read up to its end only */
+	while ( len < sizeof(line) - 1 ) {
+		n = read(fd,line+len,1);
+		if ( n == -1 && errno == EINTR )
+			continue;
+		if ( n <= 0 || line[len] == '\n' )
+			break;
+		len++;
+	}
+	line[len] = '\0';
+	if ( n <= 0 || sscanf(line,"%d",&code) != 1 ) {
+		close(fd);
+		return -1;
+	}
+	if ( answer != NULL && sscanf(line,"%*d %255s",answer) != 1 )
+		answer[0] = '\0';
+	if ( owner != NULL && sscanf(line,"%*d %*s %u",owner) != 1 )
+		*owner = (uid_t) -1;
+
+	if ( code == 1 && sock != NULL )
+		*sock = fd;
+	else
+		close(fd);
+
+	return code;
+}
+
+/*
+ * test if root marked the step or the job of a reference as ended
+ */
+static int display_ref_marked(char* refid)
+{
+	struct stat st;
+	char end_file[256];
+
+	if ( snprintf(end_file,256,END_FILE_PATTERN,refid) >= 256 )
+		return 0;
+
+	return ( lstat(end_file,&st) == 0 && S_ISREG(st.st_mode) &&
+		 st.st_uid == 0 );
+}
+
+static int display_ref_ended(char* refid)
+{
+	char jobid[64];
+	char* p;
+
+	if ( display_ref_marked(refid) )
+		return 1;
+
+	/* step references are jobid.stepid[.lazy] */
+	snprintf(jobid,sizeof(jobid),"%s",refid);
+	p = strchr(jobid,'.');
+	if ( p == NULL )
+		return 0;
+	*p = '\0';
+
+	return display_ref_marked(jobid);
+}
+
+int write_display_ref(char* refid,char* display)
+{
+	char ref_file[256];
+	char tmp_file[256];
+	char buf[300];
+	ssize_t len;
+	int fd;
+	int rc;
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* check DISPLAY reference */
+	if ( display == NULL ) {
+	        display_ref_log("error: unable to get DISPLAY value\n");
+		return 10;
+	}
+
+	/* register it in the broker if running */
+	rc = display_ref_broker("create",refid,display,NULL,NULL,NULL);
+	if ( rc > 0 ) {
+		display_ref_log("error: broker refused reference %s\n",refid);
+		return rc;
+	}
+
+	/* write it into reference file otherwise, using a new private
+	 * file renamed once complete so that no link is followed and the
+	 * readers never see a partial value */
+	if ( rc < 0 ) {
+		len = snprintf(buf,sizeof(buf),"%s %d\n",display,
+			       (int) getpid());
+		if ( len < 0 || (size_t) len >= sizeof(buf) ||
+		     snprintf(tmp_file,256,REF_TMP_PATTERN,refid) >= 256 ) {
+			display_ref_log("error: unable to build file "
+					"reference\n");
+			return 20;
+		}
+		fd = mkostemp(tmp_file,O_CLOEXEC);
+		if ( fd == -1 ) {
+			display_ref_log("error: unable to create file %s\n",
+					tmp_file);
+			return 30;
+		}
+		if ( fchmod(fd,0644) || write(fd,buf,len) != len ) {
+			display_ref_log("error: unable to write file %s\n",
+					tmp_file);
+			close(fd);
+			unlink(tmp_file);
+			return 34;
+		}
+		close(fd);
+		if ( rename(tmp_file,ref_file) ) {
+			display_ref_log("error: unable to create file %s\n",
+					ref_file);
+			unlink(tmp_file);
+			return 30;
+		}
+	}
+
+	/* the end marker being written before the removal of the 
+	 * reference, either it is seen here or the removal comes after
+	 * this write and releases the tunnel */
+	if ( display_ref_ended(refid) ) {
+		display_ref_log("info: step of ref %s already ended\n",refid);
+		remove_display_ref(refid);
+		return 41;
+	}
+
+	return 0;
+}
+
+int read_display_ref(char* refid,char** display)
+{
+	return read_display_ref_uid(refid,display,getuid());
+}
+
+int read_display_ref_uid(char* refid,char** display,uid_t uid)
+{
+        int rc;
+	int fd;
+	FILE* file;
+	struct stat st;
+	char rdisplay[256];
+	char ref_file[256];
+	char ruid[16];
+	uid_t owner;
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* references unknown to the broker may still be files, root
+	 * asking the broker for the references of uid */
+	snprintf(ruid,sizeof(ruid),"%u",(unsigned int) uid);
+	if ( display_ref_broker("get",refid,ruid,rdisplay,&owner,NULL) == 0 &&
+	     rdisplay[0] != '\0' ) {
+		if ( owner != uid && owner != 0 ) {
+			display_ref_log("error: ref %s created by uid %u "
+					"instead of %u\n",refid,owner,uid);
+			return 33;
+		}
+		*display=strdup(rdisplay);
+		return ( *display == NULL ) ? 32 : 0 ;
+	}
+
+        /* read reference file DISPLAY value, the files of /tmp being
+	 * only trusted if they belong to the user or to root */
+	fd = open(ref_file,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if ( fd == -1 ) {
+	        display_ref_log("error: unable to open file %s\n",
+			ref_file);
+		return 30;
+	}
+	if ( fstat(fd,&st) || ! S_ISREG(st.st_mode) ||
+	     ( st.st_uid != uid && st.st_uid != 0 ) ) {
+	        display_ref_log("error: ignoring file %s not owned by the "
+				"user\n",ref_file);
+		close(fd);
+		return 33;
+	}
+	file = fdopen(fd,"r");
+	if ( file == NULL ) {
+		close(fd);
+		return 30;
+	}
+	if ( fscanf(file,"%255s\n",rdisplay) != 1 ) {
+	        display_ref_log("warning: unable to read DISPLAY value "
+			"from file %s\n",ref_file);
+		rc = 31;
+	}
+	else {
+		*display=strdup(rdisplay);
+		rc = ( *display == NULL ) ? 32 : 0 ;
+	}
+	fclose(file);
+	
+	return rc;
+}
+
+int remove_display_ref(char* refid)
+{
+	char ref_file[256];
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	if ( display_ref_broker("remove",refid,NULL,NULL,NULL,NULL) == 0 )
+		return 0;
+
+        /* unlink reference file */
+        if ( unlink(ref_file) ) {
+	        display_ref_log("error: unable to remove file %s\n",
+			ref_file);
+		return 31;
+	}
+
+	return 0;
+}
+
+int drop_display_ref(char* refid,char* display)
+{
+	struct stat st, lst;
+	char ref_file[256];
+	char rdisplay[256];
+	char buf[300];
+	ssize_t len;
+	int pid;
+	int fd;
+	int rc;
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	rc = display_ref_broker("drop",refid,display,NULL,NULL,NULL);
+	if ( rc >= 0 )
+		return rc;
+
+	/* the file must still be the one written by the calling process */
+	fd = open(ref_file,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if ( fd == -1 )
+		return 30;
+	if ( fstat(fd,&st) || ! S_ISREG(st.st_mode) ) {
+		close(fd);
+		return 30;
+	}
+	len = read(fd,buf,sizeof(buf)-1);
+	close(fd);
+	buf[( len > 0 ) ? len : 0] = '\0';
+	if ( st.st_uid != getuid() ||
+	     sscanf(buf,"%255s %d",rdisplay,&pid) != 2 ||
+	     pid != (int) getpid() || strcmp(rdisplay,display) != 0 ) {
+		display_ref_log("info: ref %s replaced, not removed\n",refid);
+		return 36;
+	}
+
+	/* and not a new one renamed over it meanwhile */
+	if ( lstat(ref_file,&lst) || lst.st_ino != st.st_ino ||
+	     lst.st_dev != st.st_dev )
+		return 36;
+	if ( unlink(ref_file) ) {
+	        display_ref_log("error: unable to remove file %s\n",
+			ref_file);
+		return 31;
+	}
+
+	return 0;
+}
+
+int end_display_ref(char* refid)
+{
+	char end_file[256];
+	int fd;
+
+	if ( snprintf(end_file,256,END_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* only markers of root are honored, an existing one being kept */
+	fd = open(end_file,O_WRONLY|O_CREAT|O_NOFOLLOW|O_CLOEXEC,0644);
+	if ( fd == -1 )
+	        display_ref_log("error: unable to create file %s\n",
+				end_file);
+	else
+		close(fd);
+
+	return remove_display_ref(refid);
+}
+
+int hold_display_ref(char* refid,char* holder)
+{
+	struct stat st;
+	char hold_file[256];
+	int retry = 1;
+	int fd;
+
+	if ( snprintf(hold_file,256,HOLD_FILE_PATTERN,refid,holder) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* a hold of the caller is kept, a file planted by somebody else
+	 * being replaced by a new one */
+	while ( ( fd = open(hold_file,O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|
+			    O_CLOEXEC,0644) ) == -1 ) {
+		if ( errno == EEXIST && lstat(hold_file,&st) == 0 &&
+		     S_ISREG(st.st_mode) && st.st_uid == getuid() )
+			return 0;
+		if ( errno != EEXIST || ! retry-- || unlink(hold_file) ) {
+			display_ref_log("error: unable to create file %s\n",
+					hold_file);
+			return 30;
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+int release_display_ref(char* refid,char* holder,uid_t uid)
+{
+	struct stat st;
+	char hold_file[256];
+	glob_t g;
+	size_t i;
+	int held = 0;
+
+	if ( snprintf(hold_file,256,HOLD_FILE_PATTERN,refid,holder) >= 256 ||
+	     unlink(hold_file) ||
+	     snprintf(hold_file,256,HOLD_FILE_GLOB,refid) >= 256 )
+		return 31;
+
+	/* only the holds of root or of the user of the job count */
+	if ( glob(hold_file,GLOB_NOSORT,NULL,&g) == 0 ) {
+		for ( i = 0 ; i < g.gl_pathc && ! held ; i++ )
+			held = ( lstat(g.gl_pathv[i],&st) == 0 &&
+				 S_ISREG(st.st_mode) &&
+				 ( st.st_uid == 0 || st.st_uid == uid ) );
+		globfree(&g);
+	}
+	if ( held )
+		return 1;
+
+	return remove_display_ref(refid);
+}
+
+int purge_display_refs(char* jobid,int age)
+{
+	struct stat st;
+	glob_t g;
+	time_t now = time(NULL);
+	char prefix[256];
+	char end_file[256];
+	size_t len;
+	size_t i;
+
+	len = snprintf(prefix,256,REF_FILE_PATTERN,jobid);
+	if ( len >= 255 ||
+	     snprintf(end_file,256,END_FILE_PATTERN,jobid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+	prefix[len++] = '.';
+	prefix[len] = '\0';
+
+	if ( glob(END_FILE_GLOB,GLOB_NOSORT,NULL,&g) == 0 ) {
+		for ( i = 0 ; i < g.gl_pathc ; i++ ) {
+			if ( strcmp(g.gl_pathv[i],end_file) == 0 )
+				continue;
+			if ( strncmp(g.gl_pathv[i],prefix,len) == 0 ||
+			     ( lstat(g.gl_pathv[i],&st) == 0 && 
+			       st.st_mtime + age < now ) )
+				unlink(g.gl_pathv[i]);
+		}
+		globfree(&g);
+	}
+
+	/* holds left by the steps of the job */
+	if ( snprintf(prefix,256,HOLD_FILE_GLOB,jobid) < 256 &&
+	     glob(prefix,GLOB_NOSORT,NULL,&g) == 0 ) {
+		for ( i = 0 ; i < g.gl_pathc ; i++ )
+			unlink(g.gl_pathv[i]);
+		globfree(&g);
+	}
+
+	return 0;
+}
+
+/*
+ * open a tunnel reference file of the calling user, refusing to follow
+ * symlinks or to use a file created by somebody else
+ */
+static int open_tunnel_ref(char* refid,char* host,int flags)
+{
+	int fd;
+	struct stat st;
+	char ref_file[256];
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,TUNNEL_FILE_PATTERN,refid,host) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return -20;
+	}
+
+	fd = open(ref_file,flags|O_NOFOLLOW|O_CLOEXEC,0600);
+	if ( fd == -1 )
+		return -30;
+	if ( fstat(fd,&st) || st.st_uid != getuid() ) {
+	        display_ref_log("error: ignoring file %s not owned by the "
+				"user\n",ref_file);
+		close(fd);
+		return -33;
+	}
+
+	return fd;
+}
+
+/*
+ * get the start time of a process in clock ticks since boot, 0 if it
+ * does not exist
+ */
+static unsigned long long tunnel_ref_start(pid_t pid)
+{
+	char path[64];
+	char buf[1024];
+	char* p;
+	unsigned long long start;
+	ssize_t len;
+	int fd;
+
+	snprintf(path,sizeof(path),"/proc/%d/stat",(int) pid);
+	fd = open(path,O_RDONLY|O_CLOEXEC);
+	if ( fd == -1 )
+		return 0;
+	len = read(fd,buf,sizeof(buf)-1);
+	close(fd);
+	if ( len <= 0 )
+		return 0;
+	buf[len] = '\0';
+
+	/* the command name may contain spaces, fields are counted after 
+	 * its closing parenthesis, the start time being the 22nd one */
+	p = strrchr(buf,')');
+	if ( p == NULL || sscanf(p+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u "
+				 "%*u %*u %*u %*u %*d %*d %*d %*d %*d %*d "
+				 "%llu",&start) != 1 )
+		return 0;
+
+	return start;
+}
+
+static int write_tunnel_ref_file(char* refid,char* host,char* buf)
+{
+	int fd;
+	ssize_t len = strlen(buf);
+
+	fd = open_tunnel_ref(refid,host,O_WRONLY|O_CREAT|O_TRUNC);
+	if ( fd < 0 )
+		return -fd;
+
+	if ( write(fd,buf,len) != len ) {
+		close(fd);
+		return 34;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int read_tunnel_ref_file(char* refid,char* host,char* buf,
+				size_t size)
+{
+	int fd;
+	ssize_t len;
+
+	fd = open_tunnel_ref(refid,host,O_RDONLY);
+	if ( fd < 0 )
+		return -fd;
+
+	len = read(fd,buf,size-1);
+	close(fd);
+	if ( len <= 0 )
+		return 31;
+	buf[len] = '\0';
+
+	return 0;
+}
+
+int write_tunnel_ref(char* refid,char* host,pid_t pid)
+{
+	char buf[64];
+
+	snprintf(buf,64,"%d %llu\n",(int) pid,tunnel_ref_start(pid));
+
+	return write_tunnel_ref_file(refid,host,buf);
+}
+
+int link_tunnel_ref(char* refid,char* host,char* peer)
+{
+	char buf[64];
+	int rc;
+
+	rc = read_tunnel_ref_file(refid,peer,buf,64);
+	if ( rc )
+		return rc;
+
+	return write_tunnel_ref_file(refid,host,buf);
+}
+
+int check_tunnel_ref(char* refid,char* host)
+{
+	int pid;
+	unsigned long long start;
+	char buf[64];
+	int rc;
+
+	rc = read_tunnel_ref_file(refid,host,buf,64);
+	if ( rc )
+		return rc;
+
+	/* the helper task holding the tunnel must still be alive, and not
+	 * be another process that got its pid */
+	if ( sscanf(buf,"%d %llu",&pid,&start) != 2 || pid <= 0 ||
+	     start == 0 || tunnel_ref_start(pid) != start )
+		return 35;
+
+	return 0;
+}
+
+int remove_tunnel_ref(char* refid,char* host)
+{
+	char ref_file[256];
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,TUNNEL_FILE_PATTERN,refid,host) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+        /* unlink reference file */
+        if ( unlink(ref_file) ) {
+	        display_ref_log("error: unable to remove file %s\n",
+				ref_file);
+		return 31;
+	}
+
+	return 0;
+}
+
+/*
+ * test if a process is alive, processes of other users included, pid 0
+ * standing for a process that never exits
+ */
+static int display_ref_alive(pid_t pid)
+{
+	if ( pid == 0 )
+		return 1;
+	return ( pid > 1 && ( kill(pid,0) == 0 || errno == EPERM ) );
+}
+
+/*
+ * wait for the reference file removal or the process termination using
+ * inotify and a pidfd on the process, without any periodic wakeup. 
+ * Return -1 if the kernel does not provide the required features so 
+ * that the caller can fall back to polling.
+ */
+static int wait_display_ref_events(char* ref_file,pid_t pid)
+{
+	int rc = -1;
+	int ifd, pfd = -1, efd = -1;
+	int n, i;
+	struct epoll_event ev;
+	struct epoll_event events[2];
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+	ifd = inotify_init1(IN_CLOEXEC|IN_NONBLOCK);
+	if ( ifd == -1 )
+		return -1;
+
+	if ( pid < 0 || pid == 1 ) {
+		rc = 0;
+		goto exit;
+	}
+#ifdef SYS_pidfd_open
+	if ( pid > 0 )
+		pfd = syscall(SYS_pidfd_open,pid,0);
+#endif
+	if ( pid > 0 && pfd == -1 ) {
+		if ( errno == ESRCH )
+			rc = 0;
+		goto exit;
+	}
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if ( efd == -1 )
+		goto exit;
+	ev.events = EPOLLIN;
+	ev.data.fd = ifd;
+	if ( epoll_ctl(efd,EPOLL_CTL_ADD,ifd,&ev) )
+		goto exit;
+	ev.events = EPOLLIN;
+	ev.data.fd = pfd;
+	if ( pfd != -1 && epoll_ctl(efd,EPOLL_CTL_ADD,pfd,&ev) )
+		goto exit;
+
+	while ( 1 ) {
+		/* (re)attach the watch to the inode currently referenced 
+		 * by the path, ENOENT means that the file was removed */
+		if ( inotify_add_watch(ifd,ref_file,IN_ATTRIB|IN_DELETE_SELF|
+				       IN_MOVE_SELF) == -1 ) {
+			rc = ( errno == ENOENT ) ? 0 : -1 ;
+			break;
+		}
+
+		n = epoll_wait(efd,events,2,-1);
+		if ( n == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+		for ( i = 0 ; i < n ; i++ ) {
+			if ( events[i].data.fd == pfd ) {
+				rc = 0;
+				goto exit;
+			}
+			while ( read(ifd,buf,sizeof(buf)) > 0 ) ;
+		}
+	}
+
+exit:
+	if ( efd != -1 )
+		close(efd);
+	if ( pfd != -1 )
+		close(pfd);
+	close(ifd);
+
+	return rc;
+}
+
+/*
+ * wait for the answer of the broker to a pending wait request or for the
+ * process termination
+ */
+static int wait_display_ref_broker(int sock,pid_t pid)
+{
+	struct pollfd pfds[2];
+	int pfd = -1;
+	int n;
+
+#ifdef SYS_pidfd_open
+	if ( pid > 0 )
+		pfd = syscall(SYS_pidfd_open,pid,0);
+#endif
+	pfds[0].fd = sock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = pfd;
+	pfds[1].events = POLLIN;
+
+	/* the liveness of the process is polled without pidfd */
+	while ( display_ref_alive(pid) ) {
+		n = poll(pfds,2,( pid > 0 && pfd == -1 ) ? 1000 : -1);
+		if ( n > 0 || ( n == -1 && errno != EINTR ) )
+			break;
+	}
+
+	if ( pfd != -1 )
+		close(pfd);
+	close(sock);
+
+	return 0;
+}
+
+int wait_display_ref(char* refid)
+{
+	return wait_display_ref_pid(refid,getppid());
+}
+
+int wait_display_ref_pid(char* refid,pid_t pid)
+{
+	struct stat fstatbuf;
+	char ref_file[256];
+	int sock;
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* wait for the broker to answer the removal if running */
+	if ( display_ref_broker("wait",refid,NULL,NULL,NULL,&sock) == 1 )
+		return wait_display_ref_broker(sock,pid);
+
+	/* wait for events if supported by the kernel */
+	if ( wait_display_ref_events(ref_file,pid) == 0 )
+		return 0;
+
+	/* otherwise loop on file existence and process liveness */
+	while ( stat(ref_file,&fstatbuf) == 0 
+		&& display_ref_alive(pid) ) {
+	        sleep(1);
+	}
+	
+	return 0;
+}
+
+/*
+ * test if a reference file of uid or root holds a DISPLAY value
+ */
+static int display_ref_ready(char* ref_file,uid_t uid)
+{
+	struct stat st;
+	char rdisplay[256];
+	ssize_t len;
+	int fd;
+
+	fd = open(ref_file,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if ( fd == -1 )
+		return 0;
+	if ( fstat(fd,&st) || ! S_ISREG(st.st_mode) ||
+	     ( st.st_uid != uid && st.st_uid != 0 ) ) {
+		close(fd);
+		return 0;
+	}
+	len = read(fd,rdisplay,sizeof(rdisplay)-1);
+	close(fd);
+	if ( len <= 0 )
+		return 0;
+	rdisplay[len] = '\0';
+
+	return ( rdisplay[0] != '\0' && rdisplay[0] != '\n' );
+}
+
+int wait_display_ref_ready(char* refid,int timeout)
+{
+	return wait_display_ref_ready_fd(refid,timeout,-1,getuid());
+}
+
+int wait_display_ref_ready_fd(char* refid,int timeout,int fd,uid_t uid)
+{
+	int ifd;
+	int ms;
+	int check = 1;
+	ssize_t len;
+	char* name;
+	char* p;
+	char ref_file[256];
+	char ruid[16];
+	char buf[4096]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event* ev;
+	struct pollfd pfds[2];
+	struct timespec now, deadline;
+	int sock;
+	int rc;
+
+	/* build file reference */
+	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
+		display_ref_log("error: unable to build file reference\n");
+		return 20;
+	}
+
+	/* an existing reference is used without watching the directory,
+	 * the release of an inotify instance taking several ms */
+	if ( display_ref_ready(ref_file,uid) )
+		return 0;
+
+	/* the broker answers once the reference is created, the files
+	 * written while it was not running being checked first */
+	snprintf(ruid,sizeof(ruid),"%u",(unsigned int) uid);
+	rc = display_ref_broker("ready",refid,ruid,NULL,NULL,&sock);
+	if ( rc == 0 )
+		return 0;
+	if ( rc == 1 ) {
+		pfds[0].fd = sock;
+		pfds[1].fd = fd;
+		pfds[0].events = pfds[1].events = POLLIN;
+		pfds[0].revents = pfds[1].revents = 0;
+		while ( ( rc = poll(pfds,2,timeout*1000) ) == -1 &&
+			errno == EINTR ) ;
+		if ( rc > 0 && pfds[1].revents != 0 )
+			rc = 50;
+		else
+			rc = ( rc > 0 && read(sock,buf,1) == 1 &&
+			       buf[0] == '0' ) ? 0 : 40 ;
+		close(sock);
+		return rc;
+	}
+	name = strrchr(ref_file,'/');
+	*name = '\0';
+
+	/* watch the references directory before the first check so that 
+	 * no creation can be missed, polling if inotify is not available */
+	ifd = inotify_init1(IN_CLOEXEC|IN_NONBLOCK);
+	if ( ifd != -1 && inotify_add_watch(ifd,ref_file,IN_CLOSE_WRITE|
+					    IN_MOVED_TO) == -1 ) {
+		close(ifd);
+		ifd = -1;
+	}
+	*name = '/';
+
+	clock_gettime(CLOCK_MONOTONIC,&deadline);
+	deadline.tv_sec += timeout;
+	while ( ! ( check && display_ref_ready(ref_file,uid) ) ) {
+		check = 0;
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		ms = ( deadline.tv_sec - now.tv_sec ) * 1000 +
+			( deadline.tv_nsec - now.tv_nsec ) / 1000000;
+		if ( ms <= 0 ) {
+			if ( ifd != -1 )
+				close(ifd);
+			return 40;
+		}
+
+		/* only the events of the reference trigger a new check, 
+		 * polling every 100 ms if inotify is not available */
+		pfds[0].fd = ifd;
+		pfds[1].fd = fd;
+		pfds[0].events = pfds[1].events = POLLIN;
+		pfds[0].revents = pfds[1].revents = 0;
+		if ( ifd == -1 && ms > 100 )
+			ms = 100;
+		rc = poll(pfds,2,ms);
+		if ( rc > 0 && pfds[1].revents != 0 ) {
+			if ( ifd != -1 )
+				close(ifd);
+			return 50;
+		}
+		if ( ifd == -1 ) {
+			check = 1;
+			continue;
+		}
+		if ( rc <= 0 )
+			continue;
+		while ( ( len = read(ifd,buf,sizeof(buf)) ) > 0 ) {
+			for ( p = buf ; p < buf + len ; 
+			      p += sizeof(struct inotify_event) + ev->len ) {
+				ev = (struct inotify_event*) p;
+				if ( ev->len > 0 && 
+				     strcmp(ev->name,name + 1) == 0 )
+					check = 1;
+			}
+		}
+	}
+	if ( ifd != -1 )
+		close(ifd);
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/***************************************************************************\
+ * slurm-spank-x11-ref.h - SLURM SPANK X11 DISPLAY references library
+ ***************************************************************************
+ * Copyright  CEA/DAM/DIF (2008)
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_REF_H
+#define _SLURM_SPANK_X11_REF_H
+
+#include <stdarg.h>
+
+#include <sys/types.h>
+
+#define REF_FILE_PATTERN            "/tmp/slurm-spank-x11.%s"
+#define REF_TMP_PATTERN             "/tmp/.slurm-spank-x11.%s.XXXXXX"
+#define TUNNEL_FILE_PATTERN         "/tmp/slurm-spank-x11.%s@%s"
+#define END_FILE_PATTERN            "/tmp/slurm-spank-x11.%s.end"
+#define END_FILE_GLOB               "/tmp/slurm-spank-x11.*.end"
+#define HOLD_FILE_PATTERN           "/tmp/slurm-spank-x11.%s+%s"
+#define HOLD_FILE_GLOB              "/tmp/slurm-spank-x11.%s+*"
+#define BROKER_SOCKET               "/run/slurm-spank-x11.sock"
+
+/*
+ * DISPLAY references are small files shared between the tunnel helper
+ * tasks and the x11 plugin, each one storing the DISPLAY value to use 
+ * for a given refid (jobid.stepid).
+ *
+ * When the node broker (slurm-spank-x11 --broker) listens on 
+ * BROKER_SOCKET, new references are kept in its memory instead, the 
+ * files remaining in use when it is not running. Its requests are single
+ * lines "<op> <refid> [display]", op being create, get, remove, drop,
+ * wait or ready, answered by a line "<code> [display uid]" using the 
+ * codes of the functions below, uid being the owner of the reference.
+ * drop only removes a reference created by the same process. wait and 
+ * ready first answer 1 when they have to wait, then 0 when the reference
+ * is removed or created. Every uid has references of its own, at most
+ * 256, so that a refid taken by a user does not prevent the user of the
+ * job from creating it. root gives the uid whose reference it accesses
+ * in place of the display, and removes the references of every uid when
+ * it gives none. References are dropped when their creator stops waiting
+ * for them without removing them.
+ *
+ * All the functions return 0 on success and a positive error code 
+ * otherwise, messages being reported through display_ref_logger when
+ * it is set.
+ */
+extern void (*display_ref_logger)(const char* fmt,va_list ap);
+
+int write_display_ref(char* refid,char* display);
+
+int read_display_ref(char* refid,char** display);
+
+/*
+ * read a reference created by uid or root only, returning 33 if another
+ * user created it first. read_display_ref only trusts the references
+ * of the calling user.
+ */
+int read_display_ref_uid(char* refid,char** display,uid_t uid);
+
+int remove_display_ref(char* refid);
+
+/*
+ * remove a reference only if it still holds display and was written by
+ * the calling process (the pid of the writer follows the DISPLAY in 
+ * the files), returning 36 if it was replaced by another one meanwhile
+ */
+int drop_display_ref(char* refid,char* display);
+
+/*
+ * remove a reference whose step or job ended, root leaving a marker so 
+ * that a tunnel established afterwards is released at once: 
+ * write_display_ref checks it, and the one of the job, once the 
+ * reference is written, returning 41 after removing the reference. 
+ * purge_display_refs removes the markers of the steps of a job, covered
+ * by the one of the job, and the markers older than age seconds.
+ */
+int end_display_ref(char* refid);
+
+int purge_display_refs(char* jobid,int age);
+
+/*
+ * count the steps using a reference shared by the steps of a job, each 
+ * holder being a file named after the reference and the holder id. 
+ * release_display_ref drops a hold and removes the reference once the 
+ * last holder is gone, returning 1 if it is still held, only the holds
+ * of root or uid being counted. The holds left by the steps that did 
+ * not release them are removed by purge_display_refs.
+ */
+int hold_display_ref(char* refid,char* holder);
+
+int release_display_ref(char* refid,char* holder,uid_t uid);
+
+/*
+ * wait until the reference is removed or the calling process is
+ * reattached to init
+ */
+int wait_display_ref(char* refid);
+
+/*
+ * wait until the reference is removed or the given process exits, only
+ * the removal being waited for if pid is 0
+ */
+int wait_display_ref_pid(char* refid,pid_t pid);
+
+/*
+ * wait until the reference exists and holds a DISPLAY value, at most
+ * timeout seconds. Return 0 when it is ready and 40 on timeout. Like 
+ * read_display_ref, only the reference files of the calling user or of
+ * root are trusted.
+ *
+ * wait_display_ref_ready_fd trusts the files of uid or root instead and
+ * also returns 50 as soon as fd is readable, fd being ignored if 
+ * negative.
+ */
+int wait_display_ref_ready(char* refid,int timeout);
+
+int wait_display_ref_ready_fd(char* refid,int timeout,int fd,uid_t uid);
+
+/*
+ * tunnel references are kept on the submission side when tunnels are
+ * shared by the steps of a job. They store the pid and the start time 
+ * of the helper task holding the tunnel to a given host, so that a 
+ * reused pid is not taken for it, and are private to the user. The
+ * nodes reached through the tunnel of another one are linked to the
+ * reference of that node with link_tunnel_ref.
+ *
+ * check_tunnel_ref returns 0 if the tunnel is still alive.
+ */
+int write_tunnel_ref(char* refid,char* host,pid_t pid);
+
+int link_tunnel_ref(char* refid,char* host,char* peer);
+
+int check_tunnel_ref(char* refid,char* host);
+
+int remove_tunnel_ref(char* refid,char* host);
+
+#endif
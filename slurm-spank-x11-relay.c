@@ -0,0 +1,1288 @@
+/***************************************************************************\
+ * slurm-spank-x11-relay.c - SLURM SPANK X11 helper task relay
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "slurm-spank-x11-relay.h"
+#include "slurm-spank-x11-proto.h"
+
+#define RELAY_BUFSIZE     65536
+#define RELAY_MAX_EVENTS  64
+
+#define RELAY_SPLICE_FLAGS ( SPLICE_F_MOVE | SPLICE_F_NONBLOCK )
+
+/* marks the events of connections closed in the current batch */
+#define RELAY_CLOSED      ((void*) -1)
+
+/*
+ * compressed streams between relays start with a magic that can not be
+ * mistaken for the byte order of an X11 connection setup ('B' or 'l'),
+ * then carry frames made of a type byte and a 24 bits big endian size.
+ * The second magic tells that the images are sent as deltas.
+ */
+#define RELAY_ZMAGIC          "Zx1\n"
+#define RELAY_ZMAGIC_IMAGES   "Zx2\n"
+#define RELAY_ZMAGIC_LEN      4
+
+#define RELAY_ZCLIENT         1
+#define RELAY_ZCLIENT_IMAGES  2
+
+#define RELAY_FRAME_HDR       4
+#define RELAY_FRAME_RAW       'R'  /* data sent as is */
+#define RELAY_FRAME_DEFLATE   'D'  /* data of the deflate stream */
+#define RELAY_FRAME_RESET     'S'  /* data sent as is, deflate stream reset */
+
+#define RELAY_ZCHUNK          16384
+#define RELAY_ZMIN            64   /* smaller chunks are sent as is */
+#define RELAY_ZLEVEL_MAX      6
+#define RELAY_ZIDLE           8    /* frames without backlog to lower level */
+#define RELAY_ZSKIP_MAX       64   /* max frames sent as is after a failure */
+
+#define RELAY_CODEC_ENCODE    1
+#define RELAY_CODEC_DECODE    2
+
+/* largest connection setup accepted from the clients when the relay
+ * checks their authorization */
+#define RELAY_SETUP_MAX       1024
+#define RELAY_PAD4(n)         ( ( (n) + 3 ) & ~((size_t) 3) )
+
+/*
+ * compression state of one direction of a connection. The level adapts
+ * to the backlog of the compressed side : data waiting to be written 
+ * means that the link is slower than the compression and that it is 
+ * worth spending more CPU, no backlog lowering it down to passthrough.
+ * Incompressible chunks are sent as is, the following ones too for an
+ * increasing number of frames.
+ */
+struct relay_codec {
+	int      mode;
+	z_stream z;
+	int      level;
+	int      zlevel;
+	int      idle;
+	int      skip;
+	int      backoff;
+	char*    rx;
+	size_t   rxlen;
+	int      rxeof;
+	int      ftype;
+	size_t   fleft;
+	int      zpending;
+	unsigned long long raw;
+	unsigned long long wire;
+	double   time;
+};
+
+struct relay_conn;
+
+/*
+ * one side of a relayed connection, registered in epoll in one-shot 
+ * mode so that it is not reported while nothing can be done with it, 
+ * like when its peer has no room for more data while it hung up
+ */
+struct relay_end {
+	struct relay_conn* conn;
+	int                fd;
+	unsigned int       events;
+	int                armed;
+};
+
+/*
+ * data read from one side and not yet written to the other one. The 
+ * data is moved from socket to socket through a pipe using splice so
+ * that it is never copied to user space, a buffer being used instead
+ * when splice can not be used with the sockets.
+ */
+struct relay_pipe {
+	int    pfd[2];
+	char*  buf;
+	size_t off;
+	size_t len;
+	size_t size;
+	int    full;
+	int    eof;
+	struct relay_codec* codec;
+};
+
+/*
+ * when the X11 protocol is filtered, the data of the client goes 
+ * through cin before being sent to the server with c2s and the data of
+ * the server through cout after being received with s2c
+ */
+struct relay_conn {
+	struct relay_end  client;
+	struct relay_end  server;
+	struct relay_pipe c2s;
+	struct relay_pipe s2c;
+	struct relay_pipe cin;
+	struct relay_pipe cout;
+	struct x11_proto* xp;
+};
+
+int x11_display_connect(const char* display)
+{
+	int fd = -1;
+	int num;
+	int one = 1;
+	char host[256];
+	char port[16];
+	const char* colon;
+	struct sockaddr_un sun;
+	struct addrinfo hints;
+	struct addrinfo* res;
+	struct addrinfo* ai;
+
+	colon = strrchr(display,':');
+	if ( colon == NULL || colon - display >= 256 )
+		return -1;
+	num = atoi(colon + 1);
+	memcpy(host,display,colon - display);
+	host[colon - display] = '\0';
+
+	/* local displays are reached through their unix socket */
+	if ( host[0] == '\0' || strcmp(host,"unix") == 0 ) {
+		fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if ( fd == -1 )
+			return -1;
+		memset(&sun,0,sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path,sizeof(sun.sun_path),
+			 X11_UNIX_SOCKET_PATTERN,num);
+		if ( connect(fd,(struct sockaddr*) &sun,sizeof(sun)) ) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port,16,"%d",X11_TCP_PORT_BASE + num);
+	if ( getaddrinfo(host,port,&hints,&res) )
+		return -1;
+	for ( ai = res ; ai != NULL ; ai = ai->ai_next ) {
+		fd = socket(ai->ai_family,ai->ai_socktype|SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if ( fd == -1 )
+			continue;
+		if ( connect(fd,ai->ai_addr,ai->ai_addrlen) == 0 )
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	/* X11 requests are small and latency sensitive */
+	if ( fd != -1 )
+		setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+	return fd;
+}
+
+/*
+ * listen on the X11 socket of a display number, return the socket,
+ * -1 if the display is already used or -2 if the X11 socket directory 
+ * can not be used
+ */
+static int relay_listen_unix(int num)
+{
+	int fd;
+	struct stat st;
+	struct sockaddr_un sun;
+
+	if ( stat(X11_UNIX_SOCKET_DIR,&st) || ! S_ISDIR(st.st_mode) )
+		return -2;
+
+	fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if ( fd == -1 )
+		return -2;
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path,sizeof(sun.sun_path),
+		 X11_UNIX_SOCKET_PATTERN,num);
+	if ( bind(fd,(struct sockaddr*) &sun,sizeof(sun)) ) {
+		close(fd);
+		if ( errno != EADDRINUSE )
+			return -2;
+		/* reuse the sockets left by relays that did not exit 
+		 * properly, nobody listening on them anymore */
+		fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if ( fd == -1 )
+			return -2;
+		if ( connect(fd,(struct sockaddr*) &sun,sizeof(sun)) == 0 ||
+		     errno != ECONNREFUSED || unlink(sun.sun_path) ||
+		     bind(fd,(struct sockaddr*) &sun,sizeof(sun)) ) {
+			close(fd);
+			return -1;
+		}
+	}
+	if ( listen(fd,128) ) {
+		close(fd);
+		unlink(sun.sun_path);
+		return -2;
+	}
+
+	return fd;
+}
+
+/*
+ * get the address of host the other nodes reach it on, skipping the 
+ * loopback addresses some systems give to their own hostname
+ */
+static int relay_host_addr(const char* host,struct in_addr* addr)
+{
+	struct addrinfo hints;
+	struct addrinfo* res;
+	struct addrinfo* ai;
+	struct sockaddr_in* sin;
+	int rc = -1;
+
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo(host,NULL,&hints,&res) )
+		return -1;
+	for ( ai = res ; ai != NULL ; ai = ai->ai_next ) {
+		sin = (struct sockaddr_in*) ai->ai_addr;
+		if ( ( ntohl(sin->sin_addr.s_addr) >> 24 ) == IN_LOOPBACKNET )
+			continue;
+		*addr = sin->sin_addr;
+		rc = 0;
+		break;
+	}
+	freeaddrinfo(res);
+
+	return rc;
+}
+
+int x11_relay_listen(struct x11_relay* relay,const char* host)
+{
+	int fd;
+	int ufd;
+	int n;
+	int one = 1;
+	struct sockaddr_in sin;
+
+	memset(&sin,0,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ( host != NULL && relay_host_addr(host,&sin.sin_addr) ) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+
+	for ( n = X11_RELAY_DISPLAY_FIRST ; 
+	      n < X11_RELAY_DISPLAY_FIRST + X11_RELAY_DISPLAY_COUNT ; n++ ) {
+		fd = socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0);
+		if ( fd == -1 )
+			return -1;
+		setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+		sin.sin_port = htons(X11_TCP_PORT_BASE + n);
+		if ( bind(fd,(struct sockaddr*) &sin,sizeof(sin)) ||
+		     listen(fd,128) ) {
+			close(fd);
+			continue;
+		}
+
+		/* the X11 socket of the display must be free too, local 
+		 * clients being only relayed using TCP without it */
+		ufd = relay_listen_unix(n);
+		if ( ufd == -1 ) {
+			close(fd);
+			continue;
+		}
+
+		relay->num = n;
+		relay->tcp_fd = fd;
+		inet_ntop(AF_INET,&sin.sin_addr,relay->tcp_addr,
+			  sizeof(relay->tcp_addr));
+		relay->unix_fd = ( ufd < 0 ) ? -1 : ufd ;
+		relay->unix_path[0] = '\0';
+		relay->compress = 0;
+		relay->cache = 0;
+		relay->images = 0;
+		relay->auth_len = 0;
+		relay->target_proto[0] = '\0';
+		relay->target_auth_len = 0;
+		if ( ufd >= 0 )
+			snprintf(relay->unix_path,sizeof(relay->unix_path),
+				 X11_UNIX_SOCKET_PATTERN,n);
+		return 0;
+	}
+
+	return -1;
+}
+
+void x11_relay_close(struct x11_relay* relay,int unlink_flag)
+{
+	if ( relay->tcp_fd != -1 )
+		close(relay->tcp_fd);
+	if ( relay->unix_fd != -1 )
+		close(relay->unix_fd);
+	relay->tcp_fd = -1;
+	relay->unix_fd = -1;
+
+	if ( unlink_flag && relay->unix_path[0] != '\0' ) {
+		unlink(relay->unix_path);
+		relay->unix_path[0] = '\0';
+	}
+}
+
+static double relay_elapsed(struct timespec* t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC,&t1);
+	return ( t1.tv_sec - t0->tv_sec ) + 
+		( t1.tv_nsec - t0->tv_nsec ) / 1000000000.0 ;
+}
+
+static struct relay_codec* relay_codec_new(int mode)
+{
+	struct relay_codec* c;
+	int rc;
+
+	c = (struct relay_codec*) calloc(1,sizeof(struct relay_codec));
+	if ( c == NULL )
+		return NULL;
+	c->mode = mode;
+	c->level = 1;
+	c->zlevel = 1;
+	if ( mode == RELAY_CODEC_ENCODE )
+		rc = deflateInit(&c->z,c->zlevel);
+	else {
+		c->rx = (char*) malloc(RELAY_BUFSIZE);
+		rc = ( c->rx == NULL ) ? Z_MEM_ERROR : inflateInit(&c->z) ;
+	}
+	if ( rc != Z_OK ) {
+		free(c->rx);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+static void relay_codec_free(struct relay_codec* c)
+{
+	if ( c->raw > 0 )
+		fprintf(stderr,"x11 relay: %s %llu bytes as %llu bytes "
+			"(ratio %.2f) in %.1f ms\n",
+			( c->mode == RELAY_CODEC_ENCODE ) ? 
+			"compressed" : "decompressed",c->raw,c->wire,
+			( c->wire > 0 ) ? (double) c->raw / c->wire : 0.0,
+			c->time * 1000);
+	if ( c->mode == RELAY_CODEC_ENCODE )
+		deflateEnd(&c->z);
+	else
+		inflateEnd(&c->z);
+	free(c->rx);
+	free(c);
+}
+
+/*
+ * move the pending data of a buffer to its beginning
+ */
+static void relay_pipe_compact(struct relay_pipe* p)
+{
+	if ( p->off > 0 && p->len > 0 )
+		memmove(p->buf,p->buf + p->off,p->len);
+	p->off = 0;
+}
+
+/*
+ * append a chunk of data as a frame to the buffer, the caller ensuring
+ * that there is room for it
+ */
+static void relay_frame(struct relay_pipe* p,char* chunk,size_t n)
+{
+	struct relay_codec* c = p->codec;
+	struct timespec t0;
+	unsigned char* frame;
+	size_t len;
+	int type = RELAY_FRAME_RAW;
+	int rc;
+
+	/* adapt the compression level to the backlog */
+	if ( p->len > 0 ) {
+		c->idle = 0;
+		if ( c->level < RELAY_ZLEVEL_MAX )
+			c->level++;
+	}
+	else if ( ++c->idle >= RELAY_ZIDLE && c->level > 0 ) {
+		c->idle = 0;
+		c->level--;
+	}
+
+	frame = (unsigned char*) p->buf + p->len;
+	len = n;
+	if ( c->skip > 0 )
+		c->skip--;
+	else if ( c->level > 0 && n >= RELAY_ZMIN ) {
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		if ( c->zlevel != c->level &&
+		     deflateParams(&c->z,c->level,Z_DEFAULT_STRATEGY) == Z_OK )
+			c->zlevel = c->level;
+		/* only keep the output if it saves at least 1/16 */
+		c->z.next_in = (unsigned char*) chunk;
+		c->z.avail_in = n;
+		c->z.next_out = frame + RELAY_FRAME_HDR;
+		c->z.avail_out = n - n / 16;
+		rc = deflate(&c->z,Z_SYNC_FLUSH);
+		if ( rc == Z_OK && c->z.avail_in == 0 && c->z.avail_out > 0 ) {
+			type = RELAY_FRAME_DEFLATE;
+			len = n - n / 16 - c->z.avail_out;
+			c->backoff = 0;
+		}
+		else {
+			deflateReset(&c->z);
+			type = RELAY_FRAME_RESET;
+			c->backoff = ( c->backoff == 0 ) ? 1 : 2 * c->backoff ;
+			if ( c->backoff > RELAY_ZSKIP_MAX )
+				c->backoff = RELAY_ZSKIP_MAX;
+			c->skip = c->backoff;
+		}
+		c->time += relay_elapsed(&t0);
+	}
+	if ( type != RELAY_FRAME_DEFLATE )
+		memcpy(frame + RELAY_FRAME_HDR,chunk,n);
+
+	frame[0] = type;
+	frame[1] = ( len >> 16 ) & 0xff;
+	frame[2] = ( len >> 8 ) & 0xff;
+	frame[3] = len & 0xff;
+	p->len += RELAY_FRAME_HDR + len;
+	c->raw += n;
+	c->wire += RELAY_FRAME_HDR + len;
+}
+
+/*
+ * read a chunk of data and append it as a frame to the buffer
+ */
+static int relay_encode(int fd,struct relay_pipe* p)
+{
+	char chunk[RELAY_ZCHUNK];
+	size_t max;
+	ssize_t n;
+
+	relay_pipe_compact(p);
+	if ( p->size - p->len <= RELAY_FRAME_HDR )
+		return 0;
+	max = p->size - p->len - RELAY_FRAME_HDR;
+	if ( max > RELAY_ZCHUNK )
+		max = RELAY_ZCHUNK;
+
+	n = read(fd,chunk,max);
+	if ( n == 0 ) {
+		p->eof = 1;
+		return 0;
+	}
+	else if ( n == -1 )
+		return ( errno == EAGAIN || errno == EINTR ) ? 0 : -1 ;
+
+	relay_frame(p,chunk,n);
+
+	return 0;
+}
+
+/*
+ * decode the received frames into the buffer as long as there is room
+ */
+static int relay_decode(struct relay_pipe* p)
+{
+	struct relay_codec* c = p->codec;
+	struct timespec t0;
+	unsigned char* h;
+	size_t used = 0;
+	size_t len;
+	size_t in;
+	size_t out;
+	int rc;
+
+	relay_pipe_compact(p);
+	while ( p->len < p->size ) {
+		/* start the next frame once the current one is complete */
+		if ( c->fleft == 0 && ! c->zpending ) {
+			if ( c->rxlen - used < RELAY_FRAME_HDR )
+				break;
+			h = (unsigned char*) c->rx + used;
+			c->ftype = h[0];
+			c->fleft = ( h[1] << 16 ) | ( h[2] << 8 ) | h[3];
+			used += RELAY_FRAME_HDR;
+			if ( c->ftype == RELAY_FRAME_RESET )
+				inflateReset(&c->z);
+			else if ( c->ftype != RELAY_FRAME_RAW &&
+				  c->ftype != RELAY_FRAME_DEFLATE )
+				return -1;
+			continue;
+		}
+
+		len = c->rxlen - used;
+		if ( len > c->fleft )
+			len = c->fleft;
+		if ( c->ftype == RELAY_FRAME_DEFLATE ) {
+			/* pending output of the previous input is flushed
+			 * even without new input */
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			c->z.next_in = (unsigned char*) c->rx + used;
+			c->z.avail_in = len;
+			c->z.next_out = (unsigned char*) p->buf + p->len;
+			c->z.avail_out = p->size - p->len;
+			rc = inflate(&c->z,Z_SYNC_FLUSH);
+			c->time += relay_elapsed(&t0);
+			if ( rc != Z_OK && rc != Z_BUF_ERROR )
+				return -1;
+			in = len - c->z.avail_in;
+			out = p->size - p->len - c->z.avail_out;
+			c->zpending = ( c->z.avail_out == 0 );
+			if ( in == 0 && out == 0 ) {
+				c->zpending = 0;
+				if ( len > 0 )
+					return -1;
+				if ( c->fleft > 0 )
+					break;
+				continue;
+			}
+		}
+		else {
+			if ( len == 0 )
+				break;
+			in = out = ( len < p->size - p->len ) ?
+				len : p->size - p->len ;
+			memcpy(p->buf + p->len,c->rx + used,out);
+		}
+		used += in;
+		c->fleft -= in;
+		p->len += out;
+		c->raw += out;
+	}
+
+	if ( used > 0 ) {
+		c->rxlen -= used;
+		memmove(c->rx,c->rx + used,c->rxlen);
+	}
+	if ( c->rxeof && c->rxlen == 0 && c->fleft == 0 && ! c->zpending )
+		p->eof = 1;
+
+	return 0;
+}
+
+static int relay_pipe_init(struct relay_pipe* p,int copy)
+{
+	int size;
+
+	if ( ! copy && pipe2(p->pfd,O_NONBLOCK|O_CLOEXEC) == 0 ) {
+		size = fcntl(p->pfd[0],F_GETPIPE_SZ);
+		p->size = ( size > 0 ) ? size : RELAY_BUFSIZE ;
+		return 0;
+	}
+
+	p->pfd[0] = p->pfd[1] = -1;
+	p->buf = (char*) malloc(RELAY_BUFSIZE);
+	p->size = RELAY_BUFSIZE;
+
+	return ( p->buf == NULL ) ? -1 : 0 ;
+}
+
+/*
+ * switch to user space copies when splice is not supported
+ */
+static int relay_pipe_fallback(struct relay_pipe* p)
+{
+	close(p->pfd[0]);
+	close(p->pfd[1]);
+	p->pfd[0] = p->pfd[1] = -1;
+	p->buf = (char*) malloc(RELAY_BUFSIZE);
+	p->size = RELAY_BUFSIZE;
+
+	return ( p->buf == NULL ) ? -1 : 0 ;
+}
+
+static void relay_pipe_free(struct relay_pipe* p)
+{
+	if ( p->pfd[0] != -1 ) {
+		close(p->pfd[0]);
+		close(p->pfd[1]);
+	}
+	if ( p->codec != NULL )
+		relay_codec_free(p->codec);
+	free(p->buf);
+}
+
+/*
+ * tell if there is room to read more data on the side a pipe reads from
+ */
+static int relay_pipe_room(struct relay_pipe* p)
+{
+	if ( p->eof )
+		return 0;
+	if ( p->codec != NULL && p->codec->mode == RELAY_CODEC_DECODE )
+		return ! p->codec->rxeof && p->codec->rxlen < RELAY_BUFSIZE;
+	if ( p->codec != NULL )
+		return p->size - p->len > RELAY_FRAME_HDR;
+
+	return ! p->full && p->len < p->size;
+}
+
+static int relay_arm(int efd,struct relay_end* end,unsigned int events)
+{
+	struct epoll_event ev;
+
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = end;
+	end->events = events;
+	end->armed = 1;
+
+	return epoll_ctl(efd,EPOLL_CTL_MOD,end->fd,&ev);
+}
+
+/*
+ * update the events a side of a connection is waiting for, reading
+ * is only done when there is room to store the data and writing when
+ * data is pending
+ */
+static int relay_update(int efd,struct relay_end* end,
+			struct relay_pipe* in,struct relay_pipe* out)
+{
+	unsigned int events = 0;
+
+	if ( relay_pipe_room(in) )
+		events |= EPOLLIN;
+	if ( out->len > 0 )
+		events |= EPOLLOUT;
+	if ( events == 0 || ( end->armed && events == end->events ) )
+		return 0;
+
+	return relay_arm(efd,end,events);
+}
+
+static void relay_close(int efd,struct relay_conn* conn)
+{
+	epoll_ctl(efd,EPOLL_CTL_DEL,conn->client.fd,NULL);
+	close(conn->client.fd);
+	if ( conn->server.fd != -1 ) {
+		epoll_ctl(efd,EPOLL_CTL_DEL,conn->server.fd,NULL);
+		close(conn->server.fd);
+	}
+	relay_pipe_free(&conn->c2s);
+	relay_pipe_free(&conn->s2c);
+	relay_pipe_free(&conn->cin);
+	relay_pipe_free(&conn->cout);
+	if ( conn->xp != NULL )
+		x11_proto_free(conn->xp);
+	free(conn);
+}
+
+/*
+ * get the pipes data is read into and written from for a side
+ */
+static void relay_pipes(struct relay_conn* conn,struct relay_end* end,
+			struct relay_pipe** in,struct relay_pipe** out)
+{
+	if ( end == &conn->server ) {
+		*in = &conn->s2c;
+		*out = &conn->c2s;
+	}
+	else if ( conn->xp != NULL ) {
+		*in = &conn->cin;
+		*out = &conn->cout;
+	}
+	else {
+		*in = &conn->c2s;
+		*out = &conn->s2c;
+	}
+}
+
+/*
+ * get where data can be appended to a pipe, a chunk being used to frame
+ * it afterwards when the pipe is compressed
+ */
+static char* relay_filter_room(struct relay_pipe* p,char* chunk,
+			       size_t* room)
+{
+	relay_pipe_compact(p);
+	*room = p->size - p->len;
+	if ( p->codec == NULL )
+		return p->buf + p->len;
+
+	*room = ( *room > RELAY_FRAME_HDR ) ? *room - RELAY_FRAME_HDR : 0 ;
+	if ( *room > RELAY_ZCHUNK )
+		*room = RELAY_ZCHUNK;
+
+	return chunk;
+}
+
+static void relay_filter_append(struct relay_pipe* p,char* chunk,
+				size_t len)
+{
+	if ( len > 0 && p->codec != NULL )
+		relay_frame(p,chunk,len);
+	else
+		p->len += len;
+}
+
+/*
+ * release the data consumed from a pipe, decoding more if compressed
+ */
+static int relay_filter_consume(struct relay_pipe* p,size_t len)
+{
+	p->off += len;
+	p->len -= len;
+	if ( len > 0 && p->codec != NULL )
+		return relay_decode(p);
+
+	return 0;
+}
+
+/*
+ * move the data of the client and of the server through the X11 
+ * protocol filter, return the number of bytes processed or -1 on error
+ */
+static int relay_filter(struct relay_conn* conn)
+{
+	struct relay_pipe* in;
+	struct relay_pipe* out;
+	char chunk[RELAY_ZCHUNK];
+	char* data;
+	size_t room;
+	size_t len;
+	ssize_t n;
+	int moved = 0;
+
+	/* client to server */
+	in = &conn->cin;
+	out = &conn->c2s;
+	data = relay_filter_room(out,chunk,&room);
+	n = x11_proto_client(conn->xp,in->buf + in->off,in->len,in->eof,
+			     data,room,&len);
+	if ( n < 0 || relay_filter_consume(in,n) )
+		return -1;
+	relay_filter_append(out,chunk,len);
+	moved += n + len;
+	if ( in->eof && in->len == 0 && 
+	     ! x11_proto_client_pending(conn->xp) && ! out->eof )
+		out->eof = 1;
+
+	/* server to client, with the replies answered from the cache */
+	in = &conn->s2c;
+	out = &conn->cout;
+	data = relay_filter_room(out,chunk,&room);
+	n = x11_proto_server(conn->xp,in->buf + in->off,in->len,
+			     data,room,&len);
+	if ( n < 0 || relay_filter_consume(in,n) )
+		return -1;
+	relay_filter_append(out,chunk,len);
+	moved += n + len;
+	if ( in->eof && in->len == 0 && ! x11_proto_pending(conn->xp) &&
+	     ! out->eof )
+		out->eof = 1;
+
+	return moved;
+}
+
+/*
+ * read what is available on a side, return -1 on error
+ */
+static int relay_read(int fd,struct relay_pipe* p)
+{
+	struct relay_codec* c = p->codec;
+	ssize_t n;
+
+	if ( c != NULL && c->mode == RELAY_CODEC_ENCODE )
+		return relay_encode(fd,p);
+
+	if ( c != NULL ) {
+		n = read(fd,c->rx + c->rxlen,RELAY_BUFSIZE - c->rxlen);
+		if ( n > 0 ) {
+			c->rxlen += n;
+			c->wire += n;
+		}
+		else if ( n == 0 )
+			c->rxeof = 1;
+		else if ( errno != EAGAIN && errno != EINTR )
+			return -1;
+		return relay_decode(p);
+	}
+
+	if ( p->buf == NULL ) {
+		n = splice(fd,NULL,p->pfd[1],NULL,p->size - p->len,
+			   RELAY_SPLICE_FLAGS);
+		if ( n == -1 && errno == EINVAL && p->len == 0 ) {
+			if ( relay_pipe_fallback(p) )
+				return -1;
+			return relay_read(fd,p);
+		}
+		/* the pipe can be full before its size is reached as
+		 * partially filled pages use a whole slot */
+		if ( n == -1 && errno == EAGAIN && p->len > 0 )
+			p->full = 1;
+	}
+	else {
+		if ( p->len == 0 )
+			p->off = 0;
+		else if ( p->off + p->len == p->size ) {
+			memmove(p->buf,p->buf + p->off,p->len);
+			p->off = 0;
+		}
+		n = read(fd,p->buf + p->off + p->len,
+			 p->size - p->off - p->len);
+	}
+
+	if ( n > 0 )
+		p->len += n;
+	else if ( n == 0 )
+		p->eof = 1;
+	else if ( errno != EAGAIN && errno != EINTR )
+		return -1;
+
+	return 0;
+}
+
+/*
+ * write the pending data to a side, propagating the end of stream 
+ * once everything was written, return -1 on error
+ */
+static int relay_write(int fd,struct relay_pipe* p)
+{
+	ssize_t n;
+
+write:
+	while ( p->len > 0 ) {
+		if ( p->buf == NULL )
+			n = splice(p->pfd[0],NULL,fd,NULL,p->len,
+				   RELAY_SPLICE_FLAGS);
+		else
+			n = write(fd,p->buf + p->off,p->len);
+		if ( n == -1 ) {
+			if ( errno == EAGAIN )
+				break;
+			if ( errno == EINTR )
+				continue;
+			return -1;
+		}
+		p->off += n;
+		p->len -= n;
+		p->full = 0;
+	}
+
+	/* decode the frames waiting for room in the buffer */
+	if ( p->len == 0 && p->codec != NULL && 
+	     p->codec->mode == RELAY_CODEC_DECODE ) {
+		if ( relay_decode(p) )
+			return -1;
+		if ( p->len > 0 )
+			goto write;
+	}
+
+	if ( p->len == 0 && p->eof == 1 ) {
+		shutdown(fd,SHUT_WR);
+		p->eof = 2;
+	}
+
+	return 0;
+}
+
+/*
+ * connect the X server of a new connection, compressing the traffic
+ * with the client when zclient is set or with the target when it is
+ * another relay and compression is enabled. The X11 protocol is 
+ * filtered to use the cache or to encode or decode the image deltas. 
+ * Return -1 if the connection has to be closed.
+ */
+static int relay_connect(int efd,struct relay_conn* conn,
+			 struct x11_relay* relay,const char* target,
+			 int zclient)
+{
+	int sfd;
+	int zserver;
+	int flags = 0;
+	const char* magic;
+	struct relay_pipe* zin;
+	struct relay_pipe* zout;
+	struct epoll_event ev;
+
+	sfd = x11_display_connect(target);
+	if ( sfd == -1 ) {
+		fprintf(stderr,"warning: relay unable to connect DISPLAY "
+			"%s\n",target);
+		return -1;
+	}
+	conn->server.fd = sfd;
+
+	/* compressed streams are not re-compressed */
+	zserver = ( relay->compress && ! zclient );
+	magic = relay->images ? RELAY_ZMAGIC_IMAGES : RELAY_ZMAGIC ;
+	if ( zserver && write(sfd,magic,RELAY_ZMAGIC_LEN) != 
+	     RELAY_ZMAGIC_LEN )
+		return -1;
+	fcntl(sfd,F_SETFL,fcntl(sfd,F_GETFL) | O_NONBLOCK);
+
+	if ( relay->cache && ! zclient )
+		flags |= X11_PROTO_CACHE;
+	if ( zserver && relay->images )
+		flags |= X11_PROTO_IMAGE_ENCODE;
+	if ( zclient == RELAY_ZCLIENT_IMAGES )
+		flags |= X11_PROTO_IMAGE_DECODE;
+
+	/* the protocol is filtered using buffers, not pipes */
+	if ( flags ) {
+		conn->xp = x11_proto_new(flags);
+		if ( conn->xp == NULL || relay_pipe_init(&conn->cin,1) ||
+		     relay_pipe_init(&conn->cout,1) )
+			return -1;
+	}
+
+	if ( relay_pipe_init(&conn->c2s,zclient || zserver || flags) ||
+	     relay_pipe_init(&conn->s2c,zclient || zserver || flags) )
+		return -1;
+
+	/* the data of a compressed client is decoded before the filter */
+	if ( zclient ) {
+		zin = conn->xp ? &conn->cin : &conn->c2s ;
+		zout = conn->xp ? &conn->cout : &conn->s2c ;
+		zin->codec = relay_codec_new(RELAY_CODEC_DECODE);
+		zout->codec = relay_codec_new(RELAY_CODEC_ENCODE);
+		if ( zin->codec == NULL || zout->codec == NULL )
+			return -1;
+	}
+	else if ( zserver ) {
+		conn->c2s.codec = relay_codec_new(RELAY_CODEC_ENCODE);
+		conn->s2c.codec = relay_codec_new(RELAY_CODEC_DECODE);
+		if ( conn->c2s.codec == NULL || conn->s2c.codec == NULL )
+			return -1;
+	}
+
+	conn->server.conn = conn;
+	conn->server.events = EPOLLIN;
+	conn->server.armed = 1;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &conn->server;
+
+	return epoll_ctl(efd,EPOLL_CTL_ADD,sfd,&ev);
+}
+
+static size_t relay_get16(const unsigned char* p,int big)
+{
+	return big ? ( p[0] << 8 ) | p[1] : ( p[1] << 8 ) | p[0] ;
+}
+
+static void relay_put16(unsigned char* p,size_t v,int big)
+{
+	p[big ? 0 : 1] = ( v >> 8 ) & 0xff;
+	p[big ? 1 : 0] = v & 0xff;
+}
+
+/*
+ * read the connection setup of a client once it is complete, check that
+ * it presents the cookie of the relay and send it to the X server with
+ * the authorization of the target instead. Return 0 to wait for more
+ * data or -1 if the connection has to be closed.
+ */
+static int relay_auth(int efd,struct relay_conn* conn,
+		      struct x11_relay* relay,const char* target)
+{
+	unsigned char in[RELAY_SETUP_MAX];
+	unsigned char out[RELAY_SETUP_MAX];
+	size_t nlen, dlen, len;
+	ssize_t n;
+	int big;
+
+	n = recv(conn->client.fd,in,sizeof(in),MSG_PEEK);
+	if ( n == -1 )
+		return ( errno == EAGAIN || errno == EINTR ) ? 0 : -1 ;
+	else if ( n == 0 || ( in[0] != 'B' && in[0] != 'l' ) )
+		return -1;
+	if ( n < 12 )
+		return 0;
+
+	big = ( in[0] == 'B' );
+	nlen = relay_get16(in+6,big);
+	dlen = relay_get16(in+8,big);
+	len = 12 + RELAY_PAD4(nlen) + RELAY_PAD4(dlen);
+	if ( len > sizeof(in) )
+		return -1;
+	if ( (size_t) n < len )
+		return 0;
+
+	if ( nlen != strlen(X11_RELAY_AUTH_PROTO) ||
+	     memcmp(in+12,X11_RELAY_AUTH_PROTO,nlen) ||
+	     dlen != (size_t) relay->auth_len ||
+	     memcmp(in+12+RELAY_PAD4(nlen),relay->auth,dlen) ) {
+		fprintf(stderr,"warning: relay rejecting X11 client with "
+			"a wrong authorization\n");
+		return -1;
+	}
+	if ( recv(conn->client.fd,in,len,0) != (ssize_t) len )
+		return -1;
+
+	/* same setup with the authorization of the target */
+	nlen = strlen(relay->target_proto);
+	dlen = relay->target_auth_len;
+	memset(out,0,sizeof(out));
+	memcpy(out,in,6);
+	relay_put16(out+6,nlen,big);
+	relay_put16(out+8,dlen,big);
+	memcpy(out+12,relay->target_proto,nlen);
+	memcpy(out+12+RELAY_PAD4(nlen),relay->target_auth,dlen);
+	len = 12 + RELAY_PAD4(nlen) + RELAY_PAD4(dlen);
+
+	/* nothing was sent to the new X server connection yet */
+	if ( relay_connect(efd,conn,relay,target,0) ||
+	     write(conn->server.fd,out,len) != (ssize_t) len )
+		return -1;
+
+	return 0;
+}
+
+/*
+ * look at the first bytes of a TCP client to detect a compressed stream
+ * sent by another relay before connecting the X server, return 0 to 
+ * wait for more data or -1 if the connection has to be closed. The 
+ * clients of a relay with a cookie are all checked first, other relays
+ * never sending compressed streams to such a relay.
+ */
+static int relay_detect(int efd,struct relay_conn* conn,
+			struct x11_relay* relay,const char* target)
+{
+	char magic[RELAY_ZMAGIC_LEN];
+	ssize_t n;
+	int zclient;
+
+	if ( relay->auth_len > 0 )
+		return relay_auth(efd,conn,relay,target);
+
+	n = recv(conn->client.fd,magic,RELAY_ZMAGIC_LEN,MSG_PEEK);
+	if ( n == -1 )
+		return ( errno == EAGAIN || errno == EINTR ) ? 0 : -1 ;
+	else if ( n == 0 )
+		return -1;
+
+	if ( magic[0] != RELAY_ZMAGIC[0] )
+		return relay_connect(efd,conn,relay,target,0);
+	if ( n < RELAY_ZMAGIC_LEN )
+		return 0;
+	if ( memcmp(magic,RELAY_ZMAGIC,RELAY_ZMAGIC_LEN) == 0 )
+		zclient = RELAY_ZCLIENT;
+	else if ( memcmp(magic,RELAY_ZMAGIC_IMAGES,RELAY_ZMAGIC_LEN) == 0 )
+		zclient = RELAY_ZCLIENT_IMAGES;
+	else
+		return -1;
+	if ( recv(conn->client.fd,magic,RELAY_ZMAGIC_LEN,0) != 
+	     RELAY_ZMAGIC_LEN )
+		return -1;
+
+	return relay_connect(efd,conn,relay,target,zclient);
+}
+
+static int relay_accept(int efd,int lfd,struct x11_relay* relay,
+			const char* target)
+{
+	int cfd;
+	int one = 1;
+	struct relay_conn* conn;
+	struct epoll_event ev;
+
+	cfd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC|SOCK_NONBLOCK);
+	if ( cfd == -1 )
+		return ( errno == EAGAIN || errno == EINTR ||
+			 errno == ECONNABORTED ) ? 0 : -1 ;
+	setsockopt(cfd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+	conn = (struct relay_conn*) calloc(1,sizeof(struct relay_conn));
+	if ( conn == NULL ) {
+		close(cfd);
+		return 0;
+	}
+	conn->c2s.pfd[0] = conn->c2s.pfd[1] = -1;
+	conn->s2c.pfd[0] = conn->s2c.pfd[1] = -1;
+	conn->cin.pfd[0] = conn->cin.pfd[1] = -1;
+	conn->cout.pfd[0] = conn->cout.pfd[1] = -1;
+	conn->client.conn = conn;
+	conn->client.fd = cfd;
+	conn->client.events = EPOLLIN;
+	conn->client.armed = 1;
+	conn->server.fd = -1;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &conn->client;
+	if ( epoll_ctl(efd,EPOLL_CTL_ADD,cfd,&ev) ) {
+		relay_close(efd,conn);
+		return 0;
+	}
+
+	/* the X server is connected once the stream type is known, local
+	 * clients always being X11 clients, or once the authorization is
+	 * checked */
+	if ( lfd == relay->unix_fd && relay->auth_len == 0 &&
+	     relay_connect(efd,conn,relay,target,0) )
+		relay_close(efd,conn);
+
+	return 0;
+}
+
+int x11_relay_run(struct x11_relay* relay,const char* target)
+{
+	int efd;
+	int n, i;
+	int rc;
+	int lfds[2];
+	struct epoll_event ev;
+	struct epoll_event events[RELAY_MAX_EVENTS];
+	struct relay_end* end;
+	struct relay_end listeners[2];
+	struct relay_conn* conn;
+	struct relay_pipe* in;
+	struct relay_pipe* out;
+	struct relay_pipe* pin;
+	struct relay_pipe* pout;
+	struct relay_end* peer;
+	int moved;
+
+	/* write errors are handled when the clients go away */
+	signal(SIGPIPE,SIG_IGN);
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if ( efd == -1 )
+		return -1;
+
+	/* the listening sockets are identified by a NULL connection */
+	lfds[0] = relay->tcp_fd;
+	lfds[1] = relay->unix_fd;
+	for ( i = 0 ; i < 2 ; i++ ) {
+		if ( lfds[i] == -1 )
+			continue;
+		listeners[i].conn = NULL;
+		listeners[i].fd = lfds[i];
+		ev.events = EPOLLIN;
+		ev.data.ptr = &listeners[i];
+		if ( epoll_ctl(efd,EPOLL_CTL_ADD,lfds[i],&ev) ) {
+			close(efd);
+			return -1;
+		}
+	}
+
+	while ( 1 ) {
+		n = epoll_wait(efd,events,RELAY_MAX_EVENTS,-1);
+		if ( n == -1 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+
+		for ( i = 0 ; i < n ; i++ ) {
+			end = (struct relay_end*) events[i].data.ptr;
+			if ( end == RELAY_CLOSED )
+				continue;
+			if ( end->conn == NULL ) {
+				if ( relay_accept(efd,end->fd,relay,target) )
+					goto exit;
+				continue;
+			}
+
+			conn = end->conn;
+			end->armed = 0;
+			if ( conn->server.fd == -1 ) {
+				rc = relay_detect(efd,conn,relay,target);
+				if ( rc == 0 && conn->server.fd == -1 )
+					rc = relay_arm(efd,end,EPOLLIN);
+				else if ( rc == 0 ) {
+					relay_pipes(conn,end,&in,&out);
+					rc = relay_update(efd,end,in,out);
+				}
+				if ( rc == 0 )
+					continue;
+				goto close;
+			}
+
+			/* identify the data flowing from and to this side */
+			peer = ( end == &conn->client ) ? 
+				&conn->server : &conn->client ;
+			relay_pipes(conn,end,&in,&out);
+			relay_pipes(conn,peer,&pin,&pout);
+
+			rc = 0;
+			if ( events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR) &&
+			     ! in->eof )
+				rc |= relay_read(end->fd,in);
+			/* forward what was just read without waiting, the
+			 * filter being run until nothing moves anymore */
+			if ( conn->xp != NULL && rc == 0 &&
+			     relay_filter(conn) < 0 )
+				rc = -1;
+			do {
+				if ( events[i].events & EPOLLOUT || 
+				     out->len > 0 || out->eof == 1 )
+					rc |= relay_write(end->fd,out);
+				if ( pout->len > 0 || pout->eof == 1 )
+					rc |= relay_write(peer->fd,pout);
+				moved = 0;
+				if ( conn->xp != NULL && rc == 0 ) {
+					moved = relay_filter(conn);
+					if ( moved < 0 )
+						rc = -1;
+				}
+			} while ( moved > 0 );
+
+			/* the connection is over when both streams ended */
+			if ( rc == 0 && ! ( events[i].events & EPOLLERR ) &&
+			     ( out->eof != 2 || pout->eof != 2 ) &&
+			     relay_update(efd,end,in,out) == 0 &&
+			     relay_update(efd,peer,pin,pout) == 0 )
+				continue;
+
+close:
+			relay_close(efd,conn);
+			/* skip the pending events of this connection */
+			for ( rc = i + 1 ; rc < n ; rc++ ) {
+				end = events[rc].data.ptr;
+				if ( end != RELAY_CLOSED && end->conn == conn )
+					events[rc].data.ptr = RELAY_CLOSED;
+			}
+		}
+	}
+
+exit:
+	close(efd);
+	return -1;
+}
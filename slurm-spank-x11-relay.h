@@ -0,0 +1,101 @@
+/***************************************************************************\
+ * slurm-spank-x11-relay.h - SLURM SPANK X11 helper task relay
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at 
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify 
+ * it under the terms of the GNU General Public License as published by the 
+ * Free Software Foundation; either version 2 of the License, or (at your 
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License 
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_RELAY_H
+#define _SLURM_SPANK_X11_RELAY_H
+
+/*
+ * X11 relay used to give access to an X11 tunnel through the local 
+ * X11 socket of a display and through the cluster network
+ */
+
+/* relay displays are searched from this number to avoid the range
+ * used by sshd X11 forwarding (X11DisplayOffset defaults to 10) */
+#define X11_RELAY_DISPLAY_FIRST     100
+#define X11_RELAY_DISPLAY_COUNT     900
+
+#define X11_TCP_PORT_BASE           6000
+#define X11_UNIX_SOCKET_DIR         "/tmp/.X11-unix"
+#define X11_UNIX_SOCKET_PATTERN     X11_UNIX_SOCKET_DIR "/X%d"
+
+/*
+ * sockets a relay listens on for a display number, unix_fd being -1 
+ * and unix_path empty when the X11 socket directory is not available,
+ * tcp_addr being the numeric IPv4 address of the TCP socket.
+ * compress can be set when the target is another relay to compress the
+ * traffic sent to it, images to also send the images as deltas of the
+ * previous ones, and cache to answer the idempotent requests of the X11
+ * clients from a cache.
+ * When auth_len is set, the clients must present the auth cookie
+ * (MIT-MAGIC-COOKIE-1) of the relay in their connection setup, which is
+ * forwarded with the authorization of the target instead, the compressed
+ * streams of other relays being rejected. It can not be used with cache.
+ */
+#define X11_RELAY_AUTH_PROTO        "MIT-MAGIC-COOKIE-1"
+#define X11_RELAY_AUTH_LEN          16
+
+struct x11_relay {
+	int  num;
+	int  tcp_fd;
+	char tcp_addr[16];
+	int  unix_fd;
+	char unix_path[64];
+	int  compress;
+	int  images;
+	int  cache;
+	unsigned char auth[X11_RELAY_AUTH_LEN];
+	int  auth_len;
+	char target_proto[64];
+	unsigned char target_auth[256];
+	int  target_auth_len;
+};
+
+/*
+ * connect to the X server associated to a DISPLAY value, return a 
+ * connected socket or -1 on error
+ */
+int x11_display_connect(const char* display);
+
+/*
+ * listen on the TCP port and on the X11 socket of the first free 
+ * display number of the relay range, return 0 on success or -1 on error.
+ * The TCP port is only bound to the loopback interface when host is
+ * NULL, and to the first address of host that is not a loopback one 
+ * otherwise (the address the other nodes reach it on).
+ */
+int x11_relay_listen(struct x11_relay* relay,const char* host);
+
+/*
+ * accept X11 clients on the listening sockets and forward their traffic
+ * to the X server of the target DISPLAY, only return on error
+ */
+int x11_relay_run(struct x11_relay* relay,const char* target);
+
+/*
+ * close the listening sockets of a relay, also removing its X11 socket
+ * if unlink_flag is set
+ */
+void x11_relay_close(struct x11_relay* relay,int unlink_flag);
+
+#endif
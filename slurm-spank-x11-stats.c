@@ -0,0 +1,544 @@
+/***************************************************************************\
+ * slurm-spank-x11-stats.c - SLURM SPANK X11 node metrics library
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include "slurm-spank-x11-stats.h"
+
+#define STATS_MAGIC                 0x58313153u /* "X11S" */
+#define STATS_VERSION               3
+
+/* log-linear buckets, values below 4 having their own bucket */
+#define STATS_HIST_SUB              4
+#define STATS_HIST_MAXEXP           36
+#define STATS_HIST_BUCKETS          ( 4 + ( STATS_HIST_MAXEXP - 1 ) * \
+				      STATS_HIST_SUB )
+/* first exported bound, 2^10 us */
+#define STATS_HIST_MINEXP           9
+
+#define STATS_SLOTS                 4096
+
+/* DISPLAY references files of /tmp, tunnel ones containing a '@', holds 
+ * a '+' and end markers a ".end" suffix */
+#define STATS_REF_DIR               "/tmp"
+#define STATS_REF_PREFIX            "slurm-spank-x11."
+
+struct x11_stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+struct x11_stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t last_export;
+	uint64_t counters[X11_STATS_NCOUNTERS];
+	struct x11_stats_histogram hists[X11_STATS_NHISTS];
+	/* kind << 32 | pid of the holder, 0 when free */
+	uint64_t slots[STATS_SLOTS];
+};
+
+static const struct {
+	const char* name;
+	const char* help;
+} stats_counters[X11_STATS_NCOUNTERS] = {
+	{ "setups_total", "X11 tunnels requested by srun" },
+	{ "setup_failures_total", "Nodes that did not report a DISPLAY to "
+	  "srun" },
+	{ "ssh_failures_total", "ssh sessions of the helper tasks that "
+	  "failed" },
+	{ "relay_failures_total", "Nodes the tunnels could not be relayed "
+	  "to" },
+	{ "display_failures_total", "DISPLAY resolutions of the tasks that "
+	  "failed" },
+	{ "lazy_tunnels_total", "Lazy DISPLAYs published, the tunnel being "
+	  "established on the first X11 client" },
+	{ "lazy_unused_total", "Lazy DISPLAYs released without any X11 "
+	  "client, no tunnel being established" },
+	{ "job_infos_local_total", "Job infos taken from the local "
+	  "environment" },
+	{ "job_infos_rpc_total", "Job and step infos requested to "
+	  "slurmctld" },
+};
+
+static const struct {
+	const char* name;
+	const char* help;
+} stats_hists[X11_STATS_NHISTS] = {
+	{ "step_setup_seconds", "X11 setup latency of the steps in srun" },
+	{ "node_setup_seconds", "Tunnel setup latency of the nodes seen by "
+	  "srun" },
+	{ "display_resolve_seconds", "DISPLAY resolution latency of the "
+	  "steps in slurmstepd" },
+};
+
+static const char* stats_slots[X11_STATS_NSLOTKINDS] = {
+	NULL, "ssh", "display"
+};
+
+static struct x11_stats_shm* stats_shm = NULL;
+static char stats_path[PATH_MAX] = "";
+
+int x11_stats_open(const char* file)
+{
+	int fd;
+	int created = 1;
+	uint32_t header[2] = { STATS_MAGIC, STATS_VERSION };
+	uid_t uid = geteuid();
+	char shm_file[64];
+	struct stat st;
+	void* p;
+
+	snprintf(stats_path,sizeof(stats_path),"%s",
+		 ( file != NULL ) ? file : "");
+	if ( stats_shm != NULL )
+		return 0;
+
+	/* the file of the uid is only writable by it, a file planted by 
+	 * another user being never mapped */
+	snprintf(shm_file,sizeof(shm_file),STATS_SHM_PATTERN,
+		 (unsigned int) uid);
+	fd = open(shm_file,O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,0644);
+	if ( fd == -1 && errno == EEXIST ) {
+		fd = open(shm_file,O_RDWR|O_NOFOLLOW|O_CLOEXEC);
+		created = 0;
+	}
+	if ( fd == -1 )
+		return 10;
+
+	/* the header is written before the file gets its final size so 
+	 * that the other processes only map an initialized file */
+	if ( created && ( fchmod(fd,0644) ||
+			  pwrite(fd,header,sizeof(header),0) != 
+			  sizeof(header) ||
+			  ftruncate(fd,sizeof(struct x11_stats_shm)) ) ) {
+		close(fd);
+		return 20;
+	}
+	if ( fstat(fd,&st) || ! S_ISREG(st.st_mode) || st.st_uid != uid ||
+	     ( st.st_mode & 022 ) ||
+	     st.st_size != sizeof(struct x11_stats_shm) ) {
+		close(fd);
+		return 21;
+	}
+
+	p = mmap(NULL,sizeof(struct x11_stats_shm),PROT_READ|PROT_WRITE,
+		 MAP_SHARED,fd,0);
+	close(fd);
+	if ( p == MAP_FAILED )
+		return 30;
+	stats_shm = (struct x11_stats_shm*) p;
+	if ( stats_shm->magic != STATS_MAGIC ||
+	     stats_shm->version != STATS_VERSION ) {
+		munmap(p,sizeof(struct x11_stats_shm));
+		stats_shm = NULL;
+		return 31;
+	}
+
+	return 0;
+}
+
+void x11_stats_close(void)
+{
+	if ( stats_shm == NULL )
+		return;
+	x11_stats_flush(1);
+	munmap(stats_shm,sizeof(struct x11_stats_shm));
+	stats_shm = NULL;
+	stats_path[0] = '\0';
+}
+
+const char* x11_stats_file(void)
+{
+	if ( stats_shm == NULL || stats_path[0] == '\0' )
+		return NULL;
+
+	return stats_path;
+}
+
+uint64_t x11_stats_now(void)
+{
+	struct timespec mono;
+
+	if ( stats_shm == NULL )
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC,&mono);
+
+	return (uint64_t) mono.tv_sec * 1000000 + mono.tv_nsec / 1000;
+}
+
+void x11_stats_count(enum x11_stats_counter counter,uint64_t n)
+{
+	if ( stats_shm == NULL || counter >= X11_STATS_NCOUNTERS )
+		return;
+	__atomic_fetch_add(&stats_shm->counters[counter],n,__ATOMIC_RELAXED);
+	x11_stats_flush(0);
+}
+
+/*
+ * bucket of a value, a bucket b holding the values v such that 
+ * bound(b-1) < v <= bound(b)
+ */
+static int stats_bucket(uint64_t v)
+{
+	int e;
+
+	if ( v <= 4 )
+		return ( v == 0 ) ? 0 : (int) v - 1 ;
+	v--;
+	e = 63 - __builtin_clzll(v);
+	if ( e > STATS_HIST_MAXEXP )
+		return STATS_HIST_BUCKETS - 1;
+
+	return 4 + ( e - 2 ) * STATS_HIST_SUB + 
+		(int) ( ( v >> ( e - 2 ) ) & ( STATS_HIST_SUB - 1 ) );
+}
+
+void x11_stats_observe(enum x11_stats_hist hist,uint64_t start)
+{
+	struct x11_stats_histogram* h;
+	uint64_t now;
+
+	if ( stats_shm == NULL || hist >= X11_STATS_NHISTS )
+		return;
+	now = x11_stats_now();
+	if ( start == 0 || start > now )
+		start = now;
+
+	h = &stats_shm->hists[hist];
+	__atomic_fetch_add(&h->buckets[stats_bucket(now - start)],1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum,now - start,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count,1,__ATOMIC_RELAXED);
+	x11_stats_flush(0);
+}
+
+int x11_stats_hold(enum x11_stats_slot kind)
+{
+	uint64_t expected;
+	uint64_t value;
+	int i, start;
+
+	if ( stats_shm == NULL || kind <= 0 || kind >= X11_STATS_NSLOTKINDS )
+		return -1;
+
+	value = ( (uint64_t) kind << 32 ) | (uint32_t) getpid();
+	start = getpid() % STATS_SLOTS;
+	for ( i = 0 ; i < STATS_SLOTS ; i++ ) {
+		expected = 0;
+		if ( __atomic_compare_exchange_n(&stats_shm->slots[( start + i )
+						 % STATS_SLOTS],&expected,
+						 value,0,__ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED) ) {
+			x11_stats_flush(0);
+			return ( start + i ) % STATS_SLOTS;
+		}
+	}
+
+	return -1;
+}
+
+void x11_stats_release(int slot)
+{
+	if ( stats_shm == NULL || slot < 0 || slot >= STATS_SLOTS )
+		return;
+	__atomic_store_n(&stats_shm->slots[slot],0,__ATOMIC_RELAXED);
+	x11_stats_flush(0);
+}
+
+/*
+ * count the held slots of each kind, releasing the ones of the
+ * processes that are gone if release is set (shm being the mapped 
+ * metrics of the calling uid)
+ */
+static void stats_count_slots(struct x11_stats_shm* shm,int release,
+			      uint64_t* counts)
+{
+	uint64_t value;
+	uint32_t kind;
+	pid_t pid;
+	int i;
+
+	for ( i = 0 ; i < STATS_SLOTS ; i++ ) {
+		value = __atomic_load_n(&shm->slots[i],__ATOMIC_RELAXED);
+		if ( value == 0 )
+			continue;
+		kind = value >> 32;
+		pid = (pid_t) ( value & 0xffffffff );
+		if ( kill(pid,0) && errno == ESRCH ) {
+			if ( release )
+				__atomic_compare_exchange_n(&shm->slots[i],
+							    &value,0,0,
+							    __ATOMIC_RELAXED,
+							    __ATOMIC_RELAXED);
+			continue;
+		}
+		if ( kind < X11_STATS_NSLOTKINDS )
+			counts[kind]++;
+	}
+}
+
+/*
+ * read the metrics file of another uid into a private copy, plain reads
+ * being used so that its owner can not fault the calling process by
+ * truncating it. Return 0 if the file is valid.
+ */
+static int stats_read_file(const char* path,struct x11_stats_shm* copy)
+{
+	struct stat st;
+	unsigned int uid;
+	char* p = (char*) copy;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	if ( sscanf(path,STATS_SHM_PATTERN,&uid) != 1 )
+		return -1;
+	fd = open(path,O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if ( fd == -1 )
+		return -1;
+	if ( fstat(fd,&st) || ! S_ISREG(st.st_mode) || st.st_uid != uid ) {
+		close(fd);
+		return -1;
+	}
+	while ( len < sizeof(*copy) ) {
+		n = pread(fd,p + len,sizeof(*copy) - len,len);
+		if ( n == -1 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			break;
+		len += n;
+	}
+	close(fd);
+
+	return ( len == sizeof(*copy) && copy->magic == STATS_MAGIC &&
+		 copy->version == STATS_VERSION ) ? 0 : -1 ;
+}
+
+/*
+ * sum the metrics of all the uids of the node in sum and count their 
+ * held slots
+ */
+static void stats_sum(struct x11_stats_shm* sum,uint64_t* slots)
+{
+	struct x11_stats_shm* copy;
+	struct x11_stats_shm* shm;
+	char own[64];
+	glob_t g;
+	size_t f;
+	int i, b;
+
+	memset(sum,0,sizeof(*sum));
+	snprintf(own,sizeof(own),STATS_SHM_PATTERN,(unsigned int) geteuid());
+	copy = (struct x11_stats_shm*) malloc(sizeof(*copy));
+	if ( copy == NULL || glob(STATS_SHM_GLOB,GLOB_NOSORT,NULL,&g) )
+		g.gl_pathc = 0;
+
+	/* the mapped file of the calling uid is always part of the sum */
+	for ( f = 0 ; f <= g.gl_pathc ; f++ ) {
+		if ( f == g.gl_pathc )
+			shm = stats_shm;
+		else if ( strcmp(g.gl_pathv[f],own) == 0 ||
+			  stats_read_file(g.gl_pathv[f],copy) )
+			continue;
+		else
+			shm = copy;
+
+		stats_count_slots(shm,( shm == stats_shm ),slots);
+		for ( i = 0 ; i < X11_STATS_NCOUNTERS ; i++ )
+			sum->counters[i] += __atomic_load_n(&shm->counters[i],
+							    __ATOMIC_RELAXED);
+		for ( i = 0 ; i < X11_STATS_NHISTS ; i++ ) {
+			sum->hists[i].sum +=
+				__atomic_load_n(&shm->hists[i].sum,
+						__ATOMIC_RELAXED);
+			for ( b = 0 ; b < STATS_HIST_BUCKETS ; b++ )
+				sum->hists[i].buckets[b] +=
+					__atomic_load_n(&shm->hists[i].
+							buckets[b],
+							__ATOMIC_RELAXED);
+		}
+	}
+
+	if ( g.gl_pathc > 0 )
+		globfree(&g);
+	free(copy);
+}
+
+/*
+ * count the DISPLAY references files of the node
+ */
+static uint64_t stats_count_refs(void)
+{
+	DIR* dir;
+	struct dirent* ent;
+	uint64_t n = 0;
+
+	dir = opendir(STATS_REF_DIR);
+	if ( dir == NULL )
+		return 0;
+	while ( ( ent = readdir(dir) ) != NULL ) {
+		if ( strncmp(ent->d_name,STATS_REF_PREFIX,
+			     strlen(STATS_REF_PREFIX)) == 0 &&
+		     strpbrk(ent->d_name,"@+") == NULL &&
+		     strstr(ent->d_name,".end") == NULL )
+			n++;
+	}
+	closedir(dir);
+
+	return n;
+}
+
+int x11_stats_dump(FILE* stream)
+{
+	struct x11_stats_shm* sum;
+	struct x11_stats_histogram* h;
+	uint64_t slots[X11_STATS_NSLOTKINDS] = { 0 };
+	uint64_t refs;
+	uint64_t cumul;
+	int i, b, e;
+
+	if ( stats_shm == NULL )
+		return -1;
+
+	sum = (struct x11_stats_shm*) malloc(sizeof(*sum));
+	if ( sum == NULL )
+		return -1;
+	stats_sum(sum,slots);
+	fprintf(stream,"# HELP slurm_spank_x11_tunnels_active X11 tunnels "
+		"active on the node, ssh sessions run from it (login nodes) "
+		"and DISPLAY references held on it (compute nodes)\n"
+		"# TYPE slurm_spank_x11_tunnels_active gauge\n");
+	for ( i = 1 ; i < X11_STATS_NSLOTKINDS ; i++ )
+		fprintf(stream,"slurm_spank_x11_tunnels_active{side=\"%s\"} "
+			"%llu\n",stats_slots[i],(unsigned long long) slots[i]);
+
+	/* references that are no longer held by a live helper task */
+	refs = stats_count_refs();
+	fprintf(stream,"# HELP slurm_spank_x11_orphaned_refs DISPLAY "
+		"references files left in " STATS_REF_DIR " without helper "
+		"task\n# TYPE slurm_spank_x11_orphaned_refs gauge\n"
+		"slurm_spank_x11_orphaned_refs %llu\n",
+		(unsigned long long) ( ( refs > slots[X11_STATS_DISPLAY_REF] ) ?
+				       refs - slots[X11_STATS_DISPLAY_REF] : 0 ));
+
+	for ( i = 0 ; i < X11_STATS_NCOUNTERS ; i++ )
+		fprintf(stream,"# HELP slurm_spank_x11_%s %s\n"
+			"# TYPE slurm_spank_x11_%s counter\n"
+			"slurm_spank_x11_%s %llu\n",stats_counters[i].name,
+			stats_counters[i].help,stats_counters[i].name,
+			stats_counters[i].name,
+			(unsigned long long) sum->counters[i]);
+
+	/* only the power of two bounds are exported */
+	for ( i = 0 ; i < X11_STATS_NHISTS ; i++ ) {
+		h = &sum->hists[i];
+		fprintf(stream,"# HELP slurm_spank_x11_%s %s\n"
+			"# TYPE slurm_spank_x11_%s histogram\n",
+			stats_hists[i].name,stats_hists[i].help,
+			stats_hists[i].name);
+		cumul = 0;
+		for ( b = 0 ; b < STATS_HIST_BUCKETS ; b++ ) {
+			cumul += h->buckets[b];
+			if ( b < 4 || ( b - 4 ) % STATS_HIST_SUB !=
+			     STATS_HIST_SUB - 1 )
+				continue;
+			e = ( b - 4 ) / STATS_HIST_SUB + 2;
+			if ( e < STATS_HIST_MINEXP || b == STATS_HIST_BUCKETS - 1 )
+				continue;
+			fprintf(stream,"slurm_spank_x11_%s_bucket{le=\"%.6f\"} "
+				"%llu\n",stats_hists[i].name,
+				(double) ( 1ULL << ( e + 1 ) ) / 1000000,
+				(unsigned long long) cumul);
+		}
+		fprintf(stream,"slurm_spank_x11_%s_bucket{le=\"+Inf\"} %llu\n"
+			"slurm_spank_x11_%s_sum %.6f\n"
+			"slurm_spank_x11_%s_count %llu\n",stats_hists[i].name,
+			(unsigned long long) cumul,stats_hists[i].name,
+			(double) h->sum / 1000000,stats_hists[i].name,
+			(unsigned long long) cumul);
+	}
+	free(sum);
+
+	return ferror(stream) ? -1 : 0;
+}
+
+void x11_stats_flush(int force)
+{
+	uint64_t now;
+	uint64_t last;
+	char tmp[PATH_MAX + 32];
+	FILE* f;
+	int fd;
+	int rc;
+
+	if ( stats_shm == NULL || stats_path[0] == '\0' )
+		return;
+
+	/* only one process of the uid exports the metrics of an interval */
+	now = x11_stats_now() / 1000000;
+	last = __atomic_load_n(&stats_shm->last_export,__ATOMIC_RELAXED);
+	if ( ! force && ( now < last + STATS_EXPORT_INTERVAL ||
+			  ! __atomic_compare_exchange_n(&stats_shm->last_export,
+							&last,now,0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED) ) )
+		return;
+	if ( force )
+		__atomic_store_n(&stats_shm->last_export,now,__ATOMIC_RELAXED);
+
+	if ( snprintf(tmp,sizeof(tmp),"%s.%d.tmp",stats_path,(int) getpid())
+	     >= (int) sizeof(tmp) )
+		return;
+	fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,0644);
+	if ( fd == -1 )
+		return;
+	fchmod(fd,0644);
+	f = fdopen(fd,"w");
+	if ( f == NULL ) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	rc = x11_stats_dump(f);
+	if ( fclose(f) || rc || rename(tmp,stats_path) )
+		unlink(tmp);
+}
@@ -0,0 +1,128 @@
+/***************************************************************************\
+ * slurm-spank-x11-stats.h - SLURM SPANK X11 node metrics library
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_STATS_H
+#define _SLURM_SPANK_X11_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_SHM_PATTERN           "/dev/shm/slurm-spank-x11.stats.%u"
+#define STATS_SHM_GLOB              "/dev/shm/slurm-spank-x11.stats.*"
+#define STATS_EXPORT_INTERVAL       15
+
+/*
+ * the metrics of the node are kept in shared memory files, one per uid,
+ * mapped by the processes of the plugin running as this uid (srun and 
+ * helper tasks of the users, slurmstepd for root) and updated with 
+ * atomic operations only, without any lock. Each file is only writable
+ * by its owner and only mapped by processes of its owner, the metrics 
+ * of the node being the sum of the files, which are read into private
+ * memory to be exported.
+ *
+ * Counters only grow. Latencies are recorded in microseconds in
+ * log-linear histograms (4 sub-buckets per power of two, 25% precision)
+ * exported with power of two bounds. Active tunnels are held in slots
+ * tagged with the pid of their holder, so that the gauges do not drift
+ * when a holder is killed.
+ *
+ * When an export file is given, the metrics are written in it in the
+ * Prometheus text format (node_exporter textfile collector) at most
+ * every STATS_EXPORT_INTERVAL seconds per uid and when the metrics are
+ * closed, by whichever process updates them. The file is replaced 
+ * atomically.
+ *
+ * All the functions do nothing when the metrics are not opened.
+ */
+enum x11_stats_counter {
+	X11_STATS_SETUPS = 0,       /* tunnels requested by srun */
+	X11_STATS_SETUP_FAILURES,   /* nodes that did not report a DISPLAY */
+	X11_STATS_SSH_FAILURES,     /* ssh sessions that failed (exit 255) */
+	X11_STATS_RELAY_FAILURES,   /* nodes that could not be relayed */
+	X11_STATS_DISPLAY_FAILURES, /* DISPLAY resolutions that failed */
+	X11_STATS_LAZY_TUNNELS,     /* lazy DISPLAYs published */
+	X11_STATS_LAZY_UNUSED,      /* lazy DISPLAYs no client connected to */
+	X11_STATS_JOB_INFOS_LOCAL,  /* job infos taken from the local data */
+	X11_STATS_JOB_INFOS_RPC,    /* job infos requested to slurmctld */
+	X11_STATS_NCOUNTERS
+};
+
+enum x11_stats_hist {
+	X11_STATS_STEP_SETUP = 0,   /* X11 setup of a step by srun */
+	X11_STATS_NODE_SETUP,       /* tunnel setup of a node seen by srun */
+	X11_STATS_DISPLAY_RESOLVE,  /* DISPLAY resolution in slurmstepd */
+	X11_STATS_NHISTS
+};
+
+enum x11_stats_slot {
+	X11_STATS_SSH_TUNNEL = 1,   /* ssh session run from the node */
+	X11_STATS_DISPLAY_REF,      /* DISPLAY reference held on the node */
+	X11_STATS_NSLOTKINDS
+};
+
+int x11_stats_open(const char* file);
+
+/*
+ * export the metrics if an export file is set and unmap them
+ */
+void x11_stats_close(void);
+
+/*
+ * export file of the opened metrics or NULL
+ */
+const char* x11_stats_file(void);
+
+/*
+ * current timestamp in microseconds, 0 when the metrics are not opened
+ */
+uint64_t x11_stats_now(void);
+
+void x11_stats_count(enum x11_stats_counter counter,uint64_t n);
+
+/*
+ * record the latency of an operation started at start (taken from
+ * x11_stats_now) and ending now
+ */
+void x11_stats_observe(enum x11_stats_hist hist,uint64_t start);
+
+/*
+ * hold a slot of the given kind for the calling process, return its
+ * index to release or -1
+ */
+int x11_stats_hold(enum x11_stats_slot kind);
+
+void x11_stats_release(int slot);
+
+/*
+ * write the metrics to the export file if the export interval elapsed
+ * since the last export or if force is set
+ */
+void x11_stats_flush(int force);
+
+/*
+ * write the metrics in the Prometheus text format to a stream
+ */
+int x11_stats_dump(FILE* stream);
+
+#endif
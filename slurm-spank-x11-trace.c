@@ -0,0 +1,232 @@
+/***************************************************************************\
+ * slurm-spank-x11-trace.c - SLURM SPANK X11 setup tracing library
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+
+#include "slurm-spank-x11-trace.h"
+
+#define TRACE_EVENT_MAXLEN 1024
+
+static int trace_fd = -1;
+static uint32_t trace_pid = 0;
+static pid_t trace_tid = 0;
+static int64_t trace_anchor = 0;
+static char trace_role[64];
+static char trace_path[PATH_MAX];
+
+/*
+ * copy a string escaping the characters that are not allowed as is in
+ * a JSON string, truncating it if necessary
+ */
+static void trace_escape(char* out,size_t size,const char* in)
+{
+	size_t len = 0;
+	unsigned char c;
+
+	for ( ; *in != '\0' && len + 7 < size ; in++ ) {
+		c = (unsigned char) *in;
+		if ( c == '"' || c == '\\' ) {
+			out[len++] = '\\';
+			out[len++] = c;
+		}
+		else if ( c < 0x20 )
+			len += snprintf(out+len,size-len,"\\u%04x",c);
+		else
+			out[len++] = c;
+	}
+	out[len] = '\0';
+}
+
+static void trace_write(const char* buf,int len)
+{
+	if ( len <= 0 || len >= TRACE_EVENT_MAXLEN )
+		return;
+	while ( write(trace_fd,buf,len) == -1 && errno == EINTR ) ;
+}
+
+/*
+ * name the sub track of the calling process, done again in the children
+ * that inherit the trace (the tasks forked by slurmstepd for example)
+ */
+static void trace_name_thread(void)
+{
+	char buf[TRACE_EVENT_MAXLEN];
+	char role[128];
+
+	trace_tid = getpid();
+	trace_escape(role,sizeof(role),trace_role);
+	trace_write(buf,snprintf(buf,sizeof(buf),
+				 "{\"name\":\"thread_name\",\"ph\":\"M\","
+				 "\"pid\":%u,\"tid\":%d,\"args\":"
+				 "{\"name\":\"%s\"}},\n",trace_pid,
+				 (int) trace_tid,role));
+}
+
+int x11_trace_open(const char* dir,const char* refid,const char* role)
+{
+	char host[256];
+	char track[512];
+	char name[1024];
+	char buf[TRACE_EVENT_MAXLEN];
+	char* p;
+	int created = 1;
+	struct timespec mono, real;
+
+	x11_trace_close();
+
+	if ( dir == NULL || *dir == '\0' || refid == NULL )
+		return 10;
+
+	if ( gethostname(host,sizeof(host)) )
+		return 20;
+	host[sizeof(host)-1] = '\0';
+	p = strchr(host,'.');
+	if ( p != NULL )
+		*p = '\0';
+
+	if ( snprintf(trace_path,sizeof(trace_path),TRACE_FILE_PATTERN,dir,
+		      refid,host,(int) getpid()) >= (int) sizeof(trace_path) )
+		return 20;
+
+	/* the file already exists if the trace is reopened */
+	trace_fd = open(trace_path,O_WRONLY|O_CREAT|O_EXCL|O_APPEND|
+			O_NOFOLLOW|O_CLOEXEC,0644);
+	if ( trace_fd == -1 && errno == EEXIST ) {
+		trace_fd = open(trace_path,O_WRONLY|O_APPEND|O_NOFOLLOW|
+				O_CLOEXEC);
+		created = 0;
+	}
+	if ( trace_fd == -1 )
+		return 30;
+
+	/* anchor the monotonic clock to the realtime one */
+	clock_gettime(CLOCK_MONOTONIC,&mono);
+	clock_gettime(CLOCK_REALTIME,&real);
+	trace_anchor = ( (int64_t) real.tv_sec - mono.tv_sec ) * 1000000000 +
+		( real.tv_nsec - mono.tv_nsec );
+
+	/* the track of the step on the node, FNV-1a hash of its name */
+	snprintf(track,sizeof(track),"%s %s",refid,host);
+	trace_pid = 2166136261u;
+	for ( p = track ; *p != '\0' ; p++ )
+		trace_pid = ( trace_pid ^ (unsigned char) *p ) * 16777619u;
+	trace_pid = ( trace_pid & 0x7fffffff ) | 1;
+
+	snprintf(trace_role,sizeof(trace_role),"%s",
+		 ( role != NULL ) ? role : "x11");
+
+	if ( created )
+		trace_write("[\n",2);
+	trace_escape(name,sizeof(name),track);
+	trace_write(buf,snprintf(buf,sizeof(buf),
+				 "{\"name\":\"process_name\",\"ph\":\"M\","
+				 "\"pid\":%u,\"args\":{\"name\":\"x11 %s\"}},\n",
+				 trace_pid,name));
+	trace_name_thread();
+
+	return 0;
+}
+
+void x11_trace_close(void)
+{
+	if ( trace_fd == -1 )
+		return;
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+const char* x11_trace_dir(void)
+{
+	static char dir[PATH_MAX];
+	char* p;
+
+	if ( trace_fd == -1 )
+		return NULL;
+	snprintf(dir,sizeof(dir),"%s",trace_path);
+	p = strrchr(dir,'/');
+	if ( p != NULL )
+		*p = '\0';
+
+	return dir;
+}
+
+uint64_t x11_trace_now(void)
+{
+	struct timespec mono;
+
+	if ( trace_fd == -1 )
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC,&mono);
+
+	return ( (int64_t) mono.tv_sec * 1000000000 + mono.tv_nsec +
+		 trace_anchor ) / 1000;
+}
+
+void x11_trace_span(const char* name,uint64_t start,
+		    const char* key,const char* value)
+{
+	uint64_t now;
+	char buf[TRACE_EVENT_MAXLEN];
+	char ename[128];
+	char ekey[128];
+	char evalue[512];
+
+	if ( trace_fd == -1 )
+		return;
+	now = x11_trace_now();
+	if ( start == 0 || start > now )
+		start = now;
+	if ( getpid() != trace_tid )
+		trace_name_thread();
+
+	trace_escape(ename,sizeof(ename),name);
+	if ( key != NULL ) {
+		trace_escape(ekey,sizeof(ekey),key);
+		trace_escape(evalue,sizeof(evalue),
+			     ( value != NULL ) ? value : "");
+	}
+	trace_write(buf,snprintf(buf,sizeof(buf),
+				 "{\"name\":\"%s\",\"cat\":\"x11\",\"ph\":\"X\","
+				 "\"ts\":%llu,\"dur\":%llu,\"pid\":%u,"
+				 "\"tid\":%d,\"args\":{%s%s%s%s%s}},\n",ename,
+				 (unsigned long long) start,
+				 (unsigned long long) ( now - start ),
+				 trace_pid,(int) trace_tid,
+				 ( key != NULL ) ? "\"" : "",
+				 ( key != NULL ) ? ekey : "",
+				 ( key != NULL ) ? "\":\"" : "",
+				 ( key != NULL ) ? evalue : "",
+				 ( key != NULL ) ? "\"" : ""));
+}
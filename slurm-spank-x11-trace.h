@@ -0,0 +1,72 @@
+/***************************************************************************\
+ * slurm-spank-x11-trace.h - SLURM SPANK X11 setup tracing library
+ ***************************************************************************
+ * Copyright (2026) the slurm-spank-x11 contributors
+ *
+ * This file is part of slurm-spank-x11, a SLURM SPANK Plugin aiming at
+ * providing access to X11 display through tunneling on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * slurm-spank-x11 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * slurm-spank-x11 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with slurm-spank-x11; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SLURM_SPANK_X11_TRACE_H
+#define _SLURM_SPANK_X11_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_ENVVAR                "SLURM_SPANK_X11_TRACE"
+#define TRACE_FILE_PATTERN          "%s/slurm-spank-x11.%s.%s.%d.json"
+
+/*
+ * the phases of the X11 setup are recorded as spans in a Chrome trace
+ * file (JSON array format, also read by Perfetto) per process, named
+ * after the directory, the refid (jobid.stepid), the node and the pid.
+ * The processes of a step on a node share a track named after the refid
+ * and the node, each one having its own sub track named after its role.
+ *
+ * The timestamps are taken from the monotonic clock, anchored to the
+ * realtime clock when the trace is opened so that the files of the
+ * different nodes can be loaded together.
+ *
+ * The events are written as they are recorded so that the trace is
+ * usable even if the process is killed or executes another program,
+ * the closing bracket of the array being omitted as allowed by the
+ * format.
+ *
+ * All the functions do nothing when the trace is not opened.
+ */
+int x11_trace_open(const char* dir,const char* refid,const char* role);
+
+void x11_trace_close(void);
+
+/*
+ * directory of the opened trace or NULL
+ */
+const char* x11_trace_dir(void);
+
+/*
+ * current timestamp in microseconds, 0 when the trace is not opened
+ */
+uint64_t x11_trace_now(void);
+
+/*
+ * record a span started at start (taken from x11_trace_now) and ending
+ * now, with an optional argument shown with the span if key is not NULL
+ */
+void x11_trace_span(const char* name,uint64_t start,
+		    const char* key,const char* value);
+
+#endif
@@ -30,128 +30,796 @@
 
 #include <getopt.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <strings.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "slurm-spank-x11-ref.h"
+#include "slurm-spank-x11-relay.h"
+#include "slurm-spank-x11-trace.h"
+#include "slurm-spank-x11-stats.h"
+#include "slurm-spank-x11-broker.h"
 
 #ifndef X11_LIBEXEC_PROG
 #define X11_LIBEXEC_PROG            "/usr/libexec/slurm-spank-x11"
 #endif
 
-#define REF_FILE_PATTERN            "/tmp/slurm-spank-x11.%s"
-
 #define SPANK_X11_DEFAULT_SSH_CMD   "ssh"
 #define SPANK_X11_DEFAULT_SSH_OPTS  ""
 
-int write_display_ref(char* refid)
+#define MUX_DIR_PATTERN             "/tmp/slurm-spank-x11-mux.%u"
+
+void stderr_logger(const char* fmt,va_list ap)
 {
-	FILE* file;
-	char* display;
-	char ref_file[256];
+	vfprintf(stderr,fmt,ap);
+}
 
-	/* build file reference */
-	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
-		fprintf(stderr,"error: unable to build file reference\n");
-		return 20;
+/*
+ * get the private directory of the user where the ssh ControlMaster 
+ * sockets are stored, creating it if necessary
+ */
+int get_mux_dir(char* dir,size_t size)
+{
+	struct stat st;
+	char* runtime_dir;
+	int rc;
+
+	runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if ( runtime_dir != NULL && *runtime_dir == '/' )
+		rc = snprintf(dir,size,"%s/slurm-spank-x11",runtime_dir);
+	else
+		rc = snprintf(dir,size,MUX_DIR_PATTERN,getuid());
+	if ( rc < 0 || (size_t) rc >= size ) {
+		fprintf(stderr,"warning: unable to build ssh mux directory\n");
+		return -1;
 	}
 
-	/* get DISPLAY reference */
-	display = getenv("DISPLAY");
-	if ( display == NULL ) {
-	        fprintf(stderr,"error: unable to get DISPLAY value\n");
-		return 10;
+	if ( mkdir(dir,0700) && errno != EEXIST ) {
+		fprintf(stderr,"warning: unable to create ssh mux directory "
+			"%s : %s\n",dir,strerror(errno));
+		return -1;
 	}
 
-	/* write it into reference file */
-	file = fopen(ref_file,"w");
-	if ( file == NULL ) {
-	        fprintf(stderr,"error: unable to create file %s\n",
-			ref_file);
-		return 30;
+	/* only use a directory that is private to the user */
+	if ( lstat(dir,&st) || ! S_ISDIR(st.st_mode) || 
+	     st.st_uid != getuid() || ( st.st_mode & 077 ) ) {
+		fprintf(stderr,"warning: ignoring unsafe ssh mux directory "
+			"%s\n",dir);
+		return -1;
 	}
-	fprintf(file,"%s\n",display);
-	fclose(file);
 
 	return 0;
 }
 
-int read_display_ref(char* refid,char** display)
+/*
+ * run ssh in a child process, accounting the tunnel in the node metrics
+ * and, if keep is set, keeping a tunnel reference with the pid of the
+ * current process as long as it is alive
+ */
+int run_tunnel(char* refid,char* host,char** argv,int keep)
+{
+	pid_t pid;
+	int status;
+	int slot;
+
+	if ( keep && write_tunnel_ref(refid,host,getpid()) ) {
+		fprintf(stderr,"warning: unable to register tunnel to %s\n",
+			host);
+	}
+
+	pid = fork();
+	if ( pid == -1 ) {
+		fprintf(stderr,"error: unable to fork : %s\n",strerror(errno));
+		if ( keep )
+			remove_tunnel_ref(refid,host);
+		return 52;
+	}
+	else if ( pid == 0 ) {
+		execvp(argv[0],argv);
+		fprintf(stderr,"error: unable to execute %s : %s\n",
+			argv[0],strerror(errno));
+		_exit(51);
+	}
+
+	slot = x11_stats_hold(X11_STATS_SSH_TUNNEL);
+	while ( waitpid(pid,&status,0) == -1 && errno == EINTR ) ;
+	x11_stats_release(slot);
+	if ( keep )
+		remove_tunnel_ref(refid,host);
+
+	/* ssh reports its own errors with the 255 exit code */
+	if ( WIFEXITED(status) && WEXITSTATUS(status) == 255 )
+		x11_stats_count(X11_STATS_SSH_FAILURES,1);
+	x11_stats_close();
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 53;
+}
+
+/*
+ * growable NULL terminated argument vector used to build the commands
+ * to execute without relying on a shell
+ */
+struct x11_argv {
+	char** argv;
+	int    argc;
+	int    size;
+};
+
+int argv_add(struct x11_argv* av,const char* arg)
+{
+	char** p;
+
+	if ( av->argc + 2 > av->size ) {
+		p = (char**) realloc(av->argv,(av->size + 16)*sizeof(char*));
+		if ( p == NULL )
+			return -1;
+		av->argv = p;
+		av->size += 16;
+	}
+	av->argv[av->argc] = strdup(arg);
+	if ( av->argv[av->argc] == NULL )
+		return -1;
+	av->argc++;
+	av->argv[av->argc] = NULL;
+
+	return 0;
+}
+
+/*
+ * append the blank separated words of a string
+ */
+int argv_add_words(struct x11_argv* av,const char* words)
+{
+	char* str;
+	char* word;
+	char* saveptr;
+	int rc = 0;
+
+	str = strdup(words);
+	if ( str == NULL )
+		return -1;
+	for ( word = strtok_r(str," \t",&saveptr) ; word != NULL && rc == 0 ;
+	      word = strtok_r(NULL," \t",&saveptr) )
+		rc = argv_add(av,word);
+	free(str);
+
+	return rc;
+}
+
+/*
+ * build the string of a command to run through the remote shell of ssh,
+ * each argument being single-quoted and the command exec'ed by the shell
+ */
+char* argv_to_remote_cmd(struct x11_argv* av)
+{
+	size_t len = 8;
+	char* cmd;
+	char* p;
+	char* q;
+	int i;
+
+	for ( i = 0 ; i < av->argc ; i++ ) {
+		len += 3;
+		for ( q = av->argv[i] ; *q != '\0' ; q++ )
+			len += ( *q == '\'' ) ? 4 : 1 ;
+	}
+	cmd = (char*) malloc(len);
+	if ( cmd == NULL )
+		return NULL;
+
+	p = cmd;
+	p += sprintf(p,"exec");
+	for ( i = 0 ; i < av->argc ; i++ ) {
+		*p++ = ' ';
+		*p++ = '\'';
+		for ( q = av->argv[i] ; *q != '\0' ; q++ ) {
+			if ( *q == '\'' ) {
+				memcpy(p,"'\\''",4);
+				p += 4;
+			}
+			else
+				*p++ = *q;
+		}
+		*p++ = '\'';
+	}
+	*p = '\0';
+
+	return cmd;
+}
+
+void argv_free(struct x11_argv* av)
+{
+	int i;
+
+	for ( i = 0 ; i < av->argc ; i++ )
+		free(av->argv[i]);
+	free(av->argv);
+	av->argv = NULL;
+	av->argc = 0;
+	av->size = 0;
+}
+
+/*
+ * build the ssh command running a sub command on a remote host, x11_opt
+ * being the ssh option enabling or disabling X11 forwarding
+ */
+int build_ssh_cmd(struct x11_argv* sshcmd,char* ssh_cmd,char* ssh_args,
+		  int mux_persist,char* user,char* x11_opt,char* host,
+		  struct x11_argv* subcmd)
+{
+	char mux_opt[PATH_MAX + 64];
+	char mux_dir[PATH_MAX];
+	char* p;
+	int rc = 0;
+
+	if ( ssh_cmd == NULL )
+		ssh_cmd = SPANK_X11_DEFAULT_SSH_CMD;
+
+	if ( ssh_args == NULL )
+		ssh_args = SPANK_X11_DEFAULT_SSH_OPTS;
+
+	/* ssh command and args may contain multiple words */
+	rc |= argv_add_words(sshcmd,ssh_cmd);
+	rc |= argv_add(sshcmd,x11_opt);
+	rc |= argv_add_words(sshcmd,ssh_args);
+
+	/* open the session as a new channel of a shared master
+	 * connection if requested */
+	if ( mux_persist > 0 && get_mux_dir(mux_dir,sizeof(mux_dir)) == 0 ) {
+		rc |= argv_add(sshcmd,"-o");
+		rc |= argv_add(sshcmd,"ControlMaster=auto");
+		snprintf(mux_opt,sizeof(mux_opt),"ControlPath=%s/%%C",mux_dir);
+		rc |= argv_add(sshcmd,"-o");
+		rc |= argv_add(sshcmd,mux_opt);
+		snprintf(mux_opt,sizeof(mux_opt),"ControlPersist=%d",
+			 mux_persist);
+		rc |= argv_add(sshcmd,"-o");
+		rc |= argv_add(sshcmd,mux_opt);
+	}
+	if ( user != NULL ) {
+		rc |= argv_add(sshcmd,"-l");
+		rc |= argv_add(sshcmd,user);
+	}
+	rc |= argv_add(sshcmd,host);
+
+	/* the remote command is a single argument interpreted by 
+	 * the remote shell */
+	p = argv_to_remote_cmd(subcmd);
+	if ( p == NULL )
+		return -1;
+	rc |= argv_add(sshcmd,p);
+	free(p);
+
+	if ( sshcmd->argc < 3 )
+		rc = -1;
+
+	return rc;
+}
+
+/*
+ * relay the local tunnel to a tree of nodes. The list of nodes is split 
+ * in up to width chunks, the first node of each chunk being tunneled
+ * from the local node in proxy mode and in charge of the rest of its 
+ * chunk, so that the depth of the tree is O(log(n)).
+ *
+ * return once every direct child reported its DISPLAY, which means that
+ * its own subtree is ready, with the number of nodes that failed
+ */
+int fanout_tree(struct x11_argv* base,char* tree,int width)
 {
-        int rc;
-	FILE* file;
-	char rdisplay[256];
-	char ref_file[256];
-
-	/* build file reference */
-	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
-		fprintf(stderr,"error: unable to build file reference\n");
-		return 20;
-	}
-
-        /* read reference file DISPLAY value */
-        file = fopen(ref_file,"r");
-	if ( file == NULL ) {
-	        fprintf(stderr,"error: unable to open file %s\n",
-			ref_file);
-		return 30;
-	}
-	if ( fscanf(file,"%256s\n",rdisplay) != 1 ) {
-	        fprintf(stderr,"warning: unable to read DISPLAY value "
-			"from file %s\n",ref_file);
-		rc = 31;
-	}
-	else {
-		*display=strdup(rdisplay);
-		fflush(stdout);
+	struct x11_argv av;
+	char** nodes = NULL;
+	char** p;
+	char* list;
+	char* node;
+	char* saveptr;
+	char* subtree;
+	char wstr[16];
+	int* fds;
+	int* sizes;
+	int n = 0, nchild = 0, chunk, failed = 0;
+	int i, j, k, rc;
+	int pep[2];
+	size_t len;
+	pid_t pid;
+	FILE* f;
+	char display[256];
+	uint64_t start;
+
+	list = strdup(tree);
+	if ( list == NULL )
+		return 1;
+	for ( node = strtok_r(list,",",&saveptr) ; node != NULL ;
+	      node = strtok_r(NULL,",",&saveptr) ) {
+		p = (char**) realloc(nodes,(n+1)*sizeof(char*));
+		if ( p == NULL )
+			break;
+		nodes = p;
+		nodes[n++] = node;
+	}
+	if ( width <= 0 )
+		width = n;
+	if ( n == 0 ) {
+		free(list);
+		return 0;
+	}
+	chunk = ( n + width - 1 ) / width;
+	snprintf(wstr,16,"%d",width);
+
+	fds = (int*) malloc(width*sizeof(int));
+	sizes = (int*) malloc(width*sizeof(int));
+	if ( fds == NULL || sizes == NULL ) {
+		free(fds);
+		free(sizes);
+		free(nodes);
+		free(list);
+		return n;
+	}
+
+	/* spawn a proxy mode helper for the head of each chunk */
+	start = x11_trace_now();
+	for ( i = 0 ; i < n ; i += chunk ) {
+		k = ( i + chunk < n ) ? chunk : n - i ;
+		sizes[nchild] = k;
+		fds[nchild] = -1;
+		memset(&av,0,sizeof(av));
 		rc = 0;
+		for ( j = 0 ; j < base->argc ; j++ )
+			rc |= argv_add(&av,base->argv[j]);
+		rc |= argv_add(&av,"-p");
+		rc |= argv_add(&av,"-t");
+		rc |= argv_add(&av,nodes[i]);
+		if ( k > 1 ) {
+			for ( len = 0, j = i + 1 ; j < i + k ; j++ )
+				len += strlen(nodes[j]) + 1;
+			subtree = (char*) malloc(len);
+			if ( subtree == NULL )
+				rc = -1;
+			else {
+				subtree[0] = '\0';
+				for ( j = i + 1 ; j < i + k ; j++ ) {
+					if ( j > i + 1 )
+						strcat(subtree,",");
+					strcat(subtree,nodes[j]);
+				}
+				rc |= argv_add(&av,"-T");
+				rc |= argv_add(&av,subtree);
+				rc |= argv_add(&av,"-W");
+				rc |= argv_add(&av,wstr);
+				free(subtree);
+			}
+		}
+
+		if ( rc == 0 && pipe(pep) == 0 ) {
+			pid = fork();
+			if ( pid == 0 ) {
+				close(pep[0]);
+				if ( dup2(pep[1],1) == -1 )
+					_exit(1);
+				close(pep[1]);
+				execv(av.argv[0],av.argv);
+				_exit(1);
+			}
+			close(pep[1]);
+			if ( pid == -1 )
+				close(pep[0]);
+			else
+				fds[nchild] = pep[0];
+		}
+		argv_free(&av);
+		nchild++;
 	}
-	fclose(file);
-	
+
+	/* wait for the children DISPLAY values */
+	for ( i = 0 ; i < nchild ; i++ ) {
+		f = ( fds[i] != -1 ) ? fdopen(fds[i],"r") : NULL ;
+		if ( f == NULL || fscanf(f,"%255s",display) != 1 ) {
+			fprintf(stderr,"warning: unable to relay tunnel to "
+				"%s\n",nodes[i*chunk]);
+			failed += sizes[i];
+		}
+		x11_trace_span("fanout_tree_node",start,"node",nodes[i*chunk]);
+		if ( f != NULL )
+			fclose(f);
+		else if ( fds[i] != -1 )
+			close(fds[i]);
+	}
+
+	free(fds);
+	free(sizes);
+	free(nodes);
+	free(list);
+
+	return failed;
+}
+
+/*
+ * get the X11 authorization protocol and cookie of a DISPLAY using xauth
+ */
+int get_display_cookie(char* display,char* proto,char* cookie)
+{
+	int pep[2];
+	pid_t pid;
+	FILE* f;
+	int rc = -1;
+
+	if ( pipe(pep) )
+		return -1;
+	pid = fork();
+	if ( pid == 0 ) {
+		close(pep[0]);
+		if ( dup2(pep[1],1) == -1 )
+			_exit(1);
+		close(pep[1]);
+		execlp("xauth","xauth","list",display,(char*) NULL);
+		_exit(1);
+	}
+	close(pep[1]);
+	if ( pid == -1 ) {
+		close(pep[0]);
+		return -1;
+	}
+
+	f = fdopen(pep[0],"r");
+	if ( f != NULL ) {
+		if ( fscanf(f,"%*s %63s %511s",proto,cookie) == 2 )
+			rc = 0;
+		fclose(f);
+	}
+	else
+		close(pep[0]);
+	while ( waitpid(pid,NULL,0) == -1 && errno == EINTR ) ;
+
 	return rc;
 }
 
-int remove_display_ref(char* refid)
+/*
+ * register the X11 authorization of a DISPLAY using xauth
+ */
+int add_display_cookie(char* display,char* proto,char* cookie)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if ( pid == 0 ) {
+		execlp("xauth","xauth","-q","add",display,proto,cookie,
+		       (char*) NULL);
+		_exit(1);
+	}
+	else if ( pid == -1 )
+		return -1;
+	while ( waitpid(pid,&status,0) == -1 && errno == EINTR ) ;
+
+	return ( WIFEXITED(status) && WEXITSTATUS(status) == 0 ) ? 0 : -1 ;
+}
+
+/*
+ * start a relay to the target DISPLAY in a child process, compressing
+ * the traffic if the target is another relay and compress is set (also
+ * sending the images as deltas if images is set) and answering the 
+ * idempotent requests of its clients from a cache if cache is set, 
+ * return its pid or -1 on error. Its TCP port is only bound to the
+ * loopback interface unless host is set, the other nodes then reaching
+ * it on the address of host.
+ */
+pid_t start_relay(char* target,int compress,int images,int cache,
+		  char* host,struct x11_relay* relay)
 {
-	char ref_file[256];
+	pid_t pid;
+	int fd;
 
-	/* build file reference */
-	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
-		fprintf(stderr,"error: unable to build file reference\n");
-		return 20;
+	if ( x11_relay_listen(relay,host) ) {
+		fprintf(stderr,"warning: unable to listen for relayed X11 "
+			"connections : %s\n",strerror(errno));
+		return -1;
 	}
+	relay->compress = compress;
+	relay->images = compress && images;
+	relay->cache = cache;
 
-        /* unlink reference file */
-        if ( unlink(ref_file) ) {
-	        fprintf(stderr,"error: unable to remove file %s\n",
-			ref_file);
-		return 31;
+	pid = fork();
+	if ( pid == 0 ) {
+		prctl(PR_SET_PDEATHSIG,SIGTERM);
+		if ( getppid() == 1 )
+			_exit(0);
+		fd = open("/dev/null",O_RDWR);
+		if ( fd != -1 ) {
+			dup2(fd,0);
+			dup2(fd,1);
+			close(fd);
+		}
+		x11_relay_run(relay,target);
+		_exit(1);
 	}
 
-	return 0;
+	/* the listening sockets are only used by the relay */
+	x11_relay_close(relay,( pid == -1 ));
+
+	return pid;
 }
 
-int wait_display_ref(char* refid)
+/*
+ * generate the cookie the clients of a relay must present and register
+ * it for the DISPLAY of the relay
+ */
+int new_relay_cookie(struct x11_relay* relay,char* display)
 {
-	struct stat fstatbuf;
-	char ref_file[256];
+	char hex[2*X11_RELAY_AUTH_LEN+1];
+	int fd;
+	int i;
 
-	/* build file reference */
-	if ( snprintf(ref_file,256,REF_FILE_PATTERN,refid) >= 256 ) {
-		fprintf(stderr,"error: unable to build file reference\n");
-		return 20;
+	fd = open("/dev/urandom",O_RDONLY|O_CLOEXEC);
+	if ( fd == -1 )
+		return -1;
+	if ( read(fd,relay->auth,X11_RELAY_AUTH_LEN) != X11_RELAY_AUTH_LEN ) {
+		close(fd);
+		return -1;
 	}
+	close(fd);
+
+	for ( i = 0 ; i < X11_RELAY_AUTH_LEN ; i++ )
+		sprintf(hex+2*i,"%02x",relay->auth[i]);
+	if ( add_display_cookie(display,X11_RELAY_AUTH_PROTO,hex) )
+		return -1;
+	relay->auth_len = X11_RELAY_AUTH_LEN;
 
-	/* loop on file existence or parent process not init */
-	while ( stat(ref_file,&fstatbuf) == 0 
-		&& getppid() > 1 ) {
-	        sleep(1);
+	return 0;
+}
+
+/*
+ * set the authorization the relay sends to its target, the cookie being
+ * given in hexadecimal as reported by xauth
+ */
+int set_relay_target_auth(struct x11_relay* relay,char* proto,char* cookie)
+{
+	size_t len = strlen(cookie);
+	unsigned int byte;
+	size_t i;
+
+	if ( len % 2 || len / 2 > sizeof(relay->target_auth) ||
+	     strlen(proto) >= sizeof(relay->target_proto) )
+		return -1;
+	for ( i = 0 ; i < len / 2 ; i++ ) {
+		if ( sscanf(cookie+2*i,"%2x",&byte) != 1 )
+			return -1;
+		relay->target_auth[i] = byte;
 	}
-	
+	relay->target_auth_len = len / 2;
+	strcpy(relay->target_proto,proto);
+
 	return 0;
 }
 
+/*
+ * start a lazy relay in a child process, the upstream tunnel only being
+ * established by running chain when the first client connects. The
+ * client waits in the backlog of the listening sockets meanwhile, the
+ * data it already sent being kept by the kernel. Return the pid of the
+ * relay or -1 on error.
+ */
+pid_t start_lazy_relay(struct x11_argv* chain,struct x11_relay* relay)
+{
+	struct pollfd pfds[2];
+	char target[256];
+	char proto[64];
+	char cookie[512];
+	int pep[2];
+	pid_t pid;
+	FILE* f;
+	int fd;
+
+	pid = fork();
+	if ( pid != 0 )
+		return pid;
+
+	prctl(PR_SET_PDEATHSIG,SIGTERM);
+	if ( getppid() == 1 )
+		_exit(0);
+	fd = open("/dev/null",O_RDWR);
+	if ( fd != -1 ) {
+		dup2(fd,0);
+		dup2(fd,1);
+		close(fd);
+	}
+
+	/* wait for the first client without accepting it */
+	pfds[0].fd = relay->tcp_fd;
+	pfds[1].fd = relay->unix_fd;
+	pfds[0].events = pfds[1].events = POLLIN;
+	while ( poll(pfds,2,-1) == -1 ) {
+		if ( errno != EINTR )
+			_exit(1);
+	}
+
+	/* establish the tunnel, ending with the relay */
+	if ( pipe(pep) )
+		_exit(1);
+	pid = fork();
+	if ( pid == 0 ) {
+		prctl(PR_SET_PDEATHSIG,SIGTERM);
+		close(pep[0]);
+		if ( dup2(pep[1],1) == -1 )
+			_exit(1);
+		close(pep[1]);
+		execv(chain->argv[0],chain->argv);
+		_exit(1);
+	}
+	close(pep[1]);
+	f = ( pid != -1 ) ? fdopen(pep[0],"r") : NULL ;
+	if ( f == NULL || fscanf(f,"%255s",target) != 1 ) {
+		fprintf(stderr,"error: lazy relay unable to establish the "
+			"tunnel\n");
+		_exit(1);
+	}
+	fclose(f);
+
+	if ( get_display_cookie(target,proto,cookie) ||
+	     set_relay_target_auth(relay,proto,cookie) ) {
+		fprintf(stderr,"error: lazy relay unable to get X11 "
+			"authorization of %s\n",target);
+		_exit(1);
+	}
+
+	x11_relay_run(relay,target);
+	_exit(1);
+}
+
+/*
+ * relay the local tunnel to a list of nodes, the nodes referencing the
+ * TCP DISPLAY of the local relay (addr:num) so that a single upstream
+ * tunnel is used whatever the number of nodes. With compress, the nodes
+ * use a relay of their own compressing the traffic sent to the local
+ * relay (with images, also sending the images as deltas), with cache, a
+ * relay of their own caching the replies of the requests.
+ *
+ * return once every node reported its DISPLAY with the number of nodes
+ * that failed, the sessions to the nodes being stored in pids 
+ * (terminated by 0) to be released with the local reference
+ */
+int relay_peers(char* refid,char* peers,char* addr,int num,char* proto,
+		char* cookie,int compress,int images,int cache,char* ssh_cmd,
+		char* ssh_args,int mux_persist,char* user,pid_t** ppids)
+{
+	struct x11_argv subcmd;
+	struct x11_argv sshcmd;
+	char** nodes = NULL;
+	char** p;
+	char* list;
+	char* node;
+	char* saveptr;
+	char relay_display[300];
+	int* fds;
+	pid_t* pids;
+	int n = 0, npids = 0, failed = 0;
+	int i, rc;
+	int pin[2], pout[2];
+	pid_t pid;
+	FILE* f;
+	char display[256];
+	const char* tdir = x11_trace_dir();
+	uint64_t start;
+
+	list = strdup(peers);
+	if ( list == NULL )
+		return -1;
+	for ( node = strtok_r(list,",",&saveptr) ; node != NULL ;
+	      node = strtok_r(NULL,",",&saveptr) ) {
+		p = (char**) realloc(nodes,(n+1)*sizeof(char*));
+		if ( p == NULL )
+			break;
+		nodes = p;
+		nodes[n++] = node;
+	}
+
+	fds = (int*) malloc((n+1)*sizeof(int));
+	pids = (pid_t*) calloc(n+1,sizeof(pid_t));
+	if ( n == 0 || fds == NULL || pids == NULL ) {
+		failed = n;
+		goto exit;
+	}
+	snprintf(relay_display,sizeof(relay_display),"%s:%d.0",addr,num);
+
+	/* create the references of the nodes concurrently */
+	start = x11_trace_now();
+	for ( i = 0 ; i < n ; i++ ) {
+		fds[i] = -1;
+		memset(&subcmd,0,sizeof(subcmd));
+		memset(&sshcmd,0,sizeof(sshcmd));
+		rc = argv_add(&subcmd,X11_LIBEXEC_PROG);
+		rc |= argv_add(&subcmd,"-i");
+		rc |= argv_add(&subcmd,refid);
+		rc |= argv_add(&subcmd,"-X");
+		rc |= argv_add(&subcmd,relay_display);
+		if ( cookie != NULL )
+			rc |= argv_add(&subcmd,"-a");
+		/* the traffic is compressed by a local relay on the node */
+		if ( compress ) {
+			rc |= argv_add(&subcmd,"-l");
+			rc |= argv_add(&subcmd,"-z");
+			if ( images )
+				rc |= argv_add(&subcmd,"-I");
+		}
+		if ( cache )
+			rc |= argv_add(&subcmd,"-C");
+		if ( tdir != NULL ) {
+			rc |= argv_add(&subcmd,"-P");
+			rc |= argv_add(&subcmd,tdir);
+		}
+		rc |= argv_add(&subcmd,"-c");
+		rc |= argv_add(&subcmd,"-g");
+		rc |= argv_add(&subcmd,"-w");
+		rc |= build_ssh_cmd(&sshcmd,ssh_cmd,ssh_args,mux_persist,user,
+				    "-x",nodes[i],&subcmd);
+		if ( rc == 0 && pipe(pin) == 0 ) {
+			if ( pipe(pout) ) {
+				close(pin[0]);
+				close(pin[1]);
+			}
+			else if ( ( pid = fork() ) == 0 ) {
+				close(pin[1]);
+				close(pout[0]);
+				if ( dup2(pin[0],0) == -1 ||
+				     dup2(pout[1],1) == -1 )
+					_exit(1);
+				close(pin[0]);
+				close(pout[1]);
+				execvp(sshcmd.argv[0],sshcmd.argv);
+				_exit(51);
+			}
+			else {
+				close(pin[0]);
+				close(pout[1]);
+				if ( pid == -1 )
+					close(pout[0]);
+				else {
+					pids[npids++] = pid;
+					fds[i] = pout[0];
+					if ( cookie != NULL )
+						dprintf(pin[1],"%s %s\n",
+							proto,cookie);
+				}
+				close(pin[1]);
+			}
+		}
+		argv_free(&subcmd);
+		argv_free(&sshcmd);
+	}
+
+	/* wait for the nodes DISPLAY values */
+	for ( i = 0 ; i < n ; i++ ) {
+		f = ( fds[i] != -1 ) ? fdopen(fds[i],"r") : NULL ;
+		if ( f == NULL || fscanf(f,"%255s",display) != 1 ) {
+			fprintf(stderr,"warning: unable to relay tunnel to "
+				"%s\n",nodes[i]);
+			failed++;
+		}
+		x11_trace_span("relay_peer",start,"node",nodes[i]);
+		if ( f != NULL )
+			fclose(f);
+		else if ( fds[i] != -1 )
+			close(fds[i]);
+	}
+
+exit:
+	free(fds);
+	free(nodes);
+	free(list);
+	*ppids = pids;
+
+	return failed;
+}
+
 int main(int argc,char** argv)
 {
 	char* refid = NULL;
@@ -164,6 +832,7 @@ int main(int argc,char** argv)
 
 	int local_flag = 1;
 	int proxy_flag = 0;
+	int keep_flag = 0;
 
 	char* src_host = NULL;
 	char* dst_host = NULL;
@@ -171,18 +840,55 @@ int main(int argc,char** argv)
 
 	char* ssh_cmd = NULL;
 	char* ssh_args = NULL;
+	int mux_persist = 0;
 
-	char ref_file[256];
+	char* tree = NULL;
+	int tree_width = 0;
+	char wstr[16];
 
-	size_t subcmd_size=1024;
-	char subcmd[1024];
-	char* p;
+	char* relay = NULL;
+	char* relay_display = NULL;
+	int auth_flag = 0;
+	pid_t* relay_pids = NULL;
+	pid_t relay_pid = -1;
+	struct x11_relay xrelay;
+	int listen_flag = 0;
+	int compress_flag = 0;
+	int cache_flag = 0;
+	int images_flag = 0;
+	char local_display[64];
+	char proto[64] = "";
+	char cookie[512] = "";
+	char* target;
+	char* ref_display = NULL;
+	int i;
+
+	char* trace_dir = NULL;
+	uint64_t start;
+	uint64_t t;
+
+	char* stats_file = NULL;
+	int stats_slot = -1;
+
+	int lazy_flag = 0;
+	int relay_failed = 0;
+	pid_t end_pid = -1;
+	char hostname[256];
+	char lazy_refid[128];
+	struct x11_argv chain = { NULL, 0, 0 };
+
+	struct x11_argv subcmd = { NULL, 0, 0 };
+	struct x11_argv sshcmd = { NULL, 0, 0 };
+	int rc = 0;
 
 	/* options processing variables */
 	char* progname;
-	char* optstring = "hi:crgwf:t:pd:u:s:o:";
+	char* optstring = "hi:crgwf:t:pd:u:s:o:m:kT:W:R:X:alzICP:M:Le:";
 	char* short_options_desc = "Usage : %s [-h] -i refid [-g|c|r] [-w] \n\[-u user] [-t nodeB"
-		" [-f nodeA [-d display]] [-s ssh_cmd] [-o ssh_args] ] \n";
+		" [-f nodeA [-d display]] [-s ssh_cmd] [-o ssh_args] [-m persist] [-k] ] \n[-T nodes [-W width]] [-R nodes]\n[-X display [-a]] [-l] [-z [-I]] [-C] [-P dir] [-M file]\n"
+		"[-L -f nodeA -d display] [-e pid]\n"
+		"       %s --stats\n"
+		"       %s --broker\n";
 	int   option;
 	char* addon_options_desc="\n\
         -h\t\tshow this message\n\
@@ -192,14 +898,70 @@ int main(int argc,char** argv)
                   \tto get the good one (proxy mode only)\n\
         -f nodeA\tnode to use to initiate the X11 tunneling\n\
         -t nodeB\tnode to connect to to create an X11 tunnel\n\
+        -m persist\tshare ssh connections using ControlMaster\n\
+                  \tmasters, idle ones exiting after persist seconds\n\
+        -k\t\tregister the tunnel to nodeB so that it can be\n\
+          \t\treused by the following steps of the job\n\
+        -T nodes\tcomma separated list of nodes to tunnel from the\n\
+          \t\tnode of the created DISPLAY reference\n\
+        -W width\tnumber of nodes of the -T list to tunnel directly,\n\
+          \t\teach one relaying the tunnels to its share of the\n\
+          \t\tremaining nodes\n\
+        -R nodes\tcomma separated list of nodes to give access to\n\
+          \t\tthe created DISPLAY reference through a relay\n\
+        -X display\tDISPLAY value to use for the created reference\n\
+        -a\t\tregister the X11 authorization of the -X display\n\
+          \t\tread on stdin\n\
+        -l\t\treference a local relay to the DISPLAY instead of\n\
+          \t\tthe DISPLAY itself\n\
+        -z\t\tcompress the traffic between the relay of the -R\n\
+          \t\tnodes and the relay of the created reference\n\
+        -I\t\twith -z, send the images as deltas of the previous\n\
+          \t\tones put at the same place of the same drawable\n\
+        -C\t\tanswer the idempotent requests of the X11 clients\n\
+          \t\tfrom a cache in their local relay (implies -l)\n\
+        -P dir\t\ttrace the phases of the setup in a Chrome trace\n\
+          \t\tfile of dir, on every node of the chain\n\
+        -M file\t\trecord the node metrics, exporting them in file\n\
+          \t\t(Prometheus textfile), on every node of the chain\n\
+        -L\t\treference a local relay to the DISPLAY of nodeA\n\
+          \t\tthat only establishes the tunnel from nodeA when\n\
+          \t\tits first X11 client connects (with -c)\n\
+        -e pid\t\twith -w, wait until process pid ends instead of\n\
+          \t\tthe reattachment to init, 0 only waiting for the\n\
+          \t\treference removal\n\
+        --stats\tdump the metrics of the node\n\
+        --broker\tkeep the DISPLAY references of the node in memory,\n\
+          \t\tserving them on " BROKER_SOCKET "\n\
         -c\t\tcreate local DISPLAY reference\n\
         -r\t\tremove local DISPLAY reference\n\
         -g\t\tget local DISPLAY reference (default)\n\
         -w\t\twait until reference is removed or\n\
         \t\tprocess is reattached to init\n";
 
+	/* report DISPLAY references errors on stderr */
+	display_ref_logger = stderr_logger;
+
+	/* dump the metrics of the node */
+	if ( argc == 2 && strcmp(argv[1],"--stats") == 0 ) {
+		if ( x11_stats_open(NULL) || x11_stats_dump(stdout) ) {
+			fprintf(stderr,"error: unable to read node metrics "
+				"from %s\n",STATS_SHM_GLOB);
+			exit(1);
+		}
+		x11_stats_close();
+		exit(0);
+	}
+
+	/* serve the DISPLAY references of the node */
+	if ( argc == 2 && strcmp(argv[1],"--broker") == 0 ) {
+		rc = x11_broker_serve(BROKER_SOCKET);
+		fprintf(stderr,"error: broker on %s ended\n",BROKER_SOCKET);
+		exit(rc);
+	}
+
 	/* init subcmd */
-	snprintf(subcmd,subcmd_size,"%s",X11_LIBEXEC_PROG);
+	rc |= argv_add(&subcmd,X11_LIBEXEC_PROG);
 	
 	/* get current program name */
 	progname=rindex(argv[0],'/');
@@ -216,57 +978,49 @@ int main(int argc,char** argv)
 		case 'i' :
 			refid=strdup(optarg);
 			refid_flag=1;
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -i %s",p,optarg);
-			free(p);
+			rc |= argv_add(&subcmd,"-i");
+			rc |= argv_add(&subcmd,optarg);
 			break;
 		case 'd' :
 			display=strdup(optarg);
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -d %s",p,optarg);
-			free(p);
+			rc |= argv_add(&subcmd,"-d");
+			rc |= argv_add(&subcmd,optarg);
 			break;
 		case 'u' :
 			user=strdup(optarg);
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -u %s",p,optarg);
-			free(p);
+			rc |= argv_add(&subcmd,"-u");
+			rc |= argv_add(&subcmd,optarg);
 			break;
 		case 'c' :
 			create_flag=1;
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -c",p);
-			free(p);
+			rc |= argv_add(&subcmd,"-c");
 			break;
 		case 'r' :
 			remove_flag=1;
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -r",p);
-			free(p);
+			rc |= argv_add(&subcmd,"-r");
 			break;
 		case 'g' :
 			get_flag=1;
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -g",p);
-			free(p);
+			rc |= argv_add(&subcmd,"-g");
 			break;
 		case 'w' :
 			wait_flag=1;
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -w",p);
-			free(p);
+			rc |= argv_add(&subcmd,"-w");
 			break;
 		case 's' :
 			ssh_cmd=strdup(optarg);
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -s \"%s\"",p,optarg);
-			free(p);
+			rc |= argv_add(&subcmd,"-s");
+			rc |= argv_add(&subcmd,optarg);
 			break;
 		case 'o' :
 			ssh_args=strdup(optarg);
-			p = strdup(subcmd);
-			snprintf(subcmd,subcmd_size,"%s -o \"%s\"",p,optarg);
-			free(p);
+			rc |= argv_add(&subcmd,"-o");
+			rc |= argv_add(&subcmd,optarg);
+			break;
+		case 'm' :
+			mux_persist=atoi(optarg);
+			rc |= argv_add(&subcmd,"-m");
+			rc |= argv_add(&subcmd,optarg);
 			break;
 		case 'f' :
 		        src_host=strdup(optarg);
@@ -278,9 +1032,60 @@ int main(int argc,char** argv)
 		case 'p' :
 		        proxy_flag=1;
 			break;
+		case 'k' :
+		        keep_flag=1;
+			break;
+		case 'T' :
+		        tree=strdup(optarg);
+			break;
+		case 'W' :
+		        tree_width=atoi(optarg);
+			break;
+		case 'R' :
+		        relay=strdup(optarg);
+			break;
+		case 'X' :
+		        relay_display=strdup(optarg);
+			break;
+		case 'a' :
+		        auth_flag=1;
+			break;
+		case 'l' :
+		        listen_flag=1;
+			rc |= argv_add(&subcmd,"-l");
+			break;
+		case 'z' :
+		        compress_flag=1;
+			rc |= argv_add(&subcmd,"-z");
+			break;
+		case 'I' :
+		        images_flag=1;
+			rc |= argv_add(&subcmd,"-I");
+			break;
+		case 'C' :
+		        cache_flag=1;
+		        listen_flag=1;
+			rc |= argv_add(&subcmd,"-C");
+			break;
+		case 'P' :
+		        trace_dir=strdup(optarg);
+			rc |= argv_add(&subcmd,"-P");
+			rc |= argv_add(&subcmd,optarg);
+			break;
+		case 'M' :
+		        stats_file=strdup(optarg);
+			rc |= argv_add(&subcmd,"-M");
+			rc |= argv_add(&subcmd,optarg);
+			break;
+		case 'L' :
+		        lazy_flag=1;
+			break;
+		case 'e' :
+		        end_pid=(pid_t) atoi(optarg);
+			break;
 		case 'h' :
 		default :
-			fprintf(stdout,short_options_desc,progname);
+			fprintf(stdout,short_options_desc,progname,progname,progname);
 			fprintf(stdout,"%s\n",addon_options_desc);
 			exit(0);
 			break;
@@ -288,12 +1093,31 @@ int main(int argc,char** argv)
 	}
 
 
+	if ( rc ) {
+		fprintf(stderr,"error: unable to build sub command\n");
+		exit(50);
+	}
+
 	/* check id definition */
 	if ( ! refid_flag ) {
-		fprintf(stderr,short_options_desc,progname);
+		fprintf(stderr,short_options_desc,progname,progname,progname);
 		exit(1);		
 	}
 
+	/* trace the setup phases if requested */
+	if ( trace_dir != NULL &&
+	     x11_trace_open(trace_dir,refid,( ! local_flag ) ? 
+			    ( proxy_flag ? "proxy helper" : "ssh helper" ) :
+			    "helper") )
+		fprintf(stderr,"warning: unable to open trace in %s\n",
+			trace_dir);
+	start = x11_trace_now();
+
+	/* record the node metrics if requested */
+	if ( stats_file != NULL && x11_stats_open(stats_file) )
+		fprintf(stderr,"warning: unable to open node metrics %s\n",
+			STATS_SHM_GLOB);
+
 	/* in proxy mode, read display value corresponding to the ref and use it */
 	if ( proxy_flag ) {
 		/* read reference file DISPLAY value */
@@ -317,65 +1141,296 @@ int main(int argc,char** argv)
 	/* if not in local mode, execute the remote command */
 	if ( ! local_flag ) {
 
-		if ( ssh_cmd == NULL )
-			ssh_cmd = strdup(SPANK_X11_DEFAULT_SSH_CMD);
+		/* the target node relays the tunnels to the nodes tree */
+		if ( tree != NULL ) {
+			snprintf(wstr,sizeof(wstr),"%d",tree_width);
+			rc |= argv_add(&subcmd,"-T");
+			rc |= argv_add(&subcmd,tree);
+			rc |= argv_add(&subcmd,"-W");
+			rc |= argv_add(&subcmd,wstr);
+		}
 
-		if ( ssh_args == NULL )
-			ssh_args = strdup(SPANK_X11_DEFAULT_SSH_OPTS);
+		/* the target node relays its tunnel to the other nodes */
+		if ( relay != NULL ) {
+			rc |= argv_add(&subcmd,"-R");
+			rc |= argv_add(&subcmd,relay);
+		}
 
 	        /* if a source host is specified, use it in proxy mode */
 		if ( src_host != NULL ) {
-		        p = strdup(subcmd);
-			if ( user != NULL )
-				snprintf(subcmd,subcmd_size,"%s -x %s -l %s"
-					 " %s '%s -p -t %s'",ssh_cmd,ssh_args,
-					 user,src_host,p,dst_host);
-			else
-				snprintf(subcmd,subcmd_size,"%s -x %s %s '%s"
-					 " -p -t %s'",ssh_cmd,ssh_args,
-					 src_host,p,dst_host);
-			free(p);
+			rc |= argv_add(&subcmd,"-p");
+			rc |= argv_add(&subcmd,"-t");
+			rc |= argv_add(&subcmd,dst_host);
 		}
-		/* otherwise launch the sub command on the target node with X11 support */
-		else {
-		        p = strdup(subcmd);
-			if ( user != NULL )
-				snprintf(subcmd,subcmd_size,"%s -Y %s -l %s"
-					 " %s '%s'",ssh_cmd,ssh_args,
-					 user,dst_host,p);
-			else
-				snprintf(subcmd,subcmd_size,"%s -Y %s %s '%s'",
-					 ssh_cmd,ssh_args,dst_host,p);
-			free(p);
+
+		/* otherwise launch the sub command on the target node with
+		 * X11 support */
+		rc |= build_ssh_cmd(&sshcmd,ssh_cmd,ssh_args,mux_persist,user,
+				    ( src_host != NULL ) ? "-x" : "-Y",
+				    ( src_host != NULL ) ? src_host : dst_host,
+				    &subcmd);
+		if ( rc ) {
+			fprintf(stderr,"error: unable to build ssh command\n");
+			exit(50);
 		}
 
-		return system(subcmd);
+		/* the ssh session setup is the time until the remote
+		 * helper starts, as seen in the trace of the target */
+		x11_trace_span("helper",start,"node",
+			       ( src_host != NULL ) ? src_host : dst_host);
+
+		/* a shared tunnel is registered for the lifetime of ssh,
+		 * which is also watched to account it in the metrics */
+		if ( keep_flag || x11_stats_now() != 0 )
+			return run_tunnel(refid,dst_host,sshcmd.argv,keep_flag);
+
+		execvp(sshcmd.argv[0],sshcmd.argv);
+		fprintf(stderr,"error: unable to execute %s : %s\n",
+			sshcmd.argv[0],strerror(errno));
+		exit(51);
+	}
+
+	/* register the authorization of the relay DISPLAY sent by the 
+	 * relaying node */
+	if ( auth_flag && relay_display != NULL ) {
+		t = x11_trace_now();
+		if ( fscanf(stdin,"%63s %511s",proto,cookie) != 2 ||
+		     add_display_cookie(relay_display,proto,cookie) )
+			fprintf(stderr,"warning: unable to add X11 "
+				"authorization of %s\n",relay_display);
+		x11_trace_span("add_display_cookie",t,"display",relay_display);
 	}
 
+	/* in lazy mode, reference a local relay that establishes the 
+	 * tunnel from the source host with the batch mode chain when its 
+	 * first client connects, the clients using a cookie of its own */
+	if ( create_flag && lazy_flag ) {
+		if ( src_host == NULL || display == NULL ||
+		     gethostname(hostname,sizeof(hostname)) ) {
+			fprintf(stderr,"error: lazy mode requires -f and -d\n");
+			exit(1);
+		}
+		hostname[sizeof(hostname)-1] = '\0';
+		snprintf(lazy_refid,sizeof(lazy_refid),"%s.lazy",refid);
+		rc = argv_add(&chain,X11_LIBEXEC_PROG);
+		if ( user != NULL ) {
+			rc |= argv_add(&chain,"-u");
+			rc |= argv_add(&chain,user);
+		}
+		if ( ssh_cmd != NULL ) {
+			rc |= argv_add(&chain,"-s");
+			rc |= argv_add(&chain,ssh_cmd);
+		}
+		if ( ssh_args != NULL ) {
+			rc |= argv_add(&chain,"-o");
+			rc |= argv_add(&chain,ssh_args);
+		}
+		snprintf(wstr,sizeof(wstr),"%d",mux_persist);
+		rc |= argv_add(&chain,"-m");
+		rc |= argv_add(&chain,wstr);
+		rc |= argv_add(&chain,"-f");
+		rc |= argv_add(&chain,src_host);
+		rc |= argv_add(&chain,"-d");
+		rc |= argv_add(&chain,display);
+		rc |= argv_add(&chain,"-t");
+		rc |= argv_add(&chain,hostname);
+		rc |= argv_add(&chain,"-i");
+		rc |= argv_add(&chain,lazy_refid);
+		if ( trace_dir != NULL ) {
+			rc |= argv_add(&chain,"-P");
+			rc |= argv_add(&chain,trace_dir);
+		}
+		if ( stats_file != NULL ) {
+			rc |= argv_add(&chain,"-M");
+			rc |= argv_add(&chain,stats_file);
+		}
+		rc |= argv_add(&chain,"-cwg");
+
+		t = x11_trace_now();
+		if ( rc == 0 && x11_relay_listen(&xrelay,NULL) == 0 ) {
+			snprintf(local_display,sizeof(local_display),
+				 ( xrelay.unix_path[0] != '\0' ) ? 
+				 ":%d.0" : "localhost:%d.0",xrelay.num);
+			if ( new_relay_cookie(&xrelay,local_display) == 0 )
+				relay_pid = start_lazy_relay(&chain,&xrelay);
+			x11_relay_close(&xrelay,( relay_pid == -1 ));
+		}
+		x11_trace_span("start_lazy_relay",t,"node",src_host);
+		argv_free(&chain);
+		if ( relay_pid == -1 ) {
+			fprintf(stderr,"error: unable to start lazy relay\n");
+			exit(1);
+		}
+		x11_stats_count(X11_STATS_LAZY_TUNNELS,1);
+
+		t = x11_trace_now();
+		ref_display = local_display;
+		rc = write_display_ref(refid,local_display);
+		x11_trace_span("write_display_ref",t,"display",local_display);
+	}
 	/* do creation if necessary */
-	if ( create_flag ) {
-	        write_display_ref(refid);
+	else if ( create_flag ) {
+		target = ( relay_display != NULL ) ?
+			relay_display : getenv("DISPLAY") ;
+
+		/* give access to the DISPLAY through a local relay, only
+		 * reachable from the other nodes when relaying to them */
+		if ( ( listen_flag || relay != NULL ) && target != NULL ) {
+			if ( relay != NULL &&
+			     gethostname(hostname,sizeof(hostname)) )
+				hostname[0] = '\0';
+			hostname[sizeof(hostname)-1] = '\0';
+			/* only the traffic sent to another relay is
+			 * compressed */
+			t = x11_trace_now();
+			relay_pid = start_relay(target,compress_flag &&
+						relay_display != NULL,
+						images_flag,cache_flag,
+						( relay != NULL ) ?
+						hostname : NULL,&xrelay);
+			x11_trace_span("start_relay",t,"display",target);
+			t = x11_trace_now();
+			if ( relay_pid != -1 &&
+			     get_display_cookie(target,proto,cookie) ) {
+				fprintf(stderr,"warning: unable to get X11 "
+					"authorization of %s\n",target);
+				cookie[0] = '\0';
+			}
+			x11_trace_span("get_display_cookie",t,"display",
+				       target);
+		}
+
+		/* local clients use the X11 socket of the relay */
+		if ( listen_flag && relay_pid != -1 ) {
+			snprintf(local_display,sizeof(local_display),"%s:%d.0",
+				 ( xrelay.unix_path[0] != '\0' ) ? "" :
+				 ( relay != NULL ) ? xrelay.tcp_addr :
+				 "localhost",xrelay.num);
+			t = x11_trace_now();
+			if ( cookie[0] != '\0' &&
+			     add_display_cookie(local_display,proto,cookie) )
+				fprintf(stderr,"warning: unable to add X11 "
+					"authorization of %s\n",local_display);
+			x11_trace_span("add_display_cookie",t,"display",
+				       local_display);
+			target = local_display;
+		}
+
+		t = x11_trace_now();
+		ref_display = target;
+		rc = write_display_ref(refid,target);
+		x11_trace_span("write_display_ref",t,"display",target);
+	}
+
+	/* the step ended before the tunnel was established, release it 
+	 * at once instead of waiting for a removal that already occurred */
+	if ( create_flag && rc == 41 ) {
+		create_flag = get_flag = wait_flag = 0;
+	}
+
+	/* relay the tunnel to the nodes tree before reporting the DISPLAY */
+	if ( create_flag && tree != NULL ) {
+		t = x11_trace_now();
+		rc = fanout_tree(&subcmd,tree,tree_width);
+		x11_trace_span("fanout_tree",t,"nodes",tree);
+		x11_stats_count(X11_STATS_RELAY_FAILURES,( rc > 0 ) ? rc : 0);
+		if ( rc > 0 ) {
+			fprintf(stderr,"warning: unable to relay tunnels to %d "
+				"node(s) of %s\n",rc,tree);
+			relay_failed = 1;
+		}
+	}
+
+	/* relay the tunnel to the other nodes before reporting the DISPLAY */
+	if ( create_flag && relay != NULL ) {
+		t = x11_trace_now();
+		if ( relay_pid == -1 )
+			rc = -1;
+		else
+			rc = relay_peers(refid,relay,xrelay.tcp_addr,
+					 xrelay.num,
+					 ( cookie[0] != '\0' ) ? proto : NULL,
+					 ( cookie[0] != '\0' ) ? cookie : NULL,
+					 compress_flag,images_flag,
+					 cache_flag,ssh_cmd,ssh_args,
+					 mux_persist,user,&relay_pids);
+		x11_trace_span("relay_peers",t,"nodes",relay);
+		x11_stats_count(X11_STATS_RELAY_FAILURES,( rc > 0 ) ? rc : 0);
+		if ( rc < 0 )
+			fprintf(stderr,"warning: unable to relay tunnel to "
+				"%s\n",relay);
+		else if ( rc > 0 )
+			fprintf(stderr,"warning: unable to relay tunnel to "
+				"%d node(s) of %s\n",rc,relay);
+		relay_failed = ( rc != 0 );
 	}
 
 	/* do get if necessary */
 	if ( get_flag ) {
 		/* read reference file DISPLAY value */
+		t = x11_trace_now();
 	        if ( read_display_ref(refid,&display) == 0 ) {
-		        fprintf(stdout,"%s\n",display);
+			/* tell whether all the relayed nodes are connected */
+			if ( create_flag && ( tree != NULL || relay != NULL ) )
+				fprintf(stdout,"%s %d\n",display,relay_failed);
+			else
+				fprintf(stdout,"%s\n",display);
 			fflush(stdout);
 			free(display);
 		}
+		x11_trace_span("read_display_ref",t,"refid",refid);
 	}
+	x11_trace_span("helper",start,NULL,NULL);
 
 	/* do remove if necessary */
 	if ( remove_flag ) {
 	        remove_display_ref(refid);
 	}
 
-	/* wait for reference unlink or init reattachment */
+	/* wait for reference unlink or init reattachment, the reference
+	 * being accounted as an active tunnel of the node meanwhile */
 	if ( wait_flag ) {
-	        wait_display_ref(refid);
+		if ( create_flag )
+			stats_slot = x11_stats_hold(X11_STATS_DISPLAY_REF);
+		if ( end_pid >= 0 )
+			wait_display_ref_pid(refid,end_pid);
+		else
+			wait_display_ref(refid);
+		x11_stats_release(stats_slot);
+
+		/* the watched process ended or the session was lost, do not
+		 * leave a reference to the released tunnel, unless a newer
+		 * step already replaced it */
+		if ( create_flag && ref_display != NULL )
+			drop_display_ref(refid,ref_display);
+	}
+
+	/* release the sessions of the relayed nodes and the relay */
+	if ( relay_pids != NULL ) {
+		for ( i = 0 ; relay_pids[i] != 0 ; i++ )
+			kill(relay_pids[i],SIGTERM);
+		for ( i = 0 ; relay_pids[i] != 0 ; i++ )
+			waitpid(relay_pids[i],NULL,0);
+		free(relay_pids);
+	}
+	if ( relay_pid != -1 ) {
+		kill(relay_pid,SIGTERM);
+		waitpid(relay_pid,NULL,0);
+		x11_relay_close(&xrelay,1);
+	}
+
+	/* release the tunnel of a lazy relay, if it was ever established */
+	if ( lazy_flag && relay_pid != -1 && wait_flag ) {
+		if ( wait_display_ref_ready(lazy_refid,0) == 0 )
+			remove_display_ref(lazy_refid);
+		else {
+			fprintf(stderr,"info: lazy DISPLAY of ref %s never "
+				"used, no tunnel established\n",refid);
+			x11_stats_count(X11_STATS_LAZY_UNUSED,1);
+		}
 	}
+	x11_trace_close();
+	x11_stats_close();
 
 	return 0;
 }
@@ -7,7 +7,9 @@ Group: System Environment/Base
 Source0: %{name}-%{version}.tar.gz
 BuildRoot: %{_tmppath}/%{name}-%{version}-%{release}-root
 
-BuildRequires: slurm-devel
+%{!?_unitdir: %global _unitdir /usr/lib/systemd/system}
+
+BuildRequires: slurm-devel zlib-devel
 Requires: slurm
 
 %description
@@ -20,10 +22,17 @@ otherwise they will need to enter as many passwords as connections to establish.
 %setup -q
 
 %build
-%{__cc} -g -o slurm-spank-x11 slurm-spank-x11.c
-%{__cc} -g -shared -fPIC -o x11.so \
+%{__cc} -g -fPIC -c -o slurm-spank-x11-ref.o slurm-spank-x11-ref.c
+%{__cc} -g -fPIC -c -o slurm-spank-x11-trace.o slurm-spank-x11-trace.c
+%{__cc} -g -fPIC -c -o slurm-spank-x11-stats.o slurm-spank-x11-stats.c
+%{__ar} rcs libslurm-spank-x11-ref.a slurm-spank-x11-ref.o \
+	slurm-spank-x11-trace.o slurm-spank-x11-stats.o
+%{__cc} -g -o slurm-spank-x11 slurm-spank-x11.c slurm-spank-x11-relay.c \
+	slurm-spank-x11-proto.c slurm-spank-x11-image.c slurm-spank-x11-broker.c \
+	libslurm-spank-x11-ref.a -lz
+%{__cc} -g -shared -fPIC -pthread -o x11.so \
 	-D"X11_LIBEXEC_PROG=\"%{_libexecdir}/%{name}\"" \
-	slurm-spank-x11-plug.c
+	slurm-spank-x11-plug.c libslurm-spank-x11-ref.a
 
 %install
 rm -rf $RPM_BUILD_ROOT
@@ -34,9 +43,13 @@ mkdir -p $RPM_BUILD_ROOT%{_libexecdir}
 mkdir -p $RPM_BUILD_ROOT%{_sysconfdir}
 mkdir -p $RPM_BUILD_ROOT%{_sysconfdir}/slurm
 mkdir -p $RPM_BUILD_ROOT%{_sysconfdir}/slurm/plugstack.conf.d
+mkdir -p $RPM_BUILD_ROOT%{_unitdir}
 install -m 755 slurm-spank-x11 $RPM_BUILD_ROOT%{_libexecdir}
 install -m 755 x11.so $RPM_BUILD_ROOT%{_libdir}/slurm
 install -m 644 plugstack.conf $RPM_BUILD_ROOT%{_sysconfdir}/slurm/plugstack.conf.d/x11.conf.example
+sed -e 's|/usr/libexec/|%{_libexecdir}/|' slurm-spank-x11-broker.service \
+	> $RPM_BUILD_ROOT%{_unitdir}/slurm-spank-x11-broker.service
+chmod 644 $RPM_BUILD_ROOT%{_unitdir}/slurm-spank-x11-broker.service
 
 %clean
 rm -rf $RPM_BUILD_ROOT
@@ -46,6 +59,7 @@ rm -rf $RPM_BUILD_ROOT
 %{_libexecdir}/slurm-spank-x11
 %{_libdir}/slurm/x11.so
 %config %{_sysconfdir}/slurm/plugstack.conf.d/x11.conf.example
+%{_unitdir}/slurm-spank-x11-broker.service
 
 %changelog
 * Tue Nov 06 2012 HAUTREUX Matthieu <matthieu.hautreux@cea.fr> -  0.2.5-1